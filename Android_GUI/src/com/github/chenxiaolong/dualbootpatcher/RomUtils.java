@@ -21,6 +21,7 @@ import android.content.Context;
 import android.os.Build;
 import android.os.Environment;
 import android.os.Parcel;
+import android.os.ParcelFileDescriptor;
 import android.os.Parcelable;
 import android.support.annotation.NonNull;
 import android.support.annotation.Nullable;
@@ -36,6 +37,7 @@ import org.apache.commons.io.Charsets;
 import org.apache.commons.io.IOUtils;
 
 import java.io.File;
+import java.io.FileInputStream;
 import java.io.FileNotFoundException;
 import java.io.FileOutputStream;
 import java.io.IOException;
@@ -364,12 +366,33 @@ public class RomUtils {
             // Read file into memory
             byte[] data = new byte[(int) sb.st_size];
             int nWritten = 0;
-            while (nWritten < data.length) {
-                ByteBuffer newData = iface.fileRead(id, 10240);
+            if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.LOLLIPOP) {
+                // Read directly from the daemon's file descriptor instead of copying the data
+                // through the socket in small chunks
+                ParcelFileDescriptor pfd = iface.fileGetFd(id);
+                FileInputStream fis = new ParcelFileDescriptor.AutoCloseInputStream(pfd);
+                try {
+                    while (nWritten < data.length) {
+                        int nRead = fis.read(data, nWritten, data.length - nWritten);
+                        if (nRead < 0) {
+                            break;
+                        }
+                        nWritten += nRead;
+                    }
+                } finally {
+                    IOUtils.closeQuietly(fis);
+                }
+                if (nWritten != data.length) {
+                    return CacheWallpaperResult.FAILED;
+                }
+            } else {
+                while (nWritten < data.length) {
+                    ByteBuffer newData = iface.fileRead(id, 10240);
 
-                int nRead = newData.limit() - newData.position();
-                newData.get(data, nWritten, nRead);
-                nWritten += nRead;
+                    int nRead = newData.limit() - newData.position();
+                    newData.get(data, nWritten, nRead);
+                    nWritten += nRead;
+                }
             }
 
             iface.fileClose(id);
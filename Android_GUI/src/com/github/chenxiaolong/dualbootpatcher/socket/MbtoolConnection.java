@@ -92,6 +92,13 @@ public class MbtoolConnection implements Closeable {
     private static final String MBTOOL_TMPFS_PATH = TMPFS_MOUNTPOINT + "/mbtool";
     private static final String MBTOOL_ROOTFS_PATH = "/mbtool";
 
+    /**
+     * Arguments for launching the daemon. Connections are handed to pre-forked workers so that
+     * opening a connection doesn't have to wait for a fork.
+     */
+    private static final String[] DAEMON_ARGS = {
+            "daemon", "--replace", "--daemonize", "--workers", "2" };
+
     /** mbtool socket */
     private LocalSocket mSocket;
     /** Socket's input stream */
@@ -180,10 +187,11 @@ public class MbtoolConnection implements Closeable {
     }
 
     @Nullable
-    private static MbtoolInterface createInterface(InputStream is, OutputStream os, int version) {
+    private static MbtoolInterface createInterface(LocalSocket socket, InputStream is,
+                                                   OutputStream os, int version) {
         switch (version) {
         case 3:
-            return new MbtoolInterfaceV3(is, os);
+            return new MbtoolInterfaceV3(socket, is, os);
         default:
             return null;
         }
@@ -203,7 +211,7 @@ public class MbtoolConnection implements Closeable {
         initRequestInterface(mSocketIS, mSocketOS, PROTOCOL_VERSION);
 
         // Set up interface
-        mInterface = createInterface(mSocketIS, mSocketOS, PROTOCOL_VERSION);
+        mInterface = createInterface(mSocket, mSocketIS, mSocketOS, PROTOCOL_VERSION);
 
         // Check version
         initVerifyVersion(mInterface, MbtoolUtils.getMinimumRequiredVersion(Feature.DAEMON));
@@ -261,7 +269,10 @@ public class MbtoolConnection implements Closeable {
 
     private static int runMbtoolDaemon(String path)
             throws RootDeniedException, RootExecutionException {
-        return CommandUtils.runRootCommand(path, "daemon", "--replace", "--daemonize");
+        String[] args = new String[DAEMON_ARGS.length + 1];
+        args[0] = path;
+        System.arraycopy(DAEMON_ARGS, 0, args, 1, DAEMON_ARGS.length);
+        return CommandUtils.runRootCommand(args);
     }
 
     private static boolean launchMbtoolFromTmpfs(String path)
@@ -363,7 +374,7 @@ public class MbtoolConnection implements Closeable {
                 initRequestInterface(socketIS, socketOS, i);
 
                 // Create interface
-                MbtoolInterface iface = createInterface(socketIS, socketOS, i);
+                MbtoolInterface iface = createInterface(socket, socketIS, socketOS, i);
                 if (iface == null) {
                     throw new IllegalStateException("Failed to create interface for version: " + i);
                 }
@@ -373,7 +384,7 @@ public class MbtoolConnection implements Closeable {
                 // kills processes with cmdlines matching the former case.
                 SignedExecCompletion completion = iface.signedExec(
                         mbtool.getAbsolutePath(), mbtoolSig.getAbsolutePath(),
-                        "mbtool", new String[] { "daemon", "--replace", "--daemonize" }, null);
+                        "mbtool", DAEMON_ARGS, null);
 
                 switch (completion.result) {
                 case SignedExecResult.PROCESS_EXITED:
@@ -17,7 +17,10 @@
 
 package com.github.chenxiaolong.dualbootpatcher.socket.interfaces;
 
+import android.annotation.TargetApi;
 import android.content.Context;
+import android.os.Build;
+import android.os.ParcelFileDescriptor;
 import android.support.annotation.NonNull;
 
 import com.github.chenxiaolong.dualbootpatcher.RomUtils.RomInformation;
@@ -56,6 +59,24 @@ public interface MbtoolInterface {
      */
     void fileClose(int id) throws IOException, MbtoolException, MbtoolCommandException;
 
+    /**
+     * Get a file descriptor for an opened file.
+     *
+     * The daemon passes its own file descriptor over the socket, so the file can be read or
+     * written directly without copying the data through the daemon. The descriptor shares its
+     * file offset with the daemon's copy.
+     *
+     * @param id File ID
+     * @return File descriptor, which the caller must close
+     * @throws IOException
+     * @throws MbtoolException
+     * @throws MbtoolCommandException
+     */
+    @NonNull
+    @TargetApi(Build.VERSION_CODES.LOLLIPOP)
+    ParcelFileDescriptor fileGetFd(int id) throws IOException, MbtoolException,
+            MbtoolCommandException;
+
     /**
      * Open a file
      *
@@ -17,8 +17,14 @@
 
 package com.github.chenxiaolong.dualbootpatcher.socket.interfaces;
 
+import android.annotation.TargetApi;
 import android.content.Context;
+import android.net.LocalSocket;
+import android.os.Build;
+import android.os.ParcelFileDescriptor;
 import android.support.annotation.NonNull;
+import android.system.ErrnoException;
+import android.system.Os;
 import android.util.Log;
 
 import com.github.chenxiaolong.dualbootpatcher.RomUtils.RomInformation;
@@ -33,6 +39,7 @@ import com.github.chenxiaolong.dualbootpatcher.switcher.SwitcherUtils;
 import com.google.flatbuffers.FlatBufferBuilder;
 import com.google.flatbuffers.Table;
 
+import java.io.FileDescriptor;
 import java.io.IOException;
 import java.io.InputStream;
 import java.io.OutputStream;
@@ -44,6 +51,8 @@ import mbtool.daemon.v3.FileChmodResponse;
 import mbtool.daemon.v3.FileCloseError;
 import mbtool.daemon.v3.FileCloseRequest;
 import mbtool.daemon.v3.FileCloseResponse;
+import mbtool.daemon.v3.FileGetFdRequest;
+import mbtool.daemon.v3.FileGetFdResponse;
 import mbtool.daemon.v3.FileOpenError;
 import mbtool.daemon.v3.FileOpenRequest;
 import mbtool.daemon.v3.FileOpenResponse;
@@ -132,10 +141,12 @@ public class MbtoolInterfaceV3 implements MbtoolInterface {
     /** Flatbuffers buffer size (same as the C++ default) */
     private static final int FBB_SIZE = 1024;
 
+    private LocalSocket mSocket;
     private InputStream mIS;
     private OutputStream mOS;
 
-    public MbtoolInterfaceV3(InputStream is, OutputStream os) {
+    public MbtoolInterfaceV3(LocalSocket socket, InputStream is, OutputStream os) {
+        mSocket = socket;
         mIS = is;
         mOS = os;
     }
@@ -151,6 +162,9 @@ public class MbtoolInterfaceV3 implements MbtoolInterface {
         case ResponseType.FileCloseResponse:
             table = new FileCloseResponse();
             break;
+        case ResponseType.FileGetFdResponse:
+            table = new FileGetFdResponse();
+            break;
         case ResponseType.FileOpenResponse:
             table = new FileOpenResponse();
             break;
@@ -321,6 +335,52 @@ public class MbtoolInterfaceV3 implements MbtoolInterface {
         }
     }
 
+    @NonNull
+    @TargetApi(Build.VERSION_CODES.LOLLIPOP)
+    public synchronized ParcelFileDescriptor fileGetFd(int id) throws IOException,
+            MbtoolException, MbtoolCommandException {
+        // Create request
+        FlatBufferBuilder builder = new FlatBufferBuilder(FBB_SIZE);
+        FileGetFdRequest.startFileGetFdRequest(builder);
+        FileGetFdRequest.addId(builder, id);
+        int fbRequest = FileGetFdRequest.endFileGetFdRequest(builder);
+
+        // Send request
+        sendRequest(builder, fbRequest, RequestType.FileGetFdRequest,
+                ResponseType.FileGetFdResponse);
+
+        // The file descriptor is attached to a single dummy byte sent after the response
+        if (mIS.read() < 0) {
+            throw new IOException("[" + id + "]: Unexpected EOF when receiving file descriptor");
+        }
+
+        FileDescriptor[] fds = mSocket.getAncillaryFileDescriptors();
+        if (fds == null || fds.length != 1) {
+            if (fds != null) {
+                for (FileDescriptor fd : fds) {
+                    closeFileDescriptor(fd);
+                }
+            }
+            throw new MbtoolException(Reason.PROTOCOL_ERROR,
+                    "[" + id + "]: Expected exactly one file descriptor");
+        }
+
+        try {
+            return ParcelFileDescriptor.dup(fds[0]);
+        } finally {
+            closeFileDescriptor(fds[0]);
+        }
+    }
+
+    @TargetApi(Build.VERSION_CODES.LOLLIPOP)
+    private static void closeFileDescriptor(FileDescriptor fd) {
+        try {
+            Os.close(fd);
+        } catch (ErrnoException e) {
+            Log.w(TAG, "Failed to close received file descriptor", e);
+        }
+    }
+
     public synchronized int fileOpen(String path, short[] flags, int perms) throws IOException,
             MbtoolException, MbtoolCommandException {
         // Create request
@@ -0,0 +1,39 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class BatchResponseEntry extends Table {
+  public static BatchResponseEntry getRootAsBatchResponseEntry(ByteBuffer _bb) { return getRootAsBatchResponseEntry(_bb, new BatchResponseEntry()); }
+  public static BatchResponseEntry getRootAsBatchResponseEntry(ByteBuffer _bb, BatchResponseEntry obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public BatchResponseEntry __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public int response(int j) { int o = __offset(4); return o != 0 ? bb.get(__vector(o) + j * 1) & 0xFF : 0; }
+  public int responseLength() { int o = __offset(4); return o != 0 ? __vector_len(o) : 0; }
+  public ByteBuffer responseAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+  public Response responseAsResponse() { return responseAsResponse(new Response()); }
+  public Response responseAsResponse(Response obj) { int o = __offset(4); return o != 0 ? obj.__assign(__indirect(__vector(o)), bb) : null; }
+
+  public static int createBatchResponseEntry(FlatBufferBuilder builder,
+      int responseOffset) {
+    builder.startObject(1);
+    BatchResponseEntry.addResponse(builder, responseOffset);
+    return BatchResponseEntry.endBatchResponseEntry(builder);
+  }
+
+  public static void startBatchResponseEntry(FlatBufferBuilder builder) { builder.startObject(1); }
+  public static void addResponse(FlatBufferBuilder builder, int responseOffset) { builder.addOffset(0, responseOffset, 0); }
+  public static int createResponseVector(FlatBufferBuilder builder, byte[] data) { builder.startVector(1, data.length, 1); for (int i = data.length - 1; i >= 0; i--) builder.addByte(data[i]); return builder.endVector(); }
+  public static void startResponseVector(FlatBufferBuilder builder, int numElems) { builder.startVector(1, numElems, 1); }
+  public static int endBatchResponseEntry(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
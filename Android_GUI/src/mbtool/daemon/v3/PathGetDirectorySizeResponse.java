@@ -20,13 +20,16 @@ public final class PathGetDirectorySizeResponse extends Table {
   public long size() { int o = __offset(8); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
   public PathGetDirectorySizeError error() { return error(new PathGetDirectorySizeError()); }
   public PathGetDirectorySizeError error(PathGetDirectorySizeError obj) { int o = __offset(10); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+  public long allocatedSize() { int o = __offset(12); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
 
   public static int createPathGetDirectorySizeResponse(FlatBufferBuilder builder,
       boolean success,
       int error_msgOffset,
       long size,
-      int errorOffset) {
-    builder.startObject(4);
+      int errorOffset,
+      long allocated_size) {
+    builder.startObject(5);
+    PathGetDirectorySizeResponse.addAllocatedSize(builder, allocated_size);
     PathGetDirectorySizeResponse.addSize(builder, size);
     PathGetDirectorySizeResponse.addError(builder, errorOffset);
     PathGetDirectorySizeResponse.addErrorMsg(builder, error_msgOffset);
@@ -34,11 +37,12 @@ public final class PathGetDirectorySizeResponse extends Table {
     return PathGetDirectorySizeResponse.endPathGetDirectorySizeResponse(builder);
   }
 
-  public static void startPathGetDirectorySizeResponse(FlatBufferBuilder builder) { builder.startObject(4); }
+  public static void startPathGetDirectorySizeResponse(FlatBufferBuilder builder) { builder.startObject(5); }
   public static void addSuccess(FlatBufferBuilder builder, boolean success) { builder.addBoolean(0, success, false); }
   public static void addErrorMsg(FlatBufferBuilder builder, int errorMsgOffset) { builder.addOffset(1, errorMsgOffset, 0); }
   public static void addSize(FlatBufferBuilder builder, long size) { builder.addLong(2, size, 0L); }
   public static void addError(FlatBufferBuilder builder, int errorOffset) { builder.addOffset(3, errorOffset, 0); }
+  public static void addAllocatedSize(FlatBufferBuilder builder, long allocatedSize) { builder.addLong(4, allocatedSize, 0L); }
   public static int endPathGetDirectorySizeResponse(FlatBufferBuilder builder) {
     int o = builder.endObject();
     return o;
@@ -16,19 +16,23 @@ public final class Request extends Table {
 
   public byte requestType() { int o = __offset(4); return o != 0 ? bb.get(o + bb_pos) : 0; }
   public Table request(Table obj) { int o = __offset(6); return o != 0 ? __union(obj, o) : null; }
+  public long id() { int o = __offset(8); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
 
   public static int createRequest(FlatBufferBuilder builder,
       byte request_type,
-      int requestOffset) {
-    builder.startObject(2);
+      int requestOffset,
+      long id) {
+    builder.startObject(3);
+    Request.addId(builder, id);
     Request.addRequest(builder, requestOffset);
     Request.addRequestType(builder, request_type);
     return Request.endRequest(builder);
   }
 
-  public static void startRequest(FlatBufferBuilder builder) { builder.startObject(2); }
+  public static void startRequest(FlatBufferBuilder builder) { builder.startObject(3); }
   public static void addRequestType(FlatBufferBuilder builder, byte requestType) { builder.addByte(0, requestType, 0); }
   public static void addRequest(FlatBufferBuilder builder, int requestOffset) { builder.addOffset(1, requestOffset, 0); }
+  public static void addId(FlatBufferBuilder builder, long id) { builder.addLong(2, id, 0L); }
   public static int endRequest(FlatBufferBuilder builder) {
     int o = builder.endObject();
     return o;
@@ -41,6 +41,7 @@ elseif(${MBP_BUILD_TARGET} STREQUAL android-system)
     include(cmake/dependencies/android-system-core.cmake)
     include(cmake/dependencies/freetype2.cmake)
     include(cmake/dependencies/fuse.cmake)
+    include(cmake/dependencies/googletest.cmake)
     include(cmake/dependencies/iconv.cmake)
     include(cmake/dependencies/libarchive.cmake)
     include(cmake/dependencies/libdrm.cmake)
@@ -17,6 +17,8 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+
 #include <cerrno>
 #include <cinttypes>
 #include <cstring>
@@ -25,9 +27,11 @@
 
 #include <rapidjson/filewritestream.h>
 #include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 #include <yaml-cpp/yaml.h>
 
+#include "mbdevice/database.h"
 #include "mbdevice/json.h"
 #include "mbdevice/schema.h"
 
@@ -167,6 +171,42 @@ static bool validate_and_write(Document &d, const SchemaDocument &sd,
     return true;
 }
 
+static bool write_database(const char *json, FILE *fp)
+{
+    std::vector<Device> devices;
+    JsonError error;
+
+    if (!device_list_from_json(json, devices, error)) {
+        fprintf(stderr, "Failed to load devices from generated JSON\n");
+        return false;
+    }
+
+    // Drop invalid devices, which would be skipped when loading the JSON
+    devices.erase(std::remove_if(devices.begin(), devices.end(),
+                                 [](const Device &device) {
+        if (auto flags = device.validate()) {
+            fprintf(stderr, "%s: Skipping invalid device (0x%" PRIx64 ")\n",
+                    device.id().c_str(), static_cast<uint64_t>(flags));
+            return true;
+        }
+        return false;
+    }), devices.end());
+
+    std::string data;
+    if (!device_list_to_database(devices, data)) {
+        fprintf(stderr, "Failed to serialize device database\n");
+        return false;
+    }
+
+    if (fwrite(data.data(), 1, data.size(), fp) != data.size()) {
+        fprintf(stderr, "Failed to write device database: %s\n",
+                strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
 static void usage(FILE *stream)
 {
     fprintf(stream,
@@ -176,7 +216,8 @@ static void usage(FILE *stream)
             "  -o, --output <file>\n"
             "                   Output file (outputs to stdout if omitted)\n"
             "  -h, --help       Display this help message\n"
-            "  --styled         Output in human-readable format\n");
+            "  --styled         Output in human-readable format\n"
+            "  --binary         Output binary device database\n");
 }
 
 int main(int argc, char *argv[])
@@ -185,12 +226,14 @@ int main(int argc, char *argv[])
 
     enum Options {
         OPT_STYLED             = 1000,
+        OPT_BINARY             = 1001,
     };
 
     static const char short_options[] = "o:h";
 
     static struct option long_options[] = {
         {"styled", no_argument, 0, OPT_STYLED},
+        {"binary", no_argument, 0, OPT_BINARY},
         {"output", required_argument, 0, 'o'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
@@ -200,6 +243,7 @@ int main(int argc, char *argv[])
 
     const char *output_file = nullptr;
     bool styled = false;
+    bool binary = false;
 
     while ((opt = getopt_long(argc, argv, short_options,
                               long_options, &long_index)) != -1) {
@@ -208,6 +252,10 @@ int main(int argc, char *argv[])
             styled = true;
             break;
 
+        case OPT_BINARY:
+            binary = true;
+            break;
+
         case 'o':
             output_file = optarg;
             break;
@@ -225,7 +273,7 @@ int main(int argc, char *argv[])
     FILE *fp = stdout;
 
     if (output_file) {
-        fp = fopen(output_file, "w");
+        fp = fopen(output_file, binary ? "wb" : "w");
         if (!fp) {
             fprintf(stderr, "%s: Failed to open file: %s\n",
                     output_file, strerror(errno));
@@ -251,7 +299,19 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (styled) {
+    if (binary) {
+        // Validate against the schema here so that loading the binary
+        // database does not need to
+        StringBuffer sb;
+        Writer<StringBuffer> writer(sb);
+
+        if (!validate_and_write(d, *sd, writer)
+                || !write_database(sb.GetString(), fp)) {
+            ret = false;
+        } else {
+            ret = true;
+        }
+    } else if (styled) {
         PrettyWriter<FileWriteStream> writer(os);
         ret = validate_and_write(d, *sd, writer);
     } else {
@@ -22,6 +22,7 @@
 
 #include <cassert>
 
+#include <mbdevice/database.h>
 #include <mbdevice/json.h>
 #include <mbpatcher/errors.h>
 
@@ -426,6 +427,23 @@ void MainWindow::populateDevices()
     Q_D(MainWindow);
 
     // TODO: This shouldn't be done in the GUI thread
+    mb::device::DeviceDatabase db;
+    if (db.open(d->pc->data_directory() + "/devices.bin")) {
+        for (size_t i = 0; i < db.size(); ++i) {
+            mb::device::Device device;
+
+            if (db.device_at(i, device) && device.validate() == 0) {
+                d->deviceSel->addItem(QStringLiteral("%1 - %2")
+                        .arg(QString::fromStdString(device.id()))
+                        .arg(QString::fromStdString(device.name())));
+                d->devices.push_back(std::move(device));
+            } else {
+                qWarning("Failed to load device %zu", i);
+            }
+        }
+        return;
+    }
+
     QString path(QString::fromStdString(d->pc->data_directory())
             % QStringLiteral("/devices.json"));
     QFile file(path);
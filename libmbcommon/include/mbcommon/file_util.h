@@ -19,6 +19,9 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+
 #include "mbcommon/file.h"
 
 namespace mb
@@ -34,6 +37,24 @@ using FileSearchResultCallback =
         oc::result<FileSearchAction> (*)(File &file, void *userdata,
                                          uint64_t offset);
 
+enum class FileLineAction
+{
+    Keep,
+    Replace,
+    Drop,
+};
+
+using FileLineFilterCallback =
+        oc::result<FileLineAction> (*)(const char *line, size_t size,
+                                       std::string &replacement,
+                                       void *userdata);
+
+struct FileLineRule
+{
+    FileLineFilterCallback cb;
+    void *userdata;
+};
+
 MB_EXPORT oc::result<size_t> file_read_retry(File &file,
                                              void *buf, size_t size);
 MB_EXPORT oc::result<size_t> file_write_retry(File &file,
@@ -52,6 +73,9 @@ MB_EXPORT oc::result<void> file_search(File &file, int64_t start, int64_t end,
                                        FileSearchResultCallback result_cb,
                                        void *userdata);
 
+MB_EXPORT oc::result<void> file_filter_lines(File &input, File &output,
+                                             const std::vector<FileLineRule> &rules);
+
 MB_EXPORT oc::result<uint64_t> file_move(File &file, uint64_t src,
                                          uint64_t dest, uint64_t size);
 
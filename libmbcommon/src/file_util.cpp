@@ -30,6 +30,7 @@
 #include "mbcommon/libc/string.h"
 
 #define DEFAULT_BUFFER_SIZE             (8 * 1024 * 1024)
+#define LINE_FILTER_BUFFER_SIZE         (64 * 1024)
 
 /*!
  * \file mbcommon/file_util.h
@@ -417,6 +418,127 @@ oc::result<void> file_search(File &file, int64_t start, int64_t end,
     }
 }
 
+/*!
+ * \typedef FileLineFilterCallback
+ *
+ * \brief Line filter rule callback for file_filter_lines()
+ *
+ * \param line Pointer to line contents (without the trailing newline)
+ * \param size Size of line
+ * \param replacement Output string for the replacement line when returning
+ *                    #FileLineAction::Replace. The string must not contain
+ *                    newlines.
+ * \param userdata User callback data
+ *
+ * \return
+ *   * #FileLineAction::Keep to pass the line to the next rule unchanged
+ *   * #FileLineAction::Replace to pass \p replacement to the next rule instead
+ *   * #FileLineAction::Drop to remove the line (including its newline) from the
+ *     output. No further rules are invoked.
+ *   * An error code if file_filter_lines() should report a failure
+ */
+
+/*!
+ * \brief Copy file while filtering its lines through a set of rules
+ *
+ * Each line of \p input is passed through each rule in \p rules in order and
+ * the result is written to \p output. Lines are split on `\n` and the original
+ * line endings are preserved. The input is read and the output is written in
+ * fixed size chunks, so the memory usage does not depend on the size of the
+ * file.
+ *
+ * \note The file positions after this function returns are undefined.
+ *
+ * \param input Input file handle
+ * \param output Output file handle
+ * \param rules List of rules to apply to each line
+ *
+ * \return Nothing if the input was successfully filtered. Otherwise, the error
+ *         code.
+ */
+oc::result<void> file_filter_lines(File &input, File &output,
+                                   const std::vector<FileLineRule> &rules)
+{
+    std::vector<char> buf(LINE_FILTER_BUFFER_SIZE);
+    // Incomplete line from the previous read
+    std::string partial;
+    std::string out;
+    std::string current;
+    std::string replacement;
+
+    out.reserve(LINE_FILTER_BUFFER_SIZE * 2);
+
+    auto process_line = [&](const char *line, size_t size, bool newline)
+            -> oc::result<void> {
+        for (auto const &rule : rules) {
+            OUTCOME_TRY(action, rule.cb(line, size, replacement,
+                                        rule.userdata));
+
+            if (action == FileLineAction::Drop) {
+                return oc::success();
+            } else if (action == FileLineAction::Replace) {
+                current.swap(replacement);
+                line = current.data();
+                size = current.size();
+            }
+        }
+
+        out.append(line, size);
+        if (newline) {
+            out += '\n';
+        }
+
+        if (out.size() >= LINE_FILTER_BUFFER_SIZE) {
+            OUTCOME_TRYV(file_write_exact(output, out.data(), out.size()));
+            out.clear();
+        }
+
+        return oc::success();
+    };
+
+    while (true) {
+        OUTCOME_TRY(n, file_read_retry(input, buf.data(), buf.size()));
+        if (n == 0) {
+            break;
+        }
+
+        const char *ptr = buf.data();
+        const char *end = buf.data() + n;
+
+        while (ptr != end) {
+            auto nl = static_cast<const char *>(
+                    memchr(ptr, '\n', static_cast<size_t>(end - ptr)));
+            if (!nl) {
+                partial.append(ptr, end);
+                break;
+            }
+
+            if (partial.empty()) {
+                OUTCOME_TRYV(process_line(
+                        ptr, static_cast<size_t>(nl - ptr), true));
+            } else {
+                partial.append(ptr, nl);
+                OUTCOME_TRYV(process_line(partial.data(), partial.size(),
+                                          true));
+                partial.clear();
+            }
+
+            ptr = nl + 1;
+        }
+    }
+
+    // Last line without a trailing newline
+    if (!partial.empty()) {
+        OUTCOME_TRYV(process_line(partial.data(), partial.size(), false));
+    }
+
+    if (!out.empty()) {
+        OUTCOME_TRYV(file_write_exact(output, out.data(), out.size()));
+    }
+
+    return oc::success();
+}
+
 /*!
  * \brief Move data in file
  *
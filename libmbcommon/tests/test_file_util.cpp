@@ -20,9 +20,12 @@
 #include <gmock/gmock.h>
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <cinttypes>
+#include <cstdlib>
+#include <cstring>
 
 #include "mbcommon/file/memory.h"
 #include "mbcommon/file_util.h"
@@ -386,6 +389,96 @@ TEST_F(FileSearchTest, FindNormal)
     ASSERT_TRUE(file_search(file, -1, -1, 0, "a", 1, -1, &_result_cb, this));
 }
 
+struct FileFilterLinesTest : testing::Test
+{
+    void *_out_data = nullptr;
+    size_t _out_size = 0;
+    MemoryFile _output;
+
+    void SetUp() override
+    {
+        ASSERT_TRUE(_output.open(&_out_data, &_out_size));
+    }
+
+    void TearDown() override
+    {
+        ASSERT_TRUE(_output.close());
+        free(_out_data);
+    }
+
+    std::string output() const
+    {
+        return {static_cast<char *>(_out_data), _out_size};
+    }
+
+    static oc::result<FileLineAction>
+    _drop_erase_cb(const char *line, size_t size, std::string &replacement,
+                   void *userdata)
+    {
+        (void) replacement;
+        (void) userdata;
+
+        if (size >= 6 && memcmp(line, "erase ", 6) == 0) {
+            return FileLineAction::Drop;
+        }
+        return FileLineAction::Keep;
+    }
+
+    static oc::result<FileLineAction>
+    _comment_cb(const char *line, size_t size, std::string &replacement,
+                void *userdata)
+    {
+        ++*static_cast<int *>(userdata);
+
+        replacement = "#";
+        replacement.append(line, size);
+        return FileLineAction::Replace;
+    }
+};
+
+TEST_F(FileFilterLinesTest, NoRulesShouldCopyUnchanged)
+{
+    constexpr char buf[] = "a\n\nb\nc";
+
+    MemoryFile input(buf, sizeof(buf) - 1);
+    ASSERT_TRUE(input.is_open());
+
+    ASSERT_TRUE(file_filter_lines(input, _output, {}));
+    ASSERT_EQ(output(), "a\n\nb\nc");
+}
+
+TEST_F(FileFilterLinesTest, RulesShouldApplyInOrder)
+{
+    constexpr char buf[] = "erase 1\nnew 2\nerase 3\nzero 4\n";
+    int n_comment = 0;
+
+    MemoryFile input(buf, sizeof(buf) - 1);
+    ASSERT_TRUE(input.is_open());
+
+    ASSERT_TRUE(file_filter_lines(input, _output, {
+        { &_drop_erase_cb, nullptr },
+        { &_comment_cb, &n_comment },
+    }));
+    ASSERT_EQ(output(), "#new 2\n#zero 4\n");
+    ASSERT_EQ(n_comment, 2);
+}
+
+TEST_F(FileFilterLinesTest, LongLinesShouldSpanReads)
+{
+    std::string buf(200000, 'x');
+    buf += "\nerase ";
+    buf += std::string(100000, 'y');
+    buf += "\nz";
+
+    MemoryFile input(buf.data(), buf.size());
+    ASSERT_TRUE(input.is_open());
+
+    ASSERT_TRUE(file_filter_lines(input, _output, {
+        { &_drop_erase_cb, nullptr },
+    }));
+    ASSERT_EQ(output(), std::string(200000, 'x') + "\nz");
+}
+
 TEST(FileMoveTest, DegenerateCasesShouldSucceed)
 {
     constexpr char buf[] = "abcdef";
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "mbcommon/common.h"
+
+#include "mbdevice/device.h"
+
+namespace mb
+{
+namespace device
+{
+
+class MB_EXPORT DeviceDatabase
+{
+public:
+    DeviceDatabase();
+    ~DeviceDatabase();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(DeviceDatabase)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(DeviceDatabase)
+
+    bool open(const std::string &path);
+    bool open_memory(const void *data, size_t size);
+    void close();
+
+    bool is_open() const;
+
+    size_t size() const;
+
+    bool device_at(size_t index, Device &device) const;
+    bool find_by_codename(const std::string &codename, Device &device) const;
+
+private:
+    bool load_header();
+
+    const unsigned char *m_data;
+    size_t m_size;
+
+    // Backing storage if the file is not memory mapped
+    std::vector<unsigned char> m_buf;
+    bool m_mapped;
+
+    uint32_t m_device_count;
+    uint32_t m_bucket_count;
+    uint32_t m_device_table_offset;
+    uint32_t m_bucket_table_offset;
+};
+
+MB_EXPORT bool device_list_to_database(const std::vector<Device> &devices,
+                                       std::string &data);
+
+MB_EXPORT bool is_device_database(const void *data, size_t size);
+
+}
+}
@@ -0,0 +1,681 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbdevice/database.h"
+
+#include <limits>
+
+#include <cstring>
+
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
+
+
+/*
+ * Binary device database format
+ *
+ * All integers are little endian. Offsets are relative to the beginning of the
+ * file.
+ *
+ * Header:
+ *   char[8]  magic ("MBDEVDB" followed by format version)
+ *   uint32_t number of devices
+ *   uint32_t number of hash table buckets (power of 2)
+ *   uint32_t offset of device table
+ *   uint32_t offset of hash table
+ *
+ * Device table entry:
+ *   uint32_t offset of device record
+ *   uint32_t size of device record
+ *
+ * Hash table bucket (open addressing with linear probing):
+ *   uint32_t device index + 1 (0 if the bucket is empty)
+ *   uint32_t offset of codename
+ *   uint32_t size of codename
+ *
+ * Device records consist of the fields in the order written by
+ * encode_device(). Strings are stored as a uint32_t size followed by the
+ * (non-NULL-terminated) data and string lists are stored as a uint32_t count
+ * followed by the strings.
+ *
+ * The database is generated from the schema-validated JSON device definitions,
+ * so the only validation performed when loading is bounds checking.
+ */
+
+#define DB_MAGIC                "MBDEVDB\x01"
+#define DB_MAGIC_SIZE           8
+#define DB_HEADER_SIZE          (DB_MAGIC_SIZE + 4 * 4)
+#define DB_DEVICE_ENTRY_SIZE    8
+#define DB_BUCKET_SIZE          12
+
+namespace mb
+{
+namespace device
+{
+
+static uint32_t hash_codename(const char *data, size_t size)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static uint32_t read_le32(const unsigned char *p)
+{
+    return static_cast<uint32_t>(p[0])
+            | static_cast<uint32_t>(p[1]) << 8
+            | static_cast<uint32_t>(p[2]) << 16
+            | static_cast<uint32_t>(p[3]) << 24;
+}
+
+static void write_le32(std::string &out, uint32_t value)
+{
+    out += static_cast<char>(value & 0xff);
+    out += static_cast<char>((value >> 8) & 0xff);
+    out += static_cast<char>((value >> 16) & 0xff);
+    out += static_cast<char>((value >> 24) & 0xff);
+}
+
+static void set_le32(std::string &out, size_t offset, uint32_t value)
+{
+    out[offset] = static_cast<char>(value & 0xff);
+    out[offset + 1] = static_cast<char>((value >> 8) & 0xff);
+    out[offset + 2] = static_cast<char>((value >> 16) & 0xff);
+    out[offset + 3] = static_cast<char>((value >> 24) & 0xff);
+}
+
+static void write_string(std::string &out, const std::string &str)
+{
+    write_le32(out, static_cast<uint32_t>(str.size()));
+    out += str;
+}
+
+static void write_string_list(std::string &out,
+                              const std::vector<std::string> &list)
+{
+    write_le32(out, static_cast<uint32_t>(list.size()));
+    for (auto const &str : list) {
+        write_string(out, str);
+    }
+}
+
+static void encode_device(std::string &out, const Device &device)
+{
+    write_string(out, device.id());
+    write_string_list(out, device.codenames());
+    write_string(out, device.name());
+    write_string(out, device.architecture());
+    write_le32(out, static_cast<uint32_t>(device.flags()));
+
+    write_string_list(out, device.block_dev_base_dirs());
+    write_string_list(out, device.system_block_devs());
+    write_string_list(out, device.cache_block_devs());
+    write_string_list(out, device.data_block_devs());
+    write_string_list(out, device.boot_block_devs());
+    write_string_list(out, device.recovery_block_devs());
+    write_string_list(out, device.extra_block_devs());
+
+    write_le32(out, device.tw_supported());
+    write_le32(out, static_cast<uint32_t>(device.tw_flags()));
+    write_le32(out, static_cast<uint32_t>(device.tw_pixel_format()));
+    write_le32(out, static_cast<uint32_t>(device.tw_force_pixel_format()));
+    write_le32(out, static_cast<uint32_t>(device.tw_overscan_percent()));
+    write_le32(out, static_cast<uint32_t>(device.tw_default_x_offset()));
+    write_le32(out, static_cast<uint32_t>(device.tw_default_y_offset()));
+    write_string(out, device.tw_brightness_path());
+    write_string(out, device.tw_secondary_brightness_path());
+    write_le32(out, static_cast<uint32_t>(device.tw_max_brightness()));
+    write_le32(out, static_cast<uint32_t>(device.tw_default_brightness()));
+    write_string(out, device.tw_battery_path());
+    write_string(out, device.tw_cpu_temp_path());
+    write_string(out, device.tw_input_blacklist());
+    write_string(out, device.tw_input_whitelist());
+    write_string_list(out, device.tw_graphics_backends());
+    write_string(out, device.tw_theme());
+}
+
+namespace
+{
+
+class RecordReader
+{
+public:
+    RecordReader(const unsigned char *data, size_t size)
+        : m_ptr(data), m_end(data + size), m_ok(true)
+    {
+    }
+
+    bool ok() const
+    {
+        return m_ok;
+    }
+
+    uint32_t u32()
+    {
+        if (!m_ok || static_cast<size_t>(m_end - m_ptr) < 4) {
+            m_ok = false;
+            return 0;
+        }
+
+        uint32_t value = read_le32(m_ptr);
+        m_ptr += 4;
+        return value;
+    }
+
+    int i32()
+    {
+        return static_cast<int>(static_cast<int32_t>(u32()));
+    }
+
+    std::string string()
+    {
+        uint32_t size = u32();
+
+        if (!m_ok || static_cast<size_t>(m_end - m_ptr) < size) {
+            m_ok = false;
+            return {};
+        }
+
+        std::string str(reinterpret_cast<const char *>(m_ptr), size);
+        m_ptr += size;
+        return str;
+    }
+
+    std::vector<std::string> string_list()
+    {
+        uint32_t count = u32();
+        std::vector<std::string> list;
+
+        for (uint32_t i = 0; m_ok && i < count; ++i) {
+            list.push_back(string());
+        }
+
+        return list;
+    }
+
+private:
+    const unsigned char *m_ptr;
+    const unsigned char *m_end;
+    bool m_ok;
+};
+
+}
+
+static bool decode_device(const unsigned char *data, size_t size,
+                          Device &device)
+{
+    RecordReader r(data, size);
+    Device d;
+
+    d.set_id(r.string());
+    d.set_codenames(r.string_list());
+    d.set_name(r.string());
+    d.set_architecture(r.string());
+    d.set_flags(static_cast<DeviceFlag>(r.u32() & DEVICE_FLAG_MASK));
+
+    d.set_block_dev_base_dirs(r.string_list());
+    d.set_system_block_devs(r.string_list());
+    d.set_cache_block_devs(r.string_list());
+    d.set_data_block_devs(r.string_list());
+    d.set_boot_block_devs(r.string_list());
+    d.set_recovery_block_devs(r.string_list());
+    d.set_extra_block_devs(r.string_list());
+
+    d.set_tw_supported(r.u32() != 0);
+    d.set_tw_flags(static_cast<TwFlag>(r.u32() & TW_FLAG_MASK));
+
+    uint32_t pixel_format = r.u32();
+    if (pixel_format > static_cast<uint32_t>(TwPixelFormat::Rgba8888)) {
+        return false;
+    }
+    d.set_tw_pixel_format(static_cast<TwPixelFormat>(pixel_format));
+
+    uint32_t force_pixel_format = r.u32();
+    if (force_pixel_format > static_cast<uint32_t>(TwForcePixelFormat::Rgb565)) {
+        return false;
+    }
+    d.set_tw_force_pixel_format(
+            static_cast<TwForcePixelFormat>(force_pixel_format));
+
+    d.set_tw_overscan_percent(r.i32());
+    d.set_tw_default_x_offset(r.i32());
+    d.set_tw_default_y_offset(r.i32());
+    d.set_tw_brightness_path(r.string());
+    d.set_tw_secondary_brightness_path(r.string());
+    d.set_tw_max_brightness(r.i32());
+    d.set_tw_default_brightness(r.i32());
+    d.set_tw_battery_path(r.string());
+    d.set_tw_cpu_temp_path(r.string());
+    d.set_tw_input_blacklist(r.string());
+    d.set_tw_input_whitelist(r.string());
+    d.set_tw_graphics_backends(r.string_list());
+    d.set_tw_theme(r.string());
+
+    if (!r.ok()) {
+        return false;
+    }
+
+    device = std::move(d);
+    return true;
+}
+
+/*!
+ * \class DeviceDatabase
+ *
+ * \brief Read-only binary device database
+ *
+ * The database file is memory mapped and devices are only decoded when they
+ * are accessed. Looking up a device by codename is a hash table lookup and does
+ * not depend on the number of devices.
+ */
+
+DeviceDatabase::DeviceDatabase()
+    : m_data(nullptr)
+    , m_size(0)
+    , m_mapped(false)
+    , m_device_count(0)
+    , m_bucket_count(0)
+    , m_device_table_offset(0)
+    , m_bucket_table_offset(0)
+{
+}
+
+DeviceDatabase::~DeviceDatabase()
+{
+    close();
+}
+
+/*!
+ * \brief Open database file
+ *
+ * \param path Path to database file
+ *
+ * \return Whether the file was successfully opened and has a valid header
+ */
+bool DeviceDatabase::open(const std::string &path)
+{
+    close();
+
+#ifdef _WIN32
+    StandardFile file;
+
+    if (!file.open(path, FileOpenMode::ReadOnly)) {
+        return false;
+    }
+
+    auto size = file.seek(0, SEEK_END);
+    if (!size || size.value() > std::numeric_limits<uint32_t>::max()
+            || !file.seek(0, SEEK_SET)) {
+        return false;
+    }
+
+    m_buf.resize(static_cast<size_t>(size.value()));
+
+    auto n = file_read_retry(file, m_buf.data(), m_buf.size());
+    if (!n || n.value() != m_buf.size()) {
+        m_buf.clear();
+        return false;
+    }
+
+    m_data = m_buf.data();
+    m_size = m_buf.size();
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size < 0
+            || static_cast<uint64_t>(sb.st_size)
+                    > std::numeric_limits<uint32_t>::max()) {
+        ::close(fd);
+        return false;
+    }
+
+    void *data = mmap(nullptr, static_cast<size_t>(sb.st_size), PROT_READ,
+                      MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    m_data = static_cast<const unsigned char *>(data);
+    m_size = static_cast<size_t>(sb.st_size);
+    m_mapped = true;
+#endif
+
+    if (!load_header()) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Open database from memory
+ *
+ * \note The data is not copied and must outlive the DeviceDatabase instance or
+ *       until close() is called.
+ *
+ * \param data Database contents
+ * \param size Size of \p data
+ *
+ * \return Whether the database has a valid header
+ */
+bool DeviceDatabase::open_memory(const void *data, size_t size)
+{
+    close();
+
+    m_data = static_cast<const unsigned char *>(data);
+    m_size = size;
+
+    if (!load_header()) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Close database
+ */
+void DeviceDatabase::close()
+{
+#ifndef _WIN32
+    if (m_mapped) {
+        munmap(const_cast<unsigned char *>(m_data), m_size);
+    }
+#endif
+
+    m_data = nullptr;
+    m_size = 0;
+    m_buf.clear();
+    m_buf.shrink_to_fit();
+    m_mapped = false;
+    m_device_count = 0;
+    m_bucket_count = 0;
+    m_device_table_offset = 0;
+    m_bucket_table_offset = 0;
+}
+
+bool DeviceDatabase::is_open() const
+{
+    return m_data != nullptr;
+}
+
+bool DeviceDatabase::load_header()
+{
+    if (!is_device_database(m_data, m_size)) {
+        return false;
+    }
+
+    const unsigned char *p = m_data + DB_MAGIC_SIZE;
+
+    m_device_count = read_le32(p);
+    m_bucket_count = read_le32(p + 4);
+    m_device_table_offset = read_le32(p + 8);
+    m_bucket_table_offset = read_le32(p + 12);
+
+    // Bucket count must be a power of 2 so it can be used as a mask. Sizes are
+    // computed with 64-bit integers to avoid overflow.
+    if (m_bucket_count == 0 || (m_bucket_count & (m_bucket_count - 1)) != 0
+            || m_bucket_count <= m_device_count) {
+        return false;
+    }
+
+    if (m_device_table_offset + uint64_t(m_device_count) * DB_DEVICE_ENTRY_SIZE
+                    > m_size
+            || m_bucket_table_offset + uint64_t(m_bucket_count) * DB_BUCKET_SIZE
+                    > m_size) {
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get number of devices in database
+ */
+size_t DeviceDatabase::size() const
+{
+    return m_device_count;
+}
+
+/*!
+ * \brief Decode device at index
+ *
+ * \param[in] index Index of device
+ * \param[out] device Output device
+ *
+ * \return Whether the device exists and was successfully decoded
+ */
+bool DeviceDatabase::device_at(size_t index, Device &device) const
+{
+    if (index >= m_device_count) {
+        return false;
+    }
+
+    const unsigned char *entry =
+            m_data + m_device_table_offset + index * DB_DEVICE_ENTRY_SIZE;
+    uint32_t offset = read_le32(entry);
+    uint32_t size = read_le32(entry + 4);
+
+    if (uint64_t(offset) + size > m_size) {
+        return false;
+    }
+
+    return decode_device(m_data + offset, size, device);
+}
+
+/*!
+ * \brief Find device by codename
+ *
+ * If multiple devices share a codename, the first device in the original
+ * device list is returned.
+ *
+ * \param[in] codename Device codename
+ * \param[out] device Output device
+ *
+ * \return Whether a device was found and successfully decoded
+ */
+bool DeviceDatabase::find_by_codename(const std::string &codename,
+                                      Device &device) const
+{
+    if (!is_open()) {
+        return false;
+    }
+
+    const uint32_t mask = m_bucket_count - 1;
+    uint32_t bucket = hash_codename(codename.data(), codename.size()) & mask;
+
+    for (uint32_t i = 0; i < m_bucket_count; ++i) {
+        const unsigned char *p =
+                m_data + m_bucket_table_offset + bucket * DB_BUCKET_SIZE;
+        uint32_t index = read_le32(p);
+
+        if (index == 0) {
+            break;
+        }
+
+        uint32_t name_offset = read_le32(p + 4);
+        uint32_t name_size = read_le32(p + 8);
+
+        if (uint64_t(name_offset) + name_size > m_size) {
+            return false;
+        }
+
+        if (name_size == codename.size() && memcmp(
+                m_data + name_offset, codename.data(), name_size) == 0) {
+            return device_at(index - 1, device);
+        }
+
+        bucket = (bucket + 1) & mask;
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Serialize device list to binary database
+ *
+ * \note The devices are not validated. Callers should validate the devices
+ *       before serializing them.
+ *
+ * \param[in] devices List of devices
+ * \param[out] data Output database contents
+ *
+ * \return Whether the devices were successfully serialized. This fails only if
+ *         the database would exceed 4 GiB.
+ */
+bool device_list_to_database(const std::vector<Device> &devices,
+                             std::string &data)
+{
+    std::string out;
+
+    size_t codename_count = 0;
+    for (auto const &d : devices) {
+        codename_count += d.codenames().size();
+    }
+
+    // Keep the load factor at or below 0.5
+    uint32_t bucket_count = 1;
+    while (bucket_count < 2 * codename_count || bucket_count <= devices.size()) {
+        if (bucket_count > std::numeric_limits<uint32_t>::max() / 2) {
+            return false;
+        }
+        bucket_count <<= 1;
+    }
+
+    const size_t device_table_offset = DB_HEADER_SIZE;
+    const size_t bucket_table_offset =
+            device_table_offset + devices.size() * DB_DEVICE_ENTRY_SIZE;
+    const size_t records_offset =
+            bucket_table_offset + bucket_count * DB_BUCKET_SIZE;
+
+    out.append(DB_MAGIC, DB_MAGIC_SIZE);
+    write_le32(out, static_cast<uint32_t>(devices.size()));
+    write_le32(out, bucket_count);
+    write_le32(out, static_cast<uint32_t>(device_table_offset));
+    write_le32(out, static_cast<uint32_t>(bucket_table_offset));
+    out.resize(records_offset);
+
+    struct CodenameRef
+    {
+        uint32_t device;
+        size_t offset;
+        size_t size;
+    };
+    std::vector<CodenameRef> codenames;
+
+    for (size_t i = 0; i < devices.size(); ++i) {
+        size_t offset = out.size();
+
+        encode_device(out, devices[i]);
+
+        if (out.size() > std::numeric_limits<uint32_t>::max()) {
+            return false;
+        }
+
+        set_le32(out, device_table_offset + i * DB_DEVICE_ENTRY_SIZE,
+                 static_cast<uint32_t>(offset));
+        set_le32(out, device_table_offset + i * DB_DEVICE_ENTRY_SIZE + 4,
+                 static_cast<uint32_t>(out.size() - offset));
+
+        // Store the codenames in the string pool after the records
+        for (auto const &codename : devices[i].codenames()) {
+            codenames.push_back({ static_cast<uint32_t>(i), 0, codename.size() });
+        }
+    }
+
+    size_t n = 0;
+    for (auto const &d : devices) {
+        for (auto const &codename : d.codenames()) {
+            codenames[n++].offset = out.size();
+            out += codename;
+        }
+    }
+
+    if (out.size() > std::numeric_limits<uint32_t>::max()) {
+        return false;
+    }
+
+    const uint32_t mask = bucket_count - 1;
+
+    for (auto const &ref : codenames) {
+        const char *name = out.data() + ref.offset;
+        uint32_t bucket = hash_codename(name, ref.size) & mask;
+
+        while (true) {
+            size_t pos = bucket_table_offset + bucket * DB_BUCKET_SIZE;
+            uint32_t index = read_le32(
+                    reinterpret_cast<const unsigned char *>(out.data() + pos));
+
+            if (index == 0) {
+                set_le32(out, pos, ref.device + 1);
+                set_le32(out, pos + 4, static_cast<uint32_t>(ref.offset));
+                set_le32(out, pos + 8, static_cast<uint32_t>(ref.size));
+                break;
+            }
+
+            // Earlier devices take precedence for duplicate codenames
+            uint32_t other_size = read_le32(reinterpret_cast<const unsigned char *>(
+                    out.data() + pos + 8));
+            uint32_t other_offset = read_le32(reinterpret_cast<const unsigned char *>(
+                    out.data() + pos + 4));
+            if (other_size == ref.size
+                    && memcmp(out.data() + other_offset, name, ref.size) == 0) {
+                break;
+            }
+
+            bucket = (bucket + 1) & mask;
+        }
+    }
+
+    data.swap(out);
+    return true;
+}
+
+/*!
+ * \brief Check if data begins with the binary device database header
+ */
+bool is_device_database(const void *data, size_t size)
+{
+    return data && size >= DB_HEADER_SIZE
+            && memcmp(data, DB_MAGIC, DB_MAGIC_SIZE) == 0;
+}
+
+}
+}
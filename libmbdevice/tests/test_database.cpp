@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include "mbdevice/database.h"
+#include "mbdevice/device.h"
+
+using namespace mb::device;
+
+static Device create_device(const std::string &id,
+                            std::vector<std::string> codenames)
+{
+    Device device;
+    device.set_id(id);
+    device.set_codenames(std::move(codenames));
+    device.set_name("Test Device " + id);
+    device.set_architecture(ARCH_ARM64_V8A);
+    device.set_flags(DeviceFlag::FstabSkipSdcard0);
+    device.set_block_dev_base_dirs({"/dev/block/bootdevice/by-name"});
+    device.set_system_block_devs({"/dev/block/bootdevice/by-name/system"});
+    device.set_cache_block_devs({"/dev/block/bootdevice/by-name/cache"});
+    device.set_data_block_devs({"/dev/block/bootdevice/by-name/userdata"});
+    device.set_boot_block_devs({"/dev/block/bootdevice/by-name/boot"});
+    device.set_recovery_block_devs({"/dev/block/bootdevice/by-name/recovery"});
+    device.set_extra_block_devs({"/dev/block/bootdevice/by-name/modem"});
+    device.set_tw_supported(true);
+    device.set_tw_flags(TwFlag::TouchscreenFlipX | TwFlag::RoundScreen);
+    device.set_tw_pixel_format(TwPixelFormat::Rgba8888);
+    device.set_tw_force_pixel_format(TwForcePixelFormat::Rgb565);
+    device.set_tw_overscan_percent(10);
+    device.set_tw_default_x_offset(-20);
+    device.set_tw_default_y_offset(30);
+    device.set_tw_brightness_path("/sys/class/backlight");
+    device.set_tw_secondary_brightness_path("/sys/class/backlight2");
+    device.set_tw_max_brightness(255);
+    device.set_tw_default_brightness(-1);
+    device.set_tw_battery_path("/sys/class/power_supply/battery");
+    device.set_tw_cpu_temp_path("/sys/class/thermal/thermal_zone0/temp");
+    device.set_tw_input_blacklist("foo");
+    device.set_tw_input_whitelist("bar");
+    device.set_tw_graphics_backends({"overlay_msm_old", "fbdev"});
+    device.set_tw_theme("portrait_hdpi");
+    return device;
+}
+
+TEST(DatabaseTest, RoundTrip)
+{
+    std::vector<Device> devices{
+        create_device("a", {"a1", "a2"}),
+        create_device("b", {"b1"}),
+        create_device("c", {"c1", "c2", "c3"}),
+    };
+
+    std::string data;
+    ASSERT_TRUE(device_list_to_database(devices, data));
+    ASSERT_TRUE(is_device_database(data.data(), data.size()));
+
+    DeviceDatabase db;
+    ASSERT_TRUE(db.open_memory(data.data(), data.size()));
+    ASSERT_EQ(db.size(), devices.size());
+
+    for (size_t i = 0; i < devices.size(); ++i) {
+        Device device;
+        ASSERT_TRUE(db.device_at(i, device));
+        ASSERT_EQ(device, devices[i]);
+    }
+
+    Device device;
+    ASSERT_FALSE(db.device_at(devices.size(), device));
+}
+
+TEST(DatabaseTest, FindByCodename)
+{
+    std::vector<Device> devices{
+        create_device("a", {"a1", "shared"}),
+        create_device("b", {"b1", "shared"}),
+    };
+
+    std::string data;
+    ASSERT_TRUE(device_list_to_database(devices, data));
+
+    DeviceDatabase db;
+    ASSERT_TRUE(db.open_memory(data.data(), data.size()));
+
+    Device device;
+    ASSERT_TRUE(db.find_by_codename("b1", device));
+    ASSERT_EQ(device.id(), "b");
+    ASSERT_TRUE(db.find_by_codename("a1", device));
+    ASSERT_EQ(device.id(), "a");
+
+    // First device wins for duplicate codenames
+    ASSERT_TRUE(db.find_by_codename("shared", device));
+    ASSERT_EQ(device.id(), "a");
+
+    ASSERT_FALSE(db.find_by_codename("missing", device));
+    ASSERT_FALSE(db.find_by_codename("", device));
+}
+
+TEST(DatabaseTest, EmptyList)
+{
+    std::string data;
+    ASSERT_TRUE(device_list_to_database({}, data));
+
+    DeviceDatabase db;
+    ASSERT_TRUE(db.open_memory(data.data(), data.size()));
+    ASSERT_EQ(db.size(), 0u);
+
+    Device device;
+    ASSERT_FALSE(db.find_by_codename("a", device));
+}
+
+TEST(DatabaseTest, RejectInvalidData)
+{
+    std::string data;
+    ASSERT_TRUE(device_list_to_database({ create_device("a", {"a1"}) }, data));
+
+    DeviceDatabase db;
+
+    // Bad magic
+    std::string bad_magic(data);
+    bad_magic[0] = 'X';
+    ASSERT_FALSE(is_device_database(bad_magic.data(), bad_magic.size()));
+    ASSERT_FALSE(db.open_memory(bad_magic.data(), bad_magic.size()));
+    ASSERT_FALSE(db.is_open());
+
+    // Truncated header
+    ASSERT_FALSE(db.open_memory(data.data(), 10));
+
+    // Truncated device record
+    ASSERT_TRUE(db.open_memory(data.data(), data.size() - 20));
+    Device device;
+    ASSERT_FALSE(db.device_at(0, device));
+}
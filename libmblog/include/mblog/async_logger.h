@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mblog/base_logger.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cstdint>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+namespace mb
+{
+namespace log
+{
+
+namespace detail
+{
+struct AsyncRing;
+}
+
+/*!
+ * \brief Logger that writes formatted records to a file descriptor from a
+ *        background thread
+ *
+ * Each logging thread copies its formatted records into its own
+ * single-producer, single-consumer ring buffer without taking any locks. A
+ * flusher thread drains all of the rings and writes them out with batched
+ * writev() calls. Records from one thread are always written in order, but
+ * records from different threads may be interleaved differently than they
+ * were logged. Errors are not returned from log() until they, and every
+ * record before them, have been written.
+ *
+ * After a fork(), the child process has no flusher thread, so the logger
+ * falls back to writing records synchronously.
+ */
+class MB_EXPORT AsyncLogger : public BaseLogger
+{
+public:
+    AsyncLogger(int fd);
+    virtual ~AsyncLogger();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(AsyncLogger)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(AsyncLogger)
+
+    virtual void log(const LogRecord &rec) override;
+
+    virtual bool formatted() override;
+
+    virtual bool concurrent() override;
+
+    virtual void flush() override;
+
+private:
+    std::shared_ptr<detail::AsyncRing> thread_ring();
+    void wake_flusher();
+    void write_sync(const std::string &msg);
+    bool rings_empty() const;
+    void drain(const std::vector<std::shared_ptr<detail::AsyncRing>> &rings);
+    void run_flusher();
+
+    static void * flusher_thread(void *userdata);
+
+    int m_fd;
+    pid_t m_pid;
+    uint64_t m_id;
+
+    std::mutex m_mutex;
+    //! Signals the flusher that there are new records
+    std::condition_variable m_flush_cond;
+    //! Signals producers that the flusher has drained the rings
+    std::condition_variable m_drained_cond;
+    std::vector<std::shared_ptr<detail::AsyncRing>> m_rings;
+    std::atomic<bool> m_pending;
+    bool m_stop;
+
+    pthread_t m_thread;
+    bool m_has_thread;
+};
+
+}
+}
@@ -38,6 +38,10 @@ public:
     virtual void log(const LogRecord &rec) = 0;
 
     virtual bool formatted() = 0;
+
+    virtual bool concurrent();
+
+    virtual void flush();
 };
 
 }
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbcommon/common.h"
+
+#include "mblog/log_record.h"
+
+namespace mb
+{
+namespace log
+{
+
+/*!
+ * \brief Reads records written by BinaryLogger
+ */
+class MB_EXPORT BinaryLogReader
+{
+public:
+    BinaryLogReader(int fd);
+    ~BinaryLogReader();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(BinaryLogReader)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(BinaryLogReader)
+
+    bool next(LogRecord &rec);
+
+    const std::string & error() const;
+
+private:
+    bool read_header();
+    bool read_block();
+    bool fail(std::string error);
+
+    int m_fd;
+    bool m_header_read;
+    std::string m_error;
+
+    std::vector<unsigned char> m_block;
+    size_t m_pos;
+    int64_t m_time;
+    std::vector<std::string> m_tags;
+};
+
+}
+}
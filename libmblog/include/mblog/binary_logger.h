@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mblog/base_logger.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+#include <sys/types.h>
+
+namespace mb
+{
+namespace log
+{
+
+/*!
+ * \brief Logger that writes compact binary records
+ *
+ * Records are buffered into blocks, which are optionally compressed with LZ4
+ * and written with a single write() call. A block is written when it is full,
+ * when an error is logged, or when flush() is called. Use BinaryLogReader or
+ * the mblogdecode tool to convert the log back to text.
+ *
+ * After a fork(), the child discards the block buffered by the parent (the
+ * parent will write it) and starts a new block of its own. A child that exits
+ * with _exit() must call flush() first or its buffered records are lost.
+ */
+class MB_EXPORT BinaryLogger : public BaseLogger
+{
+public:
+    BinaryLogger(int fd, bool compress);
+    virtual ~BinaryLogger();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(BinaryLogger)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(BinaryLogger)
+
+    virtual void log(const LogRecord &rec) override;
+
+    virtual bool formatted() override;
+
+    virtual void flush() override;
+
+private:
+    void reset_block();
+
+    int m_fd;
+    bool m_compress;
+    pid_t m_pid;
+
+    std::vector<unsigned char> m_block;
+    // Reused by flush()
+    std::vector<unsigned char> m_header;
+    std::vector<char> m_compressed;
+    int64_t m_base_time;
+    int64_t m_last_time;
+    std::unordered_map<std::string, uint32_t> m_tags;
+};
+
+}
+}
@@ -67,6 +67,7 @@ namespace log
 {
 
 class BaseLogger;
+struct LogRecord;
 
 MB_EXPORT std::shared_ptr<BaseLogger> logger();
 MB_EXPORT void set_logger(std::shared_ptr<BaseLogger> logger);
@@ -74,9 +75,11 @@ MB_EXPORT void set_logger(std::shared_ptr<BaseLogger> logger);
 MB_PRINTF(3, 4)
 MB_EXPORT void log(LogLevel prio, const char *tag, const char *fmt, ...);
 MB_EXPORT void log_v(LogLevel prio, const char *tag, const char *fmt, va_list ap);
+MB_EXPORT void flush();
 
 MB_EXPORT std::string format();
 MB_EXPORT void set_format(std::string fmt);
+MB_EXPORT std::string format_record(const LogRecord &rec);
 
 }
 }
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "mbcommon/common.h"
+
+namespace mb
+{
+namespace log
+{
+
+/*!
+ * \brief Records the duration of a block of code
+ *
+ * Completed spans are stored in a fixed-size, in-memory ring buffer. When the
+ * buffer is full, the oldest spans are overwritten. Spans can be nested and
+ * used from any thread. They are ordered by their monotonic timestamps when
+ * viewed.
+ *
+ * Spans that are still open can be ended early with trace_end_open_spans(),
+ * which records them as incomplete.
+ *
+ * \note The span name is copied (and truncated if needed) when the span ends,
+ *       so it must remain valid until then.
+ */
+class MB_EXPORT TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name);
+    ~TraceSpan();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(TraceSpan)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(TraceSpan)
+
+    void end();
+
+private:
+    const char *m_name;
+    uint64_t m_begin;
+    uint64_t m_tid;
+    bool m_ended;
+
+    // List of open spans (guarded by the trace mutex)
+    TraceSpan *m_prev;
+    TraceSpan *m_next;
+
+    friend void trace_end_open_spans();
+};
+
+MB_EXPORT uint64_t trace_time_ns();
+MB_EXPORT void trace_record(const char *name, uint64_t begin_ns,
+                            uint64_t end_ns);
+MB_EXPORT void trace_end_open_spans();
+MB_EXPORT void trace_clear();
+MB_EXPORT bool trace_dump(const char *path);
+
+}
+}
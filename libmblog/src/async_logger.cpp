@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/async_logger.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "mblog/log_record.h"
+
+namespace mb
+{
+namespace log
+{
+
+static constexpr size_t ASYNC_RING_SIZE = 64 * 1024;
+static constexpr size_t ASYNC_MAX_IOVECS = 64;
+
+namespace detail
+{
+
+struct AsyncRing
+{
+    std::array<char, ASYNC_RING_SIZE> buf;
+    //! Total number of bytes written. Only modified by the producer.
+    std::atomic<size_t> head{0};
+    //! Total number of bytes consumed. Only modified by the flusher.
+    std::atomic<size_t> tail{0};
+    //! Set when the producer thread exits
+    std::atomic<bool> orphaned{false};
+};
+
+}
+
+using detail::AsyncRing;
+
+// The NDK doesn't support TLS, so the per-thread rings are stored with pthread
+// keys
+struct ThreadRing
+{
+    uint64_t logger_id;
+    std::shared_ptr<AsyncRing> ring;
+};
+
+static pthread_once_t g_tls_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_tls_key_ring;
+static std::atomic<uint64_t> g_next_logger_id{1};
+
+static void _destroy_thread_ring(void *ptr)
+{
+    auto *tr = static_cast<ThreadRing *>(ptr);
+    tr->ring->orphaned.store(true, std::memory_order_release);
+    delete tr;
+}
+
+static void _init_tls_key()
+{
+    pthread_key_create(&g_tls_key_ring, &_destroy_thread_ring);
+}
+
+static void _ring_push(AsyncRing &ring, size_t head, const char *data,
+                       size_t size)
+{
+    size_t offset = head % ring.buf.size();
+    size_t n = std::min(size, ring.buf.size() - offset);
+
+    memcpy(ring.buf.data() + offset, data, n);
+    memcpy(ring.buf.data(), data + n, size - n);
+}
+
+static bool _writev_fully(int fd, iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        auto remaining = static_cast<size_t>(n);
+
+        while (iovcnt > 0 && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Construct logger that writes to \p fd
+ *
+ * \p fd is duplicated, so the caller can close it at any time.
+ */
+AsyncLogger::AsyncLogger(int fd)
+    : m_fd(fcntl(fd, F_DUPFD_CLOEXEC, 0))
+    , m_pid(getpid())
+    , m_id(g_next_logger_id++)
+    , m_pending(false)
+    , m_stop(false)
+    , m_has_thread(false)
+{
+    pthread_once(&g_tls_once, &_init_tls_key);
+
+    m_has_thread = pthread_create(&m_thread, nullptr, &flusher_thread,
+                                  this) == 0;
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    if (m_has_thread && getpid() == m_pid) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_flush_cond.notify_one();
+
+        pthread_join(m_thread, nullptr);
+    }
+
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+void AsyncLogger::log(const LogRecord &rec)
+{
+    if (!m_has_thread || getpid() != m_pid) {
+        write_sync(rec.fmt_msg);
+        return;
+    }
+
+    auto ring = thread_ring();
+    if (!ring) {
+        write_sync(rec.fmt_msg);
+        return;
+    }
+
+    size_t size = rec.fmt_msg.size() + 1;
+
+    if (size > ring->buf.size()) {
+        // Too large to ever fit. Wait for the ring to empty so that the
+        // thread's records stay in order.
+        flush();
+        write_sync(rec.fmt_msg);
+        return;
+    }
+
+    size_t head = ring->head.load(std::memory_order_relaxed);
+
+    if (ring->buf.size() - (head - ring->tail.load(std::memory_order_acquire))
+            < size) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_pending.store(true, std::memory_order_release);
+        m_flush_cond.notify_one();
+        m_drained_cond.wait(lock, [&] {
+            return ring->buf.size() - (head - ring->tail.load(
+                    std::memory_order_acquire)) >= size;
+        });
+    }
+
+    _ring_push(*ring, head, rec.fmt_msg.data(), size - 1);
+    _ring_push(*ring, head + size - 1, "\n", 1);
+    ring->head.store(head + size, std::memory_order_release);
+
+    if (rec.prio == LogLevel::Error) {
+        // Make sure errors reach the disk in case the process is about to
+        // exit or crash
+        flush();
+    } else {
+        wake_flusher();
+    }
+}
+
+bool AsyncLogger::formatted()
+{
+    return true;
+}
+
+bool AsyncLogger::concurrent()
+{
+    return true;
+}
+
+/*!
+ * \brief Wait until every record logged so far has been written
+ */
+void AsyncLogger::flush()
+{
+    if (!m_has_thread || getpid() != m_pid) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_pending.store(true, std::memory_order_release);
+    m_flush_cond.notify_one();
+    m_drained_cond.wait(lock, [&] {
+        return rings_empty();
+    });
+}
+
+std::shared_ptr<AsyncRing> AsyncLogger::thread_ring()
+{
+    auto *tr = static_cast<ThreadRing *>(pthread_getspecific(g_tls_key_ring));
+    if (tr && tr->logger_id == m_id) {
+        return tr->ring;
+    }
+
+    auto ring = std::make_shared<AsyncRing>();
+
+    if (tr) {
+        // The thread previously logged to a different AsyncLogger
+        tr->ring->orphaned.store(true, std::memory_order_release);
+    } else {
+        tr = new ThreadRing();
+        if (pthread_setspecific(g_tls_key_ring, tr) != 0) {
+            delete tr;
+            return nullptr;
+        }
+    }
+
+    tr->logger_id = m_id;
+    tr->ring = ring;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_rings.push_back(ring);
+
+    return ring;
+}
+
+void AsyncLogger::wake_flusher()
+{
+    // Only take the lock if the flusher has already picked up the previous
+    // wakeup. Otherwise, it will see the new records when it drains the rings.
+    if (!m_pending.exchange(true, std::memory_order_acq_rel)) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_flush_cond.notify_one();
+    }
+}
+
+void AsyncLogger::write_sync(const std::string &msg)
+{
+    iovec iov[2];
+    iov[0].iov_base = const_cast<char *>(msg.data());
+    iov[0].iov_len = msg.size();
+    iov[1].iov_base = const_cast<char *>("\n");
+    iov[1].iov_len = 1;
+
+    _writev_fully(m_fd, iov, 2);
+}
+
+// Must be called with m_mutex locked
+bool AsyncLogger::rings_empty() const
+{
+    for (auto const &ring : m_rings) {
+        if (ring->head.load(std::memory_order_acquire)
+                != ring->tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void AsyncLogger::drain(const std::vector<std::shared_ptr<AsyncRing>> &rings)
+{
+    std::array<iovec, ASYNC_MAX_IOVECS> iov;
+    std::array<std::pair<AsyncRing *, size_t>, ASYNC_MAX_IOVECS> commits;
+    size_t n_iov = 0;
+    size_t n_commits = 0;
+
+    auto write_batch = [&] {
+        _writev_fully(m_fd, iov.data(), static_cast<int>(n_iov));
+
+        // Data that failed to write is dropped
+        for (size_t i = 0; i < n_commits; ++i) {
+            commits[i].first->tail.store(commits[i].second,
+                                         std::memory_order_release);
+        }
+
+        n_iov = 0;
+        n_commits = 0;
+    };
+
+    for (auto const &ring : rings) {
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        size_t head = ring->head.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            continue;
+        }
+
+        // Each ring needs at most two iovecs if the data wraps around
+        if (n_iov + 2 > iov.size()) {
+            write_batch();
+        }
+
+        size_t offset = tail % ring->buf.size();
+        size_t size = head - tail;
+        size_t n = std::min(size, ring->buf.size() - offset);
+
+        iov[n_iov].iov_base = ring->buf.data() + offset;
+        iov[n_iov].iov_len = n;
+        ++n_iov;
+
+        if (n < size) {
+            iov[n_iov].iov_base = ring->buf.data();
+            iov[n_iov].iov_len = size - n;
+            ++n_iov;
+        }
+
+        commits[n_commits++] = { ring.get(), head };
+    }
+
+    if (n_iov > 0) {
+        write_batch();
+    }
+}
+
+void AsyncLogger::run_flusher()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true) {
+        m_flush_cond.wait(lock, [&] {
+            return m_pending.load(std::memory_order_acquire) || m_stop;
+        });
+
+        bool stop = m_stop;
+        // Pairs with the exchange in wake_flusher() so that the records
+        // published before it are visible
+        m_pending.exchange(false, std::memory_order_acq_rel);
+
+        auto rings = m_rings;
+
+        lock.unlock();
+        drain(rings);
+        lock.lock();
+
+        // Remove rings of threads that have exited once they are drained
+        m_rings.erase(std::remove_if(m_rings.begin(), m_rings.end(),
+                                     [](const std::shared_ptr<AsyncRing> &r) {
+            return r->orphaned.load(std::memory_order_acquire)
+                    && r->head.load(std::memory_order_acquire)
+                            == r->tail.load(std::memory_order_relaxed);
+        }), m_rings.end());
+
+        m_drained_cond.notify_all();
+
+        if (stop) {
+            break;
+        }
+    }
+}
+
+void * AsyncLogger::flusher_thread(void *userdata)
+{
+    static_cast<AsyncLogger *>(userdata)->run_flusher();
+    return nullptr;
+}
+
+}
+}
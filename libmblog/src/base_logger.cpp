@@ -32,5 +32,24 @@ BaseLogger::~BaseLogger()
 {
 }
 
+/*!
+ * \brief Whether log() can be called from multiple threads at the same time
+ *
+ * If false (the default), calls to log() are serialized with a global mutex.
+ */
+bool BaseLogger::concurrent()
+{
+    return false;
+}
+
+/*!
+ * \brief Write out any records that the logger is buffering
+ *
+ * The default implementation does nothing.
+ */
+void BaseLogger::flush()
+{
+}
+
 }
 }
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Binary log format (all integers are little endian)
+ *
+ * File header:
+ *   char[8] - magic ("MBLOGBIN")
+ *   u32     - version
+ *
+ * Each block:
+ *   u32     - size of the uncompressed records
+ *   u32     - size of the stored (possibly compressed) records
+ *   u32     - flags (BLOCK_FLAG_*)
+ *   i64     - base timestamp (nanoseconds since the Unix epoch)
+ *   u8[]    - records
+ *
+ * Blocks are independent so that a log truncated by a crash can be decoded up
+ * to the last complete block. The tag table and timestamp delta are reset at
+ * the beginning of each block.
+ *
+ * Tag definition (assigns the next tag ID):
+ *   u8      - RECORD_TAG
+ *   varint  - length
+ *   u8[]    - tag
+ *
+ * Log record:
+ *   u8      - RECORD_LOG
+ *   u8      - priority (LogLevel)
+ *   varint  - zigzag-encoded nanoseconds since the previous record's timestamp
+ *             (or the block's base timestamp)
+ *   varint  - pid
+ *   varint  - tid
+ *   varint  - tag ID
+ *   varint  - message length
+ *   u8[]    - message
+ */
+
+namespace mb
+{
+namespace log
+{
+namespace detail
+{
+
+constexpr char BINARY_LOG_MAGIC[] = "MBLOGBIN";
+constexpr size_t BINARY_LOG_MAGIC_SIZE = sizeof(BINARY_LOG_MAGIC) - 1;
+constexpr uint32_t BINARY_LOG_VERSION = 1;
+
+constexpr size_t BINARY_LOG_HEADER_SIZE = BINARY_LOG_MAGIC_SIZE + 4;
+constexpr size_t BINARY_LOG_BLOCK_HEADER_SIZE = 4 + 4 + 4 + 8;
+
+constexpr uint32_t BLOCK_FLAG_LZ4 = 1u << 0;
+
+// Sanity limit when reading
+constexpr uint32_t BINARY_LOG_MAX_BLOCK_SIZE = 64 * 1024 * 1024;
+
+constexpr unsigned char RECORD_TAG = 0;
+constexpr unsigned char RECORD_LOG = 1;
+
+inline void put_u32(std::vector<unsigned char> &buf, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        buf.push_back(static_cast<unsigned char>(value >> (i * 8)));
+    }
+}
+
+inline void put_u64(std::vector<unsigned char> &buf, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        buf.push_back(static_cast<unsigned char>(value >> (i * 8)));
+    }
+}
+
+inline uint32_t get_u32(const unsigned char *buf)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= static_cast<uint32_t>(buf[i]) << (i * 8);
+    }
+    return value;
+}
+
+inline uint64_t get_u64(const unsigned char *buf)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= static_cast<uint64_t>(buf[i]) << (i * 8);
+    }
+    return value;
+}
+
+inline void put_varint(std::vector<unsigned char> &buf, uint64_t value)
+{
+    while (value >= 0x80) {
+        buf.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    buf.push_back(static_cast<unsigned char>(value));
+}
+
+inline bool get_varint(const unsigned char *&ptr, const unsigned char *end,
+                       uint64_t &value)
+{
+    value = 0;
+
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (ptr == end) {
+            return false;
+        }
+
+        unsigned char c = *ptr++;
+        value |= static_cast<uint64_t>(c & 0x7f) << shift;
+
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+inline uint64_t zigzag_encode(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1)
+            ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+}
+}
+}
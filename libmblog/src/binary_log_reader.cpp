@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/binary_log_reader.h"
+
+#include <chrono>
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+#ifdef MBLOG_HAVE_LZ4
+#  include <lz4.h>
+#endif
+
+#include "mbcommon/string.h"
+
+#include "binary_log_format.h"
+
+namespace mb
+{
+namespace log
+{
+
+using namespace detail;
+
+// Returns the number of bytes read, which is only less than size at EOF
+static ssize_t _read_fully(int fd, void *buf, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = read(fd, static_cast<char *>(buf) + total, size - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        total += static_cast<size_t>(n);
+    }
+
+    return static_cast<ssize_t>(total);
+}
+
+/*!
+ * \brief Construct reader for a binary log
+ *
+ * \param fd File descriptor positioned at the beginning of the log. It is not
+ *           closed by the reader.
+ */
+BinaryLogReader::BinaryLogReader(int fd)
+    : m_fd(fd)
+    , m_header_read(false)
+    , m_pos(0)
+    , m_time(0)
+{
+}
+
+BinaryLogReader::~BinaryLogReader() = default;
+
+/*!
+ * \brief Read the next record
+ *
+ * \param[out] rec Record. LogRecord::fmt_msg is not set.
+ *
+ * \return True if a record was read. False at the end of the log or if an
+ *         error occurs, in which case error() returns a non-empty string.
+ */
+bool BinaryLogReader::next(LogRecord &rec)
+{
+    if (!m_error.empty()) {
+        return false;
+    }
+
+    if (!m_header_read) {
+        if (!read_header()) {
+            return false;
+        }
+        m_header_read = true;
+    }
+
+    while (true) {
+        if (m_pos == m_block.size() && !read_block()) {
+            return false;
+        }
+
+        const unsigned char *ptr = m_block.data() + m_pos;
+        const unsigned char *end = m_block.data() + m_block.size();
+        unsigned char type = *ptr++;
+        uint64_t value;
+
+        if (type == RECORD_TAG) {
+            if (!get_varint(ptr, end, value)
+                    || value > static_cast<uint64_t>(end - ptr)) {
+                return fail("Invalid tag definition");
+            }
+
+            m_tags.emplace_back(reinterpret_cast<const char *>(ptr),
+                                static_cast<size_t>(value));
+            ptr += value;
+            m_pos = static_cast<size_t>(ptr - m_block.data());
+            continue;
+        } else if (type != RECORD_LOG) {
+            return fail(format("Invalid record type: %u", type));
+        }
+
+        uint64_t delta;
+        uint64_t tag_id;
+
+        if (ptr == end || *ptr > static_cast<unsigned char>(LogLevel::Verbose)) {
+            return fail("Invalid record priority");
+        }
+        rec.prio = static_cast<LogLevel>(*ptr++);
+
+        if (!get_varint(ptr, end, delta)
+                || !get_varint(ptr, end, rec.pid)
+                || !get_varint(ptr, end, rec.tid)
+                || !get_varint(ptr, end, tag_id)
+                || !get_varint(ptr, end, value)) {
+            return fail("Truncated record");
+        }
+
+        if (tag_id >= m_tags.size()) {
+            return fail("Invalid tag ID");
+        } else if (value > static_cast<uint64_t>(end - ptr)) {
+            return fail("Invalid message length");
+        }
+
+        m_time += zigzag_decode(delta);
+
+        rec.time = std::chrono::system_clock::time_point(
+                std::chrono::duration_cast<
+                        std::chrono::system_clock::duration>(
+                                std::chrono::nanoseconds(m_time)));
+        rec.tag = m_tags[static_cast<size_t>(tag_id)];
+        rec.msg.assign(reinterpret_cast<const char *>(ptr),
+                       static_cast<size_t>(value));
+        rec.fmt_msg.clear();
+
+        ptr += value;
+        m_pos = static_cast<size_t>(ptr - m_block.data());
+
+        return true;
+    }
+}
+
+/*!
+ * \brief Get error message
+ *
+ * \return Error message or an empty string if no error occurred
+ */
+const std::string & BinaryLogReader::error() const
+{
+    return m_error;
+}
+
+bool BinaryLogReader::read_header()
+{
+    unsigned char header[BINARY_LOG_HEADER_SIZE];
+
+    ssize_t n = _read_fully(m_fd, header, sizeof(header));
+    if (n < 0) {
+        return fail(format("Failed to read header: %s", strerror(errno)));
+    } else if (static_cast<size_t>(n) != sizeof(header)
+            || memcmp(header, BINARY_LOG_MAGIC, BINARY_LOG_MAGIC_SIZE) != 0) {
+        return fail("Not a binary log");
+    }
+
+    uint32_t version = get_u32(header + BINARY_LOG_MAGIC_SIZE);
+    if (version != BINARY_LOG_VERSION) {
+        return fail(format("Unsupported version: %u", version));
+    }
+
+    return true;
+}
+
+// Returns false at EOF without setting an error
+bool BinaryLogReader::read_block()
+{
+    unsigned char header[BINARY_LOG_BLOCK_HEADER_SIZE];
+
+    ssize_t n = _read_fully(m_fd, header, sizeof(header));
+    if (n < 0) {
+        return fail(format("Failed to read block: %s", strerror(errno)));
+    } else if (n == 0) {
+        return false;
+    } else if (static_cast<size_t>(n) != sizeof(header)) {
+        return fail("Truncated block header");
+    }
+
+    uint32_t raw_size = get_u32(header);
+    uint32_t stored_size = get_u32(header + 4);
+    uint32_t flags = get_u32(header + 8);
+    m_time = static_cast<int64_t>(get_u64(header + 12));
+
+    if (raw_size == 0 || raw_size > BINARY_LOG_MAX_BLOCK_SIZE
+            || stored_size > BINARY_LOG_MAX_BLOCK_SIZE) {
+        return fail("Invalid block size");
+    } else if (flags & ~BLOCK_FLAG_LZ4) {
+        return fail(format("Unsupported block flags: 0x%x", flags));
+    }
+
+    std::vector<unsigned char> stored(stored_size);
+
+    n = _read_fully(m_fd, stored.data(), stored.size());
+    if (n < 0) {
+        return fail(format("Failed to read block: %s", strerror(errno)));
+    } else if (static_cast<size_t>(n) != stored.size()) {
+        return fail("Truncated block");
+    }
+
+    if (flags & BLOCK_FLAG_LZ4) {
+#ifdef MBLOG_HAVE_LZ4
+        m_block.resize(raw_size);
+
+        int ret = LZ4_decompress_safe(
+                reinterpret_cast<const char *>(stored.data()),
+                reinterpret_cast<char *>(m_block.data()),
+                static_cast<int>(stored.size()), static_cast<int>(raw_size));
+        if (ret < 0 || static_cast<uint32_t>(ret) != raw_size) {
+            return fail("Failed to decompress block");
+        }
+#else
+        return fail("Compressed blocks are not supported");
+#endif
+    } else if (stored_size != raw_size) {
+        return fail("Invalid block size");
+    } else {
+        m_block = std::move(stored);
+    }
+
+    m_pos = 0;
+    m_tags.clear();
+
+    return true;
+}
+
+bool BinaryLogReader::fail(std::string error)
+{
+    m_error = std::move(error);
+    return false;
+}
+
+}
+}
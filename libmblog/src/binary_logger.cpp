@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/binary_logger.h"
+
+#include <chrono>
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef MBLOG_HAVE_LZ4
+#  include <lz4.h>
+#endif
+
+#include "mblog/log_record.h"
+
+#include "binary_log_format.h"
+
+namespace mb
+{
+namespace log
+{
+
+using namespace detail;
+
+static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+static bool _write_fully(int fd, iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        auto remaining = static_cast<size_t>(n);
+
+        while (iovcnt > 0 && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Construct logger that writes to \p fd
+ *
+ * \p fd is duplicated, so the caller can close it at any time. If \p fd refers
+ * to an empty file, the file header is written. Otherwise, new blocks are
+ * appended to the existing log.
+ *
+ * \param fd File descriptor
+ * \param compress Whether to compress blocks with LZ4. Ignored if libmblog was
+ *                 built without LZ4 support.
+ */
+BinaryLogger::BinaryLogger(int fd, bool compress)
+    : m_fd(fcntl(fd, F_DUPFD_CLOEXEC, 0))
+    , m_compress(compress)
+    , m_pid(getpid())
+    , m_base_time(0)
+    , m_last_time(0)
+{
+    m_block.reserve(BLOCK_SIZE + BINARY_LOG_BLOCK_HEADER_SIZE);
+    m_header.reserve(BINARY_LOG_BLOCK_HEADER_SIZE);
+
+    if (m_fd >= 0 && lseek(m_fd, 0, SEEK_END) == 0) {
+        std::vector<unsigned char> header(
+                BINARY_LOG_MAGIC, BINARY_LOG_MAGIC + BINARY_LOG_MAGIC_SIZE);
+        put_u32(header, BINARY_LOG_VERSION);
+
+        iovec iov;
+        iov.iov_base = header.data();
+        iov.iov_len = header.size();
+        _write_fully(m_fd, &iov, 1);
+    }
+}
+
+BinaryLogger::~BinaryLogger()
+{
+    flush();
+
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+void BinaryLogger::log(const LogRecord &rec)
+{
+    using namespace std::chrono;
+
+    if (getpid() != m_pid) {
+        // The parent process will write the inherited records. The next record
+        // starts a new block with its own base time and tag table.
+        reset_block();
+        m_pid = getpid();
+    }
+
+    auto time = static_cast<int64_t>(duration_cast<nanoseconds>(
+            rec.time.time_since_epoch()).count());
+
+    if (m_block.empty()) {
+        m_base_time = time;
+        m_last_time = time;
+    }
+
+    uint32_t tag_id;
+    auto it = m_tags.find(rec.tag);
+
+    if (it != m_tags.end()) {
+        tag_id = it->second;
+    } else {
+        tag_id = static_cast<uint32_t>(m_tags.size());
+        m_tags.emplace(rec.tag, tag_id);
+
+        m_block.push_back(RECORD_TAG);
+        put_varint(m_block, rec.tag.size());
+        m_block.insert(m_block.end(), rec.tag.begin(), rec.tag.end());
+    }
+
+    m_block.push_back(RECORD_LOG);
+    m_block.push_back(static_cast<unsigned char>(rec.prio));
+    put_varint(m_block, zigzag_encode(time - m_last_time));
+    put_varint(m_block, rec.pid);
+    put_varint(m_block, rec.tid);
+    put_varint(m_block, tag_id);
+    put_varint(m_block, rec.msg.size());
+    m_block.insert(m_block.end(), rec.msg.begin(), rec.msg.end());
+
+    m_last_time = time;
+
+    if (rec.prio == LogLevel::Error || m_block.size() >= BLOCK_SIZE) {
+        flush();
+    }
+}
+
+bool BinaryLogger::formatted()
+{
+    return false;
+}
+
+/*!
+ * \brief Write the current block
+ */
+void BinaryLogger::flush()
+{
+    if (m_block.empty() || getpid() != m_pid) {
+        return;
+    }
+
+    const unsigned char *data = m_block.data();
+    size_t size = m_block.size();
+    uint32_t flags = 0;
+
+#ifdef MBLOG_HAVE_LZ4
+    if (m_compress) {
+        // resize() keeps the capacity, so this only allocates for larger blocks
+        m_compressed.resize(static_cast<size_t>(
+                LZ4_compressBound(static_cast<int>(m_block.size()))));
+
+        int n = LZ4_compress_default(
+                reinterpret_cast<const char *>(m_block.data()),
+                m_compressed.data(), static_cast<int>(m_block.size()),
+                static_cast<int>(m_compressed.size()));
+        if (n > 0 && static_cast<size_t>(n) < m_block.size()) {
+            data = reinterpret_cast<const unsigned char *>(
+                    m_compressed.data());
+            size = static_cast<size_t>(n);
+            flags |= BLOCK_FLAG_LZ4;
+        }
+    }
+#endif
+
+    m_header.clear();
+    put_u32(m_header, static_cast<uint32_t>(m_block.size()));
+    put_u32(m_header, static_cast<uint32_t>(size));
+    put_u32(m_header, flags);
+    put_u64(m_header, static_cast<uint64_t>(m_base_time));
+
+    iovec iov[2];
+    iov[0].iov_base = m_header.data();
+    iov[0].iov_len = m_header.size();
+    iov[1].iov_base = const_cast<unsigned char *>(data);
+    iov[1].iov_len = size;
+
+    // Records that fail to write are dropped
+    _write_fully(m_fd, iov, 2);
+
+    reset_block();
+}
+
+void BinaryLogger::reset_block()
+{
+    m_block.clear();
+    m_tags.clear();
+}
+
+}
+}
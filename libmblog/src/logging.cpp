@@ -19,6 +19,7 @@
 
 #include "mblog/logging.h"
 
+#include <atomic>
 #include <chrono>
 #include <mutex>
 #include <string>
@@ -26,7 +27,9 @@
 #include <cerrno>
 #include <cinttypes>
 #include <cstdarg>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 
 #if defined(_WIN32)
@@ -41,13 +44,14 @@
 #endif
 
 #include "mbcommon/error.h"
-#include "mbcommon/optional.h"
 #include "mbcommon/string.h"
 #include "mbcommon/type_traits.h"
 
 #include "mblog/log_record.h"
 #include "mblog/stdio_logger.h"
 
+#include "process_ids.h"
+
 namespace mb
 {
 namespace log
@@ -105,6 +109,21 @@ static Tid _get_tid()
 #endif
 }
 
+namespace detail
+{
+
+uint64_t current_pid()
+{
+    return static_cast<uint64_t>(_get_pid());
+}
+
+uint64_t current_tid()
+{
+    return static_cast<uint64_t>(_get_tid());
+}
+
+}
+
 static std::tm _tm_epoch()
 {
     std::tm tm = {};
@@ -274,21 +293,133 @@ static bool _local_time_ns(const std::chrono::system_clock::time_point &tp,
     return true;
 }
 
-static std::string _format_iso8601(const std::tm &tm, long nanoseconds,
-                                   long gmtoff)
+// The local time is only computed (and the timezone reloaded) when the second
+// changes. Every other record reuses the pre-rendered parts of the timestamp.
+struct TimeCache
+{
+    std::chrono::system_clock::time_point::rep second;
+    bool valid;
+    // Sample: 2017-09-17T23:27:00
+    char date_time[32];
+    // Sample: +00:00
+    char offset[8];
+};
+
+static_assert(sizeof(TimeCache) % sizeof(uint64_t) == 0,
+              "TimeCache is not a multiple of the word size");
+
+static constexpr size_t TIME_CACHE_WORDS = sizeof(TimeCache) / sizeof(uint64_t);
+
+// The cache is published with a seqlock so that readers never block. The
+// sequence number is odd while the cache is being written. The contents are
+// stored as atomic words so that a reader racing with a writer is well
+// defined; it just sees a changed sequence number and ignores the copy.
+static std::atomic<uint32_t> g_time_seq{0};
+static std::atomic<uint64_t> g_time_words[TIME_CACHE_WORDS];
+// Only serializes writers
+static std::mutex g_time_mutex;
+
+static bool _load_time_cache(TimeCache &cache)
+{
+    uint32_t seq = g_time_seq.load(std::memory_order_acquire);
+    if (seq == 0 || (seq & 1)) {
+        return false;
+    }
+
+    uint64_t words[TIME_CACHE_WORDS];
+    for (size_t i = 0; i < TIME_CACHE_WORDS; ++i) {
+        words[i] = g_time_words[i].load(std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (g_time_seq.load(std::memory_order_relaxed) != seq) {
+        return false;
+    }
+
+    memcpy(&cache, words, sizeof(cache));
+    return true;
+}
+
+static void _store_time_cache(const TimeCache &cache)
+{
+    // If another thread is already publishing, let it win
+    std::unique_lock<std::mutex> lock(g_time_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+
+    uint64_t words[TIME_CACHE_WORDS];
+    memcpy(words, &cache, sizeof(cache));
+
+    uint32_t seq = g_time_seq.load(std::memory_order_relaxed);
+    g_time_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (size_t i = 0; i < TIME_CACHE_WORDS; ++i) {
+        g_time_words[i].store(words[i], std::memory_order_relaxed);
+    }
+
+    g_time_seq.store(seq + 2, std::memory_order_release);
+}
+
+static void _fill_time_cache(TimeCache &cache,
+                             const std::chrono::system_clock::time_point &tp)
+{
+    std::tm tm;
+    long nanos;
+    long gmtoff;
+
+    memset(&cache, 0, sizeof(cache));
+
+    if (_local_time_ns(tp, tm, nanos, gmtoff)) {
+        cache.valid = true;
+    } else {
+        tm = _tm_epoch();
+        gmtoff = 0;
+        cache.valid = false;
+    }
+
+    snprintf(cache.date_time, sizeof(cache.date_time),
+             "%04d-%02d-%02dT%02d:%02d:%02d",
+             tm.tm_year + 1900,
+             tm.tm_mon + 1,
+             tm.tm_mday,
+             tm.tm_hour,
+             tm.tm_min,
+             tm.tm_sec);
+    snprintf(cache.offset, sizeof(cache.offset),
+             "%c%02ld:%02ld",
+             gmtoff >= 0 ? '+' : '-',
+             std::abs(gmtoff) / 3600,
+             std::abs(gmtoff / 60) % 60);
+}
+
+static void _format_iso8601(const std::chrono::system_clock::time_point &tp,
+                            std::string &buf)
 {
-    // Sample: 2017-09-17T23:27:00.000000000+00:00
-    return mb::format("%04d-%02d-%02dT%02d:%02d:%02d.%09ld%c%02ld:%02ld",
-                      tm.tm_year + 1900,
-                      tm.tm_mon + 1,
-                      tm.tm_mday,
-                      tm.tm_hour,
-                      tm.tm_min,
-                      tm.tm_sec,
-                      nanoseconds,
-                      gmtoff >= 0 ? '+' : '-',
-                      std::abs(gmtoff) / 3600,
-                      std::abs(gmtoff / 60) % 60);
+    using namespace std::chrono;
+
+    auto second = time_point_cast<seconds>(tp);
+    auto nanos = duration_cast<nanoseconds>(tp - second).count();
+    TimeCache cache;
+
+    if (!_load_time_cache(cache)
+            || cache.second != second.time_since_epoch().count()) {
+        _fill_time_cache(cache, tp);
+        cache.second = second.time_since_epoch().count();
+        _store_time_cache(cache);
+    }
+
+    if (!cache.valid) {
+        nanos = 0;
+    }
+
+    char nanos_buf[16];
+    snprintf(nanos_buf, sizeof(nanos_buf), ".%09ld", static_cast<long>(nanos));
+
+    buf += cache.date_time;
+    buf += nanos_buf;
+    buf += cache.offset;
 }
 
 static std::string _format_prio(LogLevel prio)
@@ -312,7 +443,6 @@ static std::string _format_prio(LogLevel prio)
 static std::string _format_rec(const LogRecord &rec)
 {
     std::string buf;
-    optional<std::string> time_buf;
 
     for (auto it = g_format.begin(); it != g_format.end(); ++it) {
         if (*it == '%') {
@@ -337,20 +467,7 @@ static std::string _format_rec(const LogRecord &rec)
                 break;
 
             case 't':
-                if (!time_buf) {
-                    std::tm tm;
-                    long nanos;
-                    long gmtoff;
-
-                    if (!_local_time_ns(rec.time, tm, nanos, gmtoff)) {
-                        tm = _tm_epoch();
-                        nanos = 0;
-                        gmtoff = 0;
-                    }
-
-                    time_buf = _format_iso8601(tm, nanos, gmtoff);
-                }
-                buf += *time_buf;
+                _format_iso8601(rec.time, buf);
                 break;
 
             case 'P':
@@ -375,12 +492,12 @@ static std::string _format_rec(const LogRecord &rec)
 
 std::shared_ptr<BaseLogger> logger()
 {
-    return g_logger;
+    return std::atomic_load(&g_logger);
 }
 
 void set_logger(std::shared_ptr<BaseLogger> logger)
 {
-    g_logger = std::move(logger);
+    std::atomic_store(&g_logger, std::move(logger));
 }
 
 void log(LogLevel prio, const char *tag, const char *fmt, ...)
@@ -397,24 +514,56 @@ void log_v(LogLevel prio, const char *tag, const char *fmt, va_list ap)
 {
     ErrorRestorer restorer;
     LogRecord rec;
-    std::lock_guard<std::mutex> guard(g_mutex);
 
     rec.time = std::chrono::system_clock::now();
-    rec.pid = static_cast<uint64_t>(_get_pid());
-    rec.tid = static_cast<uint64_t>(_get_tid());
+    rec.pid = detail::current_pid();
+    rec.tid = detail::current_tid();
     rec.prio = prio;
     rec.tag = tag;
     rec.msg = format_v(fmt, ap);
 
-    if (!g_logger) {
-        g_logger = std::make_shared<StdioLogger>(stdout);
+    auto logger = std::atomic_load(&g_logger);
+    if (!logger) {
+        std::shared_ptr<BaseLogger> expected;
+        logger = std::make_shared<StdioLogger>(stdout);
+
+        if (!std::atomic_compare_exchange_strong(&g_logger, &expected,
+                                                 logger)) {
+            logger = std::move(expected);
+        }
     }
 
-    if (g_logger->formatted()) {
+    if (logger->formatted()) {
         rec.fmt_msg = _format_rec(rec);
     }
 
-    g_logger->log(rec);
+    if (logger->concurrent()) {
+        logger->log(rec);
+    } else {
+        std::lock_guard<std::mutex> guard(g_mutex);
+        logger->log(rec);
+    }
+}
+
+/*!
+ * \brief Write out any records buffered by the current logger
+ *
+ * This should be called before exiting, especially with _exit(), because
+ * buffered records are otherwise lost.
+ */
+void flush()
+{
+    auto logger = std::atomic_load(&g_logger);
+    if (!logger) {
+        return;
+    }
+
+    if (logger->concurrent()) {
+        logger->flush();
+    } else {
+        std::lock_guard<std::mutex> guard(g_mutex);
+        logger->flush();
+    }
 }
 
 std::string format()
@@ -427,5 +576,16 @@ void set_format(std::string fmt)
     g_format = std::move(fmt);
 }
 
+/*!
+ * \brief Format a record using the current format string
+ *
+ * This is useful for rendering records that were not logged by this process,
+ * such as those read by BinaryLogReader.
+ */
+std::string format_record(const LogRecord &rec)
+{
+    return _format_rec(rec);
+}
+
 }
 }
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/trace.h"
+
+#include <array>
+#include <chrono>
+#include <mutex>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "process_ids.h"
+
+namespace mb
+{
+namespace log
+{
+
+static constexpr size_t TRACE_BUFFER_SIZE = 512;
+static constexpr size_t TRACE_NAME_SIZE = 48;
+
+struct TraceEvent
+{
+    char name[TRACE_NAME_SIZE];
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    uint64_t tid;
+    bool incomplete;
+};
+
+static std::array<TraceEvent, TRACE_BUFFER_SIZE> g_events;
+// Total number of events recorded, including those that were overwritten
+static uint64_t g_count = 0;
+static std::mutex g_trace_mutex;
+// Most recently started span that has not ended yet
+static TraceSpan *g_open_spans = nullptr;
+
+static void _trace_record_locked(const char *name, uint64_t begin_ns,
+                                 uint64_t end_ns, uint64_t tid,
+                                 bool incomplete)
+{
+    TraceEvent &event = g_events[g_count % g_events.size()];
+    strncpy(event.name, name, sizeof(event.name) - 1);
+    event.name[sizeof(event.name) - 1] = '\0';
+    event.begin_ns = begin_ns;
+    event.end_ns = end_ns;
+    event.tid = tid;
+    event.incomplete = incomplete;
+
+    ++g_count;
+}
+
+TraceSpan::TraceSpan(const char *name)
+    : m_name(name)
+    , m_begin(trace_time_ns())
+    , m_tid(detail::current_tid())
+    , m_ended(false)
+    , m_prev(nullptr)
+{
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+
+    m_next = g_open_spans;
+    if (m_next) {
+        m_next->m_prev = this;
+    }
+    g_open_spans = this;
+}
+
+TraceSpan::~TraceSpan()
+{
+    end();
+}
+
+/*!
+ * \brief End the span before it goes out of scope
+ *
+ * Calling this more than once has no effect.
+ */
+void TraceSpan::end()
+{
+    uint64_t end_ns = trace_time_ns();
+
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+
+    if (m_ended) {
+        return;
+    }
+
+    if (m_prev) {
+        m_prev->m_next = m_next;
+    } else {
+        g_open_spans = m_next;
+    }
+    if (m_next) {
+        m_next->m_prev = m_prev;
+    }
+
+    _trace_record_locked(m_name, m_begin, end_ns, m_tid, false);
+    m_ended = true;
+}
+
+/*!
+ * \brief Get monotonic timestamp for trace events
+ */
+uint64_t trace_time_ns()
+{
+    using namespace std::chrono;
+
+    return static_cast<uint64_t>(duration_cast<nanoseconds>(
+            steady_clock::now().time_since_epoch()).count());
+}
+
+/*!
+ * \brief Record a completed span for the calling thread
+ */
+void trace_record(const char *name, uint64_t begin_ns, uint64_t end_ns)
+{
+    uint64_t tid = detail::current_tid();
+
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+
+    _trace_record_locked(name, begin_ns, end_ns, tid, false);
+}
+
+/*!
+ * \brief End all open spans and record them as incomplete
+ *
+ * This is meant to be called before trace_dump() on failure paths, where the
+ * spans for the failing stages would otherwise never be recorded. The spans
+ * are recorded with the current time as their end time. Ending them later
+ * has no effect.
+ */
+void trace_end_open_spans()
+{
+    uint64_t end_ns = trace_time_ns();
+
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+
+    // Record outermost spans first
+    TraceSpan *last = g_open_spans;
+    while (last && last->m_next) {
+        last = last->m_next;
+    }
+
+    for (TraceSpan *span = last; span;) {
+        TraceSpan *prev = span->m_prev;
+
+        _trace_record_locked(span->m_name, span->m_begin, end_ns,
+                             span->m_tid, true);
+        span->m_ended = true;
+        span->m_prev = nullptr;
+        span->m_next = nullptr;
+
+        span = prev;
+    }
+
+    g_open_spans = nullptr;
+}
+
+/*!
+ * \brief Discard all recorded spans
+ */
+void trace_clear()
+{
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    g_count = 0;
+}
+
+static bool _write_json_string(std::FILE *fp, const char *str)
+{
+    if (std::fputc('"', fp) == EOF) {
+        return false;
+    }
+
+    for (; *str; ++str) {
+        auto c = static_cast<unsigned char>(*str);
+        int ret;
+
+        if (c == '"' || c == '\\') {
+            ret = std::fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            ret = std::fprintf(fp, "\\u%04x", c);
+        } else {
+            ret = std::fputc(c, fp) == EOF ? -1 : 1;
+        }
+
+        if (ret < 0) {
+            return false;
+        }
+    }
+
+    return std::fputc('"', fp) != EOF;
+}
+
+/*!
+ * \brief Write recorded spans as Chrome trace event JSON
+ *
+ * The file can be loaded in chrome://tracing or Perfetto. Spans that have not
+ * ended yet are not included. Spans ended by trace_end_open_spans() have an
+ * `incomplete` argument.
+ *
+ * \param path Output file path
+ *
+ * \return Whether the file was successfully written
+ */
+bool trace_dump(const char *path)
+{
+    uint64_t pid = detail::current_pid();
+
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+
+    std::FILE *fp = std::fopen(path, "wb");
+    if (!fp) {
+        return false;
+    }
+
+    uint64_t first = g_count > g_events.size() ? g_count - g_events.size() : 0;
+    bool ok = std::fprintf(fp, "{\"traceEvents\":[") >= 0;
+
+    for (uint64_t i = first; ok && i < g_count; ++i) {
+        const TraceEvent &event = g_events[i % g_events.size()];
+        uint64_t duration_ns = event.end_ns - event.begin_ns;
+
+        ok = std::fprintf(fp, "%s\n{\"name\":", i == first ? "" : ",") >= 0
+                && _write_json_string(fp, event.name)
+                && std::fprintf(fp, ",\"ph\":\"X\""
+                                ",\"ts\":%" PRIu64 ".%03" PRIu64
+                                ",\"dur\":%" PRIu64 ".%03" PRIu64
+                                ",\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 "%s}",
+                                event.begin_ns / 1000, event.begin_ns % 1000,
+                                duration_ns / 1000, duration_ns % 1000,
+                                pid, event.tid,
+                                event.incomplete
+                                        ? ",\"args\":{\"incomplete\":true}"
+                                        : "") >= 0;
+    }
+
+    ok = ok && std::fprintf(fp, "\n],\"displayTimeUnit\":\"ms\""
+                            ",\"otherData\":{\"dropped_spans\":%" PRIu64 "}}\n",
+                            first) >= 0;
+
+    if (std::fclose(fp) != 0) {
+        ok = false;
+    }
+
+    return ok;
+}
+
+}
+}
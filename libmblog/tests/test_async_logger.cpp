@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mblog/async_logger.h"
+#include "mblog/log_record.h"
+
+using namespace mb::log;
+
+static LogRecord make_record(LogLevel prio, std::string fmt_msg)
+{
+    LogRecord rec;
+    rec.time = std::chrono::system_clock::now();
+    rec.pid = static_cast<uint64_t>(getpid());
+    rec.tid = 0;
+    rec.prio = prio;
+    rec.fmt_msg = std::move(fmt_msg);
+    return rec;
+}
+
+static std::string make_line(const char *prefix, size_t index)
+{
+    return std::string(prefix) + std::to_string(index)
+            + " padding to make the record a bit longer";
+}
+
+static std::vector<std::string> split_lines(const std::string &data)
+{
+    std::vector<std::string> lines;
+    size_t begin = 0;
+    size_t end;
+
+    while ((end = data.find('\n', begin)) != std::string::npos) {
+        lines.push_back(data.substr(begin, end - begin));
+        begin = end + 1;
+    }
+
+    // Any trailing data without a newline is also returned so that it causes
+    // comparisons to fail
+    if (begin < data.size()) {
+        lines.push_back(data.substr(begin));
+    }
+
+    return lines;
+}
+
+// Remove the lines starting with prefix from lines and return them
+static std::vector<std::string> take_lines(std::vector<std::string> &lines,
+                                           const std::string &prefix)
+{
+    std::vector<std::string> result;
+
+    for (auto it = lines.begin(); it != lines.end();) {
+        if (it->compare(0, prefix.size(), prefix) == 0) {
+            result.push_back(std::move(*it));
+            it = lines.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    return result;
+}
+
+class AsyncLoggerTest : public testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        _path = tmpdir ? tmpdir : "/data/local/tmp";
+        _path += "/mblog_async_test.XXXXXX";
+
+        _fd = mkstemp(&_path[0]);
+        ASSERT_GE(_fd, 0);
+    }
+
+    void TearDown() override
+    {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+        unlink(_path.c_str());
+    }
+
+    std::string read_file()
+    {
+        std::string data;
+        char buf[16384];
+        off_t offset = 0;
+        ssize_t n;
+
+        while ((n = pread(_fd, buf, sizeof(buf), offset)) > 0) {
+            data.append(buf, static_cast<size_t>(n));
+            offset += n;
+        }
+
+        return data;
+    }
+
+    std::string _path;
+    int _fd = -1;
+};
+
+TEST_F(AsyncLoggerTest, WrapsAroundRing)
+{
+    AsyncLogger logger(_fd);
+    std::vector<std::string> expected;
+
+    // Several times the size of a thread's ring
+    for (size_t i = 0; i < 10000; ++i) {
+        expected.push_back(make_line("record ", i));
+        logger.log(make_record(LogLevel::Info, expected.back()));
+    }
+
+    logger.flush();
+
+    ASSERT_EQ(split_lines(read_file()), expected);
+}
+
+TEST_F(AsyncLoggerTest, RecordLargerThanRing)
+{
+    AsyncLogger logger(_fd);
+    std::string large(256 * 1024, 'x');
+
+    logger.log(make_record(LogLevel::Info, "before"));
+    logger.log(make_record(LogLevel::Info, large));
+    logger.log(make_record(LogLevel::Info, "after"));
+    logger.flush();
+
+    ASSERT_EQ(split_lines(read_file()),
+              (std::vector<std::string>{ "before", large, "after" }));
+}
+
+TEST_F(AsyncLoggerTest, FullRingWaitsForFlusher)
+{
+    int pipe_fds[2];
+    ASSERT_EQ(pipe(pipe_fds), 0);
+
+    std::unique_ptr<AsyncLogger> logger(new AsyncLogger(pipe_fds[1]));
+    close(pipe_fds[1]);
+
+    // Much more than the ring and the pipe buffer can hold, so the producer
+    // cannot finish until the pipe is read
+    std::vector<std::string> expected;
+    for (size_t i = 0; i < 20000; ++i) {
+        expected.push_back(make_line("record ", i));
+    }
+
+    std::atomic<bool> done(false);
+    std::thread producer([&] {
+        for (auto const &line : expected) {
+            logger->log(make_record(LogLevel::Info, line));
+        }
+        logger->flush();
+        done = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_FALSE(done);
+
+    std::string data;
+    size_t expected_size = 0;
+    for (auto const &line : expected) {
+        expected_size += line.size() + 1;
+    }
+
+    char buf[16384];
+    while (data.size() < expected_size) {
+        ssize_t n = read(pipe_fds[0], buf, sizeof(buf));
+        ASSERT_GT(n, 0);
+        data.append(buf, static_cast<size_t>(n));
+    }
+
+    producer.join();
+    ASSERT_TRUE(done);
+
+    logger.reset();
+    close(pipe_fds[0]);
+
+    ASSERT_EQ(split_lines(data), expected);
+}
+
+TEST_F(AsyncLoggerTest, ErrorWrittenBeforeReturning)
+{
+    AsyncLogger logger(_fd);
+    std::vector<std::string> expected;
+
+    for (size_t i = 0; i < 100; ++i) {
+        expected.push_back(make_line("info ", i));
+        logger.log(make_record(LogLevel::Info, expected.back()));
+    }
+
+    expected.push_back("error");
+    logger.log(make_record(LogLevel::Error, expected.back()));
+
+    // No flush() so that the file only contains what log() waited for
+    ASSERT_EQ(split_lines(read_file()), expected);
+}
+
+TEST_F(AsyncLoggerTest, ErrorWaitsForOtherThreads)
+{
+    AsyncLogger logger(_fd);
+
+    std::thread other([&] {
+        logger.log(make_record(LogLevel::Info, "other thread"));
+    });
+    other.join();
+
+    logger.log(make_record(LogLevel::Error, "error"));
+
+    auto lines = split_lines(read_file());
+    ASSERT_EQ(lines.size(), 2u);
+    ASSERT_EQ(lines.back(), "error");
+    ASSERT_EQ(lines.front(), "other thread");
+}
+
+TEST_F(AsyncLoggerTest, ThreadsKeepTheirOwnOrder)
+{
+    AsyncLogger logger(_fd);
+    std::vector<std::thread> threads;
+
+    for (size_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&logger, t] {
+            std::string prefix = "thread " + std::to_string(t) + ": ";
+            for (size_t i = 0; i < 5000; ++i) {
+                logger.log(make_record(LogLevel::Info,
+                                       make_line(prefix.c_str(), i)));
+            }
+        });
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    logger.flush();
+
+    auto lines = split_lines(read_file());
+    ASSERT_EQ(lines.size(), 4u * 5000u);
+
+    for (size_t t = 0; t < 4; ++t) {
+        std::string prefix = "thread " + std::to_string(t) + ": ";
+        auto thread_lines = take_lines(lines, prefix);
+
+        ASSERT_EQ(thread_lines.size(), 5000u);
+        for (size_t i = 0; i < thread_lines.size(); ++i) {
+            ASSERT_EQ(thread_lines[i], make_line(prefix.c_str(), i));
+        }
+    }
+
+    ASSERT_TRUE(lines.empty());
+}
+
+TEST_F(AsyncLoggerTest, ExitedThreadRecordsWritten)
+{
+    AsyncLogger logger(_fd);
+
+    // Each thread's ring is orphaned when it exits and must still be drained
+    // before it is freed
+    for (size_t t = 0; t < 20; ++t) {
+        std::thread([&logger, t] {
+            logger.log(make_record(LogLevel::Info, make_line("thread ", t)));
+        }).join();
+    }
+
+    logger.log(make_record(LogLevel::Info, "main thread"));
+    logger.flush();
+
+    auto lines = split_lines(read_file());
+    auto main_lines = take_lines(lines, "main thread");
+    ASSERT_EQ(main_lines, std::vector<std::string>{ "main thread" });
+
+    std::sort(lines.begin(), lines.end());
+    std::vector<std::string> expected;
+    for (size_t t = 0; t < 20; ++t) {
+        expected.push_back(make_line("thread ", t));
+    }
+    std::sort(expected.begin(), expected.end());
+
+    ASSERT_EQ(lines, expected);
+}
+
+TEST_F(AsyncLoggerTest, ThreadSwitchesLoggers)
+{
+    std::string path2 = _path + ".2";
+    int fd2 = open(path2.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0600);
+    ASSERT_GE(fd2, 0);
+
+    {
+        AsyncLogger logger1(_fd);
+        AsyncLogger logger2(fd2);
+
+        logger1.log(make_record(LogLevel::Info, "first 1"));
+        logger2.log(make_record(LogLevel::Info, "second 1"));
+        logger1.log(make_record(LogLevel::Info, "first 2"));
+        logger2.log(make_record(LogLevel::Info, "second 2"));
+    }
+
+    ASSERT_EQ(split_lines(read_file()),
+              (std::vector<std::string>{ "first 1", "first 2" }));
+
+    close(_fd);
+    _fd = fd2;
+    unlink(path2.c_str());
+
+    ASSERT_EQ(split_lines(read_file()),
+              (std::vector<std::string>{ "second 1", "second 2" }));
+}
+
+TEST_F(AsyncLoggerTest, DestructorWritesPendingRecords)
+{
+    std::vector<std::string> expected;
+
+    {
+        AsyncLogger logger(_fd);
+
+        for (size_t i = 0; i < 1000; ++i) {
+            expected.push_back(make_line("record ", i));
+            logger.log(make_record(LogLevel::Info, expected.back()));
+        }
+    }
+
+    ASSERT_EQ(split_lines(read_file()), expected);
+}
+
+TEST_F(AsyncLoggerTest, ForkedChildWritesSynchronously)
+{
+    AsyncLogger logger(_fd);
+
+    logger.log(make_record(LogLevel::Info, "parent before fork"));
+    logger.flush();
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+
+    if (pid == 0) {
+        // The child has no flusher thread, so the record must be written
+        // before log() returns. Skip the destructors with _exit().
+        logger.log(make_record(LogLevel::Info, "child"));
+        _exit(0);
+    }
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    logger.log(make_record(LogLevel::Info, "parent after fork"));
+    logger.flush();
+
+    ASSERT_EQ(split_lines(read_file()), (std::vector<std::string>{
+        "parent before fork", "child", "parent after fork",
+    }));
+}
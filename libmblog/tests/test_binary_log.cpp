@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mblog/binary_log_reader.h"
+#include "mblog/binary_logger.h"
+#include "mblog/log_record.h"
+
+#include "binary_log_format.h"
+
+using namespace mb::log;
+using namespace mb::log::detail;
+
+TEST(BinaryLogFormatTest, VarintRoundTrip)
+{
+    static const struct {
+        uint64_t value;
+        size_t size;
+    } cases[] = {
+        { 0, 1 },
+        { 1, 1 },
+        { 127, 1 },
+        { 128, 2 },
+        { 16383, 2 },
+        { 16384, 3 },
+        { std::numeric_limits<uint32_t>::max(), 5 },
+        { std::numeric_limits<uint64_t>::max(), 10 },
+    };
+
+    for (auto const &c : cases) {
+        std::vector<unsigned char> buf;
+        put_varint(buf, c.value);
+        ASSERT_EQ(buf.size(), c.size) << "Value: " << c.value;
+
+        const unsigned char *ptr = buf.data();
+        uint64_t value;
+        ASSERT_TRUE(get_varint(ptr, buf.data() + buf.size(), value));
+        ASSERT_EQ(value, c.value);
+        ASSERT_EQ(ptr, buf.data() + buf.size());
+    }
+}
+
+TEST(BinaryLogFormatTest, VarintTruncated)
+{
+    std::vector<unsigned char> buf;
+    put_varint(buf, 16384);
+    buf.pop_back();
+
+    const unsigned char *ptr = buf.data();
+    uint64_t value;
+    ASSERT_FALSE(get_varint(ptr, buf.data() + buf.size(), value));
+
+    // More than 64 bits of continuation bytes
+    std::vector<unsigned char> overlong(11, 0x80);
+    ptr = overlong.data();
+    ASSERT_FALSE(get_varint(ptr, overlong.data() + overlong.size(), value));
+}
+
+TEST(BinaryLogFormatTest, ZigzagRoundTrip)
+{
+    ASSERT_EQ(zigzag_encode(0), 0u);
+    ASSERT_EQ(zigzag_encode(-1), 1u);
+    ASSERT_EQ(zigzag_encode(1), 2u);
+    ASSERT_EQ(zigzag_encode(-2), 3u);
+
+    for (int64_t value : { int64_t(0), int64_t(-1), int64_t(1),
+                           int64_t(-1000000000), int64_t(1000000000),
+                           std::numeric_limits<int64_t>::min(),
+                           std::numeric_limits<int64_t>::max() }) {
+        ASSERT_EQ(zigzag_decode(zigzag_encode(value)), value);
+    }
+}
+
+class BinaryLoggerTest : public testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        _path = tmpdir ? tmpdir : "/data/local/tmp";
+        _path += "/mblog_binary_test.XXXXXX";
+
+        _fd = mkstemp(&_path[0]);
+        ASSERT_GE(_fd, 0);
+    }
+
+    void TearDown() override
+    {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+        unlink(_path.c_str());
+    }
+
+    static LogRecord make_record(LogLevel prio, std::string tag,
+                                 std::string msg, int64_t offset_us)
+    {
+        LogRecord rec;
+        rec.time = std::chrono::system_clock::time_point(
+                std::chrono::seconds(1500000000))
+                + std::chrono::microseconds(offset_us);
+        rec.pid = 100;
+        rec.tid = 101;
+        rec.prio = prio;
+        rec.tag = std::move(tag);
+        rec.msg = std::move(msg);
+        return rec;
+    }
+
+    std::vector<LogRecord> read_records(std::string *error = nullptr)
+    {
+        std::vector<LogRecord> recs;
+        LogRecord rec;
+
+        EXPECT_EQ(lseek(_fd, 0, SEEK_SET), 0);
+
+        BinaryLogReader reader(_fd);
+        while (reader.next(rec)) {
+            recs.push_back(rec);
+        }
+
+        if (error) {
+            *error = reader.error();
+        } else {
+            EXPECT_EQ(reader.error(), "");
+        }
+
+        return recs;
+    }
+
+    // Returns the flags of each block
+    std::vector<uint32_t> read_block_flags()
+    {
+        std::vector<uint32_t> flags;
+        unsigned char header[BINARY_LOG_BLOCK_HEADER_SIZE];
+        off_t offset = BINARY_LOG_HEADER_SIZE;
+
+        while (pread(_fd, header, sizeof(header), offset)
+                == static_cast<ssize_t>(sizeof(header))) {
+            flags.push_back(get_u32(header + 8));
+            offset += static_cast<off_t>(sizeof(header) + get_u32(header + 4));
+        }
+
+        return flags;
+    }
+
+    static void check_equal(const std::vector<LogRecord> &actual,
+                            const std::vector<LogRecord> &expected)
+    {
+        ASSERT_EQ(actual.size(), expected.size());
+
+        for (size_t i = 0; i < actual.size(); ++i) {
+            ASSERT_EQ(actual[i].time, expected[i].time) << "Record " << i;
+            ASSERT_EQ(actual[i].pid, expected[i].pid) << "Record " << i;
+            ASSERT_EQ(actual[i].tid, expected[i].tid) << "Record " << i;
+            ASSERT_EQ(actual[i].prio, expected[i].prio) << "Record " << i;
+            ASSERT_EQ(actual[i].tag, expected[i].tag) << "Record " << i;
+            ASSERT_EQ(actual[i].msg, expected[i].msg) << "Record " << i;
+        }
+    }
+
+    std::string _path;
+    int _fd = -1;
+};
+
+TEST_F(BinaryLoggerTest, RoundTrip)
+{
+    std::vector<LogRecord> expected{
+        make_record(LogLevel::Info, "first", "Hello", 0),
+        make_record(LogLevel::Debug, "second", "", 5),
+        // Timestamps can go backwards
+        make_record(LogLevel::Verbose, "first", "Earlier", -1000000),
+        // Errors end the block
+        make_record(LogLevel::Error, "second", "Failed", 20),
+        make_record(LogLevel::Warning, "first", "New block", 30),
+    };
+
+    {
+        BinaryLogger logger(_fd, false);
+        for (auto const &rec : expected) {
+            logger.log(rec);
+        }
+    }
+
+    check_equal(read_records(), expected);
+    ASSERT_EQ(read_block_flags(), (std::vector<uint32_t>{ 0, 0 }));
+
+    // Opening the log again appends new blocks without another file header
+    auto appended = make_record(LogLevel::Info, "third", "Appended", 40);
+    {
+        BinaryLogger logger(_fd, false);
+        logger.log(appended);
+    }
+    expected.push_back(appended);
+
+    check_equal(read_records(), expected);
+}
+
+TEST_F(BinaryLoggerTest, TruncatedBlock)
+{
+    std::vector<LogRecord> expected{
+        make_record(LogLevel::Error, "tag", "Complete block", 0),
+        make_record(LogLevel::Error, "tag", "Truncated block", 10),
+    };
+
+    {
+        BinaryLogger logger(_fd, false);
+        for (auto const &rec : expected) {
+            logger.log(rec);
+        }
+    }
+
+    off_t size = lseek(_fd, 0, SEEK_END);
+    ASSERT_GT(size, 0);
+    ASSERT_EQ(ftruncate(_fd, size - 3), 0);
+
+    std::string error;
+    auto recs = read_records(&error);
+
+    expected.pop_back();
+    check_equal(recs, expected);
+    ASSERT_EQ(error, "Truncated block");
+}
+
+TEST_F(BinaryLoggerTest, CompressedBlock)
+{
+    std::vector<LogRecord> expected;
+    for (int i = 0; i < 1000; ++i) {
+        expected.push_back(make_record(
+                LogLevel::Debug, "tag" + std::to_string(i % 4),
+                "Repetitive message number " + std::to_string(i), i * 7));
+    }
+
+    {
+        BinaryLogger logger(_fd, true);
+        for (auto const &rec : expected) {
+            logger.log(rec);
+        }
+    }
+
+    auto flags = read_block_flags();
+    ASSERT_EQ(flags.size(), 1u);
+#ifdef MBLOG_HAVE_LZ4
+    ASSERT_EQ(flags[0], BLOCK_FLAG_LZ4);
+#else
+    ASSERT_EQ(flags[0], 0u);
+#endif
+
+    check_equal(read_records(), expected);
+}
+
+TEST_F(BinaryLoggerTest, ForkedChildKeepsBuffering)
+{
+    auto parent_before = make_record(LogLevel::Info, "parent", "Before", 0);
+    auto child_1 = make_record(LogLevel::Info, "child", "First", 10);
+    auto child_2 = make_record(LogLevel::Info, "child", "Second", 20);
+    auto parent_after = make_record(LogLevel::Info, "parent", "After", 30);
+
+    BinaryLogger logger(_fd, false);
+    logger.log(parent_before);
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+
+    if (pid == 0) {
+        // The parent's buffered record must not be written again
+        logger.log(child_1);
+        logger.log(child_2);
+        logger.flush();
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), EXIT_SUCCESS);
+
+    logger.log(parent_after);
+    logger.flush();
+
+    // One block from the child and one from the parent
+    ASSERT_EQ(read_block_flags().size(), 2u);
+    check_equal(read_records(),
+                { child_1, child_2, parent_before, parent_after });
+}
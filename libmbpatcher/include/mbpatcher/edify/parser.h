@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mbcommon/common.h"
+
+#include "mbpatcher/edify/tokenizer.h"
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Function call node in an edify parse tree
+ *
+ * The positions are indexes into the token list that the tree was built from.
+ */
+struct EdifyFunctionCall
+{
+    //! Unescaped function name
+    std::string name;
+    //! Index of the function name token
+    std::size_t name_pos;
+    //! Index of the left parenthesis token
+    std::size_t left_paren_pos;
+    //! Index of the matching right parenthesis token
+    std::size_t right_paren_pos;
+    //! Enclosing function call or nullptr if the call is at the top level
+    EdifyFunctionCall *parent;
+    //! Function calls nested within the arguments, in source order
+    std::vector<EdifyFunctionCall *> children;
+};
+
+using EdifyReplacement = std::pair<const EdifyFunctionCall *, std::string>;
+
+class EdifyTree
+{
+public:
+    EdifyTree();
+    ~EdifyTree();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(EdifyTree)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(EdifyTree)
+
+    bool parse(const std::vector<EdifyToken *> &tokens);
+
+    const std::vector<EdifyToken *> & tokens() const;
+    const std::vector<EdifyFunctionCall *> & calls() const;
+    const std::vector<EdifyFunctionCall *> & find_calls(const std::string &name) const;
+
+    std::string untokenize(std::vector<EdifyReplacement> replacements) const;
+
+private:
+    bool find_left_paren(std::size_t name_pos, std::size_t *out_pos) const;
+
+    const std::vector<EdifyToken *> *m_tokens;
+    // All nodes in source (pre-)order
+    std::vector<std::unique_ptr<EdifyFunctionCall>> m_nodes;
+    // Top-level nodes
+    std::vector<EdifyFunctionCall *> m_roots;
+    // Function name -> nodes in source order
+    std::unordered_map<std::string, std::vector<EdifyFunctionCall *>> m_index;
+};
+
+}
+}
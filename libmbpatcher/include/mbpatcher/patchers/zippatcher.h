@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <memory>
 #include <unordered_set>
 
 #include "mbpatcher/patcherconfig.h"
@@ -32,6 +33,8 @@ namespace patcher
 
 struct UnzCtx;
 struct ZipCtx;
+struct RawZipCtx;
+class PatchCache;
 
 class ZipPatcher : public Patcher
 {
@@ -84,18 +87,26 @@ private:
     // Patching
     UnzCtx *m_z_input = nullptr;
     ZipCtx *m_z_output = nullptr;
+    RawZipCtx *m_z_raw_output = nullptr;
     std::vector<AutoPatcher *> m_auto_patchers;
+    std::unique_ptr<PatchCache> m_cache;
 
     bool patch_zip();
+    void open_cache();
 
     bool pass1(const std::string &temporary_dir,
                const std::unordered_set<std::string> &exclude);
     bool pass2(const std::string &temporary_dir,
                const std::unordered_set<std::string> &files);
+    bool patch_uncached_files(const std::string &temporary_dir,
+                              const std::unordered_set<std::string> &files);
+    bool extract_files(const std::string &temporary_dir,
+                       const std::unordered_set<std::string> &files);
     bool open_input_archive();
     void close_input_archive();
-    bool open_output_archive();
+    bool open_output_archive(bool append);
     void close_output_archive();
+    bool finish_raw_output_archive();
 
     void update_progress(uint64_t bytes, uint64_t max_bytes);
     void update_files(uint64_t files, uint64_t max_files);
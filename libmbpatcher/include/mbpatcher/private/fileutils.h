@@ -23,6 +23,7 @@
 #include <vector>
 
 #include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
 
 #include "mbpatcher/errors.h"
 
@@ -49,6 +50,12 @@ public:
     static ErrorCode write_from_string(const std::string &path,
                                        const std::string &contents);
 
+    static bool replace_file(const std::string &replace,
+                             const std::string &with);
+
+    static ErrorCode filter_lines(const std::string &path,
+                                  const std::vector<FileLineRule> &rules);
+
     static std::string system_temporary_dir();
 
     static std::string create_temporary_dir(const std::string &directory);
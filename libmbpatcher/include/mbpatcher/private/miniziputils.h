@@ -22,6 +22,10 @@
 #include <string>
 #include <vector>
 
+#ifdef __linux__
+#  include <sys/types.h>
+#endif
+
 #include "minizip/unzip.h"
 #include "minizip/zip.h"
 
@@ -35,6 +39,7 @@ namespace patcher
 
 struct UnzCtx;
 struct ZipCtx;
+struct RawZipCtx;
 
 class MinizipUtils
 {
@@ -54,12 +59,16 @@ public:
 
     static UnzCtx * open_input_file(std::string path);
 
-    static ZipCtx * open_output_file(std::string path);
+    static ZipCtx * open_output_file(std::string path, bool append = false);
+
+    static RawZipCtx * open_raw_output_file(std::string path);
 
     static int close_input_file(UnzCtx *ctx);
 
     static int close_output_file(ZipCtx *ctx);
 
+    static bool close_raw_output_file(RawZipCtx *ctx);
+
     static ErrorCode archive_stats(const std::string &path,
                                    ArchiveStats *stats,
                                    std::vector<std::string> ignore);
@@ -74,6 +83,16 @@ public:
                               void (*cb)(uint64_t bytes, void *),
                               void *userData);
 
+    static bool can_copy_file_raw(RawZipCtx *ctx,
+                                  const unz_file_info64 &fi,
+                                  const std::string &name);
+
+    static bool copy_file_raw(UnzCtx *uctx,
+                              RawZipCtx *zctx,
+                              const std::string &name,
+                              void (*cb)(uint64_t bytes, void *),
+                              void *userData);
+
     static bool read_to_memory(unzFile uf,
                                std::vector<unsigned char> *output,
                                void (*cb)(uint64_t bytes, void *),
@@ -89,6 +108,11 @@ public:
     static ErrorCode add_file(zipFile zf,
                               const std::string &name,
                               const std::string &path);
+
+#ifdef __linux__
+    static ssize_t copy_fd_range(int in_fd, off64_t *in_offset, int out_fd,
+                                 size_t size);
+#endif
 };
 
 }
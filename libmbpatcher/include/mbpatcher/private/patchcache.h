@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include <cstdint>
+
+#include "mbcommon/common.h"
+
+#include "mbpatcher/errors.h"
+#include "mbpatcher/private/miniziputils.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+struct PatchCacheKey
+{
+    //! Whether the entry exists in the input zip
+    bool exists;
+    uint32_t crc32;
+    uint64_t compressed_size;
+};
+
+class PatchCache
+{
+public:
+    PatchCache(const std::string &directory, const std::string &name,
+               const std::string &config);
+    ~PatchCache();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(PatchCache)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(PatchCache)
+
+    bool open();
+    void close(bool commit);
+
+    void set_key(const std::string &name, const PatchCacheKey &key);
+    bool has_key(const std::string &name) const;
+
+    bool can_reuse(const std::string &name);
+
+    bool copy_cached_file(zipFile zf, const std::string &name,
+                          const std::string &out_name);
+    void add_file(const std::string &name, const std::string &path);
+
+private:
+    std::string m_zip_path;
+    std::string m_index_path;
+    std::string m_config;
+
+    // Keys from the previous run and the current run
+    std::unordered_map<std::string, PatchCacheKey> m_old_keys;
+    std::unordered_map<std::string, PatchCacheKey> m_new_keys;
+
+    // Patched files from the previous run
+    UnzCtx *m_old_zip;
+    // Patched files from the current run
+    ZipCtx *m_new_zip;
+
+    // Whether the new cache is incomplete and must not be committed
+    bool m_failed;
+
+    bool load_index();
+    bool save_index(const std::string &path) const;
+};
+
+}
+}
@@ -22,7 +22,6 @@
 #include <cstring>
 
 #include "mbpatcher/private/fileutils.h"
-#include "mbpatcher/private/stringutils.h"
 
 
 namespace mb
@@ -69,38 +68,43 @@ std::vector<std::string> MountCmdPatcher::existing_files() const
     return { FlashScript, InstallerScript };
 }
 
-static bool space_or_end(const char *ptr)
+static bool space_or_end(const char *ptr, const char *end)
 {
-    return !*ptr || isspace(*ptr);
+    return ptr == end || isspace(*ptr);
 }
 
-static bool patch_file(const std::string &path)
+static oc::result<FileLineAction>
+prefix_mount_cmd(const char *line, size_t size, std::string &replacement,
+                 void *userdata)
 {
-    std::string contents;
-
-    ErrorCode ret = FileUtils::read_to_string(path, &contents);
-    if (ret != ErrorCode::NoError) {
-        return false;
-    }
+    (void) userdata;
 
-    std::vector<std::string> lines = StringUtils::split(contents, '\n');
+    const char *end = line + size;
+    const char *ptr = line;
 
-    for (std::string &line : lines) {
-        const char *ptr = line.data();
+    // Skip whitespace
+    for (; ptr != end && isspace(*ptr); ++ptr);
 
-        // Skip whitespace
-        for (; *ptr && isspace(*ptr); ++ptr);
+    auto remain = static_cast<size_t>(end - ptr);
 
-        if ((strncmp(ptr, "mount", 5) == 0 && space_or_end(ptr + 5))
-                || (strncmp(ptr, "umount", 6) == 0 && space_or_end(ptr + 6))) {
-            line.insert(static_cast<size_t>(ptr - line.data()), "/sbin/");
-        }
+    if ((remain >= 5 && strncmp(ptr, "mount", 5) == 0
+                    && space_or_end(ptr + 5, end))
+            || (remain >= 6 && strncmp(ptr, "umount", 6) == 0
+                    && space_or_end(ptr + 6, end))) {
+        replacement.assign(line, ptr);
+        replacement += "/sbin/";
+        replacement.append(ptr, end);
+        return FileLineAction::Replace;
     }
 
-    contents = StringUtils::join(lines, "\n");
-    FileUtils::write_from_string(path, contents);
+    return FileLineAction::Keep;
+}
 
-    return true;
+static bool patch_file(const std::string &path)
+{
+    return FileUtils::filter_lines(path, {
+        { &prefix_mount_cmd, nullptr },
+    }) == ErrorCode::NoError;
 }
 
 bool MountCmdPatcher::patch_files(const std::string &directory)
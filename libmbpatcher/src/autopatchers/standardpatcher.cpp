@@ -19,14 +19,15 @@
 
 #include "mbpatcher/autopatchers/standardpatcher.h"
 
+#include <algorithm>
 #include <cstring>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 
+#include "mbpatcher/edify/parser.h"
 #include "mbpatcher/edify/tokenizer.h"
 #include "mbpatcher/private/fileutils.h"
-#include "mbpatcher/private/stringutils.h"
 
 #define LOG_TAG "mbpatcher/autopatchers/standardpatcher"
 
@@ -84,6 +85,20 @@ std::vector<std::string> StandardPatcher::existing_files() const
     return { UpdaterScript, SystemTransferList };
 }
 
+struct PartitionDevs
+{
+    std::vector<std::string> system;
+    std::vector<std::string> cache;
+    std::vector<std::string> data;
+};
+
+struct PartitionMatch
+{
+    bool system;
+    bool cache;
+    bool data;
+};
+
 static bool find_items_in_string(const std::string &haystack,
                                  const std::vector<std::string> &needles)
 {
@@ -96,277 +111,128 @@ static bool find_items_in_string(const std::string &haystack,
     return false;
 }
 
-static bool find_function(const std::vector<EdifyToken *>::iterator begin,
-                          const std::vector<EdifyToken *>::iterator end,
-                          std::vector<EdifyToken *>::iterator *out_func_name,
-                          std::vector<EdifyToken *>::iterator *out_left_paren,
-                          std::vector<EdifyToken *>::iterator *out_right_paren)
+static PartitionMatch match_partitions(const std::string &str,
+                                       const PartitionDevs &devs)
 {
-    std::vector<EdifyToken *>::iterator func_name;
-    std::vector<EdifyToken *>::iterator left_paren;
-    std::vector<EdifyToken *>::iterator right_paren;
-
-    for (auto it = begin; it != end; ++it) {
-        // Find string representing the function name
-        if ((*it)->type() != EdifyTokenType::String) {
-            continue;
-        }
-
-        func_name = it;
-
-        bool found_left_paren = false;
-        bool found_right_paren = false;
-
-        // Barring any whitespace, newlines, or comments, the function name
-        // should be followed by a left parenthesis
-        for (auto it2 = it + 1; it2 != end; ++it2) {
-            if ((*it2)->type() == EdifyTokenType::Whitespace
-                    || (*it2)->type() == EdifyTokenType::Newline
-                    || (*it2)->type() == EdifyTokenType::Comment) {
-                continue;
-            } else if ((*it2)->type() == EdifyTokenType::LeftParen) {
-                found_left_paren = true;
-                left_paren = it2;
-            }
-            break;
-        }
-
-        // If a left parenthesis was not found, then the string token was not
-        // a function name
-        if (!found_left_paren) {
-            continue;
-        }
-
-        // Left for matching right parenthesis
-        std::size_t depth = 0;
-
-        for (auto it2 = left_paren; it2 != end; ++it2) {
-            if ((*it2)->type() == EdifyTokenType::LeftParen) {
-                ++depth;
-            } else if ((*it2)->type() == EdifyTokenType::RightParen) {
-                --depth;
-            }
-            if (depth == 0) {
-                found_right_paren = true;
-                right_paren = it2;
-                break;
-            }
-        }
-
-        // If a right parenthesis was not found, but the function name and left
-        // parenthesis were found, then assume there's a syntax error and bail
-        // out
-        if (!found_right_paren) {
-            return false;
-        }
-
-        *out_func_name = func_name;
-        *out_left_paren = left_paren;
-        *out_right_paren = right_paren;
-
-        return true;
-    }
-
-    return false;
+    PartitionMatch m;
+    m.system = str.find("/system") != std::string::npos
+            || find_items_in_string(str, devs.system);
+    m.cache = str.find("/cache") != std::string::npos
+            || find_items_in_string(str, devs.cache);
+    m.data = str.find("/data") != std::string::npos
+            || str.find("/userdata") != std::string::npos
+            || find_items_in_string(str, devs.data);
+    return m;
 }
 
-/*!
- * \brief Replace edify function
- *
- * \param tokens List of edify tokens
- * \param func_name Function name token of the replaced function
- * \param left_paren Left parenthesis token of the replaced function
- * \param right_paren Right parenthesis token of the replaced function
- * \param replacement Replacement edify function (in string form)
- *
- * \return New iterator pointing to position *after* the right parenthesis of
- *         the replaced function. Returns tokens->end() if the replacement
- *         string could not be tokenized.
- */
-static std::vector<EdifyToken *>::iterator
-replace_function(std::vector<EdifyToken *> *tokens,
-                 std::vector<EdifyToken *>::iterator func_name,
-                 std::vector<EdifyToken *>::iterator left_paren,
-                 std::vector<EdifyToken *>::iterator right_paren,
-                 const std::string &replacement)
+static const char * matched_mount_point(const PartitionMatch &m)
 {
-    // Included for completeness' sake
-    (void) left_paren;
-
-    std::vector<EdifyToken *> replacement_tokens;
-    bool result = EdifyTokenizer::tokenize(
-            replacement.data(), replacement.size(), &replacement_tokens);
-    if (!result) {
-        LOGE("Failed to tokenize replacement function string: %s",
-             replacement.c_str());
-        return tokens->end();
+    if (m.system) {
+        return "/system";
+    } else if (m.cache) {
+        return "/cache";
+    } else if (m.data) {
+        return "/data";
+    } else {
+        return nullptr;
     }
+}
 
-    // Deallocate replaced tokens
-    for (auto it = func_name; it != right_paren; ++it) {
-        delete *it;
-    }
-    delete *right_paren;
-
-    // Remove replaced tokens
-    auto it = tokens->erase(func_name, right_paren);
-    it = tokens->erase(it);
-
-    // Add replacement tokens
-    it = tokens->insert(it, replacement_tokens.begin(),
-                        replacement_tokens.end());
-
-    // Move iterator to the end of the replaced tokens
-    it += static_cast<ptrdiff_t>(replacement_tokens.size());
-
-    return it;
+static bool is_rewritten_function(const std::string &name)
+{
+    return name == "mount"
+            || name == "unmount"
+            || name == "run_program"
+            || name == "delete_recursive"
+            || name == "format";
 }
 
 /*!
- * \brief Replace edify mount() command
- *
- * \param tokens List of edify tokens
- * \param func_name Function name token
- * \param left_paren Left parenthesis token
- * \param right_paren Right parenthesis token
- * \param system_devs List of system partition block devices
- * \param cache_devs List of cache partition block devices
- * \param data_devs List of data partition block devices
+ * \brief Check if a function call is nested within a rewritten function
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * The arguments of the rewritten functions are never patched, even if the
+ * function itself was left as is.
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_mount(std::vector<EdifyToken *> *tokens,
-                    const std::vector<EdifyToken *>::iterator func_name,
-                    const std::vector<EdifyToken *>::iterator left_paren,
-                    const std::vector<EdifyToken *>::iterator right_paren,
-                    const std::vector<std::string> &system_devs,
-                    const std::vector<std::string> &cache_devs,
-                    const std::vector<std::string> &data_devs)
+static bool has_rewritten_ancestor(const EdifyFunctionCall &call)
 {
-    // For the mount() edify function, replace with the corresponding
-    // update-binary-tool command
-    for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
-            continue;
-        }
-
-        auto token = static_cast<EdifyTokenString *>(*it);
-        const std::string str = token->string();
-
-        bool is_system = str.find("/system") != std::string::npos
-                || find_items_in_string(str.c_str(), system_devs);
-        bool is_cache = str.find("/cache") != std::string::npos
-                || find_items_in_string(str.c_str(), cache_devs);
-        bool is_data = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || find_items_in_string(str.c_str(), data_devs);
-
-        if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/system"));
-        } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/cache"));
-        } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/data"));
+    for (auto *p = call.parent; p; p = p->parent) {
+        if (is_rewritten_function(p->name)) {
+            return true;
         }
     }
-    return right_paren + 1;
+    return false;
 }
 
 /*!
- * \brief Replace edify unmount() command
+ * \brief Rewrite edify mount(), unmount(), or format() command
+ *
+ * Replaces the function with the corresponding update-binary-tool command for
+ * the first argument that references a partition.
  *
- * \param tokens List of edify tokens
- * \param func_name Function name token
- * \param left_paren Left parenthesis token
- * \param right_paren Right parenthesis token
- * \param system_devs List of system partition block devices
- * \param cache_devs List of cache partition block devices
- * \param data_devs List of data partition block devices
+ * \param tree Edify parse tree
+ * \param call Function call node
+ * \param fmt update-binary-tool command format string
+ * \param devs Block devices for each partition
+ * \param out Output replacement string
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \return Whether the function should be replaced
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_unmount(std::vector<EdifyToken *> *tokens,
-                      const std::vector<EdifyToken *>::iterator func_name,
-                      const std::vector<EdifyToken *>::iterator left_paren,
-                      const std::vector<EdifyToken *>::iterator right_paren,
-                      const std::vector<std::string> &system_devs,
-                      const std::vector<std::string> &cache_devs,
-                      const std::vector<std::string> &data_devs)
+static bool rewrite_edify_partition_func(const EdifyTree &tree,
+                                         const EdifyFunctionCall &call,
+                                         const char *fmt,
+                                         const PartitionDevs &devs,
+                                         std::string *out)
 {
-    // For the unmount() edify function, replace with the corresponding
-    // update-binary-tool command
-    for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    auto const &tokens = tree.tokens();
+
+    for (auto i = call.left_paren_pos + 1; i < call.right_paren_pos; ++i) {
+        if (tokens[i]->type() != EdifyTokenType::String) {
             continue;
         }
 
-        auto token = static_cast<EdifyTokenString *>(*it);
-        const std::string str = token->string();
-
-        bool is_system = str.find("/system") != std::string::npos
-                || find_items_in_string(str.c_str(), system_devs);
-        bool is_cache = str.find("/cache") != std::string::npos
-                || find_items_in_string(str.c_str(), cache_devs);
-        bool is_data = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || find_items_in_string(str.c_str(), data_devs);
-
-        if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/system"));
-        } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/cache"));
-        } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/data"));
+        auto token = static_cast<EdifyTokenString *>(tokens[i]);
+        auto mount_point = matched_mount_point(
+                match_partitions(token->string(), devs));
+
+        if (mount_point) {
+            *out = format(fmt, mount_point);
+            return true;
         }
     }
-    return right_paren + 1;
+
+    return false;
 }
 
 /*!
- * \brief Replace edify run_program() command
+ * \brief Rewrite edify run_program() command
  *
- * \param tokens List of edify tokens
- * \param func_name Function name token
- * \param left_paren Left parenthesis token
- * \param right_paren Right parenthesis token
- * \param system_devs List of system partition block devices
- * \param cache_devs List of cache partition block devices
- * \param data_devs List of data partition block devices
+ * \param tree Edify parse tree
+ * \param call Function call node
+ * \param devs Block devices for each partition
+ * \param out Output replacement string
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \return Whether the function should be replaced
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_run_program(std::vector<EdifyToken *> *tokens,
-                          const std::vector<EdifyToken *>::iterator func_name,
-                          const std::vector<EdifyToken *>::iterator left_paren,
-                          const std::vector<EdifyToken *>::iterator right_paren,
-                          const std::vector<std::string> &system_devs,
-                          const std::vector<std::string> &cache_devs,
-                          const std::vector<std::string> &data_devs)
+static bool rewrite_edify_run_program(const EdifyTree &tree,
+                                      const EdifyFunctionCall &call,
+                                      const PartitionDevs &devs,
+                                      std::string *out)
 {
+    auto const &tokens = tree.tokens();
+
     bool found_reboot = false;
     bool found_mount = false;
     bool found_umount = false;
     bool found_format_sh = false;
     bool found_mke2fs = false;
-    bool is_system = false;
-    bool is_cache = false;
-    bool is_data = false;
+    PartitionMatch m{false, false, false};
 
-    for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    for (auto i = call.left_paren_pos + 1; i < call.right_paren_pos; ++i) {
+        if (tokens[i]->type() != EdifyTokenType::String) {
             continue;
         }
 
-        auto token = static_cast<EdifyTokenString *>(*it);
+        auto token = static_cast<EdifyTokenString *>(tokens[i]);
         const std::string unescaped = token->unescaped_string();
 
         if (ends_with(unescaped, "reboot")) {
@@ -385,152 +251,73 @@ replace_edify_run_program(std::vector<EdifyToken *> *tokens,
             found_mke2fs = true;
         }
 
-        if (unescaped.find("/system") != std::string::npos
-                || find_items_in_string(unescaped.c_str(), system_devs)) {
-            is_system = true;
-        }
-        if (unescaped.find("/cache") != std::string::npos
-                || find_items_in_string(unescaped.c_str(), cache_devs)) {
-            is_cache = true;
-        }
-        if (unescaped.find("/data") != std::string::npos
-                || unescaped.find("/userdata") != std::string::npos
-                || find_items_in_string(unescaped.c_str(), data_devs)) {
-            is_data = true;
-        }
+        auto arg_m = match_partitions(unescaped, devs);
+        m.system = m.system || arg_m.system;
+        m.cache = m.cache || arg_m.cache;
+        m.data = m.data || arg_m.data;
     }
 
+    auto mount_point = matched_mount_point(m);
+
     if (found_reboot) {
-        return replace_function(tokens, func_name, left_paren, right_paren,
-                                "(ui_print(\"Removed reboot command\") == 0)");
+        *out = "(ui_print(\"Removed reboot command\") == 0)";
+        return true;
     } else if (found_umount) {
-        if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/system"));
-        } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/cache"));
-        } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/data"));
+        if (mount_point) {
+            *out = format(UNMOUNT_FMT, mount_point);
+            return true;
         }
     } else if (found_mount) {
-        if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/system"));
-        } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/cache"));
-        } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/data"));
+        if (mount_point) {
+            *out = format(MOUNT_FMT, mount_point);
+            return true;
         }
     } else if (found_format_sh) {
-        return replace_function(tokens, func_name, left_paren, right_paren,
-                                format(FORMAT_FMT, "/system"));
+        *out = format(FORMAT_FMT, "/system");
+        return true;
     } else if (found_mke2fs) {
-        if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/system"));
-        } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/cache"));
-        } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/data"));
+        if (mount_point) {
+            *out = format(FORMAT_FMT, mount_point);
+            return true;
         }
     }
 
-    return right_paren + 1;
+    return false;
 }
 
 /*!
- * \brief Replace edify delete_recursive() command
+ * \brief Rewrite edify delete_recursive() command
  *
- * \param tokens List of edify tokens
- * \param func_name Function name token
- * \param left_paren Left parenthesis token
- * \param right_paren Right parenthesis token
+ * \param tree Edify parse tree
+ * \param call Function call node
+ * \param out Output replacement string
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \return Whether the function should be replaced
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_delete_recursive(std::vector<EdifyToken *> *tokens,
-                               const std::vector<EdifyToken *>::iterator func_name,
-                               const std::vector<EdifyToken *>::iterator left_paren,
-                               const std::vector<EdifyToken *>::iterator right_paren)
+static bool rewrite_edify_delete_recursive(const EdifyTree &tree,
+                                           const EdifyFunctionCall &call,
+                                           std::string *out)
 {
-    for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    auto const &tokens = tree.tokens();
+
+    for (auto i = call.left_paren_pos + 1; i < call.right_paren_pos; ++i) {
+        if (tokens[i]->type() != EdifyTokenType::String) {
             continue;
         }
 
-        auto token = static_cast<EdifyTokenString *>(*it);
+        auto token = static_cast<EdifyTokenString *>(tokens[i]);
         const std::string unescaped = token->unescaped_string();
 
         if (unescaped == "/system" || unescaped == "/system/") {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/system"));
+            *out = format(FORMAT_FMT, "/system");
+            return true;
         } else if (unescaped == "/cache" || unescaped == "/cache/") {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/cache"));
+            *out = format(FORMAT_FMT, "/cache");
+            return true;
         }
     }
-    return right_paren + 1;
-}
 
-/*!
- * \brief Replace edify format() command
- *
- * \param tokens List of edify tokens
- * \param func_name Function name token
- * \param left_paren Left parenthesis token
- * \param right_paren Right parenthesis token
- * \param system_devs List of system partition block devices
- * \param cache_devs List of cache partition block devices
- * \param data_devs List of data partition block devices
- *
- * \return Iterator pointing to position immediately after the right parenthesis
- */
-static std::vector<EdifyToken *>::iterator
-replace_edify_format(std::vector<EdifyToken *> *tokens,
-                     const std::vector<EdifyToken *>::iterator func_name,
-                     const std::vector<EdifyToken *>::iterator left_paren,
-                     const std::vector<EdifyToken *>::iterator right_paren,
-                     const std::vector<std::string> &system_devs,
-                     const std::vector<std::string> &cache_devs,
-                     const std::vector<std::string> &data_devs)
-{
-    // For the format() edify function, replace with the corresponding
-    // update-binary-tool command
-    for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
-            continue;
-        }
-
-        auto token = static_cast<EdifyTokenString *>(*it);
-        const std::string str = token->string();
-
-        bool is_system = str.find("/system") != std::string::npos
-                || find_items_in_string(str.c_str(), system_devs);
-        bool is_cache = str.find("/cache") != std::string::npos
-                || find_items_in_string(str.c_str(), cache_devs);
-        bool is_data = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || find_items_in_string(str.c_str(), data_devs);
-
-        if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/system"));
-        } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/cache"));
-        } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/data"));
-        }
-    }
-    return right_paren + 1;
+    return false;
 }
 
 bool StandardPatcher::patch_files(const std::string &directory)
@@ -574,57 +361,64 @@ bool StandardPatcher::patch_updater(const std::string &directory)
     EdifyTokenizer::dump(tokens);
 #endif
 
+    EdifyTree tree;
+    if (!tree.parse(tokens)) {
+        LOGW("Only patching updater-script up to the unterminated function");
+    }
+
     auto &&device = m_info.device();
-    auto system_devs = device.system_block_devs();
-    auto cache_devs = device.cache_block_devs();
-    auto data_devs = device.data_block_devs();
-
-    std::vector<EdifyToken *>::iterator begin = tokens.begin();
-    std::vector<EdifyToken *>::iterator end;
-
-    // TODO: Catch errors
-    while (true) {
-        end = tokens.end();
-
-        // Need to find:
-        // 1. String containing function name
-        // 2. Left parenthesis for the function
-        // 3. Right parenthesis for the function
-        std::vector<EdifyToken *>::iterator func_name;
-        std::vector<EdifyToken *>::iterator left_paren;
-        std::vector<EdifyToken *>::iterator right_paren;
-
-        if (!find_function(begin, end, &func_name, &left_paren, &right_paren)) {
-            break;
+    PartitionDevs devs;
+    devs.system = device.system_block_devs();
+    devs.cache = device.cache_block_devs();
+    devs.data = device.data_block_devs();
+
+    // Gather all calls to the rewritten functions in source order using the
+    // function name index instead of scanning the whole script
+    std::vector<const EdifyFunctionCall *> calls;
+    for (auto const &name : { "mount", "unmount", "run_program",
+                              "delete_recursive", "format" }) {
+        auto const &found = tree.find_calls(name);
+        calls.insert(calls.end(), found.begin(), found.end());
+    }
+    std::sort(calls.begin(), calls.end(),
+              [](const EdifyFunctionCall *a, const EdifyFunctionCall *b) {
+        return a->name_pos < b->name_pos;
+    });
+
+    std::vector<EdifyReplacement> replacements;
+
+    for (auto const *call : calls) {
+        if (has_rewritten_ancestor(*call)) {
+            continue;
         }
 
-        // Tokens (types are checked by findFunction())
-        auto t_func_name = static_cast<EdifyTokenString *>(*func_name);
-
-        if (t_func_name->unescaped_string() == "mount") {
-            begin = replace_edify_mount(&tokens, func_name, left_paren, right_paren,
-                                        system_devs, cache_devs, data_devs);
-        } else if (t_func_name->unescaped_string() == "unmount") {
-            begin = replace_edify_unmount(&tokens, func_name, left_paren, right_paren,
-                                          system_devs, cache_devs, data_devs);
-        } else if (t_func_name->unescaped_string() == "run_program") {
-            begin = replace_edify_run_program(&tokens, func_name, left_paren, right_paren,
-                                              system_devs, cache_devs, data_devs);
-        } else if (t_func_name->unescaped_string() == "delete_recursive") {
-            begin = replace_edify_delete_recursive(&tokens, func_name, left_paren, right_paren);
-        } else if (t_func_name->unescaped_string() == "format") {
-            begin = replace_edify_format(&tokens, func_name, left_paren, right_paren,
-                                         system_devs, cache_devs, data_devs);
+        std::string replacement;
+        bool replace;
+
+        if (call->name == "mount") {
+            replace = rewrite_edify_partition_func(
+                    tree, *call, MOUNT_FMT, devs, &replacement);
+        } else if (call->name == "unmount") {
+            replace = rewrite_edify_partition_func(
+                    tree, *call, UNMOUNT_FMT, devs, &replacement);
+        } else if (call->name == "run_program") {
+            replace = rewrite_edify_run_program(
+                    tree, *call, devs, &replacement);
+        } else if (call->name == "delete_recursive") {
+            replace = rewrite_edify_delete_recursive(
+                    tree, *call, &replacement);
         } else {
-            begin = func_name + 1;
+            replace = rewrite_edify_partition_func(
+                    tree, *call, FORMAT_FMT, devs, &replacement);
         }
-    }
 
-#if DUMP_DEBUG
-    EdifyTokenizer::dump(tokens);
-#endif
+        if (replace) {
+            replacements.emplace_back(call, std::move(replacement));
+        }
+    }
 
-    FileUtils::write_from_string(path, EdifyTokenizer::untokenize(tokens));
+    FileUtils::write_from_string(path,
+                                 tree.untokenize(std::move(replacements)));
 
     for (EdifyToken *t : tokens) {
         delete t;
@@ -633,34 +427,35 @@ bool StandardPatcher::patch_updater(const std::string &directory)
     return true;
 }
 
+static oc::result<FileLineAction>
+drop_erase_cmd(const char *line, size_t size, std::string &replacement,
+               void *userdata)
+{
+    (void) replacement;
+    (void) userdata;
+
+    if (size >= 6 && memcmp(line, "erase ", 6) == 0) {
+        return FileLineAction::Drop;
+    }
+
+    return FileLineAction::Keep;
+}
+
 bool StandardPatcher::patch_transfer_list(const std::string &directory)
 {
-    std::string contents;
     std::string path;
-    std::vector<std::string> lines;
 
     path += directory;
     path += "/";
     path += SystemTransferList;
 
-    auto ret = FileUtils::read_to_string(path, &contents);
+    auto ret = FileUtils::filter_lines(path, {
+        { &drop_erase_cmd, nullptr },
+    });
     if (ret != ErrorCode::NoError) {
         return ret == ErrorCode::FileOpenError;
     }
 
-    lines = StringUtils::split(contents, '\n');
-
-    for (auto it = lines.begin(); it != lines.end();) {
-        if (starts_with(*it, "erase ")) {
-            it = lines.erase(it);
-        } else {
-            ++it;
-        }
-    }
-
-    contents = StringUtils::join(lines, "\n");
-    FileUtils::write_from_string(path, contents);
-
     return true;
 }
 
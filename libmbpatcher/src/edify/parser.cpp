@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/edify/parser.h"
+
+#include <algorithm>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+
+#define LOG_TAG "mbpatcher/edify/parser"
+
+namespace mb
+{
+namespace patcher
+{
+
+static const std::vector<EdifyFunctionCall *> empty_calls;
+
+EdifyTree::EdifyTree() : m_tokens(nullptr)
+{
+}
+
+EdifyTree::~EdifyTree() = default;
+
+/*!
+ * \brief Find left parenthesis following a potential function name
+ *
+ * Barring any whitespace, newlines, or comments, a function name must be
+ * followed by a left parenthesis.
+ */
+bool EdifyTree::find_left_paren(std::size_t name_pos, std::size_t *out_pos) const
+{
+    auto const &tokens = *m_tokens;
+
+    for (std::size_t i = name_pos + 1; i < tokens.size(); ++i) {
+        switch (tokens[i]->type()) {
+        case EdifyTokenType::Whitespace:
+        case EdifyTokenType::Newline:
+        case EdifyTokenType::Comment:
+            continue;
+        case EdifyTokenType::LeftParen:
+            *out_pos = i;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Build parse tree from a list of edify tokens
+ *
+ * The tree only references \p tokens, which must outlive it. The tokens are
+ * scanned exactly once.
+ *
+ * \return True if the tree was successfully built. False if a function call is
+ *         missing its right parenthesis. In the latter case, the tree still
+ *         contains all function calls appearing before the unterminated one.
+ */
+bool EdifyTree::parse(const std::vector<EdifyToken *> &tokens)
+{
+    m_tokens = &tokens;
+    m_nodes.clear();
+    m_roots.clear();
+    m_index.clear();
+
+    // Open parentheses. Grouping parentheses are represented by nullptr.
+    std::vector<EdifyFunctionCall *> stack;
+    // Innermost open function call
+    EdifyFunctionCall *current = nullptr;
+
+    for (std::size_t i = 0; i < tokens.size(); ++i) {
+        auto type = tokens[i]->type();
+        std::size_t left_paren;
+
+        if (type == EdifyTokenType::String && find_left_paren(i, &left_paren)) {
+            auto token = static_cast<EdifyTokenString *>(tokens[i]);
+
+            std::unique_ptr<EdifyFunctionCall> node(new EdifyFunctionCall());
+            node->name = token->unescaped_string();
+            node->name_pos = i;
+            node->left_paren_pos = left_paren;
+            node->right_paren_pos = 0;
+            node->parent = current;
+
+            current = node.get();
+            stack.push_back(current);
+            m_nodes.push_back(std::move(node));
+
+            i = left_paren;
+        } else if (type == EdifyTokenType::LeftParen) {
+            stack.push_back(nullptr);
+        } else if (type == EdifyTokenType::RightParen && !stack.empty()) {
+            EdifyFunctionCall *node = stack.back();
+            stack.pop_back();
+
+            if (node) {
+                node->right_paren_pos = i;
+                current = node->parent;
+            }
+        }
+    }
+
+    bool ret = true;
+
+    // Drop the first unterminated function call and everything after it
+    auto unterminated = std::find_if(stack.begin(), stack.end(),
+                                     [](EdifyFunctionCall *node) {
+        return node != nullptr;
+    });
+    if (unterminated != stack.end()) {
+        std::size_t cutoff = (*unterminated)->name_pos;
+
+        LOGW("Unterminated function call at token %" MB_PRIzu, cutoff);
+
+        m_nodes.erase(std::find_if(m_nodes.begin(), m_nodes.end(),
+                                   [&](const std::unique_ptr<EdifyFunctionCall> &node) {
+            return node->name_pos >= cutoff;
+        }), m_nodes.end());
+
+        ret = false;
+    }
+
+    // m_nodes is in source order, so the children and index lists will be too
+    for (auto const &node : m_nodes) {
+        if (node->parent) {
+            node->parent->children.push_back(node.get());
+        } else {
+            m_roots.push_back(node.get());
+        }
+        m_index[node->name].push_back(node.get());
+    }
+
+    return ret;
+}
+
+const std::vector<EdifyToken *> & EdifyTree::tokens() const
+{
+    return *m_tokens;
+}
+
+/*!
+ * \brief Get top-level function calls in source order
+ */
+const std::vector<EdifyFunctionCall *> & EdifyTree::calls() const
+{
+    return m_roots;
+}
+
+/*!
+ * \brief Get all function calls with the specified name in source order
+ *
+ * This is a hash table lookup and does not scan the tokens.
+ */
+const std::vector<EdifyFunctionCall *> &
+EdifyTree::find_calls(const std::string &name) const
+{
+    auto it = m_index.find(name);
+    if (it == m_index.end()) {
+        return empty_calls;
+    }
+    return it->second;
+}
+
+/*!
+ * \brief Generate script with function calls replaced
+ *
+ * \param replacements List of (function call, replacement string) pairs. If
+ *                     two replacements overlap, the one that appears first in
+ *                     the source is used.
+ *
+ * \return Script contents
+ */
+std::string EdifyTree::untokenize(std::vector<EdifyReplacement> replacements) const
+{
+    auto const &tokens = *m_tokens;
+
+    std::sort(replacements.begin(), replacements.end(),
+              [](const EdifyReplacement &a, const EdifyReplacement &b) {
+        return a.first->name_pos < b.first->name_pos;
+    });
+
+    std::string output;
+    std::size_t pos = 0;
+
+    for (auto const &r : replacements) {
+        if (r.first->name_pos < pos) {
+            // Nested within a previous replacement
+            continue;
+        }
+
+        for (; pos < r.first->name_pos; ++pos) {
+            output += tokens[pos]->generate();
+        }
+        output += r.second;
+        pos = r.first->right_paren_pos + 1;
+    }
+
+    for (; pos < tokens.size(); ++pos) {
+        output += tokens[pos]->generate();
+    }
+
+    return output;
+}
+
+}
+}
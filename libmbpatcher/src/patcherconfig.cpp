@@ -89,6 +89,16 @@ std::string PatcherConfig::temp_directory() const
     }
 }
 
+/*!
+ * \brief Get the patch cache directory
+ *
+ * \return Cache directory or empty string if caching is disabled
+ */
+std::string PatcherConfig::cache_directory() const
+{
+    return m_cache_dir;
+}
+
 /*!
  * \brief Set top-level data directory
  *
@@ -112,6 +122,20 @@ void PatcherConfig::set_temp_directory(std::string path)
     m_temp_dir = std::move(path);
 }
 
+/*!
+ * \brief Set the patch cache directory
+ *
+ * If set, patchers that support it will keep the files they generated in this
+ * directory and reuse them when the same file is patched again with unchanged
+ * inputs. Caching is disabled by default.
+ *
+ * \param path Path to cache directory or empty string to disable caching
+ */
+void PatcherConfig::set_cache_directory(std::string path)
+{
+    m_cache_dir = std::move(path);
+}
+
 /*!
  * \brief Get list of Patcher IDs
  *
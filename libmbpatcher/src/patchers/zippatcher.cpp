@@ -34,6 +34,7 @@
 #include "mbpatcher/patcherconfig.h"
 #include "mbpatcher/private/fileutils.h"
 #include "mbpatcher/private/miniziputils.h"
+#include "mbpatcher/private/patchcache.h"
 #include "mbpatcher/private/stringutils.h"
 
 // minizip
@@ -67,6 +68,7 @@ ZipPatcher::ZipPatcher(PatcherConfig &pc)
     , m_userdata(nullptr)
     , m_z_input(nullptr)
     , m_z_output(nullptr)
+    , m_z_raw_output(nullptr)
 {
 }
 
@@ -126,10 +128,19 @@ bool ZipPatcher::patch_file(ProgressUpdatedCallback progress_cb,
     if (m_z_input != nullptr) {
         close_input_archive();
     }
+    if (m_z_raw_output != nullptr) {
+        MinizipUtils::close_raw_output_file(m_z_raw_output);
+        m_z_raw_output = nullptr;
+    }
     if (m_z_output != nullptr) {
         close_output_archive();
     }
 
+    if (m_cache) {
+        m_cache->close(ret && !m_cancelled);
+        m_cache.reset();
+    }
+
     if (m_cancelled) {
         m_error = ErrorCode::PatchingCancelled;
         return false;
@@ -170,13 +181,13 @@ bool ZipPatcher::patch_zip()
         }
     }
 
-    // Unlike the old patcher, we'll write directly to the new file
-    if (!open_output_archive()) {
+    // Unlike the old patcher, we'll write directly to the new file. If
+    // supported, the first pass bypasses minizip for the raw copies.
+    m_z_raw_output = MinizipUtils::open_raw_output_file(m_info->output_path());
+    if (!m_z_raw_output && !open_output_archive(false)) {
         return false;
     }
 
-    zipFile zf = MinizipUtils::ctx_get_zip_file(m_z_output);
-
     if (m_cancelled) return false;
 
     MinizipUtils::ArchiveStats stats;
@@ -235,6 +246,10 @@ bool ZipPatcher::patch_zip()
         return false;
     }
 
+    if (!m_pc.cache_directory().empty()) {
+        open_cache();
+    }
+
     // Create temporary dir for extracted files for autopatchers
     std::string temp_dir =
             FileUtils::create_temporary_dir(m_pc.temp_directory());
@@ -255,6 +270,8 @@ bool ZipPatcher::patch_zip()
 
     io::delete_recursively(temp_dir);
 
+    zipFile zf = MinizipUtils::ctx_get_zip_file(m_z_output);
+
     for (const CopySpec &spec : to_copy) {
         if (m_cancelled) return false;
 
@@ -307,19 +324,58 @@ bool ZipPatcher::patch_zip()
     return true;
 }
 
+/*!
+ * \brief Open the patch cache for the current device and ROM ID
+ *
+ * The cache is keyed on everything besides the input files that affects the
+ * output of the AutoPatchers. If the cache cannot be opened, patching proceeds
+ * without it.
+ */
+void ZipPatcher::open_cache()
+{
+    std::string config;
+    config += version();
+    config += "\n";
+    config += m_info->rom_id();
+    config += "\n";
+    for (auto *ap : m_auto_patchers) {
+        config += ap->id();
+        config += "\n";
+    }
+
+    std::string json;
+    if (!device::device_to_json(m_info->device(), json)) {
+        return;
+    }
+    config += json;
+
+    m_cache.reset(new PatchCache(
+            m_pc.cache_directory(),
+            m_info->device().id() + "-" + m_info->rom_id(),
+            config));
+    if (!m_cache->open()) {
+        LOGW("Patching without cache");
+        m_cache.reset();
+    }
+}
+
 /*!
  * \brief First pass of patching operation
  *
  * This performs the following operations:
  *
  * - Files needed by an AutoPatcher are extracted to the temporary directory.
- * - Otherwise, the file is copied directly to the output zip.
+ *   If the patch cache is enabled, they are only recorded here and extracted
+ *   in pass 2 if the cached output cannot be used.
+ * - Otherwise, the file is copied directly to the output zip. If the output
+ *   zip was opened as a raw output zip, the compressed data is copied without
+ *   going through minizip until an entry is encountered that requires minizip.
+ *   The output zip is then reopened with minizip in append mode.
  */
 bool ZipPatcher::pass1(const std::string &temporary_dir,
                        const std::unordered_set<std::string> &exclude)
 {
     unzFile uf = MinizipUtils::ctx_get_unz_file(m_z_input);
-    zipFile zf = MinizipUtils::ctx_get_zip_file(m_z_output);
 
     int ret = unzGoToFirstFile(uf);
     if (ret != UNZ_OK) {
@@ -343,7 +399,13 @@ bool ZipPatcher::pass1(const std::string &temporary_dir,
 
         // Skip files that should be patched and added in pass 2
         if (exclude.find(cur_file) != exclude.end()) {
-            if (!MinizipUtils::extract_file(uf, temporary_dir)) {
+            if (m_cache) {
+                m_cache->set_key(cur_file, {
+                    true,
+                    static_cast<uint32_t>(fi.crc),
+                    fi.compressed_size
+                });
+            } else if (!MinizipUtils::extract_file(uf, temporary_dir)) {
                 m_error = ErrorCode::ArchiveReadDataError;
                 return false;
             }
@@ -355,7 +417,26 @@ bool ZipPatcher::pass1(const std::string &temporary_dir,
             cur_file = "META-INF/com/google/android/update-binary.orig";
         }
 
-        if (!MinizipUtils::copy_file_raw(uf, zf, cur_file, &la_progress_cb, this)) {
+        if (m_z_raw_output && !MinizipUtils::can_copy_file_raw(
+                m_z_raw_output, fi, cur_file)) {
+            LOGD("Switching to minizip for %s", cur_file.c_str());
+            if (!finish_raw_output_archive()) {
+                return false;
+            }
+        }
+
+        bool copied;
+
+        if (m_z_raw_output) {
+            copied = MinizipUtils::copy_file_raw(
+                    m_z_input, m_z_raw_output, cur_file, &la_progress_cb, this);
+        } else {
+            copied = MinizipUtils::copy_file_raw(
+                    uf, MinizipUtils::ctx_get_zip_file(m_z_output), cur_file,
+                    &la_progress_cb, this);
+        }
+
+        if (!copied) {
             LOGW("minizip: Failed to copy raw data: %s", cur_file.c_str());
             m_error = ErrorCode::ArchiveWriteDataError;
             return false;
@@ -369,11 +450,59 @@ bool ZipPatcher::pass1(const std::string &temporary_dir,
         return false;
     }
 
+    if (m_z_raw_output && !finish_raw_output_archive()) {
+        return false;
+    }
+
     if (m_cancelled) return false;
 
     return true;
 }
 
+static const char * output_name(const std::string &file)
+{
+    if (file == "META-INF/com/google/android/update-binary") {
+        return "META-INF/com/google/android/update-binary.orig";
+    }
+    return file.c_str();
+}
+
+/*!
+ * \brief Add AutoPatchers that depend on a set of files
+ *
+ * Any AutoPatcher in \p all that uses a file in \p files is added to
+ * \p patchers and all of its files are added to \p files. This is repeated
+ * until no more AutoPatchers are added.
+ */
+static void add_dependent_patchers(const std::vector<AutoPatcher *> &all,
+                                   std::vector<AutoPatcher *> &patchers,
+                                   std::unordered_set<std::string> &files)
+{
+    bool changed;
+    do {
+        changed = false;
+
+        for (auto *ap : all) {
+            if (std::find(patchers.begin(), patchers.end(), ap)
+                    != patchers.end()) {
+                continue;
+            }
+
+            auto ap_files = ap->existing_files();
+            bool dirty = std::any_of(ap_files.begin(), ap_files.end(),
+                                     [&](const std::string &f) {
+                return files.find(f) != files.end();
+            });
+
+            if (dirty) {
+                patchers.push_back(ap);
+                files.insert(ap_files.begin(), ap_files.end());
+                changed = true;
+            }
+        }
+    } while (changed);
+}
+
 /*!
  * \brief Second pass of patching operation
  *
@@ -381,13 +510,44 @@ bool ZipPatcher::pass1(const std::string &temporary_dir,
  *
  * - Patch files in the temporary directory using the AutoPatchers and add the
  *   resulting files to the output zip
+ *
+ * If the patch cache is enabled, AutoPatchers whose input files are unchanged
+ * since the previous run are skipped and their output is copied from the cache.
+ * An AutoPatcher sharing an input file with an AutoPatcher that must run is
+ * also rerun since the file is extracted again.
  */
 bool ZipPatcher::pass2(const std::string &temporary_dir,
                        const std::unordered_set<std::string> &files)
 {
     zipFile zf = MinizipUtils::ctx_get_zip_file(m_z_output);
 
-    for (auto *ap : m_auto_patchers) {
+    std::vector<AutoPatcher *> dirty_patchers;
+    std::unordered_set<std::string> dirty_files;
+
+    if (m_cache) {
+        for (auto const &file : files) {
+            if (!m_cache->has_key(file)) {
+                m_cache->set_key(file, { false, 0, 0 });
+            }
+            if (!m_cache->can_reuse(file)) {
+                dirty_files.insert(file);
+            }
+        }
+
+        add_dependent_patchers(m_auto_patchers, dirty_patchers, dirty_files);
+
+        LOGD("Reusing cached output for %" MB_PRIzu "/%" MB_PRIzu " files",
+             files.size() - dirty_files.size(), files.size());
+
+        if (!extract_files(temporary_dir, dirty_files)) {
+            return false;
+        }
+    } else {
+        dirty_patchers = m_auto_patchers;
+        dirty_files = files;
+    }
+
+    for (auto *ap : dirty_patchers) {
         if (m_cancelled) return false;
         if (!ap->patch_files(temporary_dir)) {
             m_error = ap->error();
@@ -397,21 +557,29 @@ bool ZipPatcher::pass2(const std::string &temporary_dir,
 
     // TODO Headers are being discarded
 
+    std::unordered_set<std::string> uncached_files;
+
     for (auto const &file : files) {
         if (m_cancelled) return false;
 
         ErrorCode ret;
+        const char *out_file = output_name(file);
 
-        if (file == "META-INF/com/google/android/update-binary") {
-            ret = MinizipUtils::add_file(
-                    zf,
-                    "META-INF/com/google/android/update-binary.orig",
-                      temporary_dir + "/" + file);
-        } else {
-            ret = MinizipUtils::add_file(
-                    zf,
-                    file,
-                      temporary_dir + "/" + file);
+        if (dirty_files.find(file) == dirty_files.end()) {
+            if (m_cache->copy_cached_file(zf, file, out_file)) {
+                continue;
+            }
+
+            // Cache failures never fail patching
+            LOGW("%s: Failed to copy cached file; patching again",
+                 file.c_str());
+            uncached_files.insert(file);
+            continue;
+        }
+
+        ret = MinizipUtils::add_file(zf, out_file, temporary_dir + "/" + file);
+        if (ret == ErrorCode::NoError && m_cache) {
+            m_cache->add_file(file, temporary_dir + "/" + file);
         }
 
         if (ret == ErrorCode::FileOpenError) {
@@ -422,11 +590,90 @@ bool ZipPatcher::pass2(const std::string &temporary_dir,
         }
     }
 
+    if (!uncached_files.empty()
+            && !patch_uncached_files(temporary_dir, uncached_files)) {
+        return false;
+    }
+
     if (m_cancelled) return false;
 
     return true;
 }
 
+/*!
+ * \brief Patch and add files whose cached output could not be copied
+ *
+ * The AutoPatchers that use these files were skipped by pass2(), so none of
+ * their files have been extracted to the temporary directory yet. They are
+ * extracted and patched now, but only \p files are added to the output zip
+ * because the rest were already added.
+ */
+bool ZipPatcher::patch_uncached_files(const std::string &temporary_dir,
+                                      const std::unordered_set<std::string> &files)
+{
+    zipFile zf = MinizipUtils::ctx_get_zip_file(m_z_output);
+
+    std::vector<AutoPatcher *> patchers;
+    std::unordered_set<std::string> extract(files);
+
+    add_dependent_patchers(m_auto_patchers, patchers, extract);
+
+    if (!extract_files(temporary_dir, extract)) {
+        return false;
+    }
+
+    for (auto *ap : patchers) {
+        if (m_cancelled) return false;
+        if (!ap->patch_files(temporary_dir)) {
+            m_error = ap->error();
+            return false;
+        }
+    }
+
+    for (auto const &file : files) {
+        if (m_cancelled) return false;
+
+        ErrorCode ret = MinizipUtils::add_file(
+                zf, output_name(file), temporary_dir + "/" + file);
+        if (ret == ErrorCode::NoError) {
+            m_cache->add_file(file, temporary_dir + "/" + file);
+        } else if (ret == ErrorCode::FileOpenError) {
+            LOGW("File does not exist in temporary directory: %s", file.c_str());
+        } else {
+            m_error = ret;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract files from the input zip to the temporary directory
+ *
+ * Files that do not exist in the input zip are skipped.
+ */
+bool ZipPatcher::extract_files(const std::string &temporary_dir,
+                               const std::unordered_set<std::string> &files)
+{
+    unzFile uf = MinizipUtils::ctx_get_unz_file(m_z_input);
+
+    for (auto const &file : files) {
+        if (m_cancelled) return false;
+
+        if (unzLocateFile(uf, file.c_str(), nullptr) != UNZ_OK) {
+            continue;
+        }
+
+        if (!MinizipUtils::extract_file(uf, temporary_dir)) {
+            m_error = ErrorCode::ArchiveReadDataError;
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool ZipPatcher::open_input_archive()
 {
     assert(m_z_input == nullptr);
@@ -455,11 +702,11 @@ void ZipPatcher::close_input_archive()
     m_z_input = nullptr;
 }
 
-bool ZipPatcher::open_output_archive()
+bool ZipPatcher::open_output_archive(bool append)
 {
     assert(m_z_output == nullptr);
 
-    m_z_output = MinizipUtils::open_output_file(m_info->output_path());
+    m_z_output = MinizipUtils::open_output_file(m_info->output_path(), append);
 
     if (!m_z_output) {
         LOGE("minizip: Failed to open for writing: %s",
@@ -483,6 +730,24 @@ void ZipPatcher::close_output_archive()
     m_z_output = nullptr;
 }
 
+/*!
+ * \brief Finalize raw output zip and reopen it with minizip
+ */
+bool ZipPatcher::finish_raw_output_archive()
+{
+    assert(m_z_raw_output != nullptr);
+
+    bool ret = MinizipUtils::close_raw_output_file(m_z_raw_output);
+    m_z_raw_output = nullptr;
+
+    if (!ret) {
+        m_error = ErrorCode::ArchiveWriteDataError;
+        return false;
+    }
+
+    return open_output_archive(true);
+}
+
 void ZipPatcher::update_progress(uint64_t bytes, uint64_t max_bytes)
 {
     if (m_progress_cb) {
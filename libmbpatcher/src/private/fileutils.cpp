@@ -21,10 +21,12 @@
 
 #include <cassert>
 #include <cerrno>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include "mbcommon/error_code.h"
+#include "mbcommon/finally.h"
 #include "mbcommon/locale.h"
 
 #include "mblog/logging.h"
@@ -201,6 +203,141 @@ ErrorCode FileUtils::write_from_string(const std::string &path,
     return ErrorCode::NoError;
 }
 
+/*!
+ * \brief Atomically replace a file with another file
+ *
+ * \param replace Path to file to replace
+ * \param with Path to file that will be renamed to \p replace
+ *
+ * \return Whether the file was successfully replaced
+ */
+bool FileUtils::replace_file(const std::string &replace,
+                             const std::string &with)
+{
+#ifdef _WIN32
+    auto w_replace = utf8_to_wcs(replace);
+    if (!w_replace) {
+        LOGE("%s: Failed to convert from UTF8 to WCS: %s",
+             replace.c_str(), w_replace.error().message().c_str());
+        return false;
+    }
+    auto w_with = utf8_to_wcs(with);
+    if (!w_with) {
+        LOGE("%s: Failed to convert from UTF8 to WCS: %s",
+             with.c_str(), w_with.error().message().c_str());
+        return false;
+    }
+
+    if (!MoveFileExW(w_with.value().c_str(), w_replace.value().c_str(),
+                     MOVEFILE_REPLACE_EXISTING)) {
+        LOGE("%s: Failed to rename to %s: %s", with.c_str(), replace.c_str(),
+             ec_from_win32().message().c_str());
+        return false;
+    }
+#else
+    if (rename(with.c_str(), replace.c_str()) < 0) {
+        LOGE("%s: Failed to rename to %s: %s", with.c_str(), replace.c_str(),
+             strerror(errno));
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+static void remove_file(const std::string &path)
+{
+#ifdef _WIN32
+    auto w_path = utf8_to_wcs(path);
+    if (!w_path) {
+        LOGE("%s: Failed to convert from UTF8 to WCS: %s",
+             path.c_str(), w_path.error().message().c_str());
+        return;
+    }
+
+    if (_wremove(w_path.value().c_str()) < 0 && errno != ENOENT) {
+#else
+    if (remove(path.c_str()) < 0 && errno != ENOENT) {
+#endif
+        LOGW("%s: Failed to remove: %s", path.c_str(), strerror(errno));
+    }
+}
+
+/*!
+ * \brief Filter lines of a file
+ *
+ * The file is streamed through mb::file_filter_lines() into a temporary file
+ * next to \p path, which then replaces the original file. The file is never
+ * fully loaded into memory.
+ *
+ * \param path Path to file
+ * \param rules Rules to apply to each line
+ *
+ * \return ErrorCode::FileOpenError if \p path cannot be opened for reading.
+ *         Otherwise, whether the file was successfully filtered. Failures to
+ *         create the temporary file are reported as ErrorCode::FileWriteError.
+ *         The temporary file is removed if an error occurs.
+ */
+ErrorCode FileUtils::filter_lines(const std::string &path,
+                                  const std::vector<FileLineRule> &rules)
+{
+    std::string new_path(path);
+    new_path += ".new";
+
+    bool created = false;
+    bool replaced = false;
+
+    // Runs after the files below are closed
+    auto remove_new = finally([&] {
+        if (created && !replaced) {
+            remove_file(new_path);
+        }
+    });
+
+    {
+        StandardFile fin;
+        StandardFile fout;
+
+        auto ret = open_file(fin, path, FileOpenMode::ReadOnly);
+        if (!ret) {
+            LOGE("%s: Failed to open for reading: %s",
+                 path.c_str(), ret.error().message().c_str());
+            return ErrorCode::FileOpenError;
+        }
+
+        ret = open_file(fout, new_path, FileOpenMode::WriteOnly);
+        if (!ret) {
+            LOGE("%s: Failed to open for writing: %s",
+                 new_path.c_str(), ret.error().message().c_str());
+            return ErrorCode::FileWriteError;
+        }
+
+        created = true;
+
+        ret = file_filter_lines(fin, fout, rules);
+        if (!ret) {
+            LOGE("%s: Failed to filter lines: %s",
+                 path.c_str(), ret.error().message().c_str());
+            return ErrorCode::FileWriteError;
+        }
+
+        ret = fout.close();
+        if (!ret) {
+            LOGE("%s: Failed to close file: %s",
+                 new_path.c_str(), ret.error().message().c_str());
+            return ErrorCode::FileCloseError;
+        }
+    }
+
+    if (!replace_file(path, new_path)) {
+        return ErrorCode::FileWriteError;
+    }
+
+    replaced = true;
+
+    return ErrorCode::NoError;
+}
+
 #ifdef _WIN32
 static bool directory_exists(const wchar_t *path)
 {
@@ -20,6 +20,7 @@
 #include "mbpatcher/private/miniziputils.h"
 
 #include <algorithm>
+#include <atomic>
 
 #include <cassert>
 #include <cerrno>
@@ -55,10 +56,22 @@
 #  include <sys/stat.h>
 #endif
 
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <sys/sendfile.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#  define RAW_ZIP_SUPPORTED
+#endif
+
 #include "mbpatcher/private/fileutils.h"
 
 #define LOG_TAG "mbpatcher/private/miniziputils"
 
+// Maximum number of bytes to copy per copy_file_range()/sendfile() call. This
+// only limits how often the progress callback is called.
+#define RAW_COPY_CHUNK_SIZE     (8 * 1024 * 1024)
+
 
 namespace mb
 {
@@ -137,6 +150,10 @@ struct UnzCtx
 #else
     std::string path;
 #endif
+#ifdef RAW_ZIP_SUPPORTED
+    // Separate unbuffered handle for raw copies. Opened on first use.
+    int fd = -1;
+#endif
 };
 
 struct ZipCtx
@@ -161,6 +178,37 @@ zipFile MinizipUtils::ctx_get_zip_file(ZipCtx *ctx)
     return ctx->zf;
 }
 
+/*!
+ * \brief Minimal zip writer for raw entry copies
+ *
+ * This only writes entries whose local header, data, and central directory
+ * record fit in the non-zip64 format. The archive is finalized by
+ * close_raw_output_file() and can then be opened with open_output_file() in
+ * append mode to add more files with minizip.
+ */
+struct RawZipCtx
+{
+    std::string path;
+    int fd;
+    uint64_t offset;
+    uint64_t entries;
+    std::vector<unsigned char> central_dir;
+};
+
+#ifdef RAW_ZIP_SUPPORTED
+static void put_le16(std::vector<unsigned char> &buf, uint16_t value)
+{
+    buf.push_back(static_cast<unsigned char>(value));
+    buf.push_back(static_cast<unsigned char>(value >> 8));
+}
+
+static void put_le32(std::vector<unsigned char> &buf, uint32_t value)
+{
+    put_le16(buf, static_cast<uint16_t>(value));
+    put_le16(buf, static_cast<uint16_t>(value >> 16));
+}
+#endif
+
 UnzCtx * MinizipUtils::open_input_file(std::string path)
 {
     UnzCtx *ctx = new(std::nothrow) UnzCtx();
@@ -195,7 +243,14 @@ UnzCtx * MinizipUtils::open_input_file(std::string path)
     return ctx;
 }
 
-ZipCtx * MinizipUtils::open_output_file(std::string path)
+/*!
+ * \brief Open output zip
+ *
+ * \param path Path to zip
+ * \param append Whether to add files to an existing zip instead of creating a
+ *               new one
+ */
+ZipCtx * MinizipUtils::open_output_file(std::string path, bool append)
 {
     ZipCtx *ctx = new(std::nothrow) ZipCtx();
     if (!ctx) {
@@ -220,7 +275,9 @@ ZipCtx * MinizipUtils::open_output_file(std::string path)
 #endif
 
     fill_buffer_filefunc64(&ctx->z_func, &ctx->buf);
-    ctx->zf = zipOpen2_64(ctx->path.c_str(), 0, nullptr, &ctx->z_func);
+    ctx->zf = zipOpen2_64(ctx->path.c_str(),
+                          append ? APPEND_STATUS_ADDINZIP : APPEND_STATUS_CREATE,
+                          nullptr, &ctx->z_func);
     if (!ctx->zf) {
         delete ctx;
         return nullptr;
@@ -229,9 +286,49 @@ ZipCtx * MinizipUtils::open_output_file(std::string path)
     return ctx;
 }
 
+/*!
+ * \brief Open output zip for zero-copy raw entry copies
+ *
+ * \return RawZipCtx or nullptr if the file could not be opened or if raw copies
+ *         are not supported on the platform. In the latter case, minizip must
+ *         be used instead.
+ */
+RawZipCtx * MinizipUtils::open_raw_output_file(std::string path)
+{
+#ifdef RAW_ZIP_SUPPORTED
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        LOGE("%s: Failed to open for writing: %s",
+             path.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    RawZipCtx *ctx = new(std::nothrow) RawZipCtx();
+    if (!ctx) {
+        close(fd);
+        return nullptr;
+    }
+
+    ctx->path = std::move(path);
+    ctx->fd = fd;
+    ctx->offset = 0;
+    ctx->entries = 0;
+
+    return ctx;
+#else
+    (void) path;
+    return nullptr;
+#endif
+}
+
 int MinizipUtils::close_input_file(UnzCtx *ctx)
 {
     int ret = unzClose(ctx->uf);
+#ifdef RAW_ZIP_SUPPORTED
+    if (ctx->fd >= 0) {
+        close(ctx->fd);
+    }
+#endif
     delete ctx;
     return ret;
 }
@@ -243,6 +340,120 @@ int MinizipUtils::close_output_file(ZipCtx *ctx)
     return ret;
 }
 
+#ifdef RAW_ZIP_SUPPORTED
+static bool write_fully(int fd, const unsigned char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        size -= static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Copy file range between file descriptors within the kernel
+ *
+ * Uses copy_file_range() if available, then sendfile(), and finally falls back
+ * to pread() and write().
+ *
+ * \return Number of bytes copied or -1 on error. 0 indicates that \p in_fd
+ *         reached EOF.
+ */
+ssize_t MinizipUtils::copy_fd_range(int in_fd, off64_t *in_offset,
+                                   int out_fd, size_t size)
+{
+    // Shared by concurrent copies. Only used as hints, so relaxed ordering is
+    // sufficient.
+    static std::atomic<bool> use_copy_file_range{true};
+    static std::atomic<bool> use_sendfile{true};
+
+#ifdef __NR_copy_file_range
+    if (use_copy_file_range.load(std::memory_order_relaxed)) {
+        auto n = static_cast<ssize_t>(syscall(
+                __NR_copy_file_range, in_fd, in_offset, out_fd, nullptr,
+                size, 0u));
+        if (n >= 0) {
+            return n;
+        } else if (errno != ENOSYS && errno != EXDEV && errno != EINVAL
+                && errno != EOPNOTSUPP && errno != EPERM) {
+            return -1;
+        }
+        use_copy_file_range.store(false, std::memory_order_relaxed);
+    }
+#else
+    (void) use_copy_file_range;
+#endif
+
+    if (use_sendfile.load(std::memory_order_relaxed)) {
+        ssize_t n = sendfile64(out_fd, in_fd, in_offset, size);
+        if (n >= 0) {
+            return n;
+        } else if (errno != ENOSYS && errno != EINVAL) {
+            return -1;
+        }
+        use_sendfile.store(false, std::memory_order_relaxed);
+    }
+
+    unsigned char buf[65536];
+    ssize_t n = pread64(in_fd, buf, std::min(size, sizeof(buf)), *in_offset);
+    if (n > 0) {
+        if (!write_fully(out_fd, buf, static_cast<size_t>(n))) {
+            return -1;
+        }
+        *in_offset += n;
+    }
+    return n;
+}
+#endif
+
+/*!
+ * \brief Write central directory and close raw output zip
+ *
+ * \return Whether the zip was successfully finalized
+ */
+bool MinizipUtils::close_raw_output_file(RawZipCtx *ctx)
+{
+#ifdef RAW_ZIP_SUPPORTED
+    std::vector<unsigned char> eocd;
+    put_le32(eocd, 0x06054b50);
+    put_le16(eocd, 0);
+    put_le16(eocd, 0);
+    put_le16(eocd, static_cast<uint16_t>(ctx->entries));
+    put_le16(eocd, static_cast<uint16_t>(ctx->entries));
+    put_le32(eocd, static_cast<uint32_t>(ctx->central_dir.size()));
+    put_le32(eocd, static_cast<uint32_t>(ctx->offset));
+    put_le16(eocd, 0);
+
+    bool ret = write_fully(ctx->fd, ctx->central_dir.data(),
+                           ctx->central_dir.size())
+            && write_fully(ctx->fd, eocd.data(), eocd.size());
+    if (!ret) {
+        LOGE("%s: Failed to write central directory: %s",
+             ctx->path.c_str(), strerror(errno));
+    }
+
+    if (close(ctx->fd) < 0) {
+        LOGE("%s: Failed to close file: %s",
+             ctx->path.c_str(), strerror(errno));
+        ret = false;
+    }
+
+    delete ctx;
+    return ret;
+#else
+    (void) ctx;
+    return false;
+#endif
+}
+
 ErrorCode MinizipUtils::archive_stats(const std::string &path,
                                       MinizipUtils::ArchiveStats *stats,
                                       std::vector<std::string> ignore)
@@ -462,6 +673,171 @@ bool MinizipUtils::copy_file_raw(unzFile uf,
     return bytes_read == 0 && close_success;
 }
 
+/*!
+ * \brief Check if an entry can be copied to a raw output zip
+ *
+ * Encrypted entries and entries that would require zip64 extensions are not
+ * supported. Such entries must be copied with minizip.
+ */
+bool MinizipUtils::can_copy_file_raw(RawZipCtx *ctx,
+                                     const unz_file_info64 &fi,
+                                     const std::string &name)
+{
+    // Local header + data + central directory record + end of central
+    // directory record
+    uint64_t max_size = 30 + name.size() + fi.compressed_size
+            + 46 + name.size() + 22;
+
+    return !(fi.flag & 1)
+            && name.size() <= UINT16_MAX
+            && ctx->entries < UINT16_MAX
+            && fi.compressed_size < UINT32_MAX
+            && fi.uncompressed_size < UINT32_MAX
+            && ctx->offset + ctx->central_dir.size() + max_size < UINT32_MAX;
+}
+
+/*!
+ * \brief Copy current entry to a raw output zip without recompression
+ *
+ * Unlike copy_file_raw() for minizip output zips, this computes the location
+ * of the compressed data and copies it directly between the underlying files
+ * in the kernel. The local header is written with the sizes and CRC32 from the
+ * central directory, so no data descriptor is needed.
+ *
+ * \pre can_copy_file_raw() returned true for the current entry
+ */
+bool MinizipUtils::copy_file_raw(UnzCtx *uctx,
+                                 RawZipCtx *zctx,
+                                 const std::string &name,
+                                 void (*cb)(uint64_t bytes, void *),
+                                 void *userData)
+{
+#ifdef RAW_ZIP_SUPPORTED
+    unz_file_info64 ufi;
+
+    if (!get_info(uctx->uf, &ufi, nullptr)) {
+        return false;
+    }
+
+    if (uctx->fd < 0) {
+        uctx->fd = open(uctx->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (uctx->fd < 0) {
+            LOGE("%s: Failed to open for reading: %s",
+                 uctx->path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    int method;
+    int level;
+
+    // Let minizip parse the local header to find the start of the data
+    int ret = unzOpenCurrentFile2(uctx->uf, &method, &level, 1);
+    if (ret != UNZ_OK) {
+        LOGE("miniunz: Failed to open inner file: %s",
+             unz_error_string(ret).c_str());
+        return false;
+    }
+
+    auto data_offset = static_cast<off64_t>(
+            unzGetCurrentFileZStreamPos64(uctx->uf));
+
+    ret = unzCloseCurrentFile(uctx->uf);
+    if (ret != UNZ_OK) {
+        LOGE("miniunz: Failed to close inner file: %s",
+             unz_error_string(ret).c_str());
+        return false;
+    }
+
+    // Sizes are known, so the data descriptor flag is cleared
+    auto flag = static_cast<uint16_t>(ufi.flag & ~0x8u);
+    auto name_size = static_cast<uint16_t>(name.size());
+
+    std::vector<unsigned char> header;
+    put_le32(header, 0x04034b50);
+    put_le16(header, static_cast<uint16_t>(ufi.version_needed));
+    put_le16(header, flag);
+    put_le16(header, static_cast<uint16_t>(ufi.compression_method));
+    put_le32(header, static_cast<uint32_t>(ufi.dos_date));
+    put_le32(header, static_cast<uint32_t>(ufi.crc));
+    put_le32(header, static_cast<uint32_t>(ufi.compressed_size));
+    put_le32(header, static_cast<uint32_t>(ufi.uncompressed_size));
+    put_le16(header, name_size);
+    put_le16(header, 0);
+    header.insert(header.end(), name.begin(), name.end());
+
+    if (!write_fully(zctx->fd, header.data(), header.size())) {
+        LOGE("%s: Failed to write local header: %s",
+             zctx->path.c_str(), strerror(errno));
+        return false;
+    }
+
+    uint64_t remaining = ufi.compressed_size;
+
+    while (remaining > 0) {
+        ssize_t n = copy_fd_range(
+                uctx->fd, &data_offset, zctx->fd,
+                static_cast<size_t>(std::min<uint64_t>(
+                        remaining, RAW_COPY_CHUNK_SIZE)));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("%s: Failed to copy data: %s",
+                 zctx->path.c_str(), strerror(errno));
+            return false;
+        } else if (n == 0) {
+            LOGE("%s: Unexpected EOF while copying %s",
+                 uctx->path.c_str(), name.c_str());
+            return false;
+        }
+
+        remaining -= static_cast<uint64_t>(n);
+
+        if (cb) {
+            // Scale this to the uncompressed size for the purposes of a
+            // progress bar
+            double ratio = static_cast<double>(ufi.compressed_size - remaining)
+                    / static_cast<double>(ufi.compressed_size);
+            cb(static_cast<uint64_t>(
+                    ratio * static_cast<double>(ufi.uncompressed_size)),
+               userData);
+        }
+    }
+
+    auto &cd = zctx->central_dir;
+    put_le32(cd, 0x02014b50);
+    put_le16(cd, static_cast<uint16_t>(ufi.version));
+    put_le16(cd, static_cast<uint16_t>(ufi.version_needed));
+    put_le16(cd, flag);
+    put_le16(cd, static_cast<uint16_t>(ufi.compression_method));
+    put_le32(cd, static_cast<uint32_t>(ufi.dos_date));
+    put_le32(cd, static_cast<uint32_t>(ufi.crc));
+    put_le32(cd, static_cast<uint32_t>(ufi.compressed_size));
+    put_le32(cd, static_cast<uint32_t>(ufi.uncompressed_size));
+    put_le16(cd, name_size);
+    put_le16(cd, 0);
+    put_le16(cd, 0);
+    put_le16(cd, 0);
+    put_le16(cd, static_cast<uint16_t>(ufi.internal_fa));
+    put_le32(cd, static_cast<uint32_t>(ufi.external_fa));
+    put_le32(cd, static_cast<uint32_t>(zctx->offset));
+    cd.insert(cd.end(), name.begin(), name.end());
+
+    zctx->offset += header.size() + ufi.compressed_size;
+    ++zctx->entries;
+
+    return true;
+#else
+    (void) uctx;
+    (void) zctx;
+    (void) name;
+    (void) cb;
+    (void) userData;
+    return false;
+#endif
+}
+
 bool MinizipUtils::read_to_memory(unzFile uf,
                                   std::vector<unsigned char> *output,
                                   void (*cb)(uint64_t bytes, void *),
@@ -0,0 +1,375 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/patchcache.h"
+
+#include <cinttypes>
+
+#include "mbcommon/integer.h"
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbpio/delete.h"
+#include "mbpio/directory.h"
+
+#include "mbpatcher/private/fileutils.h"
+
+#define LOG_TAG "mbpatcher/private/patchcache"
+
+#define INDEX_MAGIC             "mbpatcher-patch-cache 1"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \class PatchCache
+ *
+ * \brief Cache of patched files from a previous run of ZipPatcher
+ *
+ * The cache consists of two files in the cache directory:
+ *
+ * - `<name>.zip`: Files generated by the AutoPatchers during the last run,
+ *   stored under their input names
+ * - `<name>.index`: The configuration fingerprint and the (CRC32, compressed
+ *   size) key of every input entry that the AutoPatchers consumed
+ *
+ * If the configuration fingerprint and the keys of all input files of an
+ * AutoPatcher match, its output can be copied from the cache without
+ * recompression instead of extracting and patching the input files again.
+ *
+ * Failures are never fatal. The worst case is that the cache is not used or
+ * not updated.
+ */
+
+static uint64_t fnv1a_64(const std::string &str)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (unsigned char c : str) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static bool operator==(const PatchCacheKey &a, const PatchCacheKey &b)
+{
+    if (a.exists != b.exists) {
+        return false;
+    }
+    return !a.exists || (a.crc32 == b.crc32
+            && a.compressed_size == b.compressed_size);
+}
+
+/*!
+ * \brief Construct cache handle
+ *
+ * \param directory Cache directory
+ * \param name Cache name. Only one cache is kept per name.
+ * \param config Fingerprint of everything besides the input files that affects
+ *               the patched output
+ */
+PatchCache::PatchCache(const std::string &directory, const std::string &name,
+                       const std::string &config)
+    : m_config(format("%016" PRIx64, fnv1a_64(config)))
+    , m_old_zip(nullptr)
+    , m_new_zip(nullptr)
+    , m_failed(false)
+{
+    std::string base(directory);
+    base += "/";
+    base += name;
+
+    m_zip_path = base + ".zip";
+    m_index_path = base + ".index";
+}
+
+PatchCache::~PatchCache()
+{
+    close(false);
+}
+
+/*!
+ * \brief Open previous cache and create new cache
+ *
+ * \return Whether the new cache could be created. A missing or invalid previous
+ *         cache is not an error.
+ */
+bool PatchCache::open()
+{
+    if (load_index()) {
+        m_old_zip = MinizipUtils::open_input_file(m_zip_path);
+        if (!m_old_zip) {
+            LOGW("%s: Failed to open cached files", m_zip_path.c_str());
+            m_old_keys.clear();
+        }
+    }
+
+    std::string directory = m_zip_path.substr(0, m_zip_path.rfind('/'));
+    if (!io::create_directories(directory)) {
+        LOGW("%s: Failed to create directory", directory.c_str());
+    }
+
+    m_new_zip = MinizipUtils::open_output_file(m_zip_path + ".new");
+    if (!m_new_zip) {
+        LOGW("%s.new: Failed to open for writing", m_zip_path.c_str());
+        close(false);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Close cache
+ *
+ * \param commit Whether the new cache should replace the previous cache
+ */
+void PatchCache::close(bool commit)
+{
+    if (m_old_zip) {
+        MinizipUtils::close_input_file(m_old_zip);
+        m_old_zip = nullptr;
+    }
+
+    if (!m_new_zip) {
+        return;
+    }
+
+    std::string new_zip_path = m_zip_path + ".new";
+    std::string new_index_path = m_index_path + ".new";
+
+    int ret = MinizipUtils::close_output_file(m_new_zip);
+    m_new_zip = nullptr;
+
+    if (ret != ZIP_OK) {
+        LOGW("%s: Failed to close cache: %s", new_zip_path.c_str(),
+             MinizipUtils::zip_error_string(ret).c_str());
+        commit = false;
+    }
+
+    if (commit && !m_failed && save_index(new_index_path)
+            && FileUtils::replace_file(m_zip_path, new_zip_path)
+            && FileUtils::replace_file(m_index_path, new_index_path)) {
+        return;
+    }
+
+    io::delete_recursively(new_zip_path);
+    io::delete_recursively(new_index_path);
+}
+
+/*!
+ * \brief Record key of an input file for the current run
+ */
+void PatchCache::set_key(const std::string &name, const PatchCacheKey &key)
+{
+    m_new_keys[name] = key;
+}
+
+bool PatchCache::has_key(const std::string &name) const
+{
+    return m_new_keys.find(name) != m_new_keys.end();
+}
+
+/*!
+ * \brief Check if the cached output for an input file can be reused
+ *
+ * \param name Name of input file
+ *
+ * \return Whether the input file is unchanged since the previous run and the
+ *         previous output is available
+ */
+bool PatchCache::can_reuse(const std::string &name)
+{
+    if (!m_old_zip) {
+        return false;
+    }
+
+    auto old_it = m_old_keys.find(name);
+    auto new_it = m_new_keys.find(name);
+
+    if (old_it == m_old_keys.end() || new_it == m_new_keys.end()
+            || !(old_it->second == new_it->second)) {
+        return false;
+    }
+
+    // Nothing is generated for missing input files
+    return !new_it->second.exists
+            || unzLocateFile(MinizipUtils::ctx_get_unz_file(m_old_zip),
+                             name.c_str(), nullptr) == UNZ_OK;
+}
+
+/*!
+ * \brief Copy cached output file to a zip and to the new cache
+ *
+ * \pre can_reuse() returned true for \p name
+ *
+ * \param zf Output zip
+ * \param name Name of input file
+ * \param out_name Name of file in \p zf
+ *
+ * \return Whether the file was successfully copied to \p zf
+ */
+bool PatchCache::copy_cached_file(zipFile zf, const std::string &name,
+                                  const std::string &out_name)
+{
+    auto it = m_new_keys.find(name);
+    if (it != m_new_keys.end() && !it->second.exists) {
+        return true;
+    }
+
+    unzFile uf = MinizipUtils::ctx_get_unz_file(m_old_zip);
+
+    if (unzLocateFile(uf, name.c_str(), nullptr) != UNZ_OK
+            || !MinizipUtils::copy_file_raw(uf, zf, out_name, nullptr, nullptr)) {
+        return false;
+    }
+
+    if (!m_failed && !MinizipUtils::copy_file_raw(
+            uf, MinizipUtils::ctx_get_zip_file(m_new_zip), name,
+            nullptr, nullptr)) {
+        LOGW("%s: Failed to add to cache", name.c_str());
+        m_failed = true;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add newly patched file to the new cache
+ *
+ * \param name Name of input file
+ * \param path Path to patched file
+ */
+void PatchCache::add_file(const std::string &name, const std::string &path)
+{
+    if (m_failed) {
+        return;
+    }
+
+    auto ret = MinizipUtils::add_file(
+            MinizipUtils::ctx_get_zip_file(m_new_zip), name, path);
+    if (ret != ErrorCode::NoError && ret != ErrorCode::FileOpenError) {
+        LOGW("%s: Failed to add to cache", name.c_str());
+        m_failed = true;
+    }
+}
+
+bool PatchCache::load_index()
+{
+    std::string contents;
+
+    if (FileUtils::read_to_string(m_index_path, &contents)
+            != ErrorCode::NoError) {
+        return false;
+    }
+
+    std::unordered_map<std::string, PatchCacheKey> keys;
+    bool valid_magic = false;
+    bool valid_config = false;
+    std::size_t pos = 0;
+
+    while (pos < contents.size()) {
+        std::size_t end = contents.find('\n', pos);
+        if (end == std::string::npos) {
+            end = contents.size();
+        }
+
+        std::string line = contents.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (!valid_magic) {
+            valid_magic = line == INDEX_MAGIC;
+            if (!valid_magic) {
+                break;
+            }
+            continue;
+        } else if (!valid_config) {
+            valid_config = line == "config " + m_config;
+            if (!valid_config) {
+                break;
+            }
+            continue;
+        }
+
+        // <crc32> <compressed size> <name> or - - <name>
+        std::size_t sep1 = line.find(' ');
+        std::size_t sep2 = sep1 == std::string::npos
+                ? std::string::npos : line.find(' ', sep1 + 1);
+        if (sep2 == std::string::npos) {
+            LOGW("%s: Invalid line: %s", m_index_path.c_str(), line.c_str());
+            return false;
+        }
+
+        std::string crc32 = line.substr(0, sep1);
+        std::string size = line.substr(sep1 + 1, sep2 - sep1 - 1);
+        PatchCacheKey key{};
+
+        if (crc32 == "-" && size == "-") {
+            key.exists = false;
+        } else if (str_to_num(crc32.c_str(), 16, key.crc32)
+                && str_to_num(size.c_str(), 10, key.compressed_size)) {
+            key.exists = true;
+        } else {
+            LOGW("%s: Invalid line: %s", m_index_path.c_str(), line.c_str());
+            return false;
+        }
+
+        keys[line.substr(sep2 + 1)] = key;
+    }
+
+    if (!valid_magic || !valid_config) {
+        LOGD("%s: Cache is for a different configuration",
+             m_index_path.c_str());
+        return false;
+    }
+
+    m_old_keys.swap(keys);
+    return true;
+}
+
+bool PatchCache::save_index(const std::string &path) const
+{
+    std::string contents;
+
+    contents += INDEX_MAGIC "\n";
+    contents += "config ";
+    contents += m_config;
+    contents += "\n";
+
+    for (auto const &item : m_new_keys) {
+        if (item.second.exists) {
+            contents += format("%08" PRIx32 " %" PRIu64 " ",
+                               item.second.crc32,
+                               item.second.compressed_size);
+        } else {
+            contents += "- - ";
+        }
+        contents += item.first;
+        contents += "\n";
+    }
+
+    return FileUtils::write_from_string(path, contents) == ErrorCode::NoError;
+}
+
+}
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "mbpatcher/edify/parser.h"
+#include "mbpatcher/edify/tokenizer.h"
+
+using namespace mb::patcher;
+
+class EdifyTreeTest : public ::testing::Test
+{
+protected:
+    void TearDown() override
+    {
+        for (EdifyToken *t : _tokens) {
+            delete t;
+        }
+    }
+
+    void parse(const std::string &script, bool expected = true)
+    {
+        ASSERT_TRUE(EdifyTokenizer::tokenize(script.data(), script.size(),
+                                             &_tokens));
+        ASSERT_EQ(_tree.parse(_tokens), expected);
+    }
+
+    std::string name_token(const EdifyFunctionCall *call)
+    {
+        return _tokens[call->name_pos]->generate();
+    }
+
+    std::vector<EdifyToken *> _tokens;
+    EdifyTree _tree;
+};
+
+TEST_F(EdifyTreeTest, FindCallsInSourceOrder)
+{
+    parse("mount(\"ext4\", \"EMMC\", \"/dev/block/system\", \"/system\");\n"
+          "ui_print(\"Installing\");\n"
+          "run_program(\"/sbin/busybox\", \"mount\", \"/system\");\n"
+          "mount(\"ext4\", \"EMMC\", \"/dev/block/data\", \"/data\");\n");
+
+    auto const &mounts = _tree.find_calls("mount");
+    ASSERT_EQ(mounts.size(), 2u);
+    EXPECT_LT(mounts[0]->name_pos, mounts[1]->name_pos);
+    EXPECT_EQ(mounts[0]->name, "mount");
+    EXPECT_EQ(name_token(mounts[0]), "mount");
+
+    auto const &run_program = _tree.find_calls("run_program");
+    ASSERT_EQ(run_program.size(), 1u);
+    EXPECT_GT(run_program[0]->name_pos, mounts[0]->right_paren_pos);
+    EXPECT_LT(run_program[0]->right_paren_pos, mounts[1]->name_pos);
+
+    EXPECT_EQ(_tree.calls().size(), 4u);
+    EXPECT_TRUE(_tree.find_calls("format").empty());
+    EXPECT_TRUE(_tree.find_calls("ext4").empty());
+}
+
+TEST_F(EdifyTreeTest, NestedCallsAreIndexed)
+{
+    parse("ui_print(is_mounted(\"/system\"), unmount(\"/system\"));\n"
+          "assert(getprop(\"ro.product.device\") == \"hammerhead\" || "
+          "(getprop(\"ro.build.product\") == \"hammerhead\"));\n");
+
+    ASSERT_EQ(_tree.calls().size(), 2u);
+
+    auto *ui_print = _tree.calls()[0];
+    EXPECT_EQ(ui_print->name, "ui_print");
+    EXPECT_EQ(ui_print->parent, nullptr);
+    ASSERT_EQ(ui_print->children.size(), 2u);
+    EXPECT_EQ(ui_print->children[0]->name, "is_mounted");
+    EXPECT_EQ(ui_print->children[1]->name, "unmount");
+    EXPECT_EQ(ui_print->children[0]->parent, ui_print);
+
+    // Grouping parentheses do not break the parent chain
+    auto const &getprops = _tree.find_calls("getprop");
+    ASSERT_EQ(getprops.size(), 2u);
+    auto *assert_call = _tree.calls()[1];
+    EXPECT_EQ(getprops[0]->parent, assert_call);
+    EXPECT_EQ(getprops[1]->parent, assert_call);
+    EXPECT_EQ(assert_call->children.size(), 2u);
+    EXPECT_LT(getprops[1]->right_paren_pos, assert_call->right_paren_pos);
+}
+
+TEST_F(EdifyTreeTest, NameSeparatedFromParenthesis)
+{
+    parse("mount # comment\n  (\"/system\");\n"
+          "\"quoted\"(\"x\");\n");
+
+    auto const &mounts = _tree.find_calls("mount");
+    ASSERT_EQ(mounts.size(), 1u);
+    EXPECT_EQ(_tokens[mounts[0]->left_paren_pos]->type(),
+              EdifyTokenType::LeftParen);
+
+    // Function names are matched after unescaping
+    EXPECT_EQ(_tree.find_calls("quoted").size(), 1u);
+}
+
+TEST_F(EdifyTreeTest, StringsAreNotCalls)
+{
+    parse("ui_print(\"mount\", mount);\n");
+
+    EXPECT_EQ(_tree.find_calls("ui_print").size(), 1u);
+    EXPECT_TRUE(_tree.find_calls("mount").empty());
+}
+
+TEST_F(EdifyTreeTest, UnterminatedCall)
+{
+    parse("ui_print(\"a\");\n"
+          "mount(\"ext4\", getprop(\"x\");\n"
+          "unmount(\"/system\");\n", false);
+
+    // Calls up to the unterminated one are kept
+    EXPECT_EQ(_tree.find_calls("ui_print").size(), 1u);
+    EXPECT_TRUE(_tree.find_calls("mount").empty());
+    EXPECT_TRUE(_tree.find_calls("getprop").empty());
+    EXPECT_TRUE(_tree.find_calls("unmount").empty());
+    EXPECT_EQ(_tree.calls().size(), 1u);
+}
+
+TEST_F(EdifyTreeTest, ReparseResetsIndex)
+{
+    parse("mount(\"/system\");\n");
+    ASSERT_EQ(_tree.find_calls("mount").size(), 1u);
+
+    std::vector<EdifyToken *> tokens;
+    std::string script = "unmount(\"/system\");\n";
+    ASSERT_TRUE(EdifyTokenizer::tokenize(script.data(), script.size(),
+                                         &tokens));
+    ASSERT_TRUE(_tree.parse(tokens));
+
+    EXPECT_TRUE(_tree.find_calls("mount").empty());
+    EXPECT_EQ(_tree.find_calls("unmount").size(), 1u);
+
+    for (EdifyToken *t : tokens) {
+        delete t;
+    }
+}
+
+TEST_F(EdifyTreeTest, UntokenizeWithoutReplacements)
+{
+    std::string script = "# Comment\n"
+                         "ui_print(is_mounted(\"/system\"), unmount(\"/system\"));\n"
+                         "package_extract_dir(\"system\", \"/system\");\n";
+    parse(script);
+
+    EXPECT_EQ(_tree.untokenize({}), script);
+}
+
+TEST_F(EdifyTreeTest, UntokenizeWithReplacements)
+{
+    parse("ui_print(is_mounted(\"/system\"), unmount(\"/system\"));\n"
+          "mount(\"ext4\", \"EMMC\", \"/dev/block/system\", \"/system\");\n"
+          "unmount(\"/data\");\n");
+
+    auto *ui_print = _tree.find_calls("ui_print")[0];
+    auto *nested_unmount = _tree.find_calls("unmount")[0];
+    auto *mount = _tree.find_calls("mount")[0];
+    auto *unmount = _tree.find_calls("unmount")[1];
+
+    // Replacements are applied in source order regardless of the order they
+    // were given in and ones nested within another replacement are ignored
+    std::string output = _tree.untokenize({
+        { unmount, "run_program(\"/update-binary-tool\", \"unmount\", \"/data\")" },
+        { nested_unmount, "nested" },
+        { ui_print, "true" },
+        { mount, "run_program(\"/update-binary-tool\", \"mount\", \"/system\")" },
+    });
+
+    EXPECT_EQ(output,
+              "true;\n"
+              "run_program(\"/update-binary-tool\", \"mount\", \"/system\");\n"
+              "run_program(\"/update-binary-tool\", \"unmount\", \"/data\");\n");
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mbpatcher/private/miniziputils.h"
+
+using namespace mb::patcher;
+
+#ifdef __linux__
+
+class CopyFdRangeTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        if (!tmpdir) {
+            tmpdir = "/data/local/tmp";
+        }
+
+        _in_path = tmpdir;
+        _in_path += "/mbpatcher_copy_in.XXXXXX";
+        _out_path = tmpdir;
+        _out_path += "/mbpatcher_copy_out.XXXXXX";
+
+        _in_fd = mkstemp(&_in_path[0]);
+        ASSERT_GE(_in_fd, 0);
+        _out_fd = mkstemp(&_out_path[0]);
+        ASSERT_GE(_out_fd, 0);
+
+        // Larger than a single pread()/write() fallback chunk
+        _data.resize(1024 * 1024 + 123);
+        for (size_t i = 0; i < _data.size(); ++i) {
+            _data[i] = static_cast<unsigned char>(i * 7 + i / 251);
+        }
+
+        ASSERT_EQ(write(_in_fd, _data.data(), _data.size()),
+                  static_cast<ssize_t>(_data.size()));
+    }
+
+    void TearDown() override
+    {
+        if (_in_fd >= 0) {
+            close(_in_fd);
+            unlink(_in_path.c_str());
+        }
+        if (_out_fd >= 0) {
+            close(_out_fd);
+            unlink(_out_path.c_str());
+        }
+    }
+
+    // Copy until \p size bytes were copied or EOF is reached
+    ssize_t copy_all(off64_t *offset, int out_fd, size_t size)
+    {
+        size_t total = 0;
+
+        while (total < size) {
+            ssize_t n = MinizipUtils::copy_fd_range(
+                    _in_fd, offset, out_fd, size - total);
+            if (n < 0) {
+                return -1;
+            } else if (n == 0) {
+                break;
+            }
+            total += static_cast<size_t>(n);
+        }
+
+        return static_cast<ssize_t>(total);
+    }
+
+    std::vector<unsigned char> read_output()
+    {
+        std::vector<unsigned char> buf(_data.size() + 1);
+        ssize_t n = pread(_out_fd, buf.data(), buf.size(), 0);
+        buf.resize(n < 0 ? 0 : static_cast<size_t>(n));
+        return buf;
+    }
+
+    std::string _in_path;
+    std::string _out_path;
+    int _in_fd = -1;
+    int _out_fd = -1;
+    std::vector<unsigned char> _data;
+};
+
+TEST_F(CopyFdRangeTest, CopyToFile)
+{
+    off64_t offset = 0;
+
+    ASSERT_EQ(copy_all(&offset, _out_fd, _data.size()),
+              static_cast<ssize_t>(_data.size()));
+    ASSERT_EQ(offset, static_cast<off64_t>(_data.size()));
+    ASSERT_EQ(read_output(), _data);
+
+    // The input file position is not used
+    ASSERT_EQ(lseek(_in_fd, 0, SEEK_CUR),
+              static_cast<off64_t>(_data.size()));
+}
+
+TEST_F(CopyFdRangeTest, CopyRangeFromOffset)
+{
+    off64_t offset = 4096 + 17;
+    size_t size = 200000;
+
+    ASSERT_EQ(copy_all(&offset, _out_fd, size), static_cast<ssize_t>(size));
+    ASSERT_EQ(offset, static_cast<off64_t>(4096 + 17 + size));
+
+    std::vector<unsigned char> expected(_data.begin() + 4096 + 17,
+                                        _data.begin() + 4096 + 17 + size);
+    ASSERT_EQ(read_output(), expected);
+}
+
+TEST_F(CopyFdRangeTest, ReturnsZeroAtEof)
+{
+    off64_t offset = static_cast<off64_t>(_data.size());
+
+    ASSERT_EQ(MinizipUtils::copy_fd_range(_in_fd, &offset, _out_fd, 4096), 0);
+    ASSERT_EQ(offset, static_cast<off64_t>(_data.size()));
+}
+
+TEST_F(CopyFdRangeTest, FallsBackWhenUnsupported)
+{
+    // copy_file_range() only supports regular files, so copying to a pipe
+    // must fall back to sendfile()
+    int pipe_fds[2];
+    ASSERT_EQ(pipe2(pipe_fds, O_CLOEXEC), 0);
+
+    // Small enough to fit in the pipe buffer
+    size_t pipe_size = 16384;
+    off64_t offset = 0;
+
+    ASSERT_EQ(copy_all(&offset, pipe_fds[1], pipe_size),
+              static_cast<ssize_t>(pipe_size));
+    ASSERT_EQ(offset, static_cast<off64_t>(pipe_size));
+
+    std::vector<unsigned char> buf(pipe_size);
+    ASSERT_EQ(read(pipe_fds[0], buf.data(), buf.size()),
+              static_cast<ssize_t>(pipe_size));
+    ASSERT_EQ(buf, std::vector<unsigned char>(
+            _data.begin(), _data.begin() + static_cast<off64_t>(pipe_size)));
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    // sendfile() does not support O_APPEND output files, so this must fall
+    // back to pread() and write()
+    int append_fd = open(_out_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    ASSERT_GE(append_fd, 0);
+
+    offset = 0;
+    ssize_t n = copy_all(&offset, append_fd, _data.size());
+    close(append_fd);
+
+    ASSERT_EQ(n, static_cast<ssize_t>(_data.size()));
+    ASSERT_EQ(offset, static_cast<off64_t>(_data.size()));
+    ASSERT_EQ(read_output(), _data);
+
+    // Later copies keep using the fallback and still copy everything
+    ASSERT_EQ(ftruncate(_out_fd, 0), 0);
+    ASSERT_EQ(lseek(_out_fd, 0, SEEK_SET), 0);
+
+    offset = 0;
+    ASSERT_EQ(copy_all(&offset, _out_fd, _data.size()),
+              static_cast<ssize_t>(_data.size()));
+    ASSERT_EQ(read_output(), _data);
+}
+
+#endif
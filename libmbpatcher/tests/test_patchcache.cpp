@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "mbpio/delete.h"
+
+#include "mbpatcher/private/fileutils.h"
+#include "mbpatcher/private/miniziputils.h"
+#include "mbpatcher/private/patchcache.h"
+
+using namespace mb;
+using namespace mb::patcher;
+
+static const char INPUT_NAME[] = "system/build.prop";
+static const char PATCHED_CONTENTS[] = "ro.patched=1\n";
+
+static const PatchCacheKey INPUT_KEY = { true, 0x12345678, 1024 };
+
+class PatchCacheTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        _temp_dir = FileUtils::create_temporary_dir(
+                FileUtils::system_temporary_dir());
+        ASSERT_FALSE(_temp_dir.empty());
+
+        _cache_dir = _temp_dir + "/cache";
+        _patched_path = _temp_dir + "/build.prop";
+        _output_path = _temp_dir + "/output.zip";
+
+        ASSERT_EQ(FileUtils::write_from_string(_patched_path,
+                                               PATCHED_CONTENTS),
+                  ErrorCode::NoError);
+    }
+
+    void TearDown() override
+    {
+        if (!_temp_dir.empty()) {
+            io::delete_recursively(_temp_dir);
+        }
+    }
+
+    // Simulate a run that patched INPUT_NAME
+    void populate(const std::string &config, const PatchCacheKey &key)
+    {
+        PatchCache cache(_cache_dir, "test", config);
+        ASSERT_TRUE(cache.open());
+        cache.set_key(INPUT_NAME, key);
+        if (key.exists) {
+            cache.add_file(INPUT_NAME, _patched_path);
+        }
+        cache.close(true);
+    }
+
+    // Copy cached output of INPUT_NAME to a new zip and read it back
+    bool copy_cached(PatchCache &cache, std::string *contents)
+    {
+        ZipCtx *zctx = MinizipUtils::open_output_file(_output_path);
+        if (!zctx) {
+            return false;
+        }
+
+        bool ret = cache.copy_cached_file(
+                MinizipUtils::ctx_get_zip_file(zctx), INPUT_NAME, "out.prop");
+
+        if (MinizipUtils::close_output_file(zctx) != ZIP_OK || !ret) {
+            return false;
+        }
+
+        UnzCtx *uctx = MinizipUtils::open_input_file(_output_path);
+        if (!uctx) {
+            return false;
+        }
+
+        unzFile uf = MinizipUtils::ctx_get_unz_file(uctx);
+        std::vector<unsigned char> data;
+
+        if (unzLocateFile(uf, "out.prop", nullptr) == UNZ_OK) {
+            ret = MinizipUtils::read_to_memory(uf, &data, nullptr, nullptr);
+            contents->assign(data.begin(), data.end());
+        } else {
+            // Nothing was added
+            contents->clear();
+        }
+
+        MinizipUtils::close_input_file(uctx);
+        return ret;
+    }
+
+    std::string _temp_dir;
+    std::string _cache_dir;
+    std::string _patched_path;
+    std::string _output_path;
+};
+
+TEST_F(PatchCacheTest, ReusedWhenUnchanged)
+{
+    populate("config", INPUT_KEY);
+
+    for (int run = 0; run < 2; ++run) {
+        PatchCache cache(_cache_dir, "test", "config");
+        ASSERT_TRUE(cache.open());
+        cache.set_key(INPUT_NAME, INPUT_KEY);
+        ASSERT_TRUE(cache.has_key(INPUT_NAME));
+        ASSERT_TRUE(cache.can_reuse(INPUT_NAME));
+
+        std::string contents;
+        ASSERT_TRUE(copy_cached(cache, &contents));
+        ASSERT_EQ(contents, PATCHED_CONTENTS);
+
+        // Reused files are carried over to the new cache
+        cache.close(true);
+    }
+}
+
+TEST_F(PatchCacheTest, InvalidatedByChangedInput)
+{
+    populate("config", INPUT_KEY);
+
+    PatchCacheKey changed_crc = INPUT_KEY;
+    changed_crc.crc32 ^= 1;
+    PatchCacheKey changed_size = INPUT_KEY;
+    changed_size.compressed_size += 1;
+    PatchCacheKey removed = { false, 0, 0 };
+
+    for (auto const &key : { changed_crc, changed_size, removed }) {
+        PatchCache cache(_cache_dir, "test", "config");
+        ASSERT_TRUE(cache.open());
+        cache.set_key(INPUT_NAME, key);
+        ASSERT_FALSE(cache.can_reuse(INPUT_NAME));
+        cache.close(false);
+    }
+}
+
+TEST_F(PatchCacheTest, InvalidatedByChangedConfig)
+{
+    populate("config", INPUT_KEY);
+
+    PatchCache cache(_cache_dir, "test", "other config");
+    ASSERT_TRUE(cache.open());
+    cache.set_key(INPUT_NAME, INPUT_KEY);
+    ASSERT_FALSE(cache.can_reuse(INPUT_NAME));
+}
+
+TEST_F(PatchCacheTest, NotReusedWithoutKey)
+{
+    populate("config", INPUT_KEY);
+
+    PatchCache cache(_cache_dir, "test", "config");
+    ASSERT_TRUE(cache.open());
+    ASSERT_FALSE(cache.has_key(INPUT_NAME));
+    ASSERT_FALSE(cache.can_reuse(INPUT_NAME));
+}
+
+TEST_F(PatchCacheTest, NotReusedWithoutCommit)
+{
+    {
+        PatchCache cache(_cache_dir, "test", "config");
+        ASSERT_TRUE(cache.open());
+        cache.set_key(INPUT_NAME, INPUT_KEY);
+        cache.add_file(INPUT_NAME, _patched_path);
+        cache.close(false);
+    }
+
+    PatchCache cache(_cache_dir, "test", "config");
+    ASSERT_TRUE(cache.open());
+    cache.set_key(INPUT_NAME, INPUT_KEY);
+    ASSERT_FALSE(cache.can_reuse(INPUT_NAME));
+}
+
+TEST_F(PatchCacheTest, CommittedRunReplacesPreviousCache)
+{
+    populate("config", INPUT_KEY);
+
+    PatchCacheKey new_key = INPUT_KEY;
+    new_key.crc32 ^= 1;
+    populate("config", new_key);
+
+    PatchCache cache(_cache_dir, "test", "config");
+    ASSERT_TRUE(cache.open());
+    cache.set_key(INPUT_NAME, INPUT_KEY);
+    ASSERT_FALSE(cache.can_reuse(INPUT_NAME));
+    cache.set_key(INPUT_NAME, new_key);
+    ASSERT_TRUE(cache.can_reuse(INPUT_NAME));
+}
+
+TEST_F(PatchCacheTest, MissingInputFile)
+{
+    PatchCacheKey missing = { false, 0, 0 };
+    populate("config", missing);
+
+    PatchCache cache(_cache_dir, "test", "config");
+    ASSERT_TRUE(cache.open());
+    cache.set_key(INPUT_NAME, missing);
+    ASSERT_TRUE(cache.can_reuse(INPUT_NAME));
+
+    // Nothing is generated for missing input files
+    std::string contents;
+    ASSERT_TRUE(copy_cached(cache, &contents));
+    ASSERT_TRUE(contents.empty());
+}
+
+TEST_F(PatchCacheTest, InvalidIndexIgnored)
+{
+    populate("config", INPUT_KEY);
+
+    ASSERT_EQ(FileUtils::write_from_string(_cache_dir + "/test.index",
+                                           "garbage\n"),
+              ErrorCode::NoError);
+
+    PatchCache cache(_cache_dir, "test", "config");
+    ASSERT_TRUE(cache.open());
+    cache.set_key(INPUT_NAME, INPUT_KEY);
+    ASSERT_FALSE(cache.can_reuse(INPUT_NAME));
+}
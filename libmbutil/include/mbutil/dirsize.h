@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+namespace mb
+{
+namespace util
+{
+
+struct DirectorySize
+{
+    //! Sum of the sizes of all regular files
+    uint64_t apparent_size;
+    //! Disk space allocated for all regular files
+    uint64_t allocated_size;
+    //! Number of regular files counted
+    uint64_t files;
+};
+
+typedef void (*DirectorySizeProgressCb)(const DirectorySize &partial,
+                                        void *userdata);
+
+bool get_directory_size(const std::string &path,
+                        const std::vector<std::string> &exclusions,
+                        unsigned int threads,
+                        DirectorySize &result,
+                        DirectorySizeProgressCb cb, void *userdata);
+
+}
+}
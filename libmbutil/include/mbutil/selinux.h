@@ -48,6 +48,8 @@ enum class SELinuxAttr
 
 bool selinux_read_policy(const std::string &path, policydb_t *pdb);
 bool selinux_write_policy(const std::string &path, policydb_t *pdb);
+bool selinux_write_policy_data(const std::string &path,
+                               const void *data, size_t size);
 bool selinux_get_context(const std::string &path, std::string &context);
 bool selinux_lget_context(const std::string &path, std::string &context);
 bool selinux_fget_context(int fd, std::string &context);
@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/dirsize.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
+#include <cerrno>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+
+#define LOG_TAG "mbutil/dirsize"
+
+// Number of hard link set shards. Only files with st_nlink > 1 are added, so
+// contention is low.
+#define LINK_SHARDS             16
+
+// Number of files counted by a thread before its totals are published
+#define FLUSH_INTERVAL          1024
+
+// Minimum time between two progress callbacks
+#define PROGRESS_INTERVAL_MS    100
+
+#define MAX_THREADS             8
+
+namespace mb
+{
+namespace util
+{
+
+namespace
+{
+
+struct LinuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+class DirHandle
+{
+public:
+    explicit DirHandle(int fd) : m_fd(fd)
+    {
+    }
+
+    ~DirHandle()
+    {
+        close(m_fd);
+    }
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+private:
+    int m_fd;
+};
+
+struct Task
+{
+    // Parent directory. Null for the root directory.
+    std::shared_ptr<DirHandle> parent;
+    // Name relative to the parent or path to the root directory
+    std::string name;
+    // Depth of the directory. The root is at level 0.
+    int level;
+};
+
+struct InodeKey
+{
+    dev_t dev;
+    ino_t ino;
+
+    bool operator==(const InodeKey &other) const
+    {
+        return dev == other.dev && ino == other.ino;
+    }
+};
+
+struct InodeKeyHash
+{
+    size_t operator()(const InodeKey &key) const
+    {
+        return std::hash<uint64_t>()(static_cast<uint64_t>(key.ino))
+                ^ (std::hash<uint64_t>()(static_cast<uint64_t>(key.dev)) << 1);
+    }
+};
+
+/*!
+ * \brief Multithreaded directory size calculator
+ *
+ * Each thread has its own task queue. Threads take directories from the back of
+ * their own queue (depth first, which bounds the number of open directory fds)
+ * and steal from the front of other threads' queues when theirs is empty.
+ */
+class DirectorySizeWalker
+{
+public:
+    DirectorySizeWalker(const std::vector<std::string> &exclusions,
+                        unsigned int threads,
+                        DirectorySizeProgressCb cb, void *userdata)
+        : m_exclusions(exclusions)
+        , m_queues(threads)
+        , m_pending(0)
+        , m_queued(0)
+        , m_sleepers(0)
+        , m_dev(0)
+        , m_apparent_size(0)
+        , m_allocated_size(0)
+        , m_files(0)
+        , m_error(0)
+        , m_cb(cb)
+        , m_userdata(userdata)
+    {
+    }
+
+    bool run(const std::string &path, DirectorySize &result)
+    {
+        struct stat sb;
+
+        result = {};
+
+        if (lstat(path.c_str(), &sb) < 0) {
+            LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (S_ISREG(sb.st_mode)) {
+            result.apparent_size = static_cast<uint64_t>(sb.st_size);
+            result.allocated_size = static_cast<uint64_t>(sb.st_blocks) * 512;
+            result.files = 1;
+            return true;
+        } else if (!S_ISDIR(sb.st_mode)) {
+            return true;
+        }
+
+        m_dev = sb.st_dev;
+
+        push_task(0, { nullptr, path, 0 });
+
+        std::vector<pthread_t> threads;
+        std::vector<std::pair<DirectorySizeWalker *, size_t>> args;
+        args.reserve(m_queues.size());
+
+        for (size_t i = 1; i < m_queues.size(); ++i) {
+            args.emplace_back(this, i);
+
+            pthread_t thread;
+            int ret = pthread_create(&thread, nullptr, &thread_main,
+                                     &args.back());
+            if (ret != 0) {
+                LOGW("Failed to create thread: %s", strerror(ret));
+                // Other threads will steal this thread's tasks
+                break;
+            }
+            threads.push_back(thread);
+        }
+
+        worker(0);
+
+        for (pthread_t thread : threads) {
+            pthread_join(thread, nullptr);
+        }
+
+        result.apparent_size = m_apparent_size;
+        result.allocated_size = m_allocated_size;
+        result.files = m_files;
+
+        if (m_error != 0) {
+            errno = m_error;
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    struct LinkShard
+    {
+        std::mutex lock;
+        std::unordered_set<InodeKey, InodeKeyHash> inodes;
+    };
+
+    const std::vector<std::string> &m_exclusions;
+
+    std::vector<Queue> m_queues;
+
+    // Number of tasks that are queued or being processed
+    std::atomic<size_t> m_pending;
+    // Number of tasks that are queued
+    std::atomic<size_t> m_queued;
+    // Number of threads waiting for tasks
+    std::atomic<unsigned int> m_sleepers;
+    std::mutex m_wake_lock;
+    std::condition_variable m_wake_cv;
+
+    // Device of the root directory. Other file systems are not traversed.
+    dev_t m_dev;
+
+    LinkShard m_links[LINK_SHARDS];
+
+    std::atomic<uint64_t> m_apparent_size;
+    std::atomic<uint64_t> m_allocated_size;
+    std::atomic<uint64_t> m_files;
+
+    // First error that occurred
+    std::atomic<int> m_error;
+
+    DirectorySizeProgressCb m_cb;
+    void *m_userdata;
+    std::mutex m_progress_lock;
+    std::chrono::steady_clock::time_point m_last_progress;
+
+    static void * thread_main(void *arg)
+    {
+        auto *p = static_cast<std::pair<DirectorySizeWalker *, size_t> *>(arg);
+        p->first->worker(p->second);
+        return nullptr;
+    }
+
+    void set_error(int error)
+    {
+        int expected = 0;
+        m_error.compare_exchange_strong(expected, error);
+    }
+
+    void push_task(size_t index, Task task)
+    {
+        ++m_pending;
+
+        {
+            std::lock_guard<std::mutex> lock(m_queues[index].lock);
+            m_queues[index].tasks.push_back(std::move(task));
+        }
+
+        ++m_queued;
+
+        if (m_sleepers > 0) {
+            std::lock_guard<std::mutex> lock(m_wake_lock);
+            m_wake_cv.notify_one();
+        }
+    }
+
+    bool pop_task(size_t index, Task &task)
+    {
+        {
+            Queue &queue = m_queues[index];
+            std::lock_guard<std::mutex> lock(queue.lock);
+            if (!queue.tasks.empty()) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+                --m_queued;
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < m_queues.size(); ++i) {
+            Queue &queue = m_queues[(index + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.lock);
+            if (!queue.tasks.empty()) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                --m_queued;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void worker(size_t index)
+    {
+        DirectorySize local{};
+        std::vector<char> buf(32768);
+
+        while (true) {
+            {
+                Task task;
+                if (pop_task(index, task)) {
+                    process_directory(index, task, local, buf);
+                    task = {};
+
+                    if (--m_pending == 0) {
+                        std::lock_guard<std::mutex> lock(m_wake_lock);
+                        m_wake_cv.notify_all();
+                    }
+                    continue;
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(m_wake_lock);
+            ++m_sleepers;
+            m_wake_cv.wait(lock, [&]{
+                return m_queued > 0 || m_pending == 0;
+            });
+            --m_sleepers;
+
+            if (m_pending == 0) {
+                break;
+            }
+        }
+
+        flush(local);
+    }
+
+    void process_directory(size_t index, const Task &task,
+                           DirectorySize &local, std::vector<char> &buf)
+    {
+        static const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+
+        int fd = task.parent
+                ? openat(task.parent->fd(), task.name.c_str(), flags)
+                : open(task.name.c_str(), flags);
+        if (fd < 0) {
+            LOGW("%s: Failed to open directory: %s",
+                 task.name.c_str(), strerror(errno));
+            set_error(errno);
+            return;
+        }
+
+        struct stat dir_sb;
+
+        if (fstat(fd, &dir_sb) < 0) {
+            LOGW("%s: Failed to stat: %s", task.name.c_str(), strerror(errno));
+            set_error(errno);
+            close(fd);
+            return;
+        } else if (dir_sb.st_dev != m_dev) {
+            // Don't cross mount point boundaries
+            close(fd);
+            return;
+        }
+
+        auto dir = std::make_shared<DirHandle>(fd);
+
+        while (true) {
+            long n = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+            if (n < 0) {
+                LOGW("%s: Failed to read directory: %s",
+                     task.name.c_str(), strerror(errno));
+                set_error(errno);
+                break;
+            } else if (n == 0) {
+                break;
+            }
+
+            for (long pos = 0; pos < n;) {
+                auto *d = reinterpret_cast<LinuxDirent64 *>(buf.data() + pos);
+                pos += d->d_reclen;
+
+                if (strcmp(d->d_name, ".") == 0
+                        || strcmp(d->d_name, "..") == 0) {
+                    continue;
+                }
+
+                // Exclude first-level entries
+                if (task.level == 0 && std::find(
+                        m_exclusions.begin(), m_exclusions.end(), d->d_name)
+                        != m_exclusions.end()) {
+                    continue;
+                }
+
+                unsigned char type = d->d_type;
+
+                if (type == DT_DIR) {
+                    push_task(index, { dir, d->d_name, task.level + 1 });
+                } else if (type == DT_REG || type == DT_UNKNOWN) {
+                    struct stat sb;
+
+                    if (fstatat(fd, d->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+                        LOGW("%s: Failed to stat: %s",
+                             d->d_name, strerror(errno));
+                        set_error(errno);
+                    } else if (S_ISREG(sb.st_mode)) {
+                        add_file(sb, local);
+                    } else if (S_ISDIR(sb.st_mode)) {
+                        push_task(index, { dir, d->d_name, task.level + 1 });
+                    }
+                }
+            }
+        }
+    }
+
+    void add_file(const struct stat &sb, DirectorySize &local)
+    {
+        // Only count hard linked files once
+        if (sb.st_nlink > 1) {
+            InodeKey key{sb.st_dev, sb.st_ino};
+            LinkShard &shard = m_links[InodeKeyHash()(key) % LINK_SHARDS];
+
+            std::lock_guard<std::mutex> lock(shard.lock);
+            if (!shard.inodes.insert(key).second) {
+                return;
+            }
+        }
+
+        local.apparent_size += static_cast<uint64_t>(sb.st_size);
+        local.allocated_size += static_cast<uint64_t>(sb.st_blocks) * 512;
+        ++local.files;
+
+        if (local.files % FLUSH_INTERVAL == 0) {
+            flush(local);
+        }
+    }
+
+    void flush(DirectorySize &local)
+    {
+        m_apparent_size += local.apparent_size;
+        m_allocated_size += local.allocated_size;
+        m_files += local.files;
+        local = {};
+
+        if (!m_cb) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(m_progress_lock, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - m_last_progress
+                < std::chrono::milliseconds(PROGRESS_INTERVAL_MS)) {
+            return;
+        }
+        m_last_progress = now;
+
+        DirectorySize partial;
+        partial.apparent_size = m_apparent_size;
+        partial.allocated_size = m_allocated_size;
+        partial.files = m_files;
+
+        m_cb(partial, m_userdata);
+    }
+};
+
+}
+
+/*!
+ * \brief Calculate the total size of the regular files in a directory tree
+ *
+ * Symlinks are not followed and, like special files, are not counted. Hard
+ * linked files are only counted once. Directories on other file systems are
+ * not traversed.
+ *
+ * \param path Directory (or file) to calculate the size of
+ * \param exclusions Names of first-level entries to skip
+ * \param threads Number of threads to use. If 0, one thread per CPU is used.
+ * \param[out] result Calculated size. If the function fails, this contains the
+ *                    total of all files that could be read.
+ * \param cb Optional callback for reporting partial totals. It may be called
+ *           from any of the threads, but never concurrently.
+ * \param userdata User data pointer to pass to \p cb
+ *
+ * \return Whether every file could be read. If false, errno is set to the first
+ *         error that occurred.
+ */
+bool get_directory_size(const std::string &path,
+                        const std::vector<std::string> &exclusions,
+                        unsigned int threads,
+                        DirectorySize &result,
+                        DirectorySizeProgressCb cb, void *userdata)
+{
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? static_cast<unsigned int>(cpus) : 1;
+    }
+    threads = std::min<unsigned int>(threads, MAX_THREADS);
+
+    DirectorySizeWalker walker(exclusions, threads, cb, userdata);
+    return walker.run(path, result);
+}
+
+}
+}
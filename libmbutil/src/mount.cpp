@@ -20,6 +20,7 @@
 #include "mbutil/mount.h"
 
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include <cerrno>
@@ -55,6 +56,10 @@ namespace util
 
 using ScopedFILE = std::unique_ptr<FILE, decltype(fclose) *>;
 
+// Finding an unused loop device and attaching a file to it is not atomic, so
+// concurrent mounts must not interleave the two steps
+static std::mutex g_loopdev_lock;
+
 static std::string unescape_octals(const std::string &in)
 {
     std::string result;
@@ -234,6 +239,8 @@ bool mount(const std::string &source, const std::string &target,
     }
 
     if (need_loopdev) {
+        std::unique_lock<std::mutex> lock(g_loopdev_lock);
+
         std::string loopdev = loopdev_find_unused();
         if (loopdev.empty()) {
             LOGE("Failed to find unused loop device: %s", strerror(errno));
@@ -249,6 +256,8 @@ bool mount(const std::string &source, const std::string &target,
             return false;
         }
 
+        lock.unlock();
+
         if (::mount(loopdev.c_str(), target.c_str(), fstype_real.c_str(),
                     mount_flags, data.c_str()) < 0) {
             loopdev_remove_device(loopdev);
@@ -19,12 +19,19 @@
 
 #include "mbutil/properties.h"
 
+#include <algorithm>
 #include <memory>
 #include <mutex>
 #include <vector>
 
+#include <cerrno>
 #include <cstdio>
 #include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "mbcommon/common.h"
 #include "mbcommon/finally.h"
@@ -222,105 +229,258 @@ bool property_list(PropertyListCb prop_fn, void *cookie)
 
         read_property(pi, name, value);
         ctx_->prop_fn(name, value, ctx_->cookie);
-    }, &ctx);
+    }, &ctx) == 0;
 }
 
 bool property_get_all(std::unordered_map<std::string, std::string> &map)
 {
+    // The property area is already a shared mapping with its own index, so
+    // values are copied straight into the map without temporaries
     return libc_system_property_foreach(
             [](const prop_info *pi, void *cookie) {
-        auto *map_ = static_cast<std::unordered_map<std::string, std::string> *>(cookie);
-        std::string name;
-        std::string value;
-
-        read_property(pi, name, value);
-        (*map_)[name] = value;
-    }, &map);
+        libc_system_property_read_callback(
+                pi, [](void *cookie_, const char *name, const char *value,
+                       uint32_t serial) {
+            (void) serial;
+            auto *map_ = static_cast<std::unordered_map<std::string, std::string> *>(cookie_);
+            (*map_)[name] = value;
+        }, cookie);
+    }, &map) == 0;
 }
 
 // Properties file functions
 
-enum class PropIterAction
+struct PropertyFileEntry
 {
-    Continue,
-    Stop,
+    const char *key;
+    size_t key_size;
+    const char *value;
+    size_t value_size;
 };
 
-typedef PropIterAction (*PropIterCb)(const std::string &key,
-                                     const std::string &value,
-                                     void *cookie);
+/*
+ * Parsed properties file. The entries point into a single copy of the file
+ * contents. The file is not mmap'd because another process truncating it while
+ * it is cached would cause SIGBUS.
+ */
+struct PropertyFile
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    std::vector<char> data;
+    // Entries in file order
+    std::vector<PropertyFileEntry> entries;
+    // Indexes of entries sorted by key. Duplicate keys remain in file order.
+    std::vector<uint32_t> sorted;
+};
+
+// Maximum number of cached files. Paths of temporary files are never looked up
+// again, so the cache is cleared when it fills up.
+static constexpr size_t MAX_CACHED_PROPERTY_FILES = 32;
+
+static std::unordered_map<std::string, std::shared_ptr<const PropertyFile>>
+        g_prop_files;
+static std::mutex g_prop_files_lock;
 
-static bool iterate_property_file(const std::string &path, PropIterCb cb,
-                                  void *cookie)
+static bool timespec_before(const struct timespec &a, const struct timespec &b)
 {
-    ScopedFILE fp(fopen(path.c_str(), "r"), &fclose);
-    if (!fp) {
-        return false;
+    return a.tv_sec < b.tv_sec
+            || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static bool property_file_matches(const PropertyFile &pf,
+                                  const struct stat &sb)
+{
+    return pf.dev == sb.st_dev
+            && pf.ino == sb.st_ino
+            && pf.size == sb.st_size
+            && pf.mtime.tv_sec == sb.st_mtim.tv_sec
+            && pf.mtime.tv_nsec == sb.st_mtim.tv_nsec;
+}
+
+static int compare_key(const PropertyFileEntry &entry, const char *key,
+                       size_t key_size)
+{
+    int ret = memcmp(entry.key, key, std::min(entry.key_size, key_size));
+    if (ret != 0) {
+        return ret;
+    } else if (entry.key_size < key_size) {
+        return -1;
+    } else if (entry.key_size > key_size) {
+        return 1;
     }
+    return 0;
+}
 
-    char *line = nullptr;
-    size_t len = 0;
-    ssize_t read;
+static bool read_fd_fully(int fd, const struct stat &sb,
+                          std::vector<char> &data)
+{
+    size_t total = 0;
 
-    auto free_line = finally([&] {
-        free(line);
-    });
+    data.resize(S_ISREG(sb.st_mode) ? static_cast<size_t>(sb.st_size) : 0);
 
-    while ((read = getline(&line, &len, fp.get())) >= 0) {
-        if (read == 0 || line[0] == '#') {
-            // Skip empty and comment lines
-            continue;
+    while (true) {
+        if (total == data.size()) {
+            // Grow by at least one byte so EOF can be detected
+            data.resize(data.size() + std::max<size_t>(data.size() / 2, 4096));
         }
 
-        char *equals = strchr(line, '=');
-        if (!equals) {
-            // No equals in line
-            continue;
+        ssize_t n = read(fd, data.data() + total, data.size() - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
         }
 
-        *equals = '\0';
+        total += static_cast<size_t>(n);
+    }
 
-        if (line[read - 1] == '\n') {
-            line[read - 1] = '\0';
-        }
+    data.resize(total);
+    return true;
+}
 
-        if (cb(line, equals + 1, cookie) == PropIterAction::Stop) {
-            return true;
+static void parse_property_file(PropertyFile &pf)
+{
+    const char *ptr = pf.data.data();
+    const char *end = ptr + pf.data.size();
+
+    while (ptr < end) {
+        auto newline = static_cast<const char *>(
+                memchr(ptr, '\n', static_cast<size_t>(end - ptr)));
+        const char *line_end = newline ? newline : end;
+
+        // Skip empty and comment lines
+        if (line_end != ptr && *ptr != '#') {
+            auto equals = static_cast<const char *>(
+                    memchr(ptr, '=', static_cast<size_t>(line_end - ptr)));
+
+            // Skip lines with no equals sign
+            if (equals) {
+                pf.entries.push_back({
+                    ptr, static_cast<size_t>(equals - ptr),
+                    equals + 1, static_cast<size_t>(line_end - equals - 1),
+                });
+            }
         }
+
+        ptr = newline ? newline + 1 : end;
+    }
+
+    pf.sorted.resize(pf.entries.size());
+    for (uint32_t i = 0; i < pf.sorted.size(); ++i) {
+        pf.sorted[i] = i;
     }
 
-    return !ferror(fp.get());
+    std::stable_sort(pf.sorted.begin(), pf.sorted.end(),
+                     [&](uint32_t a, uint32_t b) {
+        const PropertyFileEntry &entry = pf.entries[b];
+        return compare_key(pf.entries[a], entry.key, entry.key_size) < 0;
+    });
 }
 
-bool property_file_get(const std::string &path, const std::string &key,
-                       std::string &value_out)
+/*!
+ * \brief Get parsed properties file
+ *
+ * The file is only read and parsed again if its device, inode, size, or
+ * modification time changed since the last call.
+ *
+ * \return Parsed file or nullptr with errno set if the file cannot be read
+ */
+static std::shared_ptr<const PropertyFile>
+get_property_file(const std::string &path)
 {
-    struct Ctx
-    {
-        const std::string *key;
-        std::string *value_out;
-        bool found;
-    };
+    struct stat sb;
 
-    Ctx ctx{&key, &value_out, false};
+    if (stat(path.c_str(), &sb) == 0) {
+        std::lock_guard<std::mutex> lock(g_prop_files_lock);
 
-    bool ret = iterate_property_file(
-            path, [](const std::string &key_, const std::string &value,
-                     void *cookie) {
-        auto *ctx_ = static_cast<Ctx *>(cookie);
-        if (key_ == *ctx_->key) {
-            *ctx_->value_out = value;
-            ctx_->found = true;
-            return PropIterAction::Stop;
+        auto it = g_prop_files.find(path);
+        if (it != g_prop_files.end()
+                && property_file_matches(*it->second, sb)) {
+            return it->second;
         }
-        return PropIterAction::Continue;
-    }, &ctx);
+    }
+
+    // Same granularity as inode timestamps
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME_COARSE, &start);
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    auto close_fd = finally([&] {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    auto pf = std::make_shared<PropertyFile>();
+
+    if (fstat(fd, &sb) < 0 || !read_fd_fully(fd, sb, pf->data)) {
+        return nullptr;
+    }
+
+    pf->dev = sb.st_dev;
+    pf->ino = sb.st_ino;
+    pf->size = sb.st_size;
+    pf->mtime = sb.st_mtim;
+
+    parse_property_file(*pf);
+
+    std::lock_guard<std::mutex> lock(g_prop_files_lock);
+
+    // Don't cache files that may still be changing within the timestamp
+    // granularity
+    if (S_ISREG(sb.st_mode) && timespec_before(pf->mtime, start)) {
+        if (g_prop_files.size() >= MAX_CACHED_PROPERTY_FILES) {
+            g_prop_files.clear();
+        }
+        g_prop_files[path] = pf;
+    } else {
+        g_prop_files.erase(path);
+    }
+
+    return pf;
+}
+
+static const PropertyFileEntry * find_property(const PropertyFile &pf,
+                                               const std::string &key)
+{
+    // Finds the first occurrence in the file
+    auto it = std::lower_bound(pf.sorted.begin(), pf.sorted.end(), key,
+                               [&](uint32_t i, const std::string &k) {
+        return compare_key(pf.entries[i], k.data(), k.size()) < 0;
+    });
+
+    if (it != pf.sorted.end()
+            && compare_key(pf.entries[*it], key.data(), key.size()) == 0) {
+        return &pf.entries[*it];
+    }
+
+    return nullptr;
+}
+
+bool property_file_get(const std::string &path, const std::string &key,
+                       std::string &value_out)
+{
+    auto pf = get_property_file(path);
+    const PropertyFileEntry *entry = pf ? find_property(*pf, key) : nullptr;
 
-    if (!ctx.found) {
+    if (entry) {
+        value_out.assign(entry->value, entry->value_size);
+    } else {
         value_out.clear();
     }
 
-    return ret;
+    return !!pf;
 }
 
 std::string property_file_get_string(const std::string &path,
@@ -352,36 +512,51 @@ bool property_file_get_bool(const std::string &path, const std::string &key,
 bool property_file_list(const std::string &path, PropertyListCb prop_fn,
                         void *cookie)
 {
-    struct Ctx
-    {
-        PropertyListCb prop_fn;
-        void *cookie;
-    };
+    auto pf = get_property_file(path);
+    if (!pf) {
+        return false;
+    }
+
+    // Reuse the buffers for every entry
+    std::string key;
+    std::string value;
 
-    Ctx ctx{prop_fn, cookie};
+    for (auto const &entry : pf->entries) {
+        key.assign(entry.key, entry.key_size);
+        value.assign(entry.value, entry.value_size);
+        prop_fn(key, value, cookie);
+    }
 
-    return iterate_property_file(
-            path, [](const std::string &key, const std::string &value,
-                     void *cookie_) {
-        auto *ctx_ = static_cast<Ctx *>(cookie_);
-        ctx_->prop_fn(key, value, ctx_->cookie);
-        return PropIterAction::Continue;
-    }, &ctx);
+    return true;
 }
 
 bool property_file_get_all(const std::string &path,
                            std::unordered_map<std::string, std::string> &map)
 {
-    return property_file_list(path,
-            [](const std::string &key, const std::string &value, void *cookie) {
-        auto *map_ = static_cast<std::unordered_map<std::string, std::string> *>(cookie);
-        (*map_)[key] = value;
-    }, &map);
+    auto pf = get_property_file(path);
+    if (!pf) {
+        return false;
+    }
+
+    map.reserve(map.size() + pf->entries.size());
+
+    // Later entries override earlier ones
+    for (auto const &entry : pf->entries) {
+        map[std::string(entry.key, entry.key_size)].assign(
+                entry.value, entry.value_size);
+    }
+
+    return true;
 }
 
 bool property_file_write_all(const std::string &path,
                              const std::unordered_map<std::string, std::string> &map)
 {
+    {
+        std::lock_guard<std::mutex> lock(g_prop_files_lock);
+        g_prop_files.erase(path);
+    }
+
     ScopedFILE fp(fopen(path.c_str(), "wb"), fclose);
     if (!fp) {
         return false;
@@ -154,7 +154,6 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
     void *data;
     size_t len;
     sepol_handle_t *handle;
-    int fd;
 
     // Don't print warnings to stderr
     handle = sepol_handle_create();
@@ -173,6 +172,21 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
         free(data);
     });
 
+    return selinux_write_policy_data(path, data, len);
+}
+
+/*!
+ * \brief Write binary policy to a file
+ *
+ * Like selinux_write_policy(), but for a policy that has already been
+ * serialized. The data is written with a single write(2) call, so \p path
+ * can be `/sys/fs/selinux/load`.
+ */
+bool selinux_write_policy_data(const std::string &path,
+                               const void *data, size_t size)
+{
+    int fd;
+
     for (int i = 0; i < OPEN_ATTEMPTS; ++i) {
         fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
         if (fd < 0) {
@@ -192,7 +206,7 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
         close(fd);
     });
 
-    if (write(fd, data, len) < 0) {
+    if (write(fd, data, size) < 0) {
         LOGE("%s: Failed to write sepolicy: %s", path.c_str(), strerror(errno));
         return false;
     }
@@ -293,7 +293,12 @@ bool socket_receive_fds(int fd, std::vector<int> &fds)
     cmsg->cmsg_level = SOL_SOCKET;
     cmsg->cmsg_type = SCM_RIGHTS;
 
-    if (recvmsg(fd, &msg, 0) < 0) {
+    ssize_t n = recvmsg(fd, &msg, 0);
+    if (n < 0) {
+        return false;
+    } else if (n == 0 || msg.msg_controllen < sizeof(struct cmsghdr)) {
+        // EOF or no file descriptors were sent
+        errno = EPROTO;
         return false;
     }
 
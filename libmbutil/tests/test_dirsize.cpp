@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mbutil/delete.h"
+#include "mbutil/dirsize.h"
+#include "mbutil/fts.h"
+
+using namespace mb::util;
+
+// Same traversal as the FtsWrapper-based implementation that
+// get_directory_size() replaced
+class FtsDirectorySize : public FtsWrapper
+{
+public:
+    FtsDirectorySize(std::string path, std::vector<std::string> exclusions)
+        : FtsWrapper(std::move(path), FtsFlag::GroupSpecialFiles)
+        , _exclusions(std::move(exclusions))
+        , _result()
+    {
+    }
+
+    Actions on_changed_path() override
+    {
+        // Exclude first-level directories
+        if (_curr->fts_level == 1
+                && std::find(_exclusions.begin(), _exclusions.end(),
+                             _curr->fts_name) != _exclusions.end()) {
+            return Action::Skip;
+        }
+
+        return Action::Ok;
+    }
+
+    Actions on_reached_file() override
+    {
+        auto const *sb = _curr->fts_statp;
+
+        // If this file has been visited before (hard link), then skip it
+        if (!_links[sb->st_dev].emplace(sb->st_ino).second) {
+            return Action::Ok;
+        }
+
+        _result.apparent_size += static_cast<uint64_t>(sb->st_size);
+        _result.allocated_size += static_cast<uint64_t>(sb->st_blocks) * 512;
+        ++_result.files;
+
+        return Action::Ok;
+    }
+
+    const DirectorySize & result() const
+    {
+        return _result;
+    }
+
+private:
+    std::vector<std::string> _exclusions;
+    std::unordered_map<dev_t, std::unordered_set<ino_t>> _links;
+    DirectorySize _result;
+};
+
+class DirectorySizeTest : public testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        _path = tmpdir ? tmpdir : "/data/local/tmp";
+        _path += "/mbutil_dirsize_test.XXXXXX";
+
+        ASSERT_TRUE(mkdtemp(&_path[0]));
+    }
+
+    void TearDown() override
+    {
+        delete_recursive(_path);
+    }
+
+    void make_dir(const std::string &name)
+    {
+        ASSERT_EQ(mkdir((_path + "/" + name).c_str(), 0755), 0);
+    }
+
+    void make_file(const std::string &name, size_t size)
+    {
+        int fd = open((_path + "/" + name).c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ASSERT_GE(fd, 0);
+
+        std::string data(size, 'x');
+        ASSERT_EQ(write(fd, data.data(), data.size()),
+                  static_cast<ssize_t>(data.size()));
+        ASSERT_EQ(close(fd), 0);
+    }
+
+    void make_link(const std::string &target, const std::string &name)
+    {
+        ASSERT_EQ(link((_path + "/" + target).c_str(),
+                       (_path + "/" + name).c_str()), 0);
+    }
+
+    void make_symlink(const std::string &target, const std::string &name)
+    {
+        ASSERT_EQ(symlink(target.c_str(), (_path + "/" + name).c_str()), 0);
+    }
+
+    // Tree with every type of file that the walkers need to handle
+    void make_tree()
+    {
+        make_dir("a");
+        make_dir("a/b");
+        make_dir("a/b/c");
+        make_dir("a/empty");
+        make_dir("excluded");
+        make_dir("a/excluded");
+
+        make_file("top", 100);
+        make_file("a/one", 4097);
+        make_file("a/b/two", 12345);
+        make_file("a/b/c/three", 1);
+        make_file("a/b/c/empty", 0);
+        make_file("excluded/file", 1000);
+        make_file("a/excluded/file", 2000);
+
+        for (int i = 0; i < 200; ++i) {
+            make_file("a/b/many" + std::to_string(i), static_cast<size_t>(i));
+        }
+
+        // Hard links are counted once, even across directories
+        make_link("a/one", "a/b/c/one_link");
+        make_link("a/b/two", "two_link");
+
+        make_symlink("a/b/two", "file_symlink");
+        make_symlink("a", "dir_symlink");
+        make_symlink("nonexistent", "dangling_symlink");
+
+        ASSERT_EQ(mkfifo((_path + "/a/fifo").c_str(), 0644), 0);
+    }
+
+    void expect_same_as_fts(const std::vector<std::string> &exclusions)
+    {
+        FtsDirectorySize fts(_path, exclusions);
+        ASSERT_TRUE(fts.run());
+
+        for (unsigned int threads : { 1, 2, 4, 8 }) {
+            SCOPED_TRACE("threads = " + std::to_string(threads));
+
+            DirectorySize result;
+            ASSERT_TRUE(get_directory_size(_path, exclusions, threads, result,
+                                           nullptr, nullptr));
+
+            ASSERT_EQ(result.apparent_size, fts.result().apparent_size);
+            ASSERT_EQ(result.allocated_size, fts.result().allocated_size);
+            ASSERT_EQ(result.files, fts.result().files);
+        }
+    }
+
+    std::string _path;
+};
+
+TEST_F(DirectorySizeTest, EmptyDirectory)
+{
+    DirectorySize result;
+    ASSERT_TRUE(get_directory_size(_path, {}, 0, result, nullptr, nullptr));
+    ASSERT_EQ(result.apparent_size, 0u);
+    ASSERT_EQ(result.allocated_size, 0u);
+    ASSERT_EQ(result.files, 0u);
+}
+
+TEST_F(DirectorySizeTest, MatchesFts)
+{
+    make_tree();
+    expect_same_as_fts({});
+}
+
+TEST_F(DirectorySizeTest, MatchesFtsWithExclusions)
+{
+    make_tree();
+    expect_same_as_fts({ "excluded", "top", "nonexistent" });
+}
+
+TEST_F(DirectorySizeTest, CountsRegularFilesOnly)
+{
+    make_file("file", 10);
+    make_symlink("file", "symlink");
+    make_symlink("/", "root_symlink");
+    ASSERT_EQ(mkfifo((_path + "/fifo").c_str(), 0644), 0);
+
+    // Unix sockets are special files too
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::string socket_path = _path + "/socket";
+    if (socket_path.size() < sizeof(addr.sun_path)) {
+        strcpy(addr.sun_path, socket_path.c_str());
+        ASSERT_EQ(bind(fd, reinterpret_cast<sockaddr *>(&addr),
+                       sizeof(addr)), 0);
+    }
+    close(fd);
+
+    DirectorySize result;
+    ASSERT_TRUE(get_directory_size(_path, {}, 0, result, nullptr, nullptr));
+    ASSERT_EQ(result.apparent_size, 10u);
+    ASSERT_EQ(result.files, 1u);
+
+    expect_same_as_fts({});
+}
+
+TEST_F(DirectorySizeTest, SingleFile)
+{
+    make_file("file", 1234);
+
+    DirectorySize result;
+    ASSERT_TRUE(get_directory_size(_path + "/file", {}, 0, result,
+                                   nullptr, nullptr));
+    ASSERT_EQ(result.apparent_size, 1234u);
+    ASSERT_EQ(result.files, 1u);
+}
+
+TEST_F(DirectorySizeTest, SymlinkRootNotFollowed)
+{
+    make_dir("dir");
+    make_file("dir/file", 1234);
+    make_symlink("dir", "symlink");
+
+    DirectorySize result;
+    ASSERT_TRUE(get_directory_size(_path + "/symlink", {}, 0, result,
+                                   nullptr, nullptr));
+    ASSERT_EQ(result.files, 0u);
+}
+
+TEST_F(DirectorySizeTest, MissingPath)
+{
+    DirectorySize result;
+    ASSERT_FALSE(get_directory_size(_path + "/nonexistent", {}, 0, result,
+                                    nullptr, nullptr));
+    ASSERT_EQ(errno, ENOENT);
+}
+
+TEST_F(DirectorySizeTest, UnreadableDirectory)
+{
+    if (geteuid() == 0) {
+        // Permissions are not enforced for root
+        return;
+    }
+
+    make_dir("a");
+    make_dir("a/unreadable");
+    make_file("a/file", 10);
+    make_file("a/unreadable/file", 20);
+    ASSERT_EQ(chmod((_path + "/a/unreadable").c_str(), 0), 0);
+
+    DirectorySize result;
+    bool ret = get_directory_size(_path, {}, 2, result, nullptr, nullptr);
+    int saved_errno = errno;
+
+    ASSERT_EQ(chmod((_path + "/a/unreadable").c_str(), 0755), 0);
+
+    // Everything that could be read is still counted
+    ASSERT_FALSE(ret);
+    ASSERT_EQ(saved_errno, EACCES);
+    ASSERT_EQ(result.apparent_size, 10u);
+    ASSERT_EQ(result.files, 1u);
+}
+
+TEST_F(DirectorySizeTest, ProgressIsMonotonic)
+{
+    make_dir("a");
+    for (int i = 0; i < 5000; ++i) {
+        make_file("a/" + std::to_string(i), 1);
+    }
+
+    struct Progress
+    {
+        std::vector<uint64_t> files;
+    } progress;
+
+    DirectorySize result;
+    ASSERT_TRUE(get_directory_size(
+            _path, {}, 4, result,
+            [](const DirectorySize &partial, void *userdata) {
+                static_cast<Progress *>(userdata)->files.push_back(
+                        partial.files);
+            }, &progress));
+
+    ASSERT_EQ(result.files, 5000u);
+    ASSERT_TRUE(std::is_sorted(progress.files.begin(), progress.files.end()));
+    for (uint64_t files : progress.files) {
+        ASSERT_LE(files, result.files);
+    }
+}
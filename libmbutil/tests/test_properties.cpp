@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbutil/properties.h"
+
+using namespace mb::util;
+
+class PropertyFileTest : public testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        _path = tmpdir ? tmpdir : "/data/local/tmp";
+        _path += "/mbutil_properties_test.XXXXXX";
+
+        int fd = mkstemp(&_path[0]);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(close(fd), 0);
+    }
+
+    void TearDown() override
+    {
+        unlink(_path.c_str());
+    }
+
+    void write_file(const std::string &data)
+    {
+        int fd = open(_path.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(write(fd, data.data(), data.size()),
+                  static_cast<ssize_t>(data.size()));
+        ASSERT_EQ(close(fd), 0);
+    }
+
+    // Files modified within the timestamp granularity are never cached, so
+    // move the modification time into the past
+    void set_old_mtime()
+    {
+        struct timespec times[2];
+        times[0].tv_sec = 946684800;
+        times[0].tv_nsec = 0;
+        times[1] = times[0];
+        ASSERT_EQ(utimensat(AT_FDCWD, _path.c_str(), times, 0), 0);
+    }
+
+    std::string _path;
+};
+
+TEST_F(PropertyFileTest, DuplicateKeys)
+{
+    write_file("a=first\nb=1\na=second\n");
+
+    std::string value;
+    ASSERT_TRUE(property_file_get(_path, "a", value));
+    ASSERT_EQ(value, "first");
+
+    std::unordered_map<std::string, std::string> props;
+    ASSERT_TRUE(property_file_get_all(_path, props));
+    ASSERT_EQ(props, (std::unordered_map<std::string, std::string>{
+        { "a", "second" },
+        { "b", "1" },
+    }));
+}
+
+TEST_F(PropertyFileTest, CommentsAndInvalidLines)
+{
+    write_file("# a=comment\n\nno equals sign\nb=x=y\nc=\n");
+
+    std::unordered_map<std::string, std::string> props;
+    ASSERT_TRUE(property_file_get_all(_path, props));
+    ASSERT_EQ(props, (std::unordered_map<std::string, std::string>{
+        { "b", "x=y" },
+        { "c", "" },
+    }));
+}
+
+TEST_F(PropertyFileTest, NoTrailingNewline)
+{
+    write_file("a=1\nlast=value");
+
+    std::string value;
+    ASSERT_TRUE(property_file_get(_path, "last", value));
+    ASSERT_EQ(value, "value");
+
+    std::vector<std::string> keys;
+    ASSERT_TRUE(property_file_list(_path, [](const std::string &key,
+                                             const std::string &,
+                                             void *cookie) {
+        static_cast<std::vector<std::string> *>(cookie)->push_back(key);
+    }, &keys));
+    ASSERT_EQ(keys, (std::vector<std::string>{ "a", "last" }));
+}
+
+TEST_F(PropertyFileTest, MissingFile)
+{
+    ASSERT_EQ(unlink(_path.c_str()), 0);
+
+    std::unordered_map<std::string, std::string> props;
+    ASSERT_FALSE(property_file_get_all(_path, props));
+    ASSERT_EQ(errno, ENOENT);
+}
+
+TEST_F(PropertyFileTest, InvalidatedAfterWriteAll)
+{
+    write_file("a=1\n");
+    set_old_mtime();
+
+    std::string value;
+    ASSERT_TRUE(property_file_get(_path, "a", value));
+    ASSERT_EQ(value, "1");
+
+    // The new file has the same size and, once the timestamp is restored, the
+    // same mtime, so only an explicit invalidation prevents a stale result
+    ASSERT_TRUE(property_file_write_all(_path, { { "a", "2" } }));
+    set_old_mtime();
+
+    ASSERT_TRUE(property_file_get(_path, "a", value));
+    ASSERT_EQ(value, "2");
+}
+
+TEST_F(PropertyFileTest, ReloadedAfterModification)
+{
+    write_file("a=1\n");
+    set_old_mtime();
+
+    std::string value;
+    ASSERT_TRUE(property_file_get(_path, "a", value));
+    ASSERT_EQ(value, "1");
+
+    write_file("a=22\n");
+
+    ASSERT_TRUE(property_file_get(_path, "a", value));
+    ASSERT_EQ(value, "22");
+}
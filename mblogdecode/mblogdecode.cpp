@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+// libmblog
+#include "mblog/binary_log_reader.h"
+#include "mblog/log_record.h"
+#include "mblog/logging.h"
+
+static void usage(FILE *stream)
+{
+    fprintf(stream,
+            "Usage: mblogdecode [OPTION]... [<binary log file>]\n\n"
+            "Options:\n"
+            "  -f, --format <format>\n"
+            "                  Format string for records (default: \"%s\")\n"
+            "  -h, --help      Display this help message\n\n"
+            "If no file is specified, the log is read from stdin.\n",
+            mb::log::format().c_str());
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    static const char short_options[] = "f:h";
+
+    static struct option long_options[] = {
+        {"format", required_argument, nullptr, 'f'},
+        {"help",   no_argument,       nullptr, 'h'},
+        {nullptr,  0,                 nullptr, 0},
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'f':
+            mb::log::set_format(optarg);
+            break;
+
+        case 'h':
+            usage(stdout);
+            return EXIT_SUCCESS;
+
+        default:
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind > 1) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    const char *path = argc - optind == 1 ? argv[optind] : nullptr;
+    int fd = STDIN_FILENO;
+
+    if (path) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "%s: Failed to open file: %s\n",
+                    path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    } else {
+        path = "<stdin>";
+    }
+
+    mb::log::BinaryLogReader reader(fd);
+    mb::log::LogRecord rec;
+
+    while (reader.next(rec)) {
+        std::string line = mb::log::format_record(rec);
+        line += '\n';
+        fwrite(line.data(), 1, line.size(), stdout);
+    }
+
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+
+    if (!reader.error().empty()) {
+        fflush(stdout);
+        fprintf(stderr, "%s: %s\n", path, reader.error().c_str());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
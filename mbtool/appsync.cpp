@@ -19,7 +19,12 @@
 
 #include "appsync.h"
 
-#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include <cassert>
 #include <cstdio>
@@ -28,8 +33,10 @@
 
 #include <fcntl.h>
 #include <getopt.h>
-#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -42,8 +49,8 @@
 #include "mbcommon/integer.h"
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
+#include "mblog/async_logger.h"
 #include "mblog/logging.h"
-#include "mblog/stdio_logger.h"
 #include "mbutil/chown.h"
 #include "mbutil/command.h"
 #include "mbutil/copy.h"
@@ -53,7 +60,6 @@
 #include "mbutil/fts.h"
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
-#include "mbutil/socket.h"
 #include "mbutil/string.h"
 #include "mbutil/time.h"
 
@@ -81,6 +87,11 @@
 
 #define COMMAND_BUF_SIZE                1024
 
+// installd is spawned right before the proxy starts, so its socket may not
+// exist yet when the first client connects
+#define INSTALLD_CONNECT_ATTEMPTS       5
+#define INSTALLD_CONNECT_RETRY_MS       1000
+
 #define PACKAGES_XML_PATH_FMT           "%s/system/packages.xml"
 
 namespace mb
@@ -93,6 +104,14 @@ static Packages packages;
 
 static std::vector<RomConfigAndPackages> cfg_pkgs_list; // 'dat naming tho ;)
 
+// Set by the SIGTERM handler
+static volatile sig_atomic_t terminate_requested = 0;
+
+static void terminate_handler(int)
+{
+    terminate_requested = 1;
+}
+
 /*!
  * \brief Try loading the config file in /data/media/0/MultiBoot/[ROM ID]/config.json
  */
@@ -122,7 +141,8 @@ static bool load_config_files()
             LOGW("%s: Failed to load config for ROM %s",
                  config_path.c_str(), rom->id.c_str());
         }
-        if (!rom_packages.load_xml(packages_path)) {
+        if (!rom_packages.load_xml(packages_path, Packages::Field::Name
+                                   | Packages::Field::Uid)) {
             LOGW("%s: Failed to load packages for ROM %s",
                  packages_path.c_str(), rom->id.c_str());
         }
@@ -297,82 +317,59 @@ static int create_new_socket()
 /*
  * Socket messages are prefixed with 16-bit unsigned value (little-endian)
  * indicating the number of bytes that follow. The data should be treated as
- * a string and a null terminator must be added to the end.
+ * a string and a null terminator must be added to the end. If installd is the
+ * CyanogenMod async version, the size is preceded by a 32-bit command ID.
  */
 
 /*!
- * \brief Receive a message from a socket
+ * \brief Find the first complete message in a buffer
+ *
+ * \param[in] buf Data received from a socket
+ * \param[in] is_async Whether messages are prefixed with a command ID
+ * \param[out] header_size Size of the message header
+ * \param[out] msg_size Size of the message, including the header, or 0 if
+ *                      \p buf does not yet contain a complete message
+ *
+ * \return Whether the message is valid
  */
-static bool receive_message(int fd, char *buf, std::size_t size,
-                            bool is_async, int &async_id)
+static bool find_message(const std::string &buf, bool is_async,
+                         std::size_t &header_size, std::size_t &msg_size)
 {
-    unsigned short count;
-
-    if (is_async) {
-        if (!util::socket_read_int32(fd, async_id)) {
-            LOGE("Failed to receive async command ID: %s", strerror(errno));
-            return false;
-        }
-    }
+    std::size_t offset = is_async ? sizeof(int32_t) : 0;
+    uint16_t count;
 
-    if (!util::socket_read_uint16(fd, count)) {
-        LOGE("Failed to read command size: %s", strerror(errno));
-        return false;
-    }
+    header_size = offset + sizeof(count);
+    msg_size = 0;
 
-    if (count < 1 || count >= size) {
-        LOGE("Invalid size %u", count);
-        return false;
-    }
-
-    if (util::socket_read(fd, buf, count) != count) {
-        LOGE("Failed to read command: %s", strerror(errno));
-        return false;
+    if (buf.size() < header_size) {
+        return true;
     }
 
-    buf[count] = 0;
+    memcpy(&count, buf.data() + offset, sizeof(count));
 
-    return true;
-}
-
-/*!
- * \brief Send a message to a socket
- */
-static bool send_message(int fd, const char *command,
-                         bool is_async, int async_id)
-{
-    auto count = static_cast<uint16_t>(strlen(command));
-
-    if (is_async) {
-        if (!util::socket_write_int32(fd, async_id)) {
-            LOGE("Failed to write async command ID: %s", strerror(errno));
-            return false;
-        }
-    }
-
-    if (!util::socket_write_uint16(fd, count)) {
-        LOGE("Failed to write command size: %s", strerror(errno));
+    // Use the same limit as installd
+    if (count < 1 || count >= COMMAND_BUF_SIZE) {
+        LOGE("Invalid size %u", count);
         return false;
     }
 
-    if (util::socket_write(fd, command, count) != count) {
-        LOGE("Failed to write command: %s", strerror(errno));
-        return false;
+    if (buf.size() >= header_size + count) {
+        msg_size = header_size + count;
     }
 
     return true;
 }
 
 /*!
- * \brief Connect to the installd socket at INSTALLD_SOCKET_PATH
+ * \brief Start a non-blocking connection to the installd socket at
+ *        INSTALLD_SOCKET_PATH
  *
- * Because installd is spawned right before this function is called, this
- * function will make 5 attempts to connect to the socket. If an attempt fails,
- * it will wait 1 second before trying again.
+ * \param[out] in_progress Whether the connection has not completed yet
  *
- * \return fd if the connection succeeds. Otherwise, -1
+ * \return fd if the connection succeeded or is in progress. Otherwise, -1 with
+ *         errno set
  */
-static int connect_to_installd()
+static int connect_to_installd(bool &in_progress)
 {
     struct sockaddr_un addr;
 
@@ -381,31 +378,24 @@ static int connect_to_installd()
     snprintf(addr.sun_path, sizeof(addr.sun_path), "%s",
              INSTALLD_SOCKET_PATH);
 
-    int fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+    int fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd < 0) {
-        LOGE("Failed to create socket: %s", strerror(errno));
         return -1;
     }
 
-    int attempt;
-    for (attempt = 0; attempt < 5; ++attempt) {
-        LOGV("Connecting to installd [Attempt %d/%d]", attempt + 1, 5);
-        if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
-            LOGW("Failed: %s", strerror(errno));
-            sleep(1);
-        } else {
-            break;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        if (errno == EINPROGRESS) {
+            in_progress = true;
+            return fd;
         }
-    }
 
-    if (attempt == 5) {
-        LOGD("Failed to connect to installd after 5 attempts");
+        int saved_errno = errno;
         close(fd);
+        errno = saved_errno;
         return -1;
     }
 
-    LOGD("Connected to installd");
-
+    in_progress = false;
     return fd;
 }
 
@@ -507,280 +497,835 @@ struct CommandInfo {
     const char *name;
     unsigned int nargs;
     bool (*func)(const std::vector<std::string> &args);
+    // Whether installd must not receive the command until the hook completes
+    bool wait;
 };
 
 static struct CommandInfo cmds[] = {
-    { "remove",  2, do_remove }
+    // The shared data directory must be unmounted before installd wipes it
+    { "remove",  2, do_remove, true }
 };
 
-static void handle_command(const std::vector<std::string> &args)
+static const CommandInfo * find_hook(const std::vector<std::string> &args)
 {
-    for (std::size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); ++i) {
-        if (args[0] == cmds[i].name) {
-            if (args.size() - 1 != cmds[i].nargs) {
+    for (auto const &cmd : cmds) {
+        if (args[0] == cmd.name) {
+            if (args.size() - 1 != cmd.nargs) {
                 LOGE("%s requires %u arguments (%zu given)",
-                     cmds[i].name, cmds[i].nargs, args.size() - 1);
-                LOGE("%s command won't be hooked", cmds[i].name);
-            } else {
-                LOGD("Hooking %s command", cmds[i].name);
-                cmds[i].func(std::vector<std::string>(
-                        args.begin() + 1, args.end()));
+                     cmd.name, cmd.nargs, args.size() - 1);
+                LOGE("%s command won't be hooked", cmd.name);
+                return nullptr;
             }
+
+            LOGD("Hooking %s command", cmd.name);
+            return &cmd;
         }
     }
+
+    return nullptr;
 }
 
-static bool handle_installd_event(int client_fd, int installd_fd,
-                                  bool is_async)
+/*!
+ * \brief Log a command received from the client
+ *
+ * \param[in] args Parsed command
+ * \param[out] log_result Whether the reply to the command should be logged
+ *
+ * \return Whether the command may need to be hooked
+ */
+static bool inspect_command(const std::vector<std::string> &args,
+                            bool &log_result)
 {
-    // Use the same buffer size as installd
-    char buf[COMMAND_BUF_SIZE];
+    log_result = true;
 
-    uint64_t time_start, time_stop;
-    uint64_t time_start_installd, time_stop_installd;
-    uint64_t time_start_send, time_stop_send;
+    if (args.empty()) {
+        LOGE("Invalid command (empty message)");
+        return false;
+    }
 
-    int async_id;
+    const std::string &cmd = args[0];
+
+    if (cmd == "ping"
+            || cmd == "freecache") {
+        LOGD("Received unimportant command: [%s, ...]", cmd.c_str());
+    } else if (cmd == "aapt"
+            || cmd == "aapt_with_common") {
+        LOGD("Received CyanogenMod-specific command: %s",
+             args_to_string(args).c_str());
+    } else if (cmd == "rmrcl"
+            || cmd == "asyncDexopt"
+            || cmd == "changeDexOwner") {
+        LOGD("Received Touchwiz-specific command: %s",
+             args_to_string(args).c_str());
+        if (cmd == "asyncDexopt") {
+            LOGD("Expecting future installd reply for 'asyncDexopt'");
+        }
+    } else if (cmd == "getsize") {
+        // Get size is so annoying we don't want it to show... EVER!
+        log_result = false;
+    } else if (cmd == "install"
+            || cmd == "dexopt"
+            || cmd == "markbootcomplete"
+            || cmd == "movedex"
+            || cmd == "rmdex"
+            || cmd == "remove"
+            || cmd == "rename"
+            || cmd == "fixuid"
+            || cmd == "rmcache"
+            || cmd == "rmcodecache"
+            || cmd == "rmuserdata"
+            || cmd == "movefiles"
+            || cmd == "linklib"
+            || cmd == "mkuserdata"
+            || cmd == "mkuserconfig"
+            || cmd == "rmuser"
+            || cmd == "idmap"
+            || cmd == "restorecondata"
+            || cmd == "patchoat") {
+        LOGD("Received command: %s", args_to_string(args).c_str());
+        return true;
+    } else {
+        LOGW("Unrecognized command: %s", args_to_string(args).c_str());
+    }
 
-    time_start = util::current_time_ms();
+    return false;
+}
 
-    time_start_installd = util::current_time_ms();
-    if (!receive_message(
-            installd_fd, buf, sizeof(buf), is_async, async_id)) {
-        LOGE("Failed to receive reply from installd");
-        return false;
+/*!
+ * \brief Background queue for command hooks
+ *
+ * Hooks, like unmounting a shared data directory, can take a while, so they run
+ * on a separate thread while the proxy keeps forwarding messages. There is a
+ * single worker thread that runs hooks in the order they were queued, so hooks
+ * for the same package are never reordered.
+ *
+ * Each hook is assigned an increasing ticket number. When a hook finishes,
+ * completed() returns its ticket and the eventfd returned by fd() becomes
+ * readable.
+ */
+class HookQueue
+{
+public:
+    HookQueue()
+        : m_started(false)
+        , m_stop(false)
+        , m_next_ticket(1)
+        , m_completed(0)
+        , m_event_fd(-1)
+    {
     }
-    time_stop_installd = util::current_time_ms();
-
-    std::vector<std::string> args = parse_args(buf);
-    LOGD("Received async (probably) reply: %s", args_to_string(args).c_str());
 
-    time_start_send = util::current_time_ms();
-    if (!send_message(client_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send reply to client");
-        return false;
+    ~HookQueue()
+    {
+        stop();
     }
-    time_stop_send = util::current_time_ms();
 
-    time_stop = util::current_time_ms();
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(HookQueue)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(HookQueue)
 
-    LOGD("Command stats:");
-    LOGD("- Time to send result back to client:  %" PRIu64 "ms",
-         time_stop_send - time_start_send);
-    LOGD("- Time to receive reply from installd: %" PRIu64 "ms",
-         time_stop_installd - time_start_installd);
-    LOGD("- Time to complete entire proxy logic: %" PRIu64 "ms",
-         time_stop - time_start);
-    LOGD("---");
+    bool start()
+    {
+        m_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (m_event_fd < 0) {
+            LOGE("Failed to create eventfd: %s", strerror(errno));
+            return false;
+        }
 
-    return true;
-}
+        int ret = pthread_create(&m_thread, nullptr, &thread_main, this);
+        if (ret != 0) {
+            LOGE("Failed to create hook thread: %s", strerror(ret));
+            close(m_event_fd);
+            m_event_fd = -1;
+            return false;
+        }
 
-static bool handle_android_event(int client_fd, int installd_fd,
-                                 bool can_appsync, bool is_async)
-{
-    // Use the same buffer size as installd
-    char buf[COMMAND_BUF_SIZE];
+        m_started = true;
+        return true;
+    }
 
-    uint64_t time_start, time_stop;
-    uint64_t time_start_installd, time_stop_installd;
-    uint64_t time_start_hook = 0, time_stop_hook = 0;
-    uint64_t time_start_send, time_stop_send;
+    void stop()
+    {
+        if (m_started) {
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_stop = true;
+            }
+            m_cv.notify_one();
 
-    int async_id;
+            pthread_join(m_thread, nullptr);
+            m_started = false;
+        }
 
-    if (!receive_message(client_fd, buf, sizeof(buf), is_async, async_id)) {
-        LOGE("Failed to receive request from client");
-        return false;
+        if (m_event_fd >= 0) {
+            close(m_event_fd);
+            m_event_fd = -1;
+        }
     }
 
-    time_start = util::current_time_ms();
+    uint64_t push(const CommandInfo *cmd, std::vector<std::string> args)
+    {
+        uint64_t ticket;
 
-    std::vector<std::string> args = parse_args(buf);
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            ticket = m_next_ticket++;
+            m_queue.push_back({ ticket, cmd, std::move(args) });
+        }
+        m_cv.notify_one();
 
-    bool log_result = true;
+        return ticket;
+    }
 
-    if (args.empty()) {
-        LOGE("Invalid command (empty message)");
-    } else {
-        const std::string &cmd = args[0];
-
-        if (cmd == "ping"
-                || cmd == "freecache") {
-            LOGD("Received unimportant command: [%s, ...]", cmd.c_str());
-        } else if (cmd == "aapt"
-                || cmd == "aapt_with_common") {
-            LOGD("Received CyanogenMod-specific command: %s",
-                 args_to_string(args).c_str());
-        } else if (cmd == "rmrcl"
-                || cmd == "asyncDexopt"
-                || cmd == "changeDexOwner") {
-            LOGD("Received Touchwiz-specific command: %s",
-                 args_to_string(args).c_str());
-            if (cmd == "asyncDexopt") {
-                LOGD("Expecting future installd reply for 'asyncDexopt'");
-            }
-        } else if (cmd == "getsize") {
-            // Get size is so annoying we don't want it to show... EVER!
-            log_result = false;
-        } else if (cmd == "install"
-                || cmd == "dexopt"
-                || cmd == "markbootcomplete"
-                || cmd == "movedex"
-                || cmd == "rmdex"
-                || cmd == "remove"
-                || cmd == "rename"
-                || cmd == "fixuid"
-                || cmd == "rmcache"
-                || cmd == "rmcodecache"
-                || cmd == "rmuserdata"
-                || cmd == "movefiles"
-                || cmd == "linklib"
-                || cmd == "mkuserdata"
-                || cmd == "mkuserconfig"
-                || cmd == "rmuser"
-                || cmd == "idmap"
-                || cmd == "restorecondata"
-                || cmd == "patchoat") {
-            LOGD("Received command: %s", args_to_string(args).c_str());
-
-            if (can_appsync) {
-                time_start_hook = util::current_time_ms();
-                handle_command(args);
-                time_stop_hook = util::current_time_ms();
-            }
-        } else {
-            LOGW("Unrecognized command: %s", args_to_string(args).c_str());
-        }
+    uint64_t completed() const
+    {
+        return m_completed.load();
     }
 
-    time_start_installd = util::current_time_ms();
-    if (!send_message(installd_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send request to installd");
-        return false;
+    int fd() const
+    {
+        return m_event_fd;
     }
-    if (!receive_message(
-            installd_fd, buf, sizeof(buf), is_async, async_id)) {
-        LOGE("Failed to receive reply from installd");
-        return false;
+
+    void clear_event()
+    {
+        uint64_t value;
+        MB_UNUSED ssize_t n = read(m_event_fd, &value, sizeof(value));
     }
-    time_stop_installd = util::current_time_ms();
 
-    args = parse_args(buf);
+private:
+    struct Hook
+    {
+        uint64_t ticket;
+        const CommandInfo *cmd;
+        std::vector<std::string> args;
+    };
 
-    if (log_result) {
-        LOGD("Sending reply: %s", args_to_string(args).c_str());
+    static void * thread_main(void *userdata)
+    {
+        static_cast<HookQueue *>(userdata)->run();
+        return nullptr;
     }
 
-    time_start_send = util::current_time_ms();
-    if (!send_message(client_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send reply to client");
-        return false;
-    }
-    time_stop_send = util::current_time_ms();
+    void run()
+    {
+        while (true) {
+            Hook hook;
+
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_cv.wait(lock, [&]{
+                    return m_stop || !m_queue.empty();
+                });
+
+                if (m_stop) {
+                    return;
+                }
+
+                hook = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+
+            uint64_t start = util::current_time_ms();
+            hook.cmd->func(hook.args);
+            uint64_t stop = util::current_time_ms();
 
-    time_stop = util::current_time_ms();
+            LOGD("Hook for %s took %" PRIu64 "ms",
+                 hook.cmd->name, stop - start);
 
-    if (log_result) {
-        LOGD("Command stats:");
-        LOGD("- Time to send result back to client:  %" PRIu64 "ms",
-             time_stop_send - time_start_send);
-        LOGD("- Time to complete installd command:   %" PRIu64 "ms",
-             time_stop_installd - time_start_installd);
-        if (can_appsync) {
-            LOGD("- Time to hook installd command:       %" PRIu64 "ms",
-                 time_stop_hook - time_start_hook);
+            m_completed.store(hook.ticket);
+
+            uint64_t value = 1;
+            MB_UNUSED ssize_t n = write(m_event_fd, &value, sizeof(value));
         }
-        LOGD("- Time to complete entire proxy logic: %" PRIu64 "ms",
-             time_stop - time_start);
-        LOGD("---");
     }
 
-    return true;
-}
+    pthread_t m_thread;
+    bool m_started;
 
-/**
- * \brief Main function for capturing and relaying the daemon commands
- *
- * This function will not return under normal conditions. It runs through the
- * following loop infinitely:
- *
- * 1. Accept a connection on the original installd socket
- * 2. Run installd
- * 3. Connect to the installd
- * 4. Capture and proxy commands
- *
- * If installd crashes or connection between mbtool and installd breaks in some
- * way, it will simply loop again. If this function fails to accept a connection
- * on the original socket, then it will return false.
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<Hook> m_queue;
+    bool m_stop;
+    uint64_t m_next_ticket;
+
+    std::atomic<uint64_t> m_completed;
+    int m_event_fd;
+};
+
+struct ProxyConnection
+{
+    int client_fd;
+    // -1 while waiting to retry the connection to installd
+    int installd_fd;
+    bool installd_connecting;
+    int connect_attempts;
+    // Time at which to retry connecting to installd (0 if not waiting)
+    uint64_t connect_retry_time;
+
+    // Received data that does not yet form a complete message
+    std::string client_in;
+    std::string installd_in;
+    // Data waiting for the socket to become writable
+    std::string client_out;
+    std::string installd_out;
+
+    uint32_t client_events;
+    uint32_t installd_events;
+
+    // Hook that must finish before the first message in client_in can be
+    // forwarded to installd
+    uint64_t wait_ticket;
+
+    bool log_reply;
+    uint64_t time_forwarded;
+
+    bool closed;
+};
+
+/*!
+ * \brief Event-driven proxy between the Android framework and installd
  *
- * \return False if accepting the socket connection fails. Otherwise, does not
- *         return
+ * All sockets are non-blocking and multiplexed with epoll, so a slow peer on
+ * one connection never stalls another. Each accepted client gets its own
+ * connection to installd. Messages are forwarded as soon as they are complete
+ * and command hooks are handed off to a HookQueue. If a hook must complete
+ * before installd sees the command, only that client's stream is paused until
+ * the hook's ticket is completed. The connection to installd is also made
+ * without blocking. Failed attempts are retried on a timer and only the
+ * affected client is dropped if installd cannot be reached.
  */
-static bool proxy_process(int fd, bool can_appsync)
+class InstalldProxy
 {
-    while (true) {
-        int client_fd = accept(fd, nullptr, nullptr);
+public:
+    InstalldProxy(int listen_fd, bool can_appsync, bool is_async)
+        : m_listen_fd(listen_fd)
+        , m_can_appsync(can_appsync)
+        , m_is_async(is_async)
+        , m_epoll_fd(-1)
+    {
+    }
+
+    ~InstalldProxy()
+    {
+        m_hooks.stop();
+
+        for (auto &conn : m_conns) {
+            close_connection(*conn);
+        }
+
+        if (m_epoll_fd >= 0) {
+            close(m_epoll_fd);
+        }
+    }
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(InstalldProxy)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(InstalldProxy)
+
+    bool run()
+    {
+        m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll_fd < 0) {
+            LOGE("Failed to create epoll fd: %s", strerror(errno));
+            return false;
+        }
+
+        if (!add_fd(m_listen_fd, EPOLLIN)) {
+            return false;
+        }
+
+        if (m_can_appsync && (!m_hooks.start()
+                || !add_fd(m_hooks.fd(), EPOLLIN))) {
+            LOGW("App sharing is disabled because hooks cannot be run");
+            m_can_appsync = false;
+        }
+
+        struct epoll_event events[16];
+
+        while (true) {
+            int n = epoll_wait(m_epoll_fd, events, sizeof(events)
+                               / sizeof(events[0]), next_retry_timeout());
+            if (n < 0) {
+                if (errno == EINTR) {
+                    if (terminate_requested) {
+                        LOGD("Received SIGTERM; exiting");
+                        return true;
+                    }
+                    continue;
+                }
+                LOGE("Failed to wait for events: %s", strerror(errno));
+                return false;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+
+                if (fd == m_listen_fd) {
+                    if (!accept_connection()) {
+                        return false;
+                    }
+                } else if (m_can_appsync && fd == m_hooks.fd()) {
+                    m_hooks.clear_event();
+                    resume_connections();
+                } else {
+                    auto it = m_fd_map.find(fd);
+                    if (it != m_fd_map.end() && !it->second->closed) {
+                        handle_event(*it->second, fd, events[i].events);
+                    }
+                }
+            }
+
+            retry_installd_connections();
+            reap_connections();
+        }
+    }
+
+private:
+    bool add_fd(int fd, uint32_t events)
+    {
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            LOGE("Failed to add fd %d to epoll: %s", fd, strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    bool accept_connection()
+    {
+        int client_fd = accept4(m_listen_fd, nullptr, nullptr,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (client_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK
+                    || errno == ECONNABORTED || errno == EINTR) {
+                return true;
+            }
             LOGE("Failed to accept client connection: %s", strerror(errno));
             return false;
         }
 
-        auto close_client_fd = finally([&]{
-            LOGD("Closing client connection");
-            close(client_fd);
-        });
-
         LOGD("Accepted new client connection");
 
-        // Connect to installd
-        int installd_fd = connect_to_installd();
-        if (installd_fd < 0) {
+        auto conn = std::make_shared<ProxyConnection>();
+        conn->client_fd = client_fd;
+        conn->installd_fd = -1;
+        conn->installd_connecting = false;
+        conn->connect_attempts = 0;
+        conn->connect_retry_time = 0;
+        conn->client_events = EPOLLIN;
+        conn->installd_events = 0;
+        conn->wait_ticket = 0;
+        conn->log_reply = true;
+        conn->time_forwarded = 0;
+        conn->closed = false;
+
+        m_conns.push_back(conn);
+        m_fd_map[client_fd] = conn;
+
+        // Requests from the client are queued until installd is connected
+        if (!add_fd(client_fd, conn->client_events)
+                || !connect_installd(conn)) {
+            conn->closed = true;
+        }
+
+        LOGD("---");
+
+        return true;
+    }
+
+    static bool installd_ready(const ProxyConnection &conn)
+    {
+        return conn.installd_fd >= 0 && !conn.installd_connecting;
+    }
+
+    /*!
+     * \brief Make the next attempt to connect a client's installd socket
+     *
+     * \return False if the client should be dropped
+     */
+    bool connect_installd(const std::shared_ptr<ProxyConnection> &conn)
+    {
+        ++conn->connect_attempts;
+        conn->connect_retry_time = 0;
+
+        LOGV("Connecting to installd [Attempt %d/%d]",
+             conn->connect_attempts, INSTALLD_CONNECT_ATTEMPTS);
+
+        bool in_progress;
+        int fd = connect_to_installd(in_progress);
+        if (fd < 0) {
+            LOGW("Failed: %s", strerror(errno));
+            return schedule_connect_retry(*conn);
+        }
+
+        conn->installd_fd = fd;
+        conn->installd_connecting = in_progress;
+        // Writability signals that a pending connection has completed
+        conn->installd_events = in_progress ? EPOLLOUT : EPOLLIN;
+        m_fd_map[fd] = conn;
+
+        if (!add_fd(fd, conn->installd_events)) {
             return false;
+        } else if (in_progress) {
+            return true;
         }
 
-        auto close_installd_fd = finally([&]{
-            LOGD("Closing installd connection");
-            close(installd_fd);
-        });
+        LOGD("Connected to installd");
 
-        // Check if we're using some variant of the CyanogenMood async installd
-        // NOTE: We'll effectively make the connection sychronous because we
-        //       always wait for a reply before receiving the next command.
-        // See: https://github.com/CyanogenMod/android_frameworks_native/commit/8124b181d4b5a3a44796fdb0e3ea4e4171f102c7
-        bool is_async = util::file_find_one_of(
-                INSTALLD_PATH, { "failed to read transaction id" });
-        LOGD("installd is CyanogenMod async version: %d", is_async);
+        return flush(fd, conn->installd_out) && update_events(*conn);
+    }
 
-        LOGD("---");
+    /*!
+     * \brief Check the result of a pending connection to installd
+     *
+     * \return False if the client should be dropped
+     */
+    bool finish_connect_installd(ProxyConnection &conn)
+    {
+        int error = 0;
+        socklen_t error_size = sizeof(error);
+
+        if (getsockopt(conn.installd_fd, SOL_SOCKET, SO_ERROR,
+                       &error, &error_size) < 0) {
+            error = errno;
+        }
 
-        struct pollfd fds[2];
-        memset(fds, 0, sizeof(fds));
+        if (error != 0) {
+            LOGW("Failed: %s", strerror(error));
+            close_installd(conn);
+            return schedule_connect_retry(conn);
+        }
 
-        fds[0].fd = client_fd;
-        fds[0].events = POLLIN;
-        fds[1].fd = installd_fd;
-        fds[1].events = POLLIN;
+        conn.installd_connecting = false;
 
-        while (true) {
-            fds[0].revents = 0;
-            fds[1].revents = 1;
+        LOGD("Connected to installd");
+
+        return true;
+    }
+
+    bool schedule_connect_retry(ProxyConnection &conn)
+    {
+        if (conn.connect_attempts >= INSTALLD_CONNECT_ATTEMPTS) {
+            LOGE("Failed to connect to installd after %d attempts",
+                 conn.connect_attempts);
+            return false;
+        }
+
+        conn.connect_retry_time =
+                util::current_time_ms() + INSTALLD_CONNECT_RETRY_MS;
+        return true;
+    }
+
+    /*!
+     * \brief Get the epoll timeout until the next installd connection retry
+     */
+    int next_retry_timeout() const
+    {
+        uint64_t next = 0;
+
+        for (auto const &conn : m_conns) {
+            if (!conn->closed && conn->connect_retry_time != 0
+                    && (next == 0 || conn->connect_retry_time < next)) {
+                next = conn->connect_retry_time;
+            }
+        }
+
+        if (next == 0) {
+            return -1;
+        }
+
+        uint64_t now = util::current_time_ms();
+        return next > now ? static_cast<int>(next - now) : 0;
+    }
+
+    void retry_installd_connections()
+    {
+        uint64_t now = util::current_time_ms();
+
+        for (auto &conn : m_conns) {
+            if (!conn->closed && conn->connect_retry_time != 0
+                    && conn->connect_retry_time <= now
+                    && !connect_installd(conn)) {
+                conn->closed = true;
+            }
+        }
+    }
+
+    void close_installd(ProxyConnection &conn)
+    {
+        // Closing the fd removes it from the epoll set
+        close(conn.installd_fd);
+        m_fd_map.erase(conn.installd_fd);
+
+        conn.installd_fd = -1;
+        conn.installd_connecting = false;
+        conn.installd_events = 0;
+    }
+
+    void close_connection(ProxyConnection &conn)
+    {
+        LOGD("Closing client and installd connections");
+
+        // Closing the fds removes them from the epoll set
+        close(conn.client_fd);
+        m_fd_map.erase(conn.client_fd);
+
+        if (conn.installd_fd >= 0) {
+            close_installd(conn);
+        }
+    }
+
+    /*!
+     * \brief Close connections that failed during the last batch of events
+     *
+     * This is deferred so that later events in the same batch cannot refer to
+     * a reused fd.
+     */
+    void reap_connections()
+    {
+        for (auto it = m_conns.begin(); it != m_conns.end();) {
+            if ((*it)->closed) {
+                close_connection(**it);
+                it = m_conns.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void handle_event(ProxyConnection &conn, int fd, uint32_t events)
+    {
+        bool is_client = fd == conn.client_fd;
+        bool ok = true;
+
+        if (!is_client && conn.installd_connecting) {
+            ok = finish_connect_installd(conn);
+        } else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            if (is_client) {
+                ok = read_available(fd, conn.client_in)
+                        && process_client_messages(conn);
+            } else {
+                ok = read_available(fd, conn.installd_in)
+                        && process_installd_messages(conn);
+            }
+        }
+
+        ok = ok && flush(conn.client_fd, conn.client_out)
+                && (!installd_ready(conn)
+                        || flush(conn.installd_fd, conn.installd_out))
+                && update_events(conn);
+
+        if (!ok) {
+            conn.closed = true;
+        }
+    }
+
+    void resume_connections()
+    {
+        for (auto &conn : m_conns) {
+            if (!conn->closed && conn->wait_ticket != 0
+                    && (!process_client_messages(*conn)
+                    || (installd_ready(*conn)
+                            && !flush(conn->installd_fd, conn->installd_out))
+                    || !update_events(*conn))) {
+                conn->closed = true;
+            }
+        }
+    }
 
-            if (poll(fds, 2, -1) < 0) {
-                LOGE("Failed to poll() fds: %s", strerror(errno));
+    bool process_client_messages(ProxyConnection &conn)
+    {
+        std::size_t header_size;
+        std::size_t msg_size;
+
+        while (true) {
+            if (!find_message(conn.client_in, m_is_async,
+                              header_size, msg_size)) {
+                LOGE("Failed to receive request from client");
+                return false;
+            } else if (msg_size == 0) {
                 break;
             }
 
-            if (fds[0].revents & POLLIN && !handle_android_event(
-                    client_fd, installd_fd, can_appsync, is_async)) {
+            if (conn.wait_ticket != 0) {
+                if (m_hooks.completed() < conn.wait_ticket) {
+                    break;
+                }
+                conn.wait_ticket = 0;
+            } else {
+                std::string cmd(conn.client_in, header_size,
+                                msg_size - header_size);
+                std::vector<std::string> args = parse_args(cmd.c_str());
+
+                if (inspect_command(args, conn.log_reply) && m_can_appsync) {
+                    if (auto const *hook = find_hook(args)) {
+                        uint64_t ticket = m_hooks.push(
+                                hook, std::vector<std::string>(
+                                        args.begin() + 1, args.end()));
+                        if (hook->wait) {
+                            conn.wait_ticket = ticket;
+                            continue;
+                        }
+                    }
+                }
+            }
+
+            conn.installd_out.append(conn.client_in, 0, msg_size);
+            conn.client_in.erase(0, msg_size);
+            conn.time_forwarded = util::current_time_ms();
+        }
+
+        return true;
+    }
+
+    bool process_installd_messages(ProxyConnection &conn)
+    {
+        std::size_t header_size;
+        std::size_t msg_size;
+
+        while (true) {
+            if (!find_message(conn.installd_in, m_is_async,
+                              header_size, msg_size)) {
+                LOGE("Failed to receive reply from installd");
+                return false;
+            } else if (msg_size == 0) {
                 break;
             }
-            if (fds[1].revents & POLLIN && !handle_installd_event(
-                    client_fd, installd_fd, is_async)) {
+
+            if (conn.log_reply) {
+                std::string reply(conn.installd_in, header_size,
+                                  msg_size - header_size);
+                LOGD("Sending reply: %s",
+                     args_to_string(parse_args(reply.c_str())).c_str());
+                if (!m_is_async) {
+                    LOGD("- Time to complete installd command: %" PRIu64 "ms",
+                         util::current_time_ms() - conn.time_forwarded);
+                }
+            }
+
+            conn.client_out.append(conn.installd_in, 0, msg_size);
+            conn.installd_in.erase(0, msg_size);
+        }
+
+        return true;
+    }
+
+    /*!
+     * \brief Read everything that is available from a non-blocking socket
+     *
+     * \return False if the peer closed the connection or an error occurred
+     */
+    static bool read_available(int fd, std::string &buf)
+    {
+        char chunk[COMMAND_BUF_SIZE];
+
+        while (true) {
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n > 0) {
+                buf.append(chunk, static_cast<std::size_t>(n));
+            } else if (n == 0) {
+                return false;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            } else if (errno != EINTR) {
+                LOGE("Failed to read from socket: %s", strerror(errno));
+                return false;
+            }
+        }
+    }
+
+    static bool flush(int fd, std::string &buf)
+    {
+        while (!buf.empty()) {
+            ssize_t n = send(fd, buf.data(), buf.size(), MSG_NOSIGNAL);
+            if (n >= 0) {
+                buf.erase(0, static_cast<std::size_t>(n));
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
+            } else if (errno != EINTR) {
+                LOGE("Failed to write to socket: %s", strerror(errno));
+                return false;
             }
         }
+
+        return true;
     }
+
+    bool update_events(ProxyConnection &conn)
+    {
+        if (!update_fd_events(conn.client_fd, conn.client_events,
+                              conn.client_out.empty())) {
+            return false;
+        }
+
+        // Nothing to change while a connection attempt is pending
+        return !installd_ready(conn)
+                || update_fd_events(conn.installd_fd, conn.installd_events,
+                                    conn.installd_out.empty());
+    }
+
+    bool update_fd_events(int fd, uint32_t &current, bool out_empty)
+    {
+        uint32_t events = EPOLLIN;
+        if (!out_empty) {
+            events |= EPOLLOUT;
+        }
+
+        if (events != current) {
+            struct epoll_event ev = {};
+            ev.events = events;
+            ev.data.fd = fd;
+
+            if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+                LOGE("Failed to modify epoll events: %s", strerror(errno));
+                return false;
+            }
+
+            current = events;
+        }
+
+        return true;
+    }
+
+    int m_listen_fd;
+    bool m_can_appsync;
+    bool m_is_async;
+    int m_epoll_fd;
+
+    HookQueue m_hooks;
+
+    std::vector<std::shared_ptr<ProxyConnection>> m_conns;
+    std::unordered_map<int, std::shared_ptr<ProxyConnection>> m_fd_map;
+};
+
+/**
+ * \brief Main function for capturing and relaying the daemon commands
+ *
+ * This function will not return under normal conditions. It accepts
+ * connections on the original installd socket, connects each one to installd,
+ * and proxies commands between them.
+ *
+ * If installd crashes or connection between mbtool and installd breaks in some
+ * way, only that connection is closed. If this function fails to accept a
+ * connection on the original socket, then it will return false. If SIGTERM is
+ * received, it returns true.
+ *
+ * \return False if accepting the socket connection fails. True if the process
+ *         was asked to terminate. Otherwise, does not return
+ */
+static bool proxy_process(int fd, bool can_appsync)
+{
+    // Check if we're using some variant of the CyanogenMood async installd
+    // See: https://github.com/CyanogenMod/android_frameworks_native/commit/8124b181d4b5a3a44796fdb0e3ea4e4171f102c7
+    bool is_async = util::file_find_one_of(
+            INSTALLD_PATH, { "failed to read transaction id" });
+    LOGD("installd is CyanogenMod async version: %d", is_async);
+
+    InstalldProxy proxy(fd, can_appsync, is_async);
+    return proxy.run();
 }
 
 /*!
@@ -842,6 +1387,17 @@ static bool hijack_socket(bool can_appsync)
         } while (!WIFEXITED(status) && !WIFSIGNALED(status));
     });
 
+    // Exit cleanly when stopped so that installd is killed and buffered log
+    // records are written. SA_RESTART is not set, so epoll_wait() is
+    // interrupted.
+    struct sigaction sa;
+    sa.sa_handler = terminate_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    if (sigaction(SIGTERM, &sa, nullptr) < 0) {
+        LOGW("Failed to set SIGTERM handler: %s", strerror(errno));
+    }
+
     LOGD("Ready! Waiting for connections");
 
     // Start processing commands!
@@ -930,7 +1486,7 @@ int appsync_main(int argc, char *argv[])
     fix_multiboot_permissions();
 
     // mbtool logging
-    log::set_logger(std::make_shared<log::StdioLogger>(fp.get()));
+    log::set_logger(std::make_shared<log::AsyncLogger>(fileno(fp.get())));
 
     LOGI("=== APPSYNC VERSION %s ===", version());
 
@@ -959,7 +1515,9 @@ int appsync_main(int argc, char *argv[])
         }
     }
 
-    return hijack_socket(can_appsync) ? EXIT_SUCCESS : EXIT_FAILURE;
+    bool ret = hijack_socket(can_appsync);
+    log::flush();
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 }
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Drives data through pairs of miniadbd local sockets connected to each
+// other, optionally alongside idle sockets that are registered with fdevent
+// but never become ready. This measures the cost of the fdevent loop and the
+// local socket read/write paths without a USB function device.
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "miniadbd/sysdeps.h"
+
+#include "miniadbd/adb.h"
+#include "miniadbd/fdevent.h"
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t WRITE_CHUNK_SIZE = 16384;
+
+static bool create_pair(int &input_fd, int &output_fd)
+{
+    int in[2];
+    int out[2];
+
+    if (adb_socketpair(in) < 0) {
+        return false;
+    }
+    if (adb_socketpair(out) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+
+    // Data written to input_fd is read by local socket a, passed to its peer
+    // b, and written to output_fd
+    asocket *a = create_local_socket(in[1]);
+    asocket *b = create_local_socket(out[0]);
+    a->peer = b;
+    b->peer = a;
+    a->ready(a);
+    b->ready(b);
+
+    input_fd = in[0];
+    output_fd = out[1];
+    return true;
+}
+
+static bool create_idle_socket()
+{
+    int sv[2];
+
+    if (adb_socketpair(sv) < 0) {
+        return false;
+    }
+
+    // sv[0] is kept open, but nothing is ever written to it
+    asocket *s = create_local_socket(sv[1]);
+    s->ready(s);
+
+    return true;
+}
+
+static void write_all(const std::vector<int> &fds, size_t per_pair)
+{
+    std::vector<char> buf(WRITE_CHUNK_SIZE, 'x');
+    std::vector<size_t> left(fds.size(), per_pair);
+    std::vector<pollfd> pfds(fds.size());
+    size_t remaining = per_pair * fds.size();
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    while (remaining > 0) {
+        for (size_t i = 0; i < fds.size(); ++i) {
+            pfds[i] = { fds[i], static_cast<short>(left[i] ? POLLOUT : 0), 0 };
+        }
+
+        if (poll(pfds.data(), pfds.size(), -1) < 0) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (!(pfds[i].revents & POLLOUT)) {
+                continue;
+            }
+
+            int n = adb_write(fds[i], buf.data(),
+                              std::min(WRITE_CHUNK_SIZE, left[i]));
+            if (n > 0) {
+                left[i] -= static_cast<size_t>(n);
+                remaining -= static_cast<size_t>(n);
+            }
+        }
+    }
+}
+
+static size_t read_all(const std::vector<int> &fds, size_t total)
+{
+    std::vector<char> buf(1024 * 1024);
+    std::vector<pollfd> pfds(fds.size());
+    size_t received = 0;
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+        pfds[i] = { fds[i], POLLIN, 0 };
+    }
+
+    while (received < total) {
+        if (poll(pfds.data(), pfds.size(), -1) < 0) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            int n = adb_read(fds[i], buf.data(), buf.size());
+            if (n > 0) {
+                received += static_cast<size_t>(n);
+            } else if (n == 0) {
+                fprintf(stderr, "Local socket closed unexpectedly\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    return received;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: %s <pairs> <MiB per pair> [<idle sockets>]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int pairs = atoi(argv[1]);
+    size_t per_pair = strtoul(argv[2], nullptr, 10) * 1024 * 1024;
+    int idle = argc > 3 ? atoi(argv[3]) : 0;
+
+    if (pairs <= 0 || per_pair == 0 || idle < 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<int> input_fds(static_cast<size_t>(pairs));
+    std::vector<int> output_fds(static_cast<size_t>(pairs));
+
+    for (size_t i = 0; i < input_fds.size(); ++i) {
+        if (!create_pair(input_fds[i], output_fds[i])) {
+            perror("Failed to create socket pair");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < idle; ++i) {
+        if (!create_idle_socket()) {
+            perror("Failed to create idle socket");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The loop never returns, so the process exits with it still running
+    std::thread(fdevent_loop).detach();
+
+    auto start = Clock::now();
+
+    std::thread writer(write_all, std::cref(input_fds), per_pair);
+    size_t received = read_all(output_fds, per_pair * input_fds.size());
+    writer.join();
+
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    double mib = static_cast<double>(received) / (1024 * 1024);
+
+    printf("%d pairs, %d idle: %.0f MiB in %.3f s = %.0f MiB/s\n",
+           pairs, idle, mib, secs, mib / secs);
+    fflush(stdout);
+
+    _exit(EXIT_SUCCESS);
+}
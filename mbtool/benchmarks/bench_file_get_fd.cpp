@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares copying a file through the daemon socket in FileRead-sized chunks
+// with passing the file descriptor once (FileGetFd) and reading it directly.
+// Both sides run in the same process over a socketpair.
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mbutil/socket.h"
+
+using namespace mb;
+
+using Clock = std::chrono::steady_clock;
+
+// Same chunk size as RomUtils.cacheWallpaper() used with FileRead
+static constexpr uint32_t READ_CHUNK_SIZE = 10240;
+
+enum class Mode : uint8_t
+{
+    Read,
+    GetFd,
+};
+
+static bool serve(int sock, int file_fd)
+{
+    std::vector<uint8_t> buf;
+
+    while (true) {
+        uint8_t mode;
+        if (util::socket_read(sock, &mode, 1) != 1) {
+            // Client is done
+            return true;
+        }
+
+        if (lseek(file_fd, 0, SEEK_SET) < 0) {
+            return false;
+        }
+
+        if (static_cast<Mode>(mode) == Mode::GetFd) {
+            if (!util::socket_send_fds(sock, { file_fd })) {
+                return false;
+            }
+            continue;
+        }
+
+        // One length-prefixed message per chunk, like FileReadResponse
+        while (true) {
+            uint32_t size;
+            if (!util::socket_read_uint32(sock, size)) {
+                return false;
+            }
+
+            buf.resize(size);
+            ssize_t n = read(file_fd, buf.data(), buf.size());
+            if (n < 0) {
+                return false;
+            }
+
+            if (!util::socket_write_bytes(sock, buf.data(),
+                                          static_cast<size_t>(n))) {
+                return false;
+            }
+
+            if (n == 0) {
+                break;
+            }
+        }
+    }
+}
+
+static bool run_read(int sock, std::vector<uint8_t> &data)
+{
+    uint8_t mode = static_cast<uint8_t>(Mode::Read);
+    if (util::socket_write(sock, &mode, 1) != 1) {
+        return false;
+    }
+
+    std::vector<uint8_t> chunk;
+    size_t offset = 0;
+
+    while (true) {
+        if (!util::socket_write_uint32(sock, READ_CHUNK_SIZE)
+                || !util::socket_read_bytes(sock, chunk)) {
+            return false;
+        }
+
+        if (chunk.empty()) {
+            break;
+        } else if (offset + chunk.size() > data.size()) {
+            return false;
+        }
+
+        memcpy(data.data() + offset, chunk.data(), chunk.size());
+        offset += chunk.size();
+    }
+
+    return offset == data.size();
+}
+
+static bool run_get_fd(int sock, std::vector<uint8_t> &data)
+{
+    uint8_t mode = static_cast<uint8_t>(Mode::GetFd);
+    if (util::socket_write(sock, &mode, 1) != 1) {
+        return false;
+    }
+
+    std::vector<int> fds(1);
+    if (!util::socket_receive_fds(sock, fds)) {
+        return false;
+    }
+
+    size_t offset = 0;
+
+    while (offset < data.size()) {
+        ssize_t n = read(fds[0], data.data() + offset, data.size() - offset);
+        if (n <= 0) {
+            break;
+        }
+        offset += static_cast<size_t>(n);
+    }
+
+    close(fds[0]);
+
+    return offset == data.size();
+}
+
+static void report(const char *name, Clock::duration elapsed,
+                   unsigned int iterations, size_t size)
+{
+    double secs = std::chrono::duration<double>(elapsed).count();
+    double mib = static_cast<double>(size) * iterations / (1024 * 1024);
+
+    printf("%-10s %8.2f ms/iter %10.1f MiB/s\n", name,
+           secs * 1000 / iterations, mib / secs);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = 20 * 1024 * 1024;
+    unsigned int iterations = 20;
+
+    if (argc > 1) {
+        size = strtoul(argv[1], nullptr, 10) * 1024 * 1024;
+    }
+    if (argc > 2) {
+        iterations = static_cast<unsigned int>(strtoul(argv[2], nullptr, 10));
+    }
+    if (size == 0 || iterations == 0) {
+        fprintf(stderr, "Usage: %s [<size in MiB> [<iterations>]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *tmpdir = getenv("TMPDIR");
+    std::string path(tmpdir ? tmpdir : "/data/local/tmp");
+    path += "/bench_file_get_fd.XXXXXX";
+
+    int file_fd = mkstemp(&path[0]);
+    if (file_fd < 0) {
+        fprintf(stderr, "%s: Failed to create file: %s\n",
+                path.c_str(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+    unlink(path.c_str());
+
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = static_cast<uint8_t>(i * 31);
+    }
+    if (write(file_fd, data.data(), data.size())
+            != static_cast<ssize_t>(data.size())) {
+        fprintf(stderr, "Failed to write file: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    std::thread server([&] {
+        if (!serve(sv[1], file_fd)) {
+            fprintf(stderr, "Server failed: %s\n", strerror(errno));
+        }
+        close(sv[1]);
+    });
+
+    bool ok = true;
+
+    for (auto mode : { Mode::Read, Mode::GetFd }) {
+        auto start = Clock::now();
+
+        for (unsigned int i = 0; ok && i < iterations; ++i) {
+            ok = mode == Mode::Read
+                    ? run_read(sv[0], data)
+                    : run_get_fd(sv[0], data);
+        }
+
+        if (!ok) {
+            fprintf(stderr, "Benchmark failed\n");
+            break;
+        }
+
+        report(mode == Mode::Read ? "FileRead" : "FileGetFd",
+               Clock::now() - start, iterations, size);
+    }
+
+    close(sv[0]);
+    server.join();
+    close(file_fd);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
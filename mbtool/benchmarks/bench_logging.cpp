@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures how long it takes for several threads to log a fixed number of
+// records each with the StdioLogger and AsyncLogger backends. The records go
+// to a temporary file and use the default format, including the timestamp.
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "mblog/async_logger.h"
+#include "mblog/logging.h"
+#include "mblog/stdio_logger.h"
+
+#define LOG_TAG "bench_logging"
+
+using namespace mb;
+
+using Clock = std::chrono::steady_clock;
+
+static Clock::duration run(unsigned int threads, unsigned int records)
+{
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+
+    for (unsigned int t = 0; t < threads; ++t) {
+        workers.emplace_back([records, t] {
+            for (unsigned int i = 0; i < records; ++i) {
+                LOGD("Thread %u logged record %u of %u", t, i, records);
+            }
+        });
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    log::flush();
+
+    return Clock::now() - start;
+}
+
+static void report(const char *name, Clock::duration elapsed,
+                   unsigned int threads, unsigned int records)
+{
+    double secs = std::chrono::duration<double>(elapsed).count();
+
+    printf("%-12s %8.1f ms %12.0f records/s\n", name, secs * 1000,
+           static_cast<double>(threads) * records / secs);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int threads = 8;
+    unsigned int records = 20000;
+
+    if (argc > 1) {
+        threads = static_cast<unsigned int>(strtoul(argv[1], nullptr, 10));
+    }
+    if (argc > 2) {
+        records = static_cast<unsigned int>(strtoul(argv[2], nullptr, 10));
+    }
+    if (threads == 0 || records == 0) {
+        fprintf(stderr, "Usage: %s [<threads> [<records per thread>]]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *tmpdir = getenv("TMPDIR");
+    std::string path(tmpdir ? tmpdir : "/data/local/tmp");
+    path += "/bench_logging.XXXXXX";
+
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Failed to create file: %s\n",
+                path.c_str(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+    unlink(path.c_str());
+
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file stream: %s\n", strerror(errno));
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    log::set_logger(std::make_shared<log::StdioLogger>(fp));
+    report("StdioLogger", run(threads, records), threads, records);
+
+    log::set_logger(std::make_shared<log::AsyncLogger>(fileno(fp)));
+    report("AsyncLogger", run(threads, records), threads, records);
+
+    log::set_logger(nullptr);
+    fclose(fp);
+
+    return EXIT_SUCCESS;
+}
@@ -20,10 +20,13 @@
 #include "daemon.h"
 
 #include <algorithm>
+#include <vector>
 
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <sched.h>
+#include <signal.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -33,11 +36,13 @@
 
 #include "mbcommon/common.h"
 #include "mbcommon/finally.h"
+#include "mbcommon/integer.h"
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
 #include "mblog/logging.h"
 #include "mblog/kmsg_logger.h"
-#include "mblog/stdio_logger.h"
+#include "mblog/async_logger.h"
+#include "mblog/binary_logger.h"
 #include "mbutil/directory.h"
 #include "mbutil/process.h"
 #include "mbutil/selinux.h"
@@ -46,6 +51,7 @@
 #include "daemon_v3.h"
 #include "multiboot.h"
 #include "packages.h"
+#include "rom_cache.h"
 #include "roms.h"
 #include "sepolpatch.h"
 #include "validcerts.h"
@@ -60,6 +66,10 @@
 #define RESPONSE_OK "OK"                        // Generic accepted response
 #define RESPONSE_UNSUPPORTED "UNSUPPORTED"      // Generic unsupported response
 
+// Number of connections a worker handles before it is replaced. This bounds
+// the amount of state that can leak from one connection to the next.
+#define WORKER_MAX_CONNECTIONS 100
+
 
 namespace mb
 {
@@ -72,7 +82,24 @@ static bool sigstop_when_ready = false;
 static bool allow_root_client = false;
 static bool log_to_kmsg = false;
 static bool log_to_stdio = false;
+static bool log_binary = false;
 static bool no_unshare = false;
+static unsigned int worker_count = 0;
+
+struct Worker
+{
+    pid_t pid;
+    // Our end of the control socket. Connections are passed to the worker
+    // with SCM_RIGHTS and the worker replies with a single byte when it is
+    // ready for the next one.
+    int fd;
+    bool idle;
+};
+
+static std::vector<Worker> workers;
+
+// Set by the SIGTERM handler
+static volatile sig_atomic_t terminate_requested = 0;
 
 static ScopedFILE log_fp(nullptr, [](FILE *fp) {
     if (fp) {
@@ -90,7 +117,8 @@ static bool verify_credentials(uid_t uid)
     // which case, there's not much we can do to prevent damage.
 
     Packages pkgs;
-    if (!pkgs.load_xml(PACKAGES_XML)) {
+    if (!pkgs.load_xml(PACKAGES_XML, Packages::Field::All
+            & ~Packages::Fields(Packages::Field::Paths))) {
         LOGE("Failed to load " PACKAGES_XML);
         return false;
     }
@@ -188,6 +216,309 @@ static bool client_connection(int fd)
     }
 }
 
+static void terminate_handler(int)
+{
+    terminate_requested = 1;
+}
+
+/*!
+ * \brief Flush the log and exit from a connection process
+ */
+MB_NO_RETURN
+static void exit_connection_process(int status)
+{
+    log::flush();
+    _exit(status);
+}
+
+static void close_worker_fds()
+{
+    for (auto &worker : workers) {
+        if (worker.fd >= 0) {
+            close(worker.fd);
+            worker.fd = -1;
+        }
+    }
+}
+
+/*!
+ * \brief Move the current process into a new mount namespace
+ *
+ * Mount changes made while handling requests then do not affect the rest of
+ * the system. If \p base_ns_fd is not -1, the process first rejoins that
+ * namespace so that the new namespace does not inherit mounts made for a
+ * previous connection.
+ */
+static bool enter_new_mount_namespace(int base_ns_fd)
+{
+    if (no_unshare) {
+        return true;
+    }
+
+    if (base_ns_fd >= 0 && setns(base_ns_fd, CLONE_NEWNS) < 0) {
+        LOGE("Failed to rejoin daemon mount namespace: %s", strerror(errno));
+        return false;
+    }
+
+    if (unshare(CLONE_NEWNS) < 0) {
+        LOGE("unshare() failed: %s", strerror(errno));
+        return false;
+    }
+
+    if (mount("", "/", "", MS_PRIVATE | MS_REC, "") < 0) {
+        LOGE("Failed to set private mount propagation: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Set up a newly forked process for handling connections
+ */
+static bool init_connection_process(int listen_fd, const char *title)
+{
+    // Change the process name so --replace doesn't kill existing
+    // connections
+    if (!util::set_process_title(title, nullptr)) {
+        LOGE("Failed to set process title: %s", strerror(errno));
+        return false;
+    }
+
+    // Restore default SIGCHLD handler
+    struct sigaction sa;
+    sa.sa_handler = SIG_DFL;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    if (sigaction(SIGCHLD, &sa, 0) < 0) {
+        LOGE("Failed to set default SIGCHLD handler: %s", strerror(errno));
+        return false;
+    }
+
+    // Connections are not interrupted when the daemon is stopped
+    if (sigaction(SIGTERM, &sa, 0) < 0) {
+        LOGE("Failed to set default SIGTERM handler: %s", strerror(errno));
+        return false;
+    }
+
+    // Don't need the listening socket fd or the worker control sockets
+    close(listen_fd);
+    close_worker_fds();
+
+    return true;
+}
+
+static void fork_connection(int listen_fd, int client_fd)
+{
+    // Let the child inherit an up-to-date ROM list
+    rom_cache_update();
+
+    pid_t child_pid = fork();
+    if (child_pid < 0) {
+        LOGE("Failed to fork: %s", strerror(errno));
+    } else if (child_pid == 0) {
+        if (!init_connection_process(
+                listen_fd, "mbtool connection initializing")
+                || !enter_new_mount_namespace(-1)) {
+            _exit(127);
+        }
+
+        bool ret = client_connection(client_fd);
+        close(client_fd);
+        exit_connection_process(ret ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+}
+
+MB_NO_RETURN
+static void worker_main(int listen_fd, int ctrl_fd)
+{
+    if (!init_connection_process(listen_fd, "mbtool connection worker")) {
+        _exit(127);
+    }
+
+    // Keep a reference to the daemon's mount namespace. Each connection gets
+    // a fresh namespace created from it, just like a forked connection
+    // process would, so mounts never carry over between connections.
+    int base_ns_fd = -1;
+    if (!no_unshare) {
+        base_ns_fd = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+        if (base_ns_fd < 0) {
+            LOGE("Failed to open mount namespace: %s", strerror(errno));
+            _exit(127);
+        }
+    }
+
+    for (int i = 0; i < WORKER_MAX_CONNECTIONS; ++i) {
+        std::vector<int> fds(1);
+
+        // Fails with EOF when the daemon exits
+        if (!util::socket_receive_fds(ctrl_fd, fds)) {
+            exit_connection_process(EXIT_SUCCESS);
+        }
+
+        // The daemon sees the connection closing and replaces this worker
+        if (!enter_new_mount_namespace(base_ns_fd)) {
+            exit_connection_process(EXIT_FAILURE);
+        }
+
+        // Credentials are checked for every connection
+        client_connection(fds[0]);
+        close(fds[0]);
+
+        util::set_process_title("mbtool connection worker", nullptr);
+
+        // Don't announce that we're ready if we're about to exit
+        if (i + 1 < WORKER_MAX_CONNECTIONS && write(ctrl_fd, "", 1) != 1) {
+            exit_connection_process(EXIT_FAILURE);
+        }
+    }
+
+    exit_connection_process(EXIT_SUCCESS);
+}
+
+static bool spawn_worker(int listen_fd, Worker &worker)
+{
+    int fds[2];
+
+    worker.pid = -1;
+    worker.fd = -1;
+    worker.idle = false;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        LOGE("Failed to create worker socket pair: %s", strerror(errno));
+        return false;
+    }
+
+    rom_cache_update();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Failed to fork worker: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    } else if (pid == 0) {
+        close(fds[0]);
+        worker_main(listen_fd, fds[1]);
+    }
+
+    close(fds[1]);
+
+    worker.pid = pid;
+    worker.fd = fds[0];
+    worker.idle = true;
+
+    return true;
+}
+
+static void dispatch_connection(int listen_fd, int client_fd)
+{
+    for (auto &worker : workers) {
+        if (worker.fd >= 0 && worker.idle) {
+            if (util::socket_send_fds(worker.fd, { client_fd })) {
+                worker.idle = false;
+                return;
+            }
+
+            LOGW("Failed to pass connection to worker %d: %s",
+                 worker.pid, strerror(errno));
+        }
+    }
+
+    // All workers are busy
+    fork_connection(listen_fd, client_fd);
+}
+
+static bool accept_connections(int fd)
+{
+    while (true) {
+        int client_fd = accept(fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                if (terminate_requested) {
+                    LOGD("Received SIGTERM; exiting");
+                    return true;
+                }
+                continue;
+            }
+            LOGE("Failed to accept connection on socket: %s", strerror(errno));
+            return false;
+        }
+
+        fork_connection(fd, client_fd);
+        close(client_fd);
+    }
+}
+
+static bool accept_connections_with_workers(int fd)
+{
+    workers.resize(worker_count);
+
+    for (auto &worker : workers) {
+        spawn_worker(fd, worker);
+    }
+
+    auto stop_workers = finally([&]{
+        close_worker_fds();
+    });
+
+    std::vector<struct pollfd> pfds;
+
+    while (true) {
+        pfds.clear();
+        pfds.push_back({ fd, POLLIN, 0 });
+        for (auto const &worker : workers) {
+            // Negative fds are ignored by poll()
+            pfds.push_back({ worker.fd, POLLIN, 0 });
+        }
+
+        if (poll(pfds.data(), pfds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                if (terminate_requested) {
+                    LOGD("Received SIGTERM; exiting");
+                    return true;
+                }
+                continue;
+            }
+            LOGE("Failed to poll sockets: %s", strerror(errno));
+            return false;
+        }
+
+        for (size_t i = 0; i < workers.size(); ++i) {
+            Worker &worker = workers[i];
+
+            if (worker.fd < 0 || pfds[i + 1].revents == 0) {
+                continue;
+            }
+
+            char dummy;
+            if ((pfds[i + 1].revents & POLLIN)
+                    && read(worker.fd, &dummy, 1) == 1) {
+                worker.idle = true;
+                continue;
+            }
+
+            // The worker exited. It was already reaped because SIGCHLD is
+            // ignored.
+            LOGD("Worker %d exited; spawning replacement", worker.pid);
+            close(worker.fd);
+            spawn_worker(fd, worker);
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int client_fd = accept(fd, nullptr, nullptr);
+            if (client_fd < 0) {
+                LOGE("Failed to accept connection on socket: %s",
+                     strerror(errno));
+                return false;
+            }
+
+            dispatch_connection(fd, client_fd);
+            close(client_fd);
+        }
+    }
+}
+
 static bool run_daemon()
 {
     int fd;
@@ -249,64 +580,24 @@ static bool run_daemon()
             LOGE("Failed to set SIGCHLD handler: %s", strerror(errno));
             return false;
         }
-    }
-
-    LOGD("Socket ready, waiting for connections");
-
-    int client_fd;
-    while ((client_fd = accept(fd, nullptr, nullptr)) >= 0) {
-        pid_t child_pid = fork();
-        if (child_pid < 0) {
-            LOGE("Failed to fork: %s", strerror(errno));
-        } else if (child_pid == 0) {
-            if (!no_unshare) {
-                if (unshare(CLONE_NEWNS) < 0) {
-                    LOGE("unshare() failed: %s", strerror(errno));
-                    _exit(127);
-                }
-
-                if (mount("", "/", "", MS_PRIVATE | MS_REC, "") < 0) {
-                    LOGE("Failed to set private mount propagation: %s",
-                         strerror(errno));
-                    _exit(127);
-                }
-            }
-
-            // Change the process name so --replace doesn't kill existing
-            // connections
-            if (!util::set_process_title(
-                    "mbtool connection initializing", nullptr)) {
-                LOGE("Failed to set process title: %s", strerror(errno));
-                _exit(127);
-            }
-
-            // Restore default SIGCHLD handler
-            struct sigaction sa;
-            sa.sa_handler = SIG_DFL;
-            sigemptyset(&sa.sa_mask);
-            sa.sa_flags = 0;
-            if (sigaction(SIGCHLD, &sa, 0) < 0) {
-                LOGE("Failed to set default SIGCHLD handler: %s",
-                     strerror(errno));
-                _exit(127);
-            }
-
-            // Don't need the listening socket fd
-            close(fd);
 
-            bool ret = client_connection(client_fd);
-            close(client_fd);
-            _exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
+        // Exit cleanly when stopped so that buffered log records are written.
+        // SA_RESTART is not set, so accept() and poll() are interrupted.
+        sa.sa_handler = terminate_handler;
+        if (sigaction(SIGTERM, &sa, 0) < 0) {
+            LOGE("Failed to set SIGTERM handler: %s", strerror(errno));
+            return false;
         }
-        close(client_fd);
     }
 
-    if (client_fd < 0) {
-        LOGE("Failed to accept connection on socket: %s", strerror(errno));
-        return false;
-    }
+    LOGD("Socket ready, waiting for connections");
 
-    return true;
+    if (worker_count > 0) {
+        LOGD("Using %u pre-forked workers", worker_count);
+        return accept_connections_with_workers(fd);
+    } else {
+        return accept_connections(fd);
+    }
 }
 
 static bool redirect_stdio_to_dev_null()
@@ -356,24 +647,32 @@ static bool daemon_init()
     } else if (log_to_kmsg) {
         log::set_logger(std::make_shared<log::KmsgLogger>(false));
     } else {
-        if (!util::mkdir_parent(MULTIBOOT_LOG_DAEMON, 0775)
-                && errno != EEXIST) {
+        const char *log_path =
+                log_binary ? MULTIBOOT_LOG_DAEMON_BIN : MULTIBOOT_LOG_DAEMON;
+
+        if (!util::mkdir_parent(log_path, 0775) && errno != EEXIST) {
             LOGE("Failed to create parent directory of %s: %s",
-                 MULTIBOOT_LOG_DAEMON, strerror(errno));
+                 log_path, strerror(errno));
             return false;
         }
 
-        log_fp.reset(fopen(get_raw_path(MULTIBOOT_LOG_DAEMON).c_str(), "w"));
+        log_fp.reset(fopen(get_raw_path(log_path).c_str(), "w"));
         if (!log_fp) {
             LOGE("Failed to open log file %s: %s",
-                 MULTIBOOT_LOG_DAEMON, strerror(errno));
+                 log_path, strerror(errno));
             return false;
         }
 
         fix_multiboot_permissions();
 
         // mbtool logging
-        log::set_logger(std::make_shared<log::StdioLogger>(log_fp.get()));
+        if (log_binary) {
+            log::set_logger(std::make_shared<log::BinaryLogger>(
+                    fileno(log_fp.get()), true));
+        } else {
+            log::set_logger(std::make_shared<log::AsyncLogger>(
+                    fileno(log_fp.get())));
+        }
     }
 
     LOGD("Initialized daemon");
@@ -448,8 +747,9 @@ static void run_daemon_fork()
     // Close read end of the pipe
     close(pipe_fds[0]);
 
-    _exit((daemon_init() && run_daemon())
-            ? EXIT_SUCCESS : EXIT_FAILURE);
+    bool ret = daemon_init() && run_daemon();
+    log::flush();
+    _exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 static void daemon_usage(bool error)
@@ -472,7 +772,13 @@ static void daemon_usage(bool error)
             "                   fully initialized\n"
             "  --log-to-kmsg    Send log output to kernel log instead of file\n"
             "  --log-to-stdio   Send log output to stdout/stderr\n"
-            "  --no-unshare     Don't unshare mount namespace\n");
+            "  --log-binary     Write compact binary log (decode with\n"
+            "                   mblogdecode)\n"
+            "  --no-unshare     Don't unshare mount namespace\n"
+            "  --workers <count>\n"
+            "                   Hand connections to <count> pre-forked worker\n"
+            "                   processes instead of forking for every\n"
+            "                   connection\n");
 }
 
 int daemon_main(int argc, char *argv[])
@@ -489,6 +795,8 @@ int daemon_main(int argc, char *argv[])
         OPT_LOG_TO_KMSG = 1003,
         OPT_LOG_TO_STDIO = 1004,
         OPT_NO_UNSHARE = 1005,
+        OPT_WORKERS = 1006,
+        OPT_LOG_BINARY = 1007,
     };
 
     static struct option long_options[] = {
@@ -500,7 +808,9 @@ int daemon_main(int argc, char *argv[])
         {"sigstop-when-ready", no_argument, 0, OPT_SIGSTOP_WHEN_READY},
         {"log-to-kmsg",        no_argument, 0, OPT_LOG_TO_KMSG},
         {"log-to-stdio",       no_argument, 0, OPT_LOG_TO_STDIO},
+        {"log-binary",         no_argument, 0, OPT_LOG_BINARY},
         {"no-unshare",         no_argument, 0, OPT_NO_UNSHARE},
+        {"workers",            required_argument, 0, OPT_WORKERS},
         {0, 0, 0, 0}
     };
 
@@ -540,10 +850,21 @@ int daemon_main(int argc, char *argv[])
             log_to_stdio = true;
             break;
 
+        case OPT_LOG_BINARY:
+            log_binary = true;
+            break;
+
         case OPT_NO_UNSHARE:
             no_unshare = true;
             break;
 
+        case OPT_WORKERS:
+            if (!str_to_num(optarg, 10, worker_count)) {
+                fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
         default:
             daemon_usage(1);
             return EXIT_FAILURE;
@@ -612,8 +933,9 @@ int daemon_main(int argc, char *argv[])
     if (fork_flag) {
         run_daemon_fork();
     } else {
-        return (daemon_init() && run_daemon())
-                ? EXIT_SUCCESS : EXIT_FAILURE;
+        bool ret = daemon_init() && run_daemon();
+        log::flush();
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 }
 
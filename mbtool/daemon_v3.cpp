@@ -19,8 +19,8 @@
 
 #include "daemon_v3.h"
 
+#include <array>
 #include <unordered_map>
-#include <unordered_set>
 
 #include <fcntl.h>
 #include <sys/mount.h>
@@ -36,7 +36,7 @@
 #include "mbutil/copy.h"
 #include "mbutil/delete.h"
 #include "mbutil/directory.h"
-#include "mbutil/fts.h"
+#include "mbutil/dirsize.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
@@ -46,6 +46,7 @@
 #include "init.h"
 #include "packages.h"
 #include "reboot.h"
+#include "rom_cache.h"
 #include "roms.h"
 #include "signature.h"
 #include "switcher.h"
@@ -75,16 +76,37 @@ namespace fb = flatbuffers;
 static std::unordered_map<int, int> fd_map;
 static int fd_count = 0;
 
+// ID of the request currently being handled. It is echoed back in every
+// response so that clients can pipeline requests.
+static uint64_t cur_request_id = 0;
+
+// If non-null, responses are collected here instead of being written to the
+// socket. Used for building batch responses.
+static std::vector<std::vector<uint8_t>> *batch_responses = nullptr;
+
 static bool v3_send_response(int fd, const fb::FlatBufferBuilder &builder)
 {
+    if (batch_responses) {
+        auto data = builder.GetBufferPointer();
+        batch_responses->emplace_back(data, data + builder.GetSize());
+        return true;
+    }
+
     return util::socket_write_bytes(
             fd, builder.GetBufferPointer(), builder.GetSize());
 }
 
+static fb::Offset<v3::Response> v3_create_response(fb::FlatBufferBuilder &builder,
+                                                   v3::ResponseType type,
+                                                   fb::Offset<void> response)
+{
+    return v3::CreateResponse(builder, type, response, cur_request_id);
+}
+
 static bool v3_send_response_invalid(int fd)
 {
     fb::FlatBufferBuilder builder;
-    auto response = v3::CreateResponse(builder, v3::ResponseType_Invalid,
+    auto response = v3_create_response(builder, v3::ResponseType_Invalid,
                                        v3::CreateInvalid(builder).Union());
     builder.Finish(response);
     return v3_send_response(fd, builder);
@@ -93,7 +115,7 @@ static bool v3_send_response_invalid(int fd)
 static bool v3_send_response_unsupported(int fd)
 {
     fb::FlatBufferBuilder builder;
-    auto response = v3::CreateResponse(builder, v3::ResponseType_Unsupported,
+    auto response = v3_create_response(builder, v3::ResponseType_Unsupported,
                                        v3::CreateUnsupported(builder).Union());
     builder.Finish(response);
     return v3_send_response(fd, builder);
@@ -130,7 +152,7 @@ static bool v3_file_chmod(int fd, const v3::Request *msg)
             builder, ret, ret ? nullptr : strerror(saved_errno), error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_FileChmodResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -163,7 +185,7 @@ static bool v3_file_close(int fd, const v3::Request *msg)
             builder, ret, ret ? nullptr : strerror(saved_errno), error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_FileCloseResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -219,7 +241,7 @@ static bool v3_file_open(int fd, const v3::Request *msg)
             error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_FileOpenResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -257,12 +279,34 @@ static bool v3_file_read(int fd, const v3::Request *msg)
             static_cast<size_t>(ret), data, error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_FileReadResponse, response.Union()));
 
     return v3_send_response(fd, builder);
 }
 
+static bool v3_file_get_fd(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::FileGetFdRequest *>(msg->request());
+    auto it = fd_map.find(request->id());
+    if (it == fd_map.end()) {
+        return v3_send_response_invalid(fd);
+    }
+
+    fb::FlatBufferBuilder builder;
+
+    auto response = v3::CreateFileGetFdResponse(builder);
+
+    // Wrap response
+    builder.Finish(v3_create_response(
+            builder, v3::ResponseType_FileGetFdResponse, response.Union()));
+
+    // The client reads and writes the file directly through the received fd,
+    // which avoids copying bulk data through the socket
+    return v3_send_response(fd, builder)
+            && util::socket_send_fds(fd, { it->second });
+}
+
 static bool v3_file_seek(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileSeekRequest *>(msg->request());
@@ -304,7 +348,7 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
             error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_FileSeekResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -338,7 +382,7 @@ static bool v3_file_selinux_get_label(int fd, const v3::Request *msg)
             ret ? label.c_str() : nullptr, error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_PathSELinuxGetLabelResponse,
             response.Union()));
 
@@ -371,7 +415,7 @@ static bool v3_file_selinux_set_label(int fd, const v3::Request *msg)
             builder, ret, ret ? nullptr : strerror(saved_errno), error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_FileSELinuxSetLabelResponse,
             response.Union()));
 
@@ -422,7 +466,7 @@ static bool v3_file_stat(int fd, const v3::Request *msg)
             error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_FileStatResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -454,7 +498,7 @@ static bool v3_file_write(int fd, const v3::Request *msg)
             static_cast<size_t>(ret), error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_FileWriteResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -489,7 +533,7 @@ static bool v3_path_chmod(int fd, const v3::Request *msg)
             builder, ret, ret ? nullptr : strerror(saved_errno), error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_PathChmodResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -518,7 +562,7 @@ static bool v3_path_copy(int fd, const v3::Request *msg)
             builder, ret, ret ? nullptr : strerror(saved_errno), error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_PathCopyResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -567,7 +611,7 @@ static bool v3_path_delete(int fd, const v3::Request *msg)
             builder, ret, ret ? nullptr : strerror(saved_errno), error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_PathDeleteResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -607,7 +651,7 @@ static bool v3_path_mkdir(int fd, const v3::Request *msg)
             builder, ret, ret ? nullptr : strerror(saved_errno), error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_PathMkdirResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -636,7 +680,7 @@ static bool v3_path_readlink(int fd, const v3::Request *msg)
             builder, ret ? target.c_str() : nullptr, error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_PathReadlinkResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -672,7 +716,7 @@ static bool v3_path_selinux_get_label(int fd, const v3::Request *msg)
             ret ? label.c_str() : nullptr, error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_PathSELinuxGetLabelResponse,
             response.Union()));
 
@@ -709,61 +753,32 @@ static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
             builder, ret, ret ? nullptr : strerror(errno), error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_PathSELinuxSetLabelResponse,
             response.Union()));
 
     return v3_send_response(fd, builder);
 }
 
-class DirectorySizeGetter : public util::FtsWrapper {
-public:
-    DirectorySizeGetter(std::string path, std::vector<std::string> exclusions)
-        : FtsWrapper(path, util::FtsFlag::GroupSpecialFiles)
-        , _exclusions(std::move(exclusions))
-        , _total(0)
-    {
-    }
-
-    Actions on_changed_path() override
-    {
-        // Exclude first-level directories
-        if (_curr->fts_level == 1) {
-            if (std::find(_exclusions.begin(), _exclusions.end(), _curr->fts_name)
-                    != _exclusions.end()) {
-                return Action::Skip;
-            }
-        }
-
-        return Action::Ok;
-    }
-
-    Actions on_reached_file() override
-    {
-        dev_t dev = static_cast<dev_t>(_curr->fts_statp->st_dev);
-        ino_t ino = static_cast<ino_t>(_curr->fts_statp->st_ino);
-
-        // If this file has been visited before (hard link), then skip it
-        if (_links.find(dev) != _links.end()
-                && _links[dev].find(ino) != _links[dev].end()) {
-            return Action::Ok;
-        }
+static void v3_path_get_directory_size_progress(
+        const util::DirectorySize &partial, void *userdata)
+{
+    int fd = *static_cast<int *>(userdata);
 
-        _total += static_cast<uint64_t>(_curr->fts_statp->st_size);
-        _links[dev].emplace(ino);
+    fb::FlatBufferBuilder builder;
 
-        return Action::Ok;
-    }
+    auto response = v3::CreatePathGetDirectorySizeProgressResponse(
+            builder, partial.apparent_size, partial.allocated_size,
+            partial.files);
 
-    uint64_t total() const {
-        return _total;
-    }
+    // Wrap response
+    builder.Finish(v3_create_response(
+            builder, v3::ResponseType_PathGetDirectorySizeProgressResponse,
+            response.Union()));
 
-private:
-    std::vector<std::string> _exclusions;
-    std::unordered_map<dev_t, std::unordered_set<ino_t>> _links;
-    uint64_t _total;
-};
+    // Failures will be caught when the final response is sent
+    v3_send_response(fd, builder);
+}
 
 static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
 {
@@ -780,8 +795,15 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
         }
     }
 
-    DirectorySizeGetter dsg(request->path()->c_str(), std::move(exclusions));
-    bool ret = dsg.run();
+    // Progress responses cannot be interleaved with the entries of a batch
+    // response
+    bool report_progress = request->report_progress() && !batch_responses;
+
+    util::DirectorySize size;
+    bool ret = util::get_directory_size(
+            request->path()->c_str(), exclusions, 0, size,
+            report_progress ? &v3_path_get_directory_size_progress : nullptr,
+            &fd);
     int saved_errno = errno;
 
     fb::FlatBufferBuilder builder;
@@ -793,11 +815,11 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
     }
 
     auto response = v3::CreatePathGetDirectorySizeResponseDirect(
-            builder, ret, ret ? nullptr : strerror(saved_errno), dsg.total(),
-            error);
+            builder, ret, ret ? nullptr : strerror(saved_errno),
+            size.apparent_size, error, size.allocated_size);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_PathGetDirectorySizeResponse,
             response.Union()));
 
@@ -818,7 +840,7 @@ static void signed_exec_output_cb(const char *line, bool error, void *userdata)
     auto response = v3::CreateSignedExecOutputResponse(builder, line_id);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_SignedExecOutputResponse,
             response.Union()));
 
@@ -982,7 +1004,7 @@ done:
             builder, result, error_msg_id, exit_status, term_sig, error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_SignedExecResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -1003,7 +1025,7 @@ static bool v3_mb_get_booted_rom_id(int fd, const v3::Request *msg)
     auto response = v3::CreateMbGetBootedRomIdResponse(builder, id);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_MbGetBootedRomIdResponse,
             response.Union()));
 
@@ -1017,7 +1039,7 @@ static bool v3_mb_get_installed_roms(int fd, const v3::Request *msg)
     fb::FlatBufferBuilder builder;
 
     Roms roms;
-    roms.add_installed();
+    rom_cache_get_installed(roms);
 
     std::vector<fb::Offset<v3::MbRom>> fb_roms;
 
@@ -1071,7 +1093,7 @@ static bool v3_mb_get_installed_roms(int fd, const v3::Request *msg)
             builder, &fb_roms);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_MbGetInstalledRomsResponse,
             response.Union()));
 
@@ -1088,7 +1110,7 @@ static bool v3_mb_get_version(int fd, const v3::Request *msg)
     auto response = v3::CreateMbGetVersionResponseDirect(builder, version());
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_MbGetVersionResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -1115,7 +1137,7 @@ static bool v3_mb_set_kernel(int fd, const v3::Request *msg)
     auto response = v3::CreateMbSetKernelResponse(builder, ret, error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_MbSetKernelResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -1172,7 +1194,7 @@ static bool v3_mb_switch_rom(int fd, const v3::Request *msg)
             builder, success, fb_ret, error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_MbSwitchRomResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -1187,7 +1209,7 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
 
     // Find and verify ROM is installed
     Roms roms;
-    roms.add_installed();
+    rom_cache_get_installed(roms);
 
     auto rom = roms.find_by_id(request->rom_id()->c_str());
     if (!rom) {
@@ -1246,7 +1268,7 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
             builder, &succeeded, &failed);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_MbWipeRomResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -1262,7 +1284,7 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
 
     // Find and verify ROM is installed
     Roms roms;
-    roms.add_installed();
+    rom_cache_get_installed(roms);
 
     auto rom = roms.find_by_id(request->rom_id()->c_str());
     if (!rom) {
@@ -1279,14 +1301,17 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
     unsigned int other_pkgs = 0;
 
     Packages pkgs;
-    bool ret = pkgs.load_xml(packages_xml);
+    bool ret = pkgs.load_xml(packages_xml, Packages::Field::Flags);
 
     if (ret) {
-        for (std::shared_ptr<Package> pkg : pkgs.pkgs) {
-            bool is_system = (pkg->pkg_flags & Package::Flag::SYSTEM)
-                    || (pkg->pkg_public_flags & Package::PublicFlag::SYSTEM);
-            bool is_update = (pkg->pkg_flags & Package::Flag::UPDATED_SYSTEM_APP)
-                    || (pkg->pkg_public_flags & Package::PublicFlag::UPDATED_SYSTEM_APP);
+        for (size_t i = 0; i < pkgs.size(); ++i) {
+            auto flags = pkgs.pkg_flags(i);
+            auto public_flags = pkgs.pkg_public_flags(i);
+
+            bool is_system = (flags & Package::Flag::SYSTEM)
+                    || (public_flags & Package::PublicFlag::SYSTEM);
+            bool is_update = (flags & Package::Flag::UPDATED_SYSTEM_APP)
+                    || (public_flags & Package::PublicFlag::UPDATED_SYSTEM_APP);
 
             if (is_update) {
                 ++update_pkgs;
@@ -1304,7 +1329,7 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
             builder, ret, system_pkgs, update_pkgs, other_pkgs, error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_MbGetPackagesCountResponse,
             response.Union()));
 
@@ -1349,7 +1374,7 @@ static bool v3_reboot(int fd, const v3::Request *msg)
     auto response = v3::CreateRebootResponse(builder, ret, error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_RebootResponse, response.Union()));
 
     return v3_send_response(fd, builder);
@@ -1385,12 +1410,73 @@ static bool v3_shutdown(int fd, const v3::Request *msg)
     auto response = v3::CreateShutdownResponse(builder, ret, error);
 
     // Wrap response
-    builder.Finish(v3::CreateResponse(
+    builder.Finish(v3_create_response(
             builder, v3::ResponseType_ShutdownResponse, response.Union()));
 
     return v3_send_response(fd, builder);
 }
 
+static bool v3_dispatch(int fd, const v3::Request *msg);
+
+static bool v3_batch(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::BatchRequest *>(msg->request());
+
+    std::vector<std::vector<uint8_t>> responses;
+
+    {
+        batch_responses = &responses;
+
+        auto reset_batch = finally([&]{
+            batch_responses = nullptr;
+        });
+
+        if (request->requests()) {
+            responses.reserve(request->requests()->size());
+
+            for (auto const *sub_request : *request->requests()) {
+                bool ret;
+
+                switch (sub_request->request_type()) {
+                case v3::RequestType_BatchRequest:
+                case v3::RequestType_FileGetFdRequest:
+                case v3::RequestType_SignedExecRequest:
+                    // Nested batches and requests that send more than a single
+                    // response are not allowed
+                    cur_request_id = sub_request->id();
+                    ret = v3_send_response_invalid(fd);
+                    break;
+                default:
+                    ret = v3_dispatch(fd, sub_request);
+                    break;
+                }
+
+                if (!ret) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    fb::FlatBufferBuilder builder;
+    std::vector<fb::Offset<v3::BatchResponseEntry>> entries;
+    entries.reserve(responses.size());
+
+    for (auto const &data : responses) {
+        entries.push_back(v3::CreateBatchResponseEntryDirect(builder, &data));
+    }
+
+    // Create response
+    auto response = v3::CreateBatchResponseDirect(builder, &entries);
+
+    // Wrap response
+    cur_request_id = msg->id();
+    builder.Finish(v3_create_response(
+            builder, v3::ResponseType_BatchResponse, response.Union()));
+
+    return v3_send_response(fd, builder);
+}
+
 typedef bool (*request_handler_fn)(int, const v3::Request *);
 
 struct RequestMap
@@ -1402,6 +1488,7 @@ struct RequestMap
 static RequestMap request_map[] = {
     { v3::RequestType_FileChmodRequest, v3_file_chmod },
     { v3::RequestType_FileCloseRequest, v3_file_close },
+    { v3::RequestType_FileGetFdRequest, v3_file_get_fd },
     { v3::RequestType_FileOpenRequest, v3_file_open },
     { v3::RequestType_FileReadRequest, v3_file_read },
     { v3::RequestType_FileSeekRequest, v3_file_seek },
@@ -1427,9 +1514,41 @@ static RequestMap request_map[] = {
     { v3::RequestType_MbGetPackagesCountRequest, v3_mb_get_packages_count },
     { v3::RequestType_RebootRequest, v3_reboot },
     { v3::RequestType_ShutdownRequest, v3_shutdown },
+    { v3::RequestType_BatchRequest, v3_batch },
     { v3::RequestType_NONE, nullptr }
 };
 
+using RequestHandlerTable =
+        std::array<request_handler_fn, v3::RequestType_MAX + 1>;
+
+// Handlers indexed by request type
+static const RequestHandlerTable request_handlers = []{
+    RequestHandlerTable handlers{};
+    for (auto iter = request_map; iter->fn; ++iter) {
+        handlers[iter->type] = iter->fn;
+    }
+    return handlers;
+}();
+
+static bool v3_dispatch(int fd, const v3::Request *msg)
+{
+    v3::RequestType type = msg->request_type();
+    request_handler_fn fn = nullptr;
+
+    if (static_cast<size_t>(type) < request_handlers.size()) {
+        fn = request_handlers[type];
+    }
+
+    cur_request_id = msg->id();
+
+    if (fn) {
+        return fn(fd, msg);
+    } else {
+        // Invalid command; allow further commands
+        return v3_send_response_unsupported(fd);
+    }
+}
+
 bool connection_version_3(int fd)
 {
     std::string command;
@@ -1455,28 +1574,10 @@ bool connection_version_3(int fd)
         }
 
         const v3::Request *request = v3::GetRequest(data.data());
-        v3::RequestType type = request->request_type();
-        request_handler_fn fn = nullptr;
-
-        for (auto iter = request_map; iter->fn; ++iter) {
-            if (type == iter->type) {
-                fn = iter->fn;
-                break;
-            }
-        }
 
         // NOTE: A false return value indicates a connection error, not a
         //       command failure!
-        bool ret = true;
-
-        if (fn) {
-            ret = fn(fd, request);
-        } else {
-            // Invalid command; allow further commands
-            ret = v3_send_response_unsupported(fd);
-        }
-
-        if (!ret) {
+        if (!v3_dispatch(fd, request)) {
             return false;
         }
     }
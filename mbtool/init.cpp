@@ -40,12 +40,16 @@
 #include "minizip/ioapi_buf.h"
 #include "minizip/unzip.h"
 
+#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/finally.h"
+#include "mbcommon/libc/string.h"
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
 #include "mbdevice/json.h"
 #include "mblog/kmsg_logger.h"
 #include "mblog/logging.h"
+#include "mblog/trace.h"
 #include "mbutil/chown.h"
 #include "mbutil/cmdline.h"
 #include "mbutil/command.h"
@@ -65,6 +69,7 @@
 #include "initwrapper/util.h"
 #include "daemon.h"
 #include "emergency.h"
+#include "file-contexts-tool/fcontexts.h"
 #include "mount_fstab.h"
 #include "multiboot.h"
 #include "romconfig.h"
@@ -155,6 +160,7 @@ static bool start_daemon()
               "--sigstop-when-ready",
               "--log-to-kmsg",
               "--no-unshare",
+              "--workers", "2",
               nullptr);
         LOGE("Failed to exec daemon: %s", strerror(errno));
         _exit(127);
@@ -313,70 +319,242 @@ static bool replace_file(const char *replace, const char *with)
     return true;
 }
 
+struct NewFileContext
+{
+    const char *regex;
+    const char *context;
+};
+
+static constexpr NewFileContext new_file_contexts[] = {
+    { "/data/media",              "<<none>>" },
+    { "/data/media/[0-9]+(/.*)?", "<<none>>" },
+    { "/raw(/.*)?",               "<<none>>" },
+    { "/data/multiboot(/.*)?",    "<<none>>" },
+    { "/cache/multiboot(/.*)?",   "<<none>>" },
+    { "/system/multiboot(/.*)?",  "<<none>>" },
+};
+
+static oc::result<FileLineAction>
+comment_data_media_context(const char *line, size_t size,
+                           std::string &replacement, void *userdata)
+{
+    (void) userdata;
+
+    static constexpr char prefix[] = "/data/media(";
+    static constexpr char none[] = "<<none>>";
+
+    if (size >= sizeof(prefix) - 1
+            && memcmp(line, prefix, sizeof(prefix) - 1) == 0
+            && !mb_memmem(line, size, none, sizeof(none) - 1)) {
+        replacement = "#";
+        replacement.append(line, size);
+        return FileLineAction::Replace;
+    }
+
+    return FileLineAction::Keep;
+}
+
 static bool fix_file_contexts(const char *path)
 {
     std::string new_path(path);
     new_path += ".new";
 
-    ScopedFILE fp_old(fopen(path, "rb"), fclose);
-    if (!fp_old) {
-        if (errno == ENOENT) {
+    bool created = false;
+    bool replaced = false;
+
+    // Declared before the files so that it runs after they are closed
+    auto remove_new = finally([&] {
+        if (created && !replaced) {
+            unlink(new_path.c_str());
+        }
+    });
+
+    StandardFile fin;
+    StandardFile fout;
+
+    auto ret = fin.open(path, FileOpenMode::ReadOnly);
+    if (!ret) {
+        if (ret.error() == std::errc::no_such_file_or_directory) {
             return true;
         } else {
             LOGE("%s: Failed to open for reading: %s",
-                 path, strerror(errno));
+                 path, ret.error().message().c_str());
             return false;
         }
     }
 
-    ScopedFILE fp_new(fopen(new_path.c_str(), "wb"), fclose);
-    if (!fp_new) {
+    ret = fout.open(new_path, FileOpenMode::WriteOnly);
+    if (!ret) {
         LOGE("%s: Failed to open for writing: %s",
-             new_path.c_str(), strerror(errno));
+             new_path.c_str(), ret.error().message().c_str());
         return false;
     }
 
-    char *line = nullptr;
-    size_t len = 0;
-    ssize_t read = 0;
+    created = true;
 
-    auto free_line = finally([&]{
-        free(line);
+    ret = file_filter_lines(fin, fout, {
+        { &comment_data_media_context, nullptr },
     });
+    if (!ret) {
+        LOGE("%s: Failed to write file: %s",
+             new_path.c_str(), ret.error().message().c_str());
+        return false;
+    }
 
-    while ((read = getline(&line, &len, fp_old.get())) >= 0) {
-        if (starts_with(line, "/data/media(") && !strstr(line, "<<none>>")) {
-            fputc('#', fp_new.get());
-        }
+    // The file position is undefined after file_filter_lines()
+    auto seek_ret = fout.seek(0, SEEK_END);
+    if (!seek_ret) {
+        LOGE("%s: Failed to seek file: %s",
+             new_path.c_str(), seek_ret.error().message().c_str());
+        return false;
+    }
 
-        if (fwrite(line, 1, static_cast<size_t>(read), fp_new.get())
-                != static_cast<size_t>(read)) {
-            LOGE("%s: Failed to write file: %s",
-                 new_path.c_str(), strerror(errno));
-            return false;
+    std::string new_contexts("\n");
+    for (auto const &c : new_file_contexts) {
+        new_contexts += format("%-24s %s\n", c.regex, c.context);
+    }
+
+    ret = file_write_exact(fout, new_contexts.data(), new_contexts.size());
+    if (!ret) {
+        LOGE("%s: Failed to write file: %s",
+             new_path.c_str(), ret.error().message().c_str());
+        return false;
+    }
+
+    ret = fout.close();
+    if (!ret) {
+        LOGE("%s: Failed to close file: %s",
+             new_path.c_str(), ret.error().message().c_str());
+        return false;
+    }
+
+    replaced = replace_file(path, new_path.c_str());
+    return replaced;
+}
+
+static bool is_new_file_context(const char *regex)
+{
+    for (auto const &c : new_file_contexts) {
+        if (strcmp(regex, c.regex) == 0) {
+            return true;
         }
     }
+    return false;
+}
 
-    static const char *new_contexts =
-            "\n"
-            "/data/media              <<none>>\n"
-            "/data/media/[0-9]+(/.*)? <<none>>\n"
-            "/raw(/.*)?               <<none>>\n"
-            "/data/multiboot(/.*)?    <<none>>\n"
-            "/cache/multiboot(/.*)?   <<none>>\n"
-            "/system/multiboot(/.*)?  <<none>>\n";
-    fputs(new_contexts, fp_new.get());
+// Files older than SELINUX_COMPILED_FCONTEXT_PCRE_VERS do not record the PCRE
+// version, so regexes cached from them cannot be validated and are never used.
+// On those devices, file-contexts-tool still compiles the new contexts on every
+// boot.
+static bool is_same_regex_format(const fcontexts &a, const fcontexts &b)
+{
+    return a.version == b.version && a.pcre2 == b.pcre2
+            && a.pcre_version && b.pcre_version
+            && strcmp(a.pcre_version, b.pcre_version) == 0;
+}
 
-    return replace_file(path, new_path.c_str());
+// Fill in the regex data for the added contexts from the cache. The regex data
+// only depends on the regex string and the PCRE version.
+static void load_cached_regexes(fcontexts &fc)
+{
+    fcontexts cache;
+
+    if (access(FILE_CONTEXTS_REGEX_CACHE, R_OK) < 0
+            || fcontexts_read_file(&cache, FILE_CONTEXTS_REGEX_CACHE) < 0) {
+        return;
+    }
+
+    auto free_cache = finally([&] {
+        fcontexts_free(&cache);
+    });
+
+    if (!is_same_regex_format(fc, cache)) {
+        LOGV("%s: Ignoring regexes compiled with PCRE %s",
+             FILE_CONTEXTS_REGEX_CACHE,
+             cache.pcre_version ? cache.pcre_version : "(none)");
+        return;
+    }
+
+    for (uint32_t i = 0; i < fc.num_specs; ++i) {
+        fcontexts_spec &spec = fc.specs[i];
+
+        for (uint32_t j = 0; !spec.regex_data && j < cache.num_specs; ++j) {
+            fcontexts_spec &cached = cache.specs[j];
+
+            if (cached.regex_data
+                    && strcmp(spec.regex_str, cached.regex_str) == 0) {
+                // Transfer ownership
+                spec.regex_data = cached.regex_data;
+                spec.regex_data_len = cached.regex_data_len;
+                cached.regex_data = nullptr;
+                cached.regex_data_len = 0;
+            }
+        }
+    }
 }
 
-static bool fix_binary_file_contexts(const char *path)
+static void store_cached_regexes(const fcontexts &fc)
 {
-    std::string new_path(path);
-    new_path += ".bin";
-    std::string tmp_path(path);
+    // The cache would never be used (see is_same_regex_format())
+    if (!fc.pcre_version) {
+        return;
+    }
+
+    fcontexts cache;
+    fcontexts_init(&cache);
+
+    auto free_cache = finally([&] {
+        fcontexts_free(&cache);
+    });
+
+    cache.version = fc.version;
+    cache.pcre2 = fc.pcre2;
+    cache.pcre_version = strdup(fc.pcre_version);
+    if (!cache.pcre_version) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < fc.num_specs; ++i) {
+        const fcontexts_spec &spec = fc.specs[i];
+
+        if (!spec.regex_data || !is_new_file_context(spec.regex_str)) {
+            continue;
+        }
+
+        if (fcontexts_add_spec(&cache, spec.regex_str, spec.mode,
+                               spec.context) < 0) {
+            return;
+        }
+
+        fcontexts_spec &cached = cache.specs[cache.num_specs - 1];
+        cached.regex_data = static_cast<unsigned char *>(
+                malloc(spec.regex_data_len));
+        if (!cached.regex_data) {
+            return;
+        }
+        memcpy(cached.regex_data, spec.regex_data, spec.regex_data_len);
+        cached.regex_data_len = spec.regex_data_len;
+    }
+
+    if (cache.num_specs == 0) {
+        return;
+    }
+
+    std::string tmp_path(FILE_CONTEXTS_REGEX_CACHE);
     tmp_path += ".tmp";
 
+    if (!util::mkdir_parent(tmp_path, 0700)
+            || fcontexts_write_file(&cache, tmp_path.c_str()) < 0
+            || rename(tmp_path.c_str(), FILE_CONTEXTS_REGEX_CACHE) < 0) {
+        LOGW("%s: Failed to write regex cache", FILE_CONTEXTS_REGEX_CACHE);
+        unlink(tmp_path.c_str());
+    }
+}
+
+// Compile the regexes that have no compiled data. This requires loading the
+// PCRE library, which the statically linked mbtool cannot do.
+static bool compile_missing_regexes(const char *source, const char *target)
+{
     // Check signature
     SigVerifyResult result;
     result = verify_signature("/sbin/file-contexts-tool",
@@ -386,39 +564,89 @@ static bool fix_binary_file_contexts(const char *path)
         return false;
     }
 
-    std::vector<std::string> decompile_argv{
-        "/sbin/file-contexts-tool",  "decompile", "-p", PCRE_PATH,
-        path, tmp_path
-    };
-    std::vector<std::string> compile_argv{
-        "/sbin/file-contexts-tool", "compile", "-p", PCRE_PATH,
-        tmp_path, new_path
+    std::vector<std::string> argv{
+        "/sbin/file-contexts-tool", "compile-missing", "-p", PCRE_PATH,
+        source, target
     };
 
-    // Decompile binary file_contexts to temporary file
-    int ret = util::run_command(decompile_argv[0], decompile_argv,
-                                {}, {}, nullptr, nullptr);
+    int ret = util::run_command(argv[0], argv, {}, {}, nullptr, nullptr);
     if (ret < 0 || !WIFEXITED(ret) || WEXITSTATUS(ret) != 0) {
-        LOGE("%s: Failed to decompile file_contexts", path);
+        LOGE("%s: Failed to compile binary file_contexts", source);
         return false;
     }
 
-    // Patch temporary file
-    if (!fix_file_contexts(tmp_path.c_str())) {
-        unlink(tmp_path.c_str());
+    return true;
+}
+
+static bool fix_binary_file_contexts(const char *path)
+{
+    std::string new_path(path);
+    new_path += ".bin";
+    std::string tmp_path(path);
+    tmp_path += ".tmp";
+
+    fcontexts fc;
+
+    if (fcontexts_read_file(&fc, path) < 0) {
+        LOGE("%s: Failed to load binary file_contexts", path);
         return false;
     }
 
-    // Recompile binary file_contexts
-    ret = util::run_command(compile_argv[0], compile_argv,
-                            {}, {}, nullptr, nullptr);
-    if (ret < 0 || !WIFEXITED(ret) || WEXITSTATUS(ret) != 0) {
-        LOGE("%s: Failed to compile binary file_contexts", tmp_path.c_str());
+    auto free_fc = finally([&] {
+        fcontexts_free(&fc);
+    });
+
+    // Same as comment_data_media_context()
+    for (uint32_t i = fc.num_specs; i-- > 0;) {
+        if (starts_with(fc.specs[i].regex_str, "/data/media(")
+                && strcmp(fc.specs[i].context, "<<none>>") != 0) {
+            fcontexts_remove_spec(&fc, i);
+        }
+    }
+
+    for (auto const &c : new_file_contexts) {
+        if (fcontexts_add_spec(&fc, c.regex, 0, c.context) < 0) {
+            LOGE("%s: Failed to add context for %s", path, c.regex);
+            return false;
+        }
+    }
+
+    if (fcontexts_sort(&fc) < 0) {
+        LOGE("%s: Failed to sort contexts", path);
+        return false;
+    }
+
+    load_cached_regexes(fc);
+
+    if (fcontexts_is_compiled(&fc)) {
+        if (fcontexts_write_file(&fc, new_path.c_str()) < 0) {
+            LOGE("%s: Failed to write binary file_contexts", new_path.c_str());
+            unlink(new_path.c_str());
+            return false;
+        }
+
+        return replace_file(path, new_path.c_str());
+    }
+
+    LOGV("%s: Compiling regexes for new contexts", path);
+
+    if (fcontexts_write_file(&fc, tmp_path.c_str()) < 0) {
+        LOGE("%s: Failed to write binary file_contexts", tmp_path.c_str());
         unlink(tmp_path.c_str());
         return false;
     }
 
+    bool compiled = compile_missing_regexes(tmp_path.c_str(), new_path.c_str());
     unlink(tmp_path.c_str());
+    if (!compiled) {
+        return false;
+    }
+
+    fcontexts_free(&fc);
+
+    if (fcontexts_read_file(&fc, new_path.c_str()) == 0) {
+        store_cached_regexes(fc);
+    }
 
     return replace_file(path, new_path.c_str());
 }
@@ -1103,12 +1331,30 @@ static void run_adb()
 }
 #endif
 
+static void dump_boot_trace()
+{
+    // Only write to the real cache partition
+    if (!util::is_mounted("/raw/cache")) {
+        return;
+    }
+
+    if (!util::mkdir_parent(BOOT_TRACE_PATH, 0755)
+            || !log::trace_dump(BOOT_TRACE_PATH)) {
+        LOGW("%s: Failed to write boot trace: %s",
+             BOOT_TRACE_PATH, strerror(errno));
+    }
+}
+
 static bool critical_failure()
 {
 #if RUN_ADB_BEFORE_EXEC_OR_REBOOT
     run_adb();
 #endif
 
+    // The spans for the failing stage and init_main are still open
+    log::trace_end_open_spans();
+    dump_boot_trace();
+
     return emergency_reboot();
 }
 
@@ -1174,26 +1420,36 @@ int init_main(int argc, char *argv[])
     LOGV("Booting up with version %s (%s)",
          version(), git_version());
 
+    // Spans are dumped to BOOT_TRACE_PATH before exec'ing the real init
+    log::TraceSpan boot_span("init_main");
+
     std::vector<unsigned char> contents;
     util::file_read_all(DEVICE_JSON_PATH, contents);
     contents.push_back('\0');
 
     // Start probing for devices so we have somewhere to write logs for
     // critical_failure()
-    device_init(false);
+    {
+        log::TraceSpan span("device_init");
+        device_init(false);
+    }
 
     Device device;
     JsonError error;
 
-    if (!device_from_json(
-            reinterpret_cast<char *>(contents.data()), device, error)) {
-        LOGE("%s: Failed to load device definition", DEVICE_JSON_PATH);
-        critical_failure();
-        return EXIT_FAILURE;
-    } else if (device.validate()) {
-        LOGE("%s: Device definition validation failed", DEVICE_JSON_PATH);
-        critical_failure();
-        return EXIT_FAILURE;
+    {
+        log::TraceSpan span("device_from_json");
+
+        if (!device_from_json(
+                reinterpret_cast<char *>(contents.data()), device, error)) {
+            LOGE("%s: Failed to load device definition", DEVICE_JSON_PATH);
+            critical_failure();
+            return EXIT_FAILURE;
+        } else if (device.validate()) {
+            LOGE("%s: Device definition validation failed", DEVICE_JSON_PATH);
+            critical_failure();
+            return EXIT_FAILURE;
+        }
     }
 
     // Symlink by-name directory to /dev/block/by-name (ugh... ASUS)
@@ -1202,7 +1458,10 @@ int init_main(int argc, char *argv[])
     add_props_to_default_prop(device);
 
     // initialize properties
-    properties_setup();
+    {
+        log::TraceSpan span("properties_setup");
+        properties_setup();
+    }
 
     std::string fstab(find_fstab());
 
@@ -1233,30 +1492,46 @@ int init_main(int argc, char *argv[])
             | MountFlag::MountCache
             | MountFlag::MountData
             | MountFlag::MountExternalSd;
-    if (!mount_fstab(fstab.c_str(), rom, device, flags)) {
-        LOGE("Failed to mount fstab");
-        critical_failure();
-        return EXIT_FAILURE;
+    {
+        log::TraceSpan span("mount_fstab");
+
+        if (!mount_fstab(fstab.c_str(), rom, device, flags)) {
+            LOGE("Failed to mount fstab");
+            critical_failure();
+            return EXIT_FAILURE;
+        }
     }
 
     LOGV("Successfully mounted fstab");
 
-    if (!launch_boot_menu()) {
-        LOGE("Failed to run boot menu");
-        // Continue anyway since boot menu might not run on every device
+    {
+        log::TraceSpan span("launch_boot_menu");
+
+        if (!launch_boot_menu()) {
+            LOGE("Failed to run boot menu");
+            // Continue anyway since boot menu might not run on every device
+        }
     }
 
     // Mount selinuxfs
     selinux_mount();
     // Load pre-boot policy
-    patch_sepolicy(util::SELINUX_DEFAULT_POLICY_FILE, util::SELINUX_LOAD_FILE,
-                   SELinuxPatch::PreBoot);
+    {
+        log::TraceSpan span("patch_sepolicy_preboot");
+        patch_sepolicy_cached(util::SELINUX_DEFAULT_POLICY_FILE,
+                              util::SELINUX_LOAD_FILE,
+                              SELinuxPatch::PreBoot, SEPOLICY_CACHE_DIR);
+    }
 
     // Mount ROM (bind mount directory or mount images, etc.)
-    if (!mount_rom(rom)) {
-        LOGE("Failed to mount ROM directories and images");
-        critical_failure();
-        return EXIT_FAILURE;
+    {
+        log::TraceSpan span("mount_rom");
+
+        if (!mount_rom(rom)) {
+            LOGE("Failed to mount ROM directories and images");
+            critical_failure();
+            return EXIT_FAILURE;
+        }
     }
 
     std::string config_path(rom->config_path());
@@ -1269,14 +1544,21 @@ int init_main(int argc, char *argv[])
     LOGD("Enable appsync: %d", config.indiv_app_sharing);
 
     // Make runtime ramdisk modifications
-    if (access(FILE_CONTEXTS, R_OK) == 0) {
-        fix_file_contexts(FILE_CONTEXTS);
-    }
-    if (access(FILE_CONTEXTS_BIN, R_OK) == 0) {
-        fix_binary_file_contexts(FILE_CONTEXTS_BIN);
+    {
+        log::TraceSpan span("fix_file_contexts");
+
+        if (access(FILE_CONTEXTS, R_OK) == 0) {
+            fix_file_contexts(FILE_CONTEXTS);
+        }
+        if (access(FILE_CONTEXTS_BIN, R_OK) == 0) {
+            fix_binary_file_contexts(FILE_CONTEXTS_BIN);
+        }
     }
     write_fstab_hack(fstab.c_str());
-    add_mbtool_services(config.indiv_app_sharing);
+    {
+        log::TraceSpan span("add_mbtool_services");
+        add_mbtool_services(config.indiv_app_sharing);
+    }
     strip_manual_mounts();
 
     // Data modifications
@@ -1288,9 +1570,11 @@ int init_main(int argc, char *argv[])
     // Patch SELinux policy
     struct stat sb;
     if (stat(util::SELINUX_DEFAULT_POLICY_FILE, &sb) == 0) {
-        if (!patch_sepolicy(util::SELINUX_DEFAULT_POLICY_FILE,
-                            util::SELINUX_DEFAULT_POLICY_FILE,
-                            SELinuxPatch::Main)) {
+        log::TraceSpan span("patch_sepolicy");
+
+        if (!patch_sepolicy_cached(util::SELINUX_DEFAULT_POLICY_FILE,
+                                   util::SELINUX_DEFAULT_POLICY_FILE,
+                                   SELinuxPatch::Main, SEPOLICY_CACHE_DIR)) {
             LOGW("%s: Failed to patch policy",
                  util::SELINUX_DEFAULT_POLICY_FILE);
             critical_failure();
@@ -1304,6 +1588,9 @@ int init_main(int argc, char *argv[])
     // Kill properties service and clean up
     properties_cleanup();
 
+    boot_span.end();
+    dump_boot_trace();
+
     // Remove mbtool init symlink and restore original binary
     unlink("/init");
     rename("/init.orig", "/init");
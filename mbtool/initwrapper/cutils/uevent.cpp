@@ -18,6 +18,7 @@
 #include "initwrapper/cutils/uevent.h"
 
 #include <cerrno>
+#include <cstring>
 #include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -102,6 +103,66 @@ out:
     return -1;
 }
 
+#define UEVENT_RECV_BATCH_MAX 64
+
+/**
+ * Like uevent_kernel_multicast_recv(), but receives up to "count" messages
+ * with a single recvmmsg() call. Message i is stored in buffers[i] and its
+ * length in lengths[i]. If a message did not originate from the kernel, its
+ * buffer is cleared and its length is set to -1.
+ *
+ * Returns the number of messages received (at most UEVENT_RECV_BATCH_MAX) or
+ * -1 if recvmmsg() fails.
+ */
+int uevent_kernel_multicast_recv_batch(int socket, void **buffers, size_t length, ssize_t *lengths, unsigned int count)
+{
+    struct mmsghdr msgs[UEVENT_RECV_BATCH_MAX];
+    struct iovec iovs[UEVENT_RECV_BATCH_MAX];
+    struct sockaddr_nl addrs[UEVENT_RECV_BATCH_MAX];
+    char controls[UEVENT_RECV_BATCH_MAX][CMSG_SPACE(sizeof(struct ucred))];
+
+    if (count > UEVENT_RECV_BATCH_MAX) {
+        count = UEVENT_RECV_BATCH_MAX;
+    }
+
+    memset(msgs, 0, sizeof(msgs[0]) * count);
+    for (unsigned int i = 0; i < count; ++i) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = length;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
+
+    int n = recvmmsg(socket, msgs, count, MSG_DONTWAIT, nullptr);
+    if (n <= 0) {
+        return n;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+        struct ucred *cred = nullptr;
+
+        if (cmsg && cmsg->cmsg_type == SCM_CREDENTIALS) {
+            cred = (struct ucred *) CMSG_DATA(cmsg);
+        }
+
+        // Same checks as uevent_kernel_recv()
+        if (!cred || cred->uid != 0 || addrs[i].nl_pid != 0
+                || addrs[i].nl_groups == 0) {
+            bzero(buffers[i], length);
+            lengths[i] = -1;
+        } else {
+            lengths[i] = msgs[i].msg_len;
+        }
+    }
+
+    return n;
+}
+
 int uevent_open_socket(int buf_sz, bool passcred)
 {
     struct sockaddr_nl addr;
@@ -17,8 +17,13 @@
 
 #include "initwrapper/devices.h"
 
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
+#include <string>
+#include <vector>
 
+#include <cinttypes>
 #include <cstdlib>
 #include <cstring>
 
@@ -27,6 +32,7 @@
 #include <fnmatch.h>
 #include <poll.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/sysmacros.h>
 #include <unistd.h>
@@ -34,9 +40,12 @@
 #include "mbcommon/common.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
+#include "mblog/trace.h"
 #include "mbutil/cmdline.h"
 #include "mbutil/directory.h"
+#include "mbutil/path.h"
 #include "mbutil/string.h"
+#include "mbutil/time.h"
 #include "mbutil/external/system_properties.h"
 
 #include "initwrapper/cutils/uevent.h"
@@ -48,6 +57,14 @@
 
 #define UEVENT_LOGGING 0
 
+// Netlink receive buffer size after coldboot
+#define UEVENT_RCVBUF_SIZE          (256 * 1024)
+// Netlink receive buffer size during coldboot, when thousands of events are
+// generated at once
+#define COLDBOOT_RCVBUF_SIZE        (16 * 1024 * 1024)
+// Maximum number of threads for walking sysfs during coldboot
+#define COLDBOOT_MAX_THREADS        4
+
 static char bootdevice[PROP_VALUE_MAX];
 static int device_fd = -1;
 static int pipe_fd[2];
@@ -77,6 +94,12 @@ static std::vector<platform_node> platform_names;
 
 static std::unordered_map<std::string, BlockDevInfo> block_dev_mappings;
 static std::mutex block_dev_mappings_guard;
+// Signalled after a block device and its symlinks have been created
+static std::condition_variable block_dev_added;
+// Incremented every time a block device is added
+static uint64_t block_dev_generation = 0;
+// Whether the uevent thread is running
+static bool block_dev_thread_running = false;
 
 static mode_t get_device_perm(const char *path,
                               const std::vector<std::string> &links,
@@ -593,9 +616,14 @@ static void handle_block_device_event(struct uevent *uevent)
             info.partition_name = uevent->partition_name;
         }
 
-        std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-        block_dev_mappings.emplace(
-                std::make_pair(uevent->path, std::move(info)));
+        {
+            std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
+            block_dev_mappings.emplace(
+                    std::make_pair(uevent->path, std::move(info)));
+            ++block_dev_generation;
+        }
+
+        block_dev_added.notify_all();
     } else if (strcmp(uevent->action, "remove") == 0) {
         std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
         block_dev_mappings.erase(uevent->path);
@@ -739,29 +767,58 @@ static void handle_device_event(struct uevent *uevent)
 }
 
 #define UEVENT_MSG_LEN  2048
-void handle_device_fd()
+#define UEVENT_BATCH    64
+
+/*
+ * Handle all pending events from the netlink socket. Up to UEVENT_BATCH
+ * messages are received per syscall. Returns the number of handled events.
+ */
+static size_t drain_device_fd()
 {
-    char msg[UEVENT_MSG_LEN + 2];
-    int n;
-    while ((n = uevent_kernel_multicast_recv(device_fd, msg, UEVENT_MSG_LEN)) > 0) {
-        if (n >= UEVENT_MSG_LEN) {
-            // overflow -- discard
-            continue;
-        }
+    // Only one thread handles events at a time
+    static char msgs[UEVENT_BATCH][UEVENT_MSG_LEN + 2];
+    void *buffers[UEVENT_BATCH];
+    ssize_t lengths[UEVENT_BATCH];
+    size_t handled = 0;
+    int count;
+
+    for (int i = 0; i < UEVENT_BATCH; ++i) {
+        buffers[i] = msgs[i];
+    }
+
+    while ((count = uevent_kernel_multicast_recv_batch(
+            device_fd, buffers, UEVENT_MSG_LEN, lengths, UEVENT_BATCH)) > 0) {
+        for (int i = 0; i < count; ++i) {
+            char *msg = msgs[i];
+            ssize_t n = lengths[i];
+
+            if (n <= 0 || n >= UEVENT_MSG_LEN) {
+                // overflow or not from the kernel -- discard
+                continue;
+            }
 
-        msg[n] = '\0';
-        msg[n + 1] = '\0';
+            msg[n] = '\0';
+            msg[n + 1] = '\0';
 
-        struct uevent uevent;
-        parse_event(msg, &uevent);
+            struct uevent uevent;
+            parse_event(msg, &uevent);
 
-        if (uevent.path && strstr(uevent.path, "sec-battery")) {
-            // sec-battery causes boot delays on the Galaxy S4
-            continue;
-        }
+            if (uevent.path && strstr(uevent.path, "sec-battery")) {
+                // sec-battery causes boot delays on the Galaxy S4
+                continue;
+            }
 
-        handle_device_event(&uevent);
+            handle_device_event(&uevent);
+            ++handled;
+        }
     }
+
+    return handled;
+}
+
+void handle_device_fd()
+{
+    drain_device_fd();
 }
 
 /*
@@ -769,54 +826,205 @@ void handle_device_fd()
  * to cause the kernel to regenerate device add events that happened
  * before init's device manager was started
  *
- * We drain any pending events from the netlink socket every time
- * we poke another uevent file to make sure we don't overrun the
- * socket's buffer.
+ * The tree is walked by several threads while the calling thread drains the
+ * netlink socket, which is temporarily given a much larger receive buffer so
+ * that events are not dropped. A directory's uevent file is always written
+ * before its subdirectories are queued, so parent devices (eg. platform
+ * devices) are still handled before their children.
  */
 
-static void do_coldboot(DIR *d)
+struct ColdbootState
 {
-    struct dirent *de;
-    int dfd, fd;
+    std::mutex mutex;
+    std::condition_variable cond;
+    // Directories that have not been visited yet
+    std::vector<std::string> pending;
+    // Number of threads currently visiting a directory
+    unsigned int busy = 0;
+    // Number of uevent files written
+    size_t triggered = 0;
+    // Set when every directory has been visited
+    bool done = false;
+    // Signalled when done is set
+    int done_fd = -1;
+};
 
-    dfd = dirfd(d);
+static void coldboot_visit(const std::string &path,
+                           std::vector<std::string> &subdirs,
+                           size_t &triggered)
+{
+    int dfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        return;
+    }
 
-    fd = openat(dfd, "uevent", O_WRONLY);
+    int fd = openat(dfd, "uevent", O_WRONLY | O_CLOEXEC);
     if (fd >= 0) {
         write(fd, "add\n", 4);
         close(fd);
-        handle_device_fd();
+        ++triggered;
     }
 
-    while ((de = readdir(d))) {
-        DIR *d2;
+    DIR *d = fdopendir(dfd);
+    if (!d) {
+        close(dfd);
+        return;
+    }
 
+    struct dirent *de;
+
+    while ((de = readdir(d))) {
         if (de->d_type != DT_DIR || de->d_name[0] == '.') {
             continue;
         }
 
-        fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY);
-        if (fd < 0) {
-            continue;
+        std::string subdir(path);
+        subdir += '/';
+        subdir += de->d_name;
+        subdirs.push_back(std::move(subdir));
+    }
+
+    closedir(d);
+}
+
+static void * coldboot_thread(void *userdata)
+{
+    mb::log::TraceSpan span("coldboot_thread");
+    ColdbootState *state = static_cast<ColdbootState *>(userdata);
+    std::vector<std::string> subdirs;
+    size_t triggered = 0;
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+
+    while (true) {
+        state->cond.wait(lock, [&]{
+            return !state->pending.empty() || state->done;
+        });
+        if (state->done) {
+            break;
         }
 
-        d2 = fdopendir(fd);
-        if (d2 == 0) {
-            close(fd);
-        } else {
-            do_coldboot(d2);
-            closedir(d2);
+        std::string path = std::move(state->pending.back());
+        state->pending.pop_back();
+        ++state->busy;
+
+        lock.unlock();
+        coldboot_visit(path, subdirs, triggered);
+        lock.lock();
+
+        --state->busy;
+
+        if (!subdirs.empty()) {
+            // Push in reverse so that pop_back() visits in readdir() order
+            state->pending.insert(state->pending.end(),
+                                  std::make_move_iterator(subdirs.rbegin()),
+                                  std::make_move_iterator(subdirs.rend()));
+            subdirs.clear();
+            state->cond.notify_all();
+        } else if (state->pending.empty() && state->busy == 0) {
+            state->done = true;
+            state->cond.notify_all();
+
+            if (state->done_fd >= 0) {
+                uint64_t value = 1;
+                write(state->done_fd, &value, sizeof(value));
+            }
         }
     }
+
+    state->triggered += triggered;
+
+    return nullptr;
 }
 
-static void coldboot(const char *path)
+static void coldboot()
 {
-    DIR *d = opendir(path);
-    if (d) {
-        do_coldboot(d);
-        closedir(d);
+    mb::log::TraceSpan span("coldboot");
+    uint64_t start = mb::util::current_time_ms();
+
+    int rcvbuf = COLDBOOT_RCVBUF_SIZE;
+    if (setsockopt(device_fd, SOL_SOCKET, SO_RCVBUFFORCE,
+                   &rcvbuf, sizeof(rcvbuf)) < 0) {
+        LOGW("Failed to enlarge uevent socket buffer: %s", strerror(errno));
     }
+
+    ColdbootState state;
+    // Used as a stack, so /sys/class is visited first
+    state.pending = { "/sys/devices", "/sys/block", "/sys/class" };
+    state.done_fd = eventfd(0, EFD_CLOEXEC);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int max_threads = cpus > 0
+            ? std::min<unsigned int>(cpus, COLDBOOT_MAX_THREADS) : 1;
+    pthread_t threads[COLDBOOT_MAX_THREADS];
+    unsigned int n_threads = 0;
+
+    if (state.done_fd >= 0) {
+        for (; n_threads < max_threads; ++n_threads) {
+            if (pthread_create(&threads[n_threads], nullptr,
+                               &coldboot_thread, &state) != 0) {
+                break;
+            }
+        }
+    }
+
+    size_t handled = 0;
+
+    if (n_threads == 0) {
+        LOGW("Failed to start coldboot threads; walking sysfs synchronously");
+        coldboot_thread(&state);
+    } else {
+        struct pollfd fds[2];
+        fds[0].fd = device_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = state.done_fd;
+        fds[1].events = POLLIN;
+
+        while (true) {
+            fds[0].revents = 0;
+            fds[1].revents = 0;
+
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOGW("Failed to poll uevent socket: %s", strerror(errno));
+                break;
+            }
+            if (fds[0].revents & POLLIN) {
+                handled += drain_device_fd();
+            }
+            if (fds[1].revents & POLLIN) {
+                break;
+            }
+        }
+
+        for (unsigned int i = 0; i < n_threads; ++i) {
+            pthread_join(threads[i], nullptr);
+        }
+    }
+
+    uint64_t walked = mb::util::current_time_ms();
+
+    // The kernel sends the event before write() returns, so everything has
+    // been queued by now
+    handled += drain_device_fd();
+
+    uint64_t drained = mb::util::current_time_ms();
+
+    if (state.done_fd >= 0) {
+        close(state.done_fd);
+    }
+
+    rcvbuf = UEVENT_RCVBUF_SIZE;
+    setsockopt(device_fd, SOL_SOCKET, SO_RCVBUFFORCE,
+               &rcvbuf, sizeof(rcvbuf));
+
+    LOGD("Coldboot: triggered %zu uevents with %u threads in %" PRIu64 " ms",
+         state.triggered, n_threads, walked - start);
+    LOGD("Coldboot: handled %zu events; final drain took %" PRIu64 " ms",
+         handled, drained - walked);
+    LOGD("Coldboot: took %" PRIu64 " ms total", drained - start);
 }
 
 void * device_thread(void *)
@@ -858,20 +1066,21 @@ void device_init(bool dry_run_)
     }
 
     // Is 256K enough? udev uses 16MB!
-    device_fd = uevent_open_socket(256 * 1024, true);
+    device_fd = uevent_open_socket(UEVENT_RCVBUF_SIZE, true);
     if (device_fd < 0) {
         return;
     }
 
     fcntl(device_fd, F_SETFL, O_NONBLOCK);
 
-    coldboot("/sys/class");
-    coldboot("/sys/block");
-    coldboot("/sys/devices");
+    coldboot();
 
     run_thread = true;
     pipe(pipe_fd);
-    pthread_create(&thread, nullptr, &device_thread, nullptr);
+    if (pthread_create(&thread, nullptr, &device_thread, nullptr) == 0) {
+        std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
+        block_dev_thread_running = true;
+    }
 }
 
 void device_close()
@@ -881,6 +1090,12 @@ void device_close()
 
     pthread_join(thread, nullptr);
 
+    {
+        std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
+        block_dev_thread_running = false;
+    }
+    block_dev_added.notify_all();
+
     close(device_fd);
     device_fd = -1;
     close(pipe_fd[0]);
@@ -897,3 +1112,77 @@ std::unordered_map<std::string, BlockDevInfo> get_block_dev_mappings()
     std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
     return block_dev_mappings;
 }
+
+std::unordered_map<std::string, BlockDevInfo>
+get_block_dev_mappings(uint64_t &generation)
+{
+    std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
+    generation = block_dev_generation;
+    return block_dev_mappings;
+}
+
+/*!
+ * \brief Wait for a block device or a symlink to one to exist
+ *
+ * Instead of polling, the path is checked every time the uevent thread
+ * finishes creating a block device node and its symlinks. If the uevent
+ * thread is not running, this falls back to mb::util::wait_for_path().
+ *
+ * \param path Block device path (eg. `/dev/block/bootdevice/by-name/system`)
+ * \param timeout_ms Maximum time to wait
+ *
+ * \return Whether the path exists
+ */
+bool wait_for_block_dev(const std::string &path, unsigned int timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now()
+            + std::chrono::milliseconds(timeout_ms);
+    struct stat sb;
+
+    std::unique_lock<std::mutex> lock(block_dev_mappings_guard);
+
+    if (!block_dev_thread_running) {
+        lock.unlock();
+        return mb::util::wait_for_path(path, timeout_ms);
+    }
+
+    while (true) {
+        uint64_t generation = block_dev_generation;
+
+        // stat() may need to resolve symlinks, so don't block the uevent
+        // thread while doing so
+        lock.unlock();
+        if (stat(path.c_str(), &sb) == 0) {
+            return true;
+        }
+        lock.lock();
+
+        if (!block_dev_added.wait_until(lock, deadline, [&]{
+            return block_dev_generation != generation
+                    || !block_dev_thread_running;
+        })) {
+            return false;
+        } else if (!block_dev_thread_running) {
+            lock.unlock();
+            return stat(path.c_str(), &sb) == 0;
+        }
+    }
+}
+
+/*!
+ * \brief Wait for a block device to be added
+ *
+ * \param generation Value returned by get_block_dev_mappings(uint64_t &)
+ * \param timeout_ms Maximum time to wait
+ *
+ * \return Whether a block device was added since \p generation was retrieved
+ */
+bool wait_for_block_dev_change(uint64_t generation, unsigned int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(block_dev_mappings_guard);
+
+    return block_dev_added.wait_for(
+            lock, std::chrono::milliseconds(timeout_ms), [&]{
+        return block_dev_generation != generation;
+    });
+}
@@ -20,6 +20,8 @@
 #include <string>
 #include <unordered_map>
 
+#include <cstdint>
+
 #include <sys/stat.h>
 
 struct BlockDevInfo
@@ -37,3 +39,8 @@ void device_close();
 int get_device_fd();
 
 std::unordered_map<std::string, BlockDevInfo> get_block_dev_mappings();
+std::unordered_map<std::string, BlockDevInfo>
+get_block_dev_mappings(uint64_t &generation);
+
+bool wait_for_block_dev(const std::string &path, unsigned int timeout_ms);
+bool wait_for_block_dev_change(uint64_t generation, unsigned int timeout_ms);
@@ -170,7 +170,8 @@ static void send_close(unsigned local, unsigned remote, atransport *t)
 static size_t fill_connect_data(char *buf, size_t bufsize)
 {
     size_t len;
-    len = snprintf(buf, bufsize, "%s::", adb_device_banner);
+    len = snprintf(buf, bufsize, "%s::features=" ADB_FEATURES,
+                   adb_device_banner);
     return len + 1;
 }
 
@@ -263,6 +264,8 @@ void handle_packet(apacket *p, atransport *t)
             handle_offline(t);
         }
 
+        t->update_version(p->msg.arg0, p->msg.arg1);
+
         parse_banner(reinterpret_cast<const char*>(p->data), t);
 
         handle_online(t);
@@ -17,9 +17,14 @@
 #ifndef __ADB_H
 #define __ADB_H
 
+#include <cstddef>
+
 #include "fdevent.h"
 
-#define MAX_PAYLOAD 4096
+// Maximum payload for the original protocol version. Transports start with this
+// limit until the host's CNXN message says it can accept more.
+#define MAX_PAYLOAD_V1 (4 * 1024)
+#define MAX_PAYLOAD (256 * 1024)
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -29,7 +34,15 @@
 #define A_WRTE 0x45545257
 
 // ADB protocol version.
-#define A_VERSION 0x01000000
+// Version revision:
+// 0x01000000: original
+// 0x01000001: skip checksum (Dec 2017)
+#define A_VERSION_MIN 0x01000000
+#define A_VERSION_SKIP_CHECKSUM 0x01000001
+#define A_VERSION 0x01000001
+
+// Features advertised to the host in the CNXN banner
+#define ADB_FEATURES "sendrecv_v2"
 
 struct atransport;
 struct usb_handle;
@@ -123,6 +136,8 @@ struct asocket {
 
         /* A socket is bound to atransport */
     atransport *transport;
+
+    size_t get_max_payload() const;
 };
 
 
@@ -195,7 +210,15 @@ struct atransport
     void *key;
     unsigned char token[TOKEN_SIZE];
 
+        /* negotiated with the host when the CNXN message is received */
+    unsigned protocol_version;
+    size_t max_payload;
+
     const char* connection_state_name() const;
+
+    void update_version(unsigned version, size_t payload);
+    unsigned get_protocol_version() const;
+    size_t get_max_payload() const;
 };
 
 
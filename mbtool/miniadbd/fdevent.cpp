@@ -18,6 +18,7 @@
 #include "sysdeps.h"
 #include "fdevent.h"
 
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
@@ -35,6 +36,9 @@
 */
 #define FDEVENT_DEBUG 0   /* non-0 will break adb server */
 
+/* Use the edge-triggered epoll backend instead of select() */
+#define FDEVENT_USE_EPOLL 1
+
 // This socket is used when a subproc shell service exists.
 // It wakes up the fdevent_loop() and cause the correct handling
 // of the shell's pseudo-tty master. I.e. force close it.
@@ -75,6 +79,9 @@ static void dump_fde(fdevent *fde, const char *info)
 #define FDE_ACTIVE     0x0100
 #define FDE_PENDING    0x0200
 #define FDE_CREATED    0x0400
+/* events registered with epoll (only used by the epoll backend) */
+#define FDE_EPOLL_READ  0x1000
+#define FDE_EPOLL_WRITE 0x2000
 
 static void fdevent_plist_enqueue(fdevent *node);
 static void fdevent_plist_remove(fdevent *node);
@@ -95,25 +102,34 @@ static fdevent list_pending = {
 static fdevent **fd_table = 0;
 static int fd_table_max = 0;
 
-#ifdef CRAPTASTIC
-//HAVE_EPOLL
+#if FDEVENT_USE_EPOLL
 
 #include <sys/epoll.h>
 
+/* The epoll backend registers each fd once and only touches the kernel's
+** interest list the first time an event is requested, instead of rebuilding
+** the fd sets on every loop iteration. Readiness is edge-triggered, so
+** handlers must keep reading (or writing) until the fd would block or they
+** stop watching the event.
+**
+** Registered events are never removed. Events that are no longer wanted are
+** filtered out in fdevent_process() and since an edge may have been missed
+** while an event was not wanted, re-enabling an event queues a callback so
+** that the handler can check the fd itself. Handlers already have to cope
+** with EAGAIN, so this only costs a read() or write() that would block and
+** avoids an epoll_ctl() call every time a socket applies backpressure.
+*/
+
+#define FDEVENT_MAX_EVENTS 256
+
 static int epoll_fd = -1;
 
 static void fdevent_init()
 {
-        /* XXX: what's a good size for the passed in hint? */
-    epoll_fd = epoll_create(256);
-
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     if (epoll_fd < 0) {
-        ADB_LOGE(ADB_FDEV, "epoll_create() failed");
-        exit(1);
+        FATAL("epoll_create1() failed: %s", strerror(errno));
     }
-
-        /* mark for close-on-exec */
-    fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
 }
 
 static void fdevent_connect(fdevent *fde)
@@ -121,15 +137,13 @@ static void fdevent_connect(fdevent *fde)
     struct epoll_event ev;
 
     memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
+    ev.events = EPOLLET;
     ev.data.ptr = fde;
 
-#if 0
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fde->fd, &ev)) {
-        ADB_LOGE(ADB_FDEV, "epoll_ctl() failed\n");
-        exit(1);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fde->fd, &ev) < 0) {
+        FATAL("epoll_ctl(ADD) failed for fd %d: %s",
+              fde->fd, strerror(errno));
     }
-#endif
 }
 
 static void fdevent_disconnect(fdevent *fde)
@@ -137,95 +151,102 @@ static void fdevent_disconnect(fdevent *fde)
     struct epoll_event ev;
 
     memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
-    ev.data.ptr = fde;
 
-        /* technically we only need to delete if we
-        ** were actively monitoring events, but let's
-        ** be aggressive and do it anyway, just in case
-        ** something's out of sync
-        */
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fde->fd, &ev);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fde->fd, &ev) < 0) {
+        ADB_LOGW(ADB_FDEV, "epoll_ctl(DEL) failed for fd %d: %s",
+                 fde->fd, strerror(errno));
+    }
 }
 
 static void fdevent_update(fdevent *fde, unsigned events)
 {
     struct epoll_event ev;
-    int active;
+    unsigned registered = 0;
+    unsigned added;
 
-    active = (fde->state & FDE_EVENTMASK) != 0;
+    if (fde->state & FDE_EPOLL_READ) registered |= FDE_READ;
+    if (fde->state & FDE_EPOLL_WRITE) registered |= FDE_WRITE;
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
-    ev.data.ptr = fde;
+    added = events & ~(fde->state & FDE_EVENTMASK) & (FDE_READ | FDE_WRITE);
 
-    if (events & FDE_READ) ev.events |= EPOLLIN;
-    if (events & FDE_WRITE) ev.events |= EPOLLOUT;
-    if (events & FDE_ERROR) ev.events |= (EPOLLERR | EPOLLHUP);
+    if (events & ~registered & (FDE_READ | FDE_WRITE)) {
+        registered |= events & (FDE_READ | FDE_WRITE);
 
-    fde->state = (fde->state & FDE_STATEMASK) | events;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLET;
+        ev.data.ptr = fde;
 
-    if (active) {
-            /* we're already active. if we're changing to *no*
-            ** events being monitored, we need to delete, otherwise
-            ** we need to just modify
-            */
-        if (ev.events) {
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fde->fd, &ev)) {
-                ADB_LOGE(ADB_FDEV, "epoll_ctl() failed\n");
-                exit(1);
-            }
-        } else {
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fde->fd, &ev)) {
-                ADB_LOGE(ADB_FDEV, "epoll_ctl() failed\n");
-                exit(1);
-            }
+        if (registered & FDE_READ) ev.events |= EPOLLIN | EPOLLRDHUP;
+        if (registered & FDE_WRITE) ev.events |= EPOLLOUT;
+
+        /* EPOLL_CTL_MOD makes the kernel re-check the fd, so there's no
+        ** need to queue a callback here
+        */
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fde->fd, &ev) < 0) {
+            FATAL("epoll_ctl(MOD) failed for fd %d: %s",
+                  fde->fd, strerror(errno));
         }
-    } else {
-            /* we're not active.  if we're watching events, we need
-            ** to add, otherwise we can just do nothing
-            */
-        if (ev.events) {
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fde->fd, &ev)) {
-                ADB_LOGE(ADB_FDEV, "epoll_ctl() failed\n");
-                exit(1);
-            }
+
+        if (registered & FDE_READ) fde->state |= FDE_EPOLL_READ;
+        if (registered & FDE_WRITE) fde->state |= FDE_EPOLL_WRITE;
+    } else if (added) {
+        fde->events |= added;
+        if (!(fde->state & FDE_PENDING)) {
+            fde->state |= FDE_PENDING;
+            fdevent_plist_enqueue(fde);
         }
     }
+
+    fde->state = (fde->state & FDE_STATEMASK) | events;
 }
 
 static void fdevent_process()
 {
-    struct epoll_event events[256];
+    struct epoll_event ep_events[FDEVENT_MAX_EVENTS];
     fdevent *fde;
+    unsigned events;
+    unsigned wanted;
     int i, n;
 
-    n = epoll_wait(epoll_fd, events, 256, -1);
-
+    /* don't block if fdevent_update() already queued callbacks */
+    n = epoll_wait(epoll_fd, ep_events, FDEVENT_MAX_EVENTS,
+                   list_pending.next != &list_pending ? 0 : -1);
     if (n < 0) {
         if (errno == EINTR) return;
-        ADB_LOGE(ADB_FDEV, "epoll_wait");
-        exit(1);
+        FATAL("epoll_wait() failed: %s", strerror(errno));
     }
 
+    ADB_LOGD(ADB_FDEV, "epoll_wait() returned n=%d", n);
+
     for (i = 0; i < n; i++) {
-        struct epoll_event *ev = events + i;
-        fde = ev->data.ptr;
+        fde = reinterpret_cast<fdevent*>(ep_events[i].data.ptr);
+        wanted = fde->state & FDE_EVENTMASK;
+        events = 0;
 
-        if (ev->events & EPOLLIN) {
-            fde->events |= FDE_READ;
+        if (ep_events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+            events |= FDE_READ;
         }
-        if (ev->events & EPOLLOUT) {
-            fde->events |= FDE_WRITE;
+        if (ep_events[i].events & EPOLLOUT) {
+            events |= FDE_WRITE;
         }
-        if (ev->events & (EPOLLERR | EPOLLHUP)) {
-            fde->events |= FDE_ERROR;
-        }
-        if (fde->events) {
-            if (fde->state & FDE_PENDING) continue;
-            fde->state |= FDE_PENDING;
-            fdevent_plist_enqueue(fde);
+        if (ep_events[i].events & (EPOLLERR | EPOLLHUP)) {
+            /* Like select(), report a hangup as readable so that the
+            ** handler's next read sees the EOF or error.
+            */
+            events |= FDE_READ | FDE_ERROR;
         }
+
+        /* EPOLLERR and EPOLLHUP are reported even if not requested */
+        events &= wanted;
+        if (events == 0) continue;
+
+        fde->events |= events;
+
+        ADB_LOGD(ADB_FDEV, "got events fde->fd=%d events=%04x, state=%04x",
+                 fde->fd, fde->events, fde->state);
+        if (fde->state & FDE_PENDING) continue;
+        fde->state |= FDE_PENDING;
+        fdevent_plist_enqueue(fde);
     }
 }
 
@@ -438,7 +459,8 @@ static void fdevent_register(fdevent *fde)
         if (fd_table == 0) {
             FATAL("could not expand fd_table to %d entries", fd_table_max);
         }
-        memset(fd_table + oldmax, 0, sizeof(int) * (fd_table_max - oldmax));
+        memset(fd_table + oldmax, 0,
+               sizeof(fdevent*) * (fd_table_max - oldmax));
     }
 
     fd_table[fde->fd] = fde;
@@ -505,6 +527,49 @@ static void fdevent_call_fdfunc(fdevent* fde)
     fde->func(fde->fd, events, fde->arg);
 }
 
+static void fdevent_subproc_handle_fd(int subproc_fd)
+{
+    if ((subproc_fd < 0) || (subproc_fd >= fd_table_max)) {
+        ADB_LOGD(ADB_FDEV, "subproc_fd %d out of range 0, fd_table_max=%d",
+                 subproc_fd, fd_table_max);
+        return;
+    }
+    fdevent *subproc_fde = fd_table[subproc_fd];
+    if (!subproc_fde) {
+        ADB_LOGD(ADB_FDEV, "subproc_fd %d cleared from fd_table",
+                 subproc_fd);
+        return;
+    }
+    if (subproc_fde->fd != subproc_fd) {
+        // Already reallocated?
+        ADB_LOGD(ADB_FDEV, "subproc_fd %d != fd_table[].fd %d",
+                 subproc_fd, subproc_fde->fd);
+        return;
+    }
+
+    subproc_fde->force_eof = 1;
+
+    int rcount = 0;
+    ioctl(subproc_fd, FIONREAD, &rcount);
+    ADB_LOGD(ADB_FDEV, "subproc with fd=%d  has rcount=%d err=%d",
+             subproc_fd, rcount, errno);
+
+    if (rcount) {
+        // If there is data left, it will show up in the next poll. This
+        // works because there is no other thread reading that data when in
+        // this fd_func().
+        return;
+    }
+
+    ADB_LOGD(ADB_FDEV, "subproc_fde.state=%04x", subproc_fde->state);
+    subproc_fde->events |= FDE_READ;
+    if (subproc_fde->state & FDE_PENDING) {
+        return;
+    }
+    subproc_fde->state |= FDE_PENDING;
+    fdevent_call_fdfunc(subproc_fde);
+}
+
 static void fdevent_subproc_event_func(int fd, unsigned ev,
                                        void* /* userdata */)
 {
@@ -518,51 +583,25 @@ static void fdevent_subproc_event_func(int fd, unsigned ev,
     fdevent *fde = fd_table[fd];
     fdevent_add(fde, FDE_READ);
 
-    if (ev & FDE_READ) {
-        int subproc_fd;
-
-        if (!ReadFdExactly(fd, &subproc_fd, sizeof(subproc_fd))) {
-            FATAL("Failed to read the subproc's fd from fd=%d", fd);
-        }
-        if ((subproc_fd < 0) || (subproc_fd >= fd_table_max)) {
-            ADB_LOGD(ADB_FDEV, "subproc_fd %d out of range 0, fd_table_max=%d",
-                     subproc_fd, fd_table_max);
-            return;
-        }
-        fdevent *subproc_fde = fd_table[subproc_fd];
-        if (!subproc_fde) {
-            ADB_LOGD(ADB_FDEV, "subproc_fd %d cleared from fd_table",
-                     subproc_fd);
-            return;
-        }
-        if (subproc_fde->fd != subproc_fd) {
-            // Already reallocated?
-            ADB_LOGD(ADB_FDEV, "subproc_fd %d != fd_table[].fd %d",
-                     subproc_fd, subproc_fde->fd);
-            return;
-        }
-
-        subproc_fde->force_eof = 1;
-
-        int rcount = 0;
-        ioctl(subproc_fd, FIONREAD, &rcount);
-        ADB_LOGD(ADB_FDEV, "subproc with fd=%d  has rcount=%d err=%d",
-                 subproc_fd, rcount, errno);
+    if (!(ev & FDE_READ)) {
+        return;
+    }
 
-        if (rcount) {
-            // If there is data left, it will show up in the select().
-            // This works because there is no other thread reading that
-            // data when in this fd_func().
+    // Readiness is edge-triggered, so handle every queued notification
+    for (;;) {
+        int subproc_fd;
+        int r = adb_read(fd, &subproc_fd, sizeof(subproc_fd));
+        if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r < 0 && errno == EAGAIN) {
             return;
+        } else if (r != sizeof(subproc_fd)) {
+            // The shell service writes each fd with a single write(), so a
+            // short read means the socket pair is broken
+            FATAL("Failed to read the subproc's fd from fd=%d", fd);
         }
 
-        ADB_LOGD(ADB_FDEV, "subproc_fde.state=%04x", subproc_fde->state);
-        subproc_fde->events |= FDE_READ;
-        if (subproc_fde->state & FDE_PENDING) {
-            return;
-        }
-        subproc_fde->state |= FDE_PENDING;
-        fdevent_call_fdfunc(subproc_fde);
+        fdevent_subproc_handle_fd(subproc_fd);
     }
 }
 
@@ -636,7 +675,7 @@ void fdevent_set(fdevent *fde, unsigned events)
             ** we don't signal an event that
             ** is no longer wanted.
             */
-        fde->events &= (~events);
+        fde->events &= events;
         if (fde->events == 0) {
             fdevent_plist_remove(fde);
             fde->state &= (~FDE_PENDING);
@@ -17,10 +17,13 @@
 #include "sysdeps.h"
 #include "file_sync_service.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <utime.h>
 
 #include "adb_io.h"
@@ -154,12 +157,150 @@ static int fail_errno(int s)
     return fail_message(s, strerror(errno));
 }
 
+/*
+ * DATA payloads are moved between the sync socket and files through a pipe with
+ * splice() so that they don't have to be copied through userspace. If either
+ * side does not support splicing, the data is read out of the pipe into the
+ * buffer instead, so the stream never gets out of sync.
+ */
+static bool open_splice_pipe(int *pipe_fds)
+{
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        ADB_LOGW(ADB_SERV, "sync: failed to create pipe: %s", strerror(errno));
+        pipe_fds[0] = pipe_fds[1] = -1;
+        return false;
+    }
+
+    // Allow an entire DATA payload to fit in the pipe
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, SYNC_DATA_MAX);
+
+    return true;
+}
+
+static void close_splice_pipe(int *pipe_fds)
+{
+    if (pipe_fds[0] >= 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        pipe_fds[0] = pipe_fds[1] = -1;
+    }
+}
+
+/*
+ * Move len bytes in the pipe to out_fd. If out_fd is -1 or cannot be written,
+ * the data is discarded instead so that the pipe is always left empty.
+ */
+static bool drain_splice_pipe(int *pipe_fds, int out_fd, char *buffer,
+                              size_t len)
+{
+    int write_errno = 0;
+    bool can_splice = out_fd >= 0;
+
+    while (len > 0) {
+        ssize_t n;
+
+        if (can_splice) {
+            n = splice(pipe_fds[0], nullptr, out_fd, nullptr, len,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n > 0) {
+                len -= n;
+                continue;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            can_splice = false;
+
+            // EINVAL means out_fd can't be spliced to, so copy the data instead
+            if (n == 0) {
+                write_errno = EIO;
+            } else if (errno != EINVAL) {
+                write_errno = errno;
+            }
+        }
+
+        n = adb_read(pipe_fds[0], buffer, std::min<size_t>(len, SYNC_DATA_MAX));
+        if (n <= 0) {
+            // Can't happen unless the pipe itself is broken
+            write_errno = n < 0 ? errno : EIO;
+            break;
+        }
+        len -= n;
+
+        if (out_fd >= 0 && write_errno == 0
+                && !WriteFdExactly(out_fd, buffer, n)) {
+            write_errno = errno;
+        }
+    }
+
+    if (write_errno != 0) {
+        errno = write_errno;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Read a DATA payload from the socket and write it to fd, which may be -1 if the
+ * payload should be discarded. Returns 0 on success, 1 if the payload was
+ * consumed, but could not be written (errno is set), or -1 if reading from the
+ * socket failed.
+ */
+static int receive_data(int s, int fd, char *buffer, int *pipe_fds,
+                        unsigned int len)
+{
+    if (fd >= 0 && pipe_fds[0] >= 0) {
+        unsigned int remaining = len;
+        int write_errno = 0;
+
+        while (remaining > 0) {
+            ssize_t n = splice(s, nullptr, pipe_fds[1], nullptr, remaining,
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && remaining == len
+                    && (errno == EINVAL || errno == ENOSYS)) {
+                break;
+            } else if (n <= 0) {
+                return -1;
+            }
+
+            remaining -= n;
+
+            // Keep going after a write error to consume the whole payload
+            if (!drain_splice_pipe(pipe_fds, write_errno == 0 ? fd : -1,
+                                   buffer, n)) {
+                write_errno = errno;
+            }
+        }
+
+        if (remaining == 0) {
+            errno = write_errno;
+            return write_errno == 0 ? 0 : 1;
+        }
+
+        ADB_LOGD(ADB_SERV, "sync: socket does not support splice");
+        close_splice_pipe(pipe_fds);
+    }
+
+    if (!ReadFdExactly(s, buffer, len)) {
+        return -1;
+    }
+    if (fd >= 0 && !WriteFdExactly(fd, buffer, len)) {
+        return 1;
+    }
+
+    return 0;
+}
+
 static int handle_send_file(int s, char *path, uid_t uid,
-        gid_t gid, mode_t mode, char *buffer, bool do_unlink)
+        gid_t gid, mode_t mode, char *buffer, int *pipe_fds, bool do_unlink)
 {
     syncmsg msg;
     unsigned int timestamp = 0;
     int fd;
+    int ret;
 
     fd = adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
     if (fd < 0 && errno == ENOENT) {
@@ -211,12 +352,12 @@ static int handle_send_file(int s, char *path, uid_t uid,
             fail_message(s, "oversize data message");
             goto fail;
         }
-        if (!ReadFdExactly(s, buffer, len))
+
+        ret = receive_data(s, fd, buffer, pipe_fds, len);
+        if (ret < 0)
             goto fail;
 
-        if (fd < 0)
-            continue;
-        if (!WriteFdExactly(fd, buffer, len)) {
+        if (ret > 0) {
             int saved_errno = errno;
             close(fd);
             if (do_unlink) unlink(path);
@@ -299,7 +440,36 @@ static int handle_send_link(int s, char *path, char *buffer)
     return 0;
 }
 
-static int do_send(int s, char *path, char *buffer)
+static int send_path(int s, char *path, unsigned int mode, bool is_link,
+                     bool do_unlink, char *buffer, int *pipe_fds)
+{
+    if (is_link) {
+        return handle_send_link(s, path, buffer);
+    }
+
+    uid_t uid = -1;
+    gid_t gid = -1;
+
+    /* copy user permission bits to "group" and "other" permissions */
+    mode |= ((mode >> 3) & 0070);
+    mode |= ((mode >> 3) & 0007);
+
+    return handle_send_file(s, path, uid, gid, mode, buffer, pipe_fds,
+                            do_unlink);
+}
+
+static bool unlink_before_send(const char *path)
+{
+    struct stat st;
+    /* Don't delete files before copying if they are not "regular" */
+    bool do_unlink = lstat(path, &st) || S_ISREG(st.st_mode) || S_ISLNK(st.st_mode);
+    if (do_unlink) {
+        unlink(path);
+    }
+    return do_unlink;
+}
+
+static int do_send(int s, char *path, char *buffer, int *pipe_fds)
 {
     unsigned int mode;
     bool is_link = false;
@@ -318,33 +488,42 @@ static int do_send(int s, char *path, char *buffer)
         is_link = 0;
         do_unlink = true;
     } else {
-        struct stat st;
-        /* Don't delete files before copying if they are not "regular" */
-        do_unlink = lstat(path, &st) || S_ISREG(st.st_mode) || S_ISLNK(st.st_mode);
-        if (do_unlink) {
-            unlink(path);
-        }
+        do_unlink = unlink_before_send(path);
     }
 
-    if (is_link) {
-        return handle_send_link(s, path, buffer);
+    return send_path(s, path, mode, is_link, do_unlink, buffer, pipe_fds);
+}
+
+/*
+ * Version 2 sends the mode in a separate setup message instead of appending it
+ * to the path, so paths containing commas work.
+ */
+static int do_send_v2(int s, char *path, char *buffer, int *pipe_fds)
+{
+    syncmsg msg;
+
+    if (!ReadFdExactly(s, &msg.send_v2_setup, sizeof(msg.send_v2_setup))) {
+        return -1;
+    }
+    if (msg.send_v2_setup.id != ID_SEND_V2) {
+        fail_message(s, "invalid send v2 setup message");
+        return -1;
+    }
+    if (ltohl(msg.send_v2_setup.flags) != SYNC_FLAG_NONE) {
+        fail_message(s, "unsupported send v2 flags");
+        return -1;
     }
 
-    uid_t uid = -1;
-    gid_t gid = -1;
+    unsigned int mode = ltohl(msg.send_v2_setup.mode);
+    bool is_link = S_ISLNK((mode_t) mode);
+    mode &= 0777;
 
-    /* copy user permission bits to "group" and "other" permissions */
-    mode |= ((mode >> 3) & 0070);
-    mode |= ((mode >> 3) & 0007);
+    bool do_unlink = unlink_before_send(path);
 
-    tmp = path;
-    if (*tmp == '/') {
-        tmp++;
-    }
-    return handle_send_file(s, path, uid, gid, mode, buffer, do_unlink);
+    return send_path(s, path, mode, is_link, do_unlink, buffer, pipe_fds);
 }
 
-static int do_recv(int s, const char *path, char *buffer)
+static int do_recv(int s, const char *path, char *buffer, int *pipe_fds)
 {
     syncmsg msg;
     int fd, r;
@@ -356,6 +535,31 @@ static int do_recv(int s, const char *path, char *buffer)
     }
 
     msg.data.id = ID_DATA;
+
+    // Splice the file into the pipe first so the size of each DATA payload is
+    // known before its header is written. Files that can't be spliced (eg.
+    // procfs) continue from the same offset with the read() loop below.
+    while (pipe_fds[0] >= 0) {
+        ssize_t n = splice(fd, nullptr, pipe_fds[1], nullptr, SYNC_DATA_MAX,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS) break;
+            r = fail_errno(s);
+            close(fd);
+            return r;
+        } else if (n == 0) {
+            goto done;
+        }
+
+        msg.data.size = htoll(n);
+        if (!WriteFdExactly(s, &msg.data, sizeof(msg.data))
+                || !drain_splice_pipe(pipe_fds, s, buffer, n)) {
+            close(fd);
+            return -1;
+        }
+    }
+
     for (;;) {
         r = adb_read(fd, buffer, SYNC_DATA_MAX);
         if (r <= 0) {
@@ -373,6 +577,7 @@ static int do_recv(int s, const char *path, char *buffer)
         }
     }
 
+done:
     close(fd);
 
     msg.data.id = ID_DONE;
@@ -384,15 +589,38 @@ static int do_recv(int s, const char *path, char *buffer)
     return 0;
 }
 
+static int do_recv_v2(int s, const char *path, char *buffer, int *pipe_fds)
+{
+    syncmsg msg;
+
+    if (!ReadFdExactly(s, &msg.recv_v2_setup, sizeof(msg.recv_v2_setup))) {
+        return -1;
+    }
+    if (msg.recv_v2_setup.id != ID_RECV_V2) {
+        fail_message(s, "invalid recv v2 setup message");
+        return -1;
+    }
+    if (ltohl(msg.recv_v2_setup.flags) != SYNC_FLAG_NONE) {
+        fail_message(s, "unsupported recv v2 flags");
+        return -1;
+    }
+
+    return do_recv(s, path, buffer, pipe_fds);
+}
+
 void file_sync_service(int fd, void *cookie)
 {
     syncmsg msg;
     char name[1025];
     unsigned namelen;
 
+    int pipe_fds[2];
+
     char *buffer = reinterpret_cast<char*>(malloc(SYNC_DATA_MAX));
     if (buffer == 0) goto fail;
 
+    open_splice_pipe(pipe_fds);
+
     for (;;) {
         ADB_LOGD(ADB_SERV, "sync: waiting for command");
 
@@ -422,10 +650,16 @@ void file_sync_service(int fd, void *cookie)
             if (do_list(fd, name)) goto fail;
             break;
         case ID_SEND:
-            if (do_send(fd, name, buffer)) goto fail;
+            if (do_send(fd, name, buffer, pipe_fds)) goto fail;
+            break;
+        case ID_SEND_V2:
+            if (do_send_v2(fd, name, buffer, pipe_fds)) goto fail;
             break;
         case ID_RECV:
-            if (do_recv(fd, name, buffer)) goto fail;
+            if (do_recv(fd, name, buffer, pipe_fds)) goto fail;
+            break;
+        case ID_RECV_V2:
+            if (do_recv_v2(fd, name, buffer, pipe_fds)) goto fail;
             break;
         case ID_QUIT:
             goto fail;
@@ -436,7 +670,10 @@ void file_sync_service(int fd, void *cookie)
     }
 
 fail:
-    if (buffer != 0) free(buffer);
+    if (buffer != 0) {
+        close_splice_pipe(pipe_fds);
+        free(buffer);
+    }
     ADB_LOGD(ADB_SERV, "sync: done");
     close(fd);
 }
@@ -35,6 +35,12 @@
 #define ID_OKAY MKID('O','K','A','Y')
 #define ID_FAIL MKID('F','A','I','L')
 #define ID_QUIT MKID('Q','U','I','T')
+#define ID_SEND_V2 MKID('S','N','D','2')
+#define ID_RECV_V2 MKID('R','C','V','2')
+
+// Transfer flags for ID_SEND_V2 and ID_RECV_V2. Compression and dry runs are
+// not advertised as features, so hosts should never set any flags.
+#define SYNC_FLAG_NONE 0
 
 union syncmsg {
     unsigned id;
@@ -63,6 +69,15 @@ union syncmsg {
         unsigned id;
         unsigned msglen;
     } status;
+    struct {
+        unsigned id;
+        unsigned mode;
+        unsigned flags;
+    } send_v2_setup;
+    struct {
+        unsigned id;
+        unsigned flags;
+    } recv_v2_setup;
 };
 
 
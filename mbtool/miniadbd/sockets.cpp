@@ -16,6 +16,8 @@
 
 #include "sysdeps.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
@@ -261,6 +263,18 @@ static void local_socket_close_locked(asocket *s)
     insert_local_socket(s, &local_socket_closing_list);
 }
 
+size_t asocket::get_max_payload() const
+{
+    size_t max_payload = MAX_PAYLOAD;
+    if (transport) {
+        max_payload = std::min(max_payload, transport->get_max_payload());
+    }
+    if (peer && peer->transport) {
+        max_payload = std::min(max_payload, peer->transport->get_max_payload());
+    }
+    return max_payload;
+}
+
 static void local_socket_event_func(int fd, unsigned ev, void* _s)
 {
     asocket* s = reinterpret_cast<asocket*>(_s);
@@ -323,70 +337,86 @@ static void local_socket_event_func(int fd, unsigned ev, void* _s)
 
 
     if (ev & FDE_READ) {
-        apacket *p = get_apacket();
-        unsigned char *x = p->data;
-        size_t avail = MAX_PAYLOAD;
-        int r;
-        int is_eof = 0;
-
-        while (avail > 0) {
-            r = adb_read(fd, x, avail);
-            ADB_LOGE(ADB_SOCK,
-                     "LS(%d): post adb_read(fd=%d,...) r=%d (errno=%d) avail=%zu",
-                     s->id, s->fd, r, r < 0 ? errno : 0, avail);
-            if (r == -1) {
-                if (errno == EAGAIN) {
-                    break;
+        /* readiness is edge-triggered, so keep reading until the fd
+        ** would block, the peer stops accepting data, or we close
+        */
+        bool more;
+
+        do {
+            apacket *p = get_apacket();
+            unsigned char *x = p->data;
+            const size_t max_payload = s->get_max_payload();
+            size_t avail = max_payload;
+            int r;
+            int is_eof = 0;
+
+            more = false;
+
+            while (avail > 0) {
+                r = adb_read(fd, x, avail);
+                ADB_LOGD(ADB_SOCK,
+                         "LS(%d): post adb_read(fd=%d,...) r=%d (errno=%d) avail=%zu",
+                         s->id, s->fd, r, r < 0 ? errno : 0, avail);
+                if (r == -1) {
+                    if (errno == EAGAIN) {
+                        break;
+                    }
+                } else if (r > 0) {
+                    avail -= r;
+                    x += r;
+                    continue;
                 }
-            } else if (r > 0) {
-                avail -= r;
-                x += r;
-                continue;
-            }
 
-            /* r = 0 or unhandled error */
-            is_eof = 1;
-            break;
-        }
-        ADB_LOGD(ADB_SOCK,
-                 "LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d",
-                 s->id, s->fd, r, is_eof, s->fde.force_eof);
-        if ((avail == MAX_PAYLOAD) || (s->peer == 0)) {
-            put_apacket(p);
-        } else {
-            p->len = MAX_PAYLOAD - avail;
-
-            r = s->peer->enqueue(s->peer, p);
-            ADB_LOGD(ADB_SOCK, "LS(%d): fd=%d post peer->enqueue(). r=%d",
-                     s->id, s->fd, r);
-
-            if (r < 0) {
-                    /* error return means they closed us as a side-effect
-                    ** and we must return immediately.
-                    **
-                    ** note that if we still have buffered packets, the
-                    ** socket will be placed on the closing socket list.
-                    ** this handler function will be called again
-                    ** to process FDE_WRITE events.
-                    */
-                return;
+                /* r = 0 or unhandled error */
+                is_eof = 1;
+                break;
             }
+            ADB_LOGD(ADB_SOCK,
+                     "LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d",
+                     s->id, s->fd, r, is_eof, s->fde.force_eof);
+            if ((avail == max_payload) || (s->peer == 0)) {
+                put_apacket(p);
+            } else {
+                p->len = max_payload - avail;
+
+                r = s->peer->enqueue(s->peer, p);
+                ADB_LOGD(ADB_SOCK, "LS(%d): fd=%d post peer->enqueue(). r=%d",
+                         s->id, s->fd, r);
+
+                if (r < 0) {
+                        /* error return means they closed us as a side-effect
+                        ** and we must return immediately.
+                        **
+                        ** note that if we still have buffered packets, the
+                        ** socket will be placed on the closing socket list.
+                        ** this handler function will be called again
+                        ** to process FDE_WRITE events.
+                        */
+                    return;
+                }
 
-            if (r > 0) {
-                    /* if the remote cannot accept further events,
-                    ** we disable notification of READs.  They'll
-                    ** be enabled again when we get a call to ready()
-                    */
-                fdevent_del(&s->fde, FDE_READ);
+                if (r > 0) {
+                        /* if the remote cannot accept further events,
+                        ** we disable notification of READs.  They'll
+                        ** be enabled again when we get a call to ready()
+                        */
+                    fdevent_del(&s->fde, FDE_READ);
+                } else if (avail == 0) {
+                        /* the packet was filled, so there may be more
+                        ** data that won't trigger another event
+                        */
+                    more = true;
+                }
             }
-        }
-        /* Don't allow a forced eof if data is still there */
-        if ((s->fde.force_eof && !r) || is_eof) {
-            ADB_LOGD(ADB_SOCK,
-                     " closing because is_eof=%d r=%d s->fde.force_eof=%d",
-                     is_eof, r, s->fde.force_eof);
-            s->close(s);
-        }
+            /* Don't allow a forced eof if data is still there */
+            if ((s->fde.force_eof && !r) || is_eof) {
+                ADB_LOGD(ADB_SOCK,
+                         " closing because is_eof=%d r=%d s->fde.force_eof=%d",
+                         is_eof, r, s->fde.force_eof);
+                s->close(s);
+                more = false;
+            }
+        } while (more);
     }
 
     if (ev & FDE_ERROR) {
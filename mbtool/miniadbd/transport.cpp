@@ -17,9 +17,13 @@
 #include "sysdeps.h"
 #include "transport.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
+#include <poll.h>
+
 #include "adb_log.h"
 #include "adb_utils.h"
 
@@ -183,20 +187,86 @@ write_packet(int fd, const char* name, apacket** ppacket)
     return 0;
 }
 
+/* Maximum number of packets handled per wake-up of the transport socket */
+#define TRANSPORT_PACKET_BATCH 32
+
+/* Wait for the rest of a message whose first bytes have already been read.
+** The writers always send a whole message with a single write(), so this
+** never blocks for long.
+*/
+static void
+wait_for_readable(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, -1);
+}
+
+/* Read as many queued packet addresses as fit in ppackets without blocking.
+** Returns the number of packets read (0 if none are queued) or -1 on error.
+*/
+static int
+read_packets(int fd, const char* name, apacket** ppackets, int max)
+{
+    char *p = (char*) ppackets;  /* really read packet addresses */
+    int   len = max * sizeof(*ppackets);
+    int   total = 0;
+    int   r;
+
+    while (total < len) {
+        r = adb_read(fd, p + total, len - total);
+        if (r > 0) {
+            total += r;
+            if (total % sizeof(*ppackets) == 0) {
+                /* A short read means the socket has been drained */
+                break;
+            }
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r < 0 && errno == EAGAIN) {
+            if (total % sizeof(*ppackets) == 0) {
+                break;
+            }
+            wait_for_readable(fd);
+        } else {
+            ADB_LOGE(ADB_TSPT,
+                     "%s: read_packets (fd=%d), error ret=%d errno=%d: %s",
+                     name, fd, r, errno, strerror(errno));
+            return -1;
+        }
+    }
+
+    return total / sizeof(*ppackets);
+}
+
 static void transport_socket_events(int fd, unsigned events, void *_t)
 {
     atransport *t = reinterpret_cast<atransport*>(_t);
     ADB_LOGD(ADB_TSPT, "transport_socket_events(fd=%d, events=%04x,...)",
              fd, events);
     if (events & FDE_READ) {
-        apacket *p = 0;
-        if (read_packet(fd, t->serial, &p)) {
-            ADB_LOGE(ADB_TSPT,
-                     "%s: failed to read packet from transport socket on fd %d",
-                     t->serial, fd);
-        } else {
-            handle_packet(p, (atransport *) _t);
-        }
+        apacket *packets[TRANSPORT_PACKET_BATCH];
+        int count;
+
+        /* Readiness is edge-triggered, so drain every packet the input
+        ** thread has queued since the last wake-up.
+        */
+        do {
+            count = read_packets(fd, t->serial, packets,
+                                 TRANSPORT_PACKET_BATCH);
+            if (count < 0) {
+                ADB_LOGE(ADB_TSPT,
+                         "%s: failed to read packet from transport socket on fd %d",
+                         t->serial, fd);
+                break;
+            }
+
+            for (int i = 0; i < count; ++i) {
+                handle_packet(packets[i], t);
+            }
+        } while (count == TRANSPORT_PACKET_BATCH);
     }
 }
 
@@ -208,16 +278,6 @@ void send_packet(apacket *p, atransport *t)
 
     p->msg.magic = p->msg.command ^ 0xffffffff;
 
-    count = p->msg.data_length;
-    x = (unsigned char *) p->data;
-    sum = 0;
-    while (count-- > 0) {
-        sum += *x++;
-    }
-    p->msg.data_check = sum;
-
-    print_packet("send", p);
-
     if (t == NULL) {
         ADB_LOGW(ADB_TSPT, "Transport is null");
         // Zap errno because print_packet() and other stuff have errno effect.
@@ -225,6 +285,21 @@ void send_packet(apacket *p, atransport *t)
         fatal_errno("Transport is null");
     }
 
+    // Newer hosts don't verify the checksum, so skip the pass over the payload
+    if (t->get_protocol_version() >= A_VERSION_SKIP_CHECKSUM) {
+        p->msg.data_check = 0;
+    } else {
+        count = p->msg.data_length;
+        x = (unsigned char *) p->data;
+        sum = 0;
+        while (count-- > 0) {
+            sum += *x++;
+        }
+        p->msg.data_check = sum;
+    }
+
+    print_packet("send", p);
+
     if (write_packet(t->transport_socket, t->serial, &p)) {
         fatal_errno("cannot enqueue packet on transport socket");
     }
@@ -377,6 +452,7 @@ struct tmsg
     int         action;
 };
 
+/* Returns 0 if a message was read, 1 if none are queued, or -1 on error */
 static int
 transport_read_action(int  fd, struct tmsg*  m)
 {
@@ -391,6 +467,11 @@ transport_read_action(int  fd, struct tmsg*  m)
             p   += r;
         } else {
             if ((r < 0) && (errno == EINTR)) continue;
+            if ((r < 0) && (errno == EAGAIN)) {
+                if (len == sizeof(*m)) return 1;
+                wait_for_readable(fd);
+                continue;
+            }
             ADB_LOGE(ADB_TSPT, "transport_read_action: on fd %d, error %d: %s",
                      fd, errno, strerror(errno));
             return -1;
@@ -421,25 +502,16 @@ transport_write_action(int  fd, struct tmsg*  m)
     return 0;
 }
 
-static void transport_registration_func(int _fd, unsigned ev, void *data)
+static void handle_transport_registration(tmsg *m)
 {
-    tmsg m;
     pthread_t output_thread_ptr;
     pthread_t input_thread_ptr;
     int s[2];
     atransport *t;
 
-    if (!(ev & FDE_READ)) {
-        return;
-    }
-
-    if (transport_read_action(_fd, &m)) {
-        fatal_errno("cannot read transport registration socket");
-    }
-
-    t = m.transport;
+    t = m->transport;
 
-    if (m.action == 0) {
+    if (m->action == 0) {
         ADB_LOGD(ADB_TSPT, "transport: %s removing and free'ing %d",
                  t->serial, t->transport_socket);
 
@@ -521,6 +593,25 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
     update_transports();
 }
 
+static void transport_registration_func(int _fd, unsigned ev, void *data)
+{
+    tmsg m;
+    int r;
+
+    if (!(ev & FDE_READ)) {
+        return;
+    }
+
+    /* Readiness is edge-triggered, so handle every queued message */
+    while ((r = transport_read_action(_fd, &m)) == 0) {
+        handle_transport_registration(&m);
+    }
+
+    if (r < 0) {
+        fatal_errno("cannot read transport registration socket");
+    }
+}
+
 void init_transport_registration(void)
 {
     int s[2];
@@ -619,6 +710,24 @@ const char* atransport::connection_state_name() const {
     }
 }
 
+void atransport::update_version(unsigned version, size_t payload)
+{
+    protocol_version = std::min(version, static_cast<unsigned>(A_VERSION));
+    max_payload = std::min(payload, static_cast<size_t>(MAX_PAYLOAD));
+    ADB_LOGD(ADB_TSPT, "transport: protocol version %08x, max payload %zu",
+             protocol_version, max_payload);
+}
+
+unsigned atransport::get_protocol_version() const
+{
+    return protocol_version;
+}
+
+size_t atransport::get_max_payload() const
+{
+    return max_payload;
+}
+
 void register_usb_transport(usb_handle *usb, const char *serial, const char *devpath, unsigned writeable)
 {
     atransport *t = reinterpret_cast<atransport*>(calloc(1, sizeof(atransport)));
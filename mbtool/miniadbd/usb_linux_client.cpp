@@ -16,11 +16,15 @@
 
 #include "sysdeps.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
 #include <endian.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
 
@@ -35,6 +39,20 @@
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
+// Size of each AIO request. Larger requests fail on some FunctionFS drivers.
+#define USB_FFS_BULK_SIZE       16384
+
+// Number of requests needed to keep an entire packet in flight
+#define USB_FFS_NUM_BUFS        (MAX_PAYLOAD / USB_FFS_BULK_SIZE)
+
+struct aio_block
+{
+    struct iocb iocb[USB_FFS_NUM_BUFS];
+    struct iocb *iocbs[USB_FFS_NUM_BUFS];
+    struct io_event events[USB_FFS_NUM_BUFS];
+    aio_context_t ctx;
+};
+
 struct usb_handle
 {
     pthread_cond_t notify;
@@ -51,6 +69,11 @@ struct usb_handle
     int control;
     int bulk_out; /* "out" from the host's perspective => source for adbd */
     int bulk_in;  /* "in" from the host's perspective => sink for adbd */
+
+    // Reads and writes happen on different threads, so each has its own
+    // context
+    struct aio_block read_aiob;
+    struct aio_block write_aiob;
 };
 
 struct func_desc {
@@ -268,14 +291,22 @@ static int usb_adb_write(usb_handle *h, const void *data, int len)
 
 static int usb_adb_read(usb_handle *h, void *data, int len)
 {
-    int n;
+    char *buf = reinterpret_cast<char *>(data);
 
     ADB_LOGD(ADB_USB, "about to read (fd=%d, len=%d)", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if (n != len) {
-        ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d, errno = %d (%s)",
-                 h->fd, n, errno, strerror(errno));
-        return -1;
+    while (len > 0) {
+        // The kernel implementation of adb_read in f_adb.c doesn't support
+        // reads larger than 4096 bytes, so read the data in chunks. (The ffs
+        // implementation doesn't have this limit.)
+        int bytes_to_read = std::min(len, MAX_PAYLOAD_V1);
+        int n = adb_read(h->fd, buf, bytes_to_read);
+        if (n != bytes_to_read) {
+            ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d, errno = %d (%s)",
+                     h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        len -= n;
+        buf += n;
     }
     ADB_LOGD(ADB_USB, "[ done fd=%d ]", h->fd);
     return 0;
@@ -503,6 +534,171 @@ static int usb_ffs_read(usb_handle* h, void* data, int len)
     return 0;
 }
 
+static int io_setup(unsigned nr, aio_context_t *ctxp)
+{
+    return syscall(__NR_io_setup, nr, ctxp);
+}
+
+static int io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static int io_getevents(aio_context_t ctx, long min_nr, long max_nr,
+                        struct io_event *events, struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events, timeout);
+}
+
+static bool aio_block_init(struct aio_block *aiob)
+{
+    for (int i = 0; i < USB_FFS_NUM_BUFS; ++i) {
+        aiob->iocbs[i] = &aiob->iocb[i];
+    }
+
+    aiob->ctx = 0;
+    if (io_setup(USB_FFS_NUM_BUFS, &aiob->ctx) < 0) {
+        ADB_LOGW(ADB_USB, "[ aio: io_setup failed: %s ]", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static void aio_block_destroy(struct aio_block *aiob)
+{
+    if (aiob->ctx != 0) {
+        io_destroy(aiob->ctx);
+        aiob->ctx = 0;
+    }
+}
+
+static void prepare_iocb(struct iocb *cb, int fd, void *buf, size_t len,
+                         bool read)
+{
+    memset(cb, 0, sizeof(*cb));
+    cb->aio_fildes = fd;
+    cb->aio_lio_opcode = read ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+    cb->aio_buf = reinterpret_cast<uintptr_t>(buf);
+    cb->aio_nbytes = len;
+}
+
+/*
+ * Split the transfer into USB_FFS_BULK_SIZE requests and submit them all at
+ * once so that the UDC always has queued requests instead of idling between
+ * each read() or write() syscall. A request can complete short if the host
+ * ends a transfer early (eg. with a zero-length packet), in which case the
+ * remainder is resubmitted.
+ */
+static int usb_ffs_do_aio(usb_handle *h, int fd, void *data, int len,
+                          bool read)
+{
+    struct aio_block *aiob = read ? &h->read_aiob : &h->write_aiob;
+    char *cur = reinterpret_cast<char *>(data);
+    int remaining = len;
+
+    while (remaining > 0) {
+        int num_bufs = 0;
+        int submitted_len = 0;
+
+        while (num_bufs < USB_FFS_NUM_BUFS && submitted_len < remaining) {
+            int buf_len = std::min(remaining - submitted_len,
+                                   USB_FFS_BULK_SIZE);
+            prepare_iocb(&aiob->iocb[num_bufs], fd, cur + submitted_len,
+                         buf_len, read);
+            submitted_len += buf_len;
+            ++num_bufs;
+        }
+
+        int ret = TEMP_FAILURE_RETRY(io_submit(aiob->ctx, num_bufs, aiob->iocbs));
+        if (ret < num_bufs) {
+            ADB_LOGE(ADB_USB, "[ aio: failed to submit %s: %s ]",
+                     read ? "read" : "write",
+                     ret < 0 ? strerror(errno) : "partial submission");
+            return -1;
+        }
+
+        ret = TEMP_FAILURE_RETRY(io_getevents(aiob->ctx, num_bufs, num_bufs,
+                                              aiob->events, nullptr));
+        if (ret < num_bufs) {
+            ADB_LOGE(ADB_USB, "[ aio: failed to wait for %s: %s ]",
+                     read ? "read" : "write",
+                     ret < 0 ? strerror(errno) : "missing events");
+            return -1;
+        }
+
+        // Events are not necessarily returned in submission order
+        int64_t results[USB_FFS_NUM_BUFS];
+        for (int i = 0; i < num_bufs; ++i) {
+            struct iocb *cb = reinterpret_cast<struct iocb *>(
+                    aiob->events[i].obj);
+            results[cb - aiob->iocb] = aiob->events[i].res;
+        }
+
+        int done = 0;
+        bool short_transfer = false;
+
+        for (int i = 0; i < num_bufs; ++i) {
+            if (results[i] == -EINTR) {
+                short_transfer = true;
+            } else if (results[i] < 0) {
+                errno = static_cast<int>(-results[i]);
+                ADB_LOGE(ADB_USB, "[ aio: %s failed: %s ]",
+                         read ? "read" : "write", strerror(errno));
+                return -1;
+            } else if (short_transfer) {
+                // Data landed after a gap, so the stream is out of sync
+                if (results[i] > 0) {
+                    ADB_LOGE(ADB_USB, "[ aio: non-contiguous %s ]",
+                             read ? "read" : "write");
+                    errno = EIO;
+                    return -1;
+                }
+            } else {
+                done += static_cast<int>(results[i]);
+                short_transfer = static_cast<uint64_t>(results[i])
+                        < aiob->iocb[i].aio_nbytes;
+            }
+        }
+
+        cur += done;
+        remaining -= done;
+    }
+
+    return len;
+}
+
+static int usb_ffs_aio_write(usb_handle *h, const void *data, int len)
+{
+    ADB_LOGD(ADB_USB, "about to write (fd=%d, len=%d)", h->bulk_in, len);
+    int n = usb_ffs_do_aio(h, h->bulk_in, const_cast<void *>(data), len, false);
+    if (n != len) {
+        ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d: %s",
+                 h->bulk_in, n, strerror(errno));
+        return -1;
+    }
+    ADB_LOGD(ADB_USB, "[ done fd=%d ]", h->bulk_in);
+    return 0;
+}
+
+static int usb_ffs_aio_read(usb_handle *h, void *data, int len)
+{
+    ADB_LOGD(ADB_USB, "about to read (fd=%d, len=%d)", h->bulk_out, len);
+    int n = usb_ffs_do_aio(h, h->bulk_out, data, len, true);
+    if (n != len) {
+        ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d: %s",
+                 h->bulk_out, n, strerror(errno));
+        return -1;
+    }
+    ADB_LOGD(ADB_USB, "[ done fd=%d ]", h->bulk_out);
+    return 0;
+}
+
 static void usb_ffs_kick(usb_handle *h)
 {
     int err;
@@ -535,12 +731,21 @@ static void usb_ffs_init()
     usb_handle* h = reinterpret_cast<usb_handle*>(calloc(1, sizeof(usb_handle)));
     if (h == nullptr) fatal("couldn't allocate usb_handle");
 
-    h->write = usb_ffs_write;
-    h->read = usb_ffs_read;
+    // Fall back to synchronous I/O if the kernel doesn't support AIO
+    if (aio_block_init(&h->read_aiob) && aio_block_init(&h->write_aiob)) {
+        ADB_LOGD(ADB_USB, "[ usb_init - using AIO ]");
+        h->write = usb_ffs_aio_write;
+        h->read = usb_ffs_aio_read;
+    } else {
+        // Don't leak the read context if only the write context failed
+        aio_block_destroy(&h->read_aiob);
+        h->write = usb_ffs_write;
+        h->read = usb_ffs_read;
+    }
     h->kick = usb_ffs_kick;
     h->control = -1;
     h->bulk_out = -1;
-    h->bulk_out = -1;
+    h->bulk_in = -1;
 
     pthread_cond_init(&h->notify, 0);
     pthread_mutex_init(&h->lock, 0);
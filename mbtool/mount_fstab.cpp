@@ -20,8 +20,12 @@
 #include "mount_fstab.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -30,6 +34,7 @@
 #include <fnmatch.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <sys/mount.h>
@@ -40,6 +45,7 @@
 #include "mbcommon/string.h"
 #include "mbdevice/device.h"
 #include "mblog/logging.h"
+#include "mblog/trace.h"
 #include "mbutil/blkid.h"
 #include "mbutil/command.h"
 #include "mbutil/copy.h"
@@ -51,6 +57,7 @@
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
+#include "mbutil/time.h"
 
 #include "multiboot.h"
 #include "reboot.h"
@@ -119,7 +126,7 @@ static bool create_dir_and_mount(const std::vector<util::FstabRec> &recs,
         if (rec.fs_mgr_flags & util::MF_WAIT) {
             LOGD("%s: Waiting up to 20 seconds for block device",
                  rec.blk_device.c_str());
-            util::wait_for_path(rec.blk_device, 20 * 1000);
+            wait_for_block_dev(rec.blk_device, 20 * 1000);
         }
 
         // Try mounting
@@ -476,15 +483,18 @@ static bool mount_extsd_fstab_entries(const std::vector<util::FstabRec> &extsd_r
     }
 
     // We can't wait for a block device path to appear since we don't know the
-    // block device path. Thus, we'll match the paths a number of times with a
-    // delay between each attempt.
-    static const int max_attempts = 10;
+    // block device path. Thus, we'll match the paths every time a new block
+    // device is added (or at least once a second) until the timeout expires.
+    static const unsigned int timeout_ms = 10 * 1000;
+    static const unsigned int retry_ms = 1000;
 
-    for (int i = 0; i < max_attempts; ++i) {
-        LOGV("[Attempt %d/%d] Finding and mounting external SD",
-             i + 1, max_attempts);
+    uint64_t until = util::current_time_ms() + timeout_ms;
 
-        auto devices_map = get_block_dev_mappings();
+    for (int attempt = 1; ; ++attempt) {
+        LOGV("[Attempt %d] Finding and mounting external SD", attempt);
+
+        uint64_t generation;
+        auto devices_map = get_block_dev_mappings(generation);
 
         for (const util::FstabRec &rec : extsd_recs) {
             std::vector<std::string> patterns =
@@ -518,14 +528,19 @@ static bool mount_extsd_fstab_entries(const std::vector<util::FstabRec> &extsd_r
             }
         }
 
-        if (i < max_attempts - 1) {
-            LOGW("No external SD patterns were matched; waiting 1 second");
-            sleep(1);
+        uint64_t now = util::current_time_ms();
+        if (now >= until) {
+            break;
         }
+
+        LOGW("No external SD patterns were matched; "
+             "waiting for new block devices");
+        wait_for_block_dev_change(generation, static_cast<unsigned int>(
+                std::min<uint64_t>(retry_ms, until - now)));
     }
 
-    LOGE("No external SD patterns were matched after %d attempts",
-         max_attempts);
+    LOGE("No external SD patterns were matched after %u seconds",
+         timeout_ms / 1000);
 
     return false;
 }
@@ -843,6 +858,193 @@ static bool process_fstab(const char *path, const std::shared_ptr<Rom> &rom,
     return true;
 }
 
+/*!
+ * \brief Runs independent mounts concurrently
+ *
+ * Each mount runs in its own thread, so waiting for one block device or one
+ * slow mount (eg. ext4 journal replay) does not delay the others. A mount only
+ * waits for the mounts whose mount points are parent directories of its own
+ * mount point.
+ */
+class MountScheduler
+{
+public:
+    MountScheduler() = default;
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(MountScheduler)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(MountScheduler)
+
+    void add(std::string mount_point, std::function<bool()> func)
+    {
+        MountJob job;
+        job.mount_point = std::move(mount_point);
+        job.func = std::move(func);
+        m_jobs.push_back(std::move(job));
+    }
+
+    /*!
+     * \brief Run all mounts and wait for them to complete
+     *
+     * \return Whether every mount succeeded
+     */
+    bool run()
+    {
+        uint64_t start = util::current_time_ms();
+
+        // Parents have shorter paths, so they'll come before their children.
+        // This guarantees progress if a job has to run on this thread.
+        std::stable_sort(m_jobs.begin(), m_jobs.end(),
+                         [](const MountJob &a, const MountJob &b) {
+            return a.mount_point.size() < b.mount_point.size();
+        });
+
+        for (size_t i = 0; i < m_jobs.size(); ++i) {
+            for (size_t j = 0; j < i; ++j) {
+                if (is_parent_of(m_jobs[j].mount_point,
+                                 m_jobs[i].mount_point)) {
+                    m_jobs[i].deps.push_back(j);
+                }
+            }
+        }
+
+        std::vector<ThreadArgs> args(m_jobs.size());
+
+        for (size_t i = 0; i < m_jobs.size(); ++i) {
+            args[i].scheduler = this;
+            args[i].index = i;
+
+            if (pthread_create(&m_jobs[i].thread, nullptr, &job_thread,
+                               &args[i]) == 0) {
+                m_jobs[i].has_thread = true;
+            } else {
+                LOGW("%s: Failed to create thread; mounting synchronously",
+                     m_jobs[i].mount_point.c_str());
+                run_job(i);
+            }
+        }
+
+        bool ret = true;
+
+        for (MountJob &job : m_jobs) {
+            if (job.has_thread) {
+                pthread_join(job.thread, nullptr);
+            }
+            if (!job.success) {
+                ret = false;
+            }
+        }
+
+        LOGD("Finished %zu mounts in %" PRIu64 " ms",
+             m_jobs.size(), util::current_time_ms() - start);
+
+        return ret;
+    }
+
+    /*!
+     * \brief Get successfully mounted mount points
+     *
+     * \return Mount points in the order they were mounted
+     */
+    std::vector<std::string> mounted() const
+    {
+        std::vector<std::string> result;
+        for (size_t index : m_mounted) {
+            result.push_back(m_jobs[index].mount_point);
+        }
+        return result;
+    }
+
+private:
+    struct MountJob
+    {
+        std::string mount_point;
+        std::function<bool()> func;
+        //! Indexes of jobs that must be mounted first
+        std::vector<size_t> deps;
+
+        pthread_t thread;
+        bool has_thread = false;
+        bool done = false;
+        bool success = false;
+    };
+
+    struct ThreadArgs
+    {
+        MountScheduler *scheduler;
+        size_t index;
+    };
+
+    static bool is_parent_of(const std::string &parent,
+                             const std::string &child)
+    {
+        return child.size() > parent.size()
+                && child[parent.size()] == '/'
+                && mb::starts_with(child, parent);
+    }
+
+    static void * job_thread(void *userdata)
+    {
+        auto *args = static_cast<ThreadArgs *>(userdata);
+        args->scheduler->run_job(args->index);
+        return nullptr;
+    }
+
+    void run_job(size_t index)
+    {
+        MountJob &job = m_jobs[index];
+        const char *failed_dep = nullptr;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            for (size_t dep : job.deps) {
+                m_cond.wait(lock, [&]{ return m_jobs[dep].done; });
+                if (!m_jobs[dep].success) {
+                    failed_dep = m_jobs[dep].mount_point.c_str();
+                    break;
+                }
+            }
+        }
+
+        bool success = false;
+
+        if (failed_dep) {
+            LOGW("%s: Skipping because %s failed to mount",
+                 job.mount_point.c_str(), failed_dep);
+        } else {
+            log::TraceSpan span(job.mount_point.c_str());
+            uint64_t start = util::current_time_ms();
+
+            success = job.func();
+
+            uint64_t duration = util::current_time_ms() - start;
+            if (success) {
+                LOGD("%s: Mounted in %" PRIu64 " ms",
+                     job.mount_point.c_str(), duration);
+            } else {
+                LOGE("%s: Failed to mount after %" PRIu64 " ms",
+                     job.mount_point.c_str(), duration);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            job.done = true;
+            job.success = success;
+            if (success) {
+                m_mounted.push_back(index);
+            }
+        }
+
+        m_cond.notify_all();
+    }
+
+    std::vector<MountJob> m_jobs;
+    std::vector<size_t> m_mounted;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
+
 /*!
  * \brief Mount system, cache, and data entries from fstab
  *
@@ -854,7 +1056,6 @@ static bool process_fstab(const char *path, const std::shared_ptr<Rom> &rom,
 bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
                  const Device &device, MountFlags flags)
 {
-    std::vector<std::string> successful;
     FstabRecs recs;
 
     if (!process_fstab(path, rom, device, flags, recs)) {
@@ -867,36 +1068,24 @@ bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
         return false;
     }
 
-    bool ret = true;
+    MountScheduler scheduler;
 
-    // Mount system
-    if (ret && !recs.system.empty()) {
-        if (create_dir_and_mount(recs.system, SYSTEM_MOUNT_POINT, 0755)) {
-            successful.push_back(SYSTEM_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " SYSTEM_MOUNT_POINT);
-            ret = false;
-        }
+    if (!recs.system.empty()) {
+        scheduler.add(SYSTEM_MOUNT_POINT, [&]{
+            return create_dir_and_mount(recs.system, SYSTEM_MOUNT_POINT, 0755);
+        });
     }
 
-    // Mount cache
-    if (ret && !recs.cache.empty()) {
-        if (create_dir_and_mount(recs.cache, CACHE_MOUNT_POINT, 0755)) {
-            successful.push_back(CACHE_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " CACHE_MOUNT_POINT);
-            ret = false;
-        }
+    if (!recs.cache.empty()) {
+        scheduler.add(CACHE_MOUNT_POINT, [&]{
+            return create_dir_and_mount(recs.cache, CACHE_MOUNT_POINT, 0755);
+        });
     }
 
-    // Mount data
-    if (ret && !recs.data.empty()) {
-        if (create_dir_and_mount(recs.data, DATA_MOUNT_POINT, 0755)) {
-            successful.push_back(DATA_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " DATA_MOUNT_POINT);
-            ret = false;
-        }
+    if (!recs.data.empty()) {
+        scheduler.add(DATA_MOUNT_POINT, [&]{
+            return create_dir_and_mount(recs.data, DATA_MOUNT_POINT, 0755);
+        });
     }
 
     // Mount external SD only if ROM is installed on the external SD. This is
@@ -909,20 +1098,25 @@ bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
         LOGV("Skipping extsd mount because ROM is not an extsd-slot");
     }
 
-    if (ret && !recs.extsd.empty() && require_extsd) {
-        if (mount_extsd_fstab_entries(recs.extsd, EXTSD_MOUNT_POINT, 0755)) {
-            successful.push_back(EXTSD_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " EXTSD_MOUNT_POINT);
-            ret = false;
-        }
+    if (!recs.extsd.empty() && require_extsd) {
+        scheduler.add(EXTSD_MOUNT_POINT, [&]{
+            return mount_extsd_fstab_entries(
+                    recs.extsd, EXTSD_MOUNT_POINT, 0755);
+        });
     }
 
+    // Partitions do not depend on each other, so they are mounted
+    // concurrently
+    bool ret = scheduler.run();
+
     if (ret) {
         LOGI("Successfully mounted partitions");
     } else if (flags & MountFlag::UnmountOnFailure) {
-        for (const std::string &mount_point : successful) {
-            util::umount(mount_point);
+        std::vector<std::string> mounted = scheduler.mounted();
+
+        // Unmount in reverse order in case mount points are nested
+        for (auto it = mounted.rbegin(); it != mounted.rend(); ++it) {
+            util::umount(*it);
         }
     }
 
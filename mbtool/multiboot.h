@@ -27,6 +27,7 @@
 #define MULTIBOOT_LOG_INSTALLER         INTERNAL_STORAGE "/MultiBoot.log"
 #define MULTIBOOT_LOG_APPSYNC           MULTIBOOT_DIR "/appsync.log"
 #define MULTIBOOT_LOG_DAEMON            MULTIBOOT_DIR "/daemon.log"
+#define MULTIBOOT_LOG_DAEMON_BIN        MULTIBOOT_DIR "/daemon.mblog"
 
 #define ABOOT_PARTITION                 "/dev/block/platform/msm_sdcc.1/by-name/aboot"
 
@@ -59,6 +60,15 @@
 #define BOOT_UI_PATH                    "/mbbootui"
 #define BOOT_UI_EXEC_PATH               BOOT_UI_PATH "/exec"
 
+// Boot timeline (Chrome trace event format)
+#define BOOT_TRACE_PATH                 "/raw/cache/multiboot/logs/boot_trace.json"
+
+// Patched SELinux policies
+#define SEPOLICY_CACHE_DIR              "/raw/cache/multiboot/sepolicy"
+
+// Compiled regexes for the contexts added to file_contexts.bin
+#define FILE_CONTEXTS_REGEX_CACHE       "/raw/cache/multiboot/file_contexts_regexes.bin"
+
 // Installer
 #define CHROOT_SYSTEM_BIND_MOUNT        "/mb/bind.system"
 #define CHROOT_CACHE_BIND_MOUNT         "/mb/bind.cache"
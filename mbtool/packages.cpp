@@ -19,18 +19,16 @@
 
 #include "packages.h"
 
-#include <algorithm>
-
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 
-#include <pugixml.hpp>
-
 #include "mbcommon/integer.h"
 #include "mblog/logging.h"
 
+#include "xml_pull_parser.h"
+
 #define LOG_TAG "mbtool/packages"
 
 
@@ -92,13 +90,6 @@ static const char *ATTR_SAMSUNG_NATIVE_LIBRARY_ROOT_REQUIRES_ISA
 static const char *ATTR_SAMSUNG_SECONDARY_NATIVE_LIBRARY_DIR
                                              = "secondaryNativeLibraryDir";
 
-static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
-                           std::shared_ptr<Package> pkg);
-static bool parse_tag_sigs(pugi::xml_node node, Packages *pkgs,
-                           std::shared_ptr<Package> pkg);
-static bool parse_tag_package(pugi::xml_node node, Packages *pkgs);
-static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs);
-
 
 Package::Package() :
         name(),
@@ -311,67 +302,96 @@ void Package::dump()
 #undef DUMP_PRIVATE_FLAG_IF_SET
 }
 
-bool Packages::load_xml(const std::string &path)
+class PackagesParser
 {
-    pkgs.clear();
-    sigs.clear();
+public:
+    PackagesParser(Packages &pkgs, Packages::Fields fields);
+
+    bool parse(const std::string &path);
+
+private:
+    bool parse_tag_cert();
+    bool parse_tag_sigs();
+    bool parse_tag_package();
+    bool parse_tag_packages();
+    bool skip_children(const char *parent);
+
+    uint32_t intern(const std::string &str);
+
+    Packages &m_pkgs;
+    Packages::Fields m_fields;
+    XmlPullParser m_parser;
+    // Offsets of strings in m_pkgs.m_strings. Only needed while loading.
+    std::unordered_map<std::string, uint32_t> m_string_ids;
+};
+
+PackagesParser::PackagesParser(Packages &pkgs, Packages::Fields fields)
+    : m_pkgs(pkgs)
+    , m_fields(fields)
+{
+}
 
-    pugi::xml_document doc;
-    pugi::xml_parse_result result = doc.load_file(path.c_str());
-    if (!result) {
-        LOGE("Failed to parse XML file: %s: %s",
-             path.c_str(), result.description());
+bool PackagesParser::parse(const std::string &path)
+{
+    if (!m_parser.open(path)) {
+        LOGE("%s: %s", path.c_str(), m_parser.error().c_str());
         return false;
     }
 
-    pugi::xml_node root = doc.root();
+    XmlPullParser::Event event;
 
-    for (pugi::xml_node cur_node : root.children()) {
-        if (cur_node.type() != pugi::xml_node_type::node_element) {
-            continue;
-        }
-
-        if (strcmp(cur_node.name(), TAG_PACKAGES) == 0) {
-            if (!parse_tag_packages(cur_node, this)) {
-                return false;
+    while ((event = m_parser.next()) == XmlPullParser::Event::StartTag) {
+        if (m_parser.name() == TAG_PACKAGES) {
+            if (!parse_tag_packages()) {
+                break;
             }
         } else {
-            LOGW("Unrecognized root tag: %s", cur_node.name());
+            LOGW("Unrecognized root tag: %s", m_parser.name().c_str());
+            if (!m_parser.skip_tag()) {
+                break;
+            }
         }
     }
 
-    return true;
+    if (event == XmlPullParser::Event::EndDocument) {
+        return true;
+    }
+
+    if (!m_parser.error().empty()) {
+        LOGE("Failed to parse XML file: %s: %s",
+             path.c_str(), m_parser.error().c_str());
+    }
+    return false;
 }
 
-static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
-                           std::shared_ptr<Package> pkg)
+bool PackagesParser::parse_tag_cert()
 {
-    assert(strcmp(node.name(), TAG_CERT) == 0);
+    assert(m_parser.name() == TAG_CERT);
 
     std::string index;
     std::string key;
 
-    for (pugi::xml_attribute attr : node.attributes()) {
-        const pugi::char_t *name = attr.name();
-        const pugi::char_t *value = attr.value();
+    for (size_t i = 0; i < m_parser.attribute_count(); ++i) {
+        const std::string &name = m_parser.attribute_name(i);
+        const std::string &value = m_parser.attribute_value(i);
 
-        if (strcmp(name, ATTR_INDEX) == 0) {
+        if (name == ATTR_INDEX) {
             index = value;
-        } else if (strcmp(name, ATTR_KEY) == 0) {
+        } else if (name == ATTR_KEY) {
             key = value;
         } else {
-            LOGW("Unrecognized attribute '%s' in <%s>", name, TAG_CERT);
+            LOGW("Unrecognized attribute '%s' in <%s>", name.c_str(), TAG_CERT);
         }
     }
 
     if (index.empty()) {
         LOGW("Missing or empty index in <%s>", TAG_CERT);
     } else {
-        pkg->sig_indexes.push_back(index);
+        m_pkgs.m_sig_indexes.push_back(intern(index));
     }
     if (!index.empty() && !key.empty()) {
-        auto it = pkgs->sigs.find(index);
-        if (it != pkgs->sigs.end()) {
+        auto it = m_pkgs.sigs.find(index);
+        if (it != m_pkgs.sigs.end()) {
             // Make sure key matches if it's already in the map
             if (it->second != key) {
                 LOGE("Error: Index \"%s\" assigned to multiple keys",
@@ -380,211 +400,521 @@ static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
             }
         } else {
             // Otherwise, add it to the map
-            pkgs->sigs.insert(std::make_pair(std::move(index), std::move(key)));
+            m_pkgs.sigs.insert(std::make_pair(std::move(index), std::move(key)));
         }
     }
 
-    return true;
+    return m_parser.skip_tag();
 }
 
-static bool parse_tag_sigs(pugi::xml_node node, Packages *pkgs,
-                           std::shared_ptr<Package> pkg)
+bool PackagesParser::parse_tag_sigs()
 {
-    assert(strcmp(node.name(), TAG_SIGS) == 0);
+    assert(m_parser.name() == TAG_SIGS);
+
+    XmlPullParser::Event event;
 
-    for (pugi::xml_node cur_node : node.children()) {
-        if (cur_node.type() != pugi::xml_node_type::node_element) {
+    while ((event = m_parser.next()) != XmlPullParser::Event::EndTag) {
+        if (event == XmlPullParser::Event::Text) {
             continue;
+        } else if (event != XmlPullParser::Event::StartTag) {
+            return false;
         }
 
-        if (strcmp(cur_node.name(), TAG_SIGS) == 0) {
-            LOGW("Nested <%s> is not allowed", TAG_SIGS);
-        } else if (strcmp(cur_node.name(), TAG_CERT) == 0) {
-            if (!parse_tag_cert(cur_node, pkgs, pkg)) {
+        if (m_parser.name() == TAG_CERT) {
+            if (!parse_tag_cert()) {
                 return false;
             }
+            continue;
+        }
+
+        if (m_parser.name() == TAG_SIGS) {
+            LOGW("Nested <%s> is not allowed", TAG_SIGS);
         } else {
-            LOGW("Unrecognized <%s> within <%s>", cur_node.name(), TAG_SIGS);
+            LOGW("Unrecognized <%s> within <%s>",
+                 m_parser.name().c_str(), TAG_SIGS);
+        }
+        if (!m_parser.skip_tag()) {
+            return false;
         }
     }
 
     return true;
 }
 
-static bool parse_tag_package(pugi::xml_node node, Packages *pkgs)
+bool PackagesParser::parse_tag_package()
 {
-    assert(strcmp(node.name(), TAG_PACKAGE) == 0);
-
-    std::shared_ptr<Package> pkg(new Package());
-
-    for (pugi::xml_attribute attr : node.attributes()) {
-        const pugi::char_t *name = attr.name();
-        const pugi::char_t *value = attr.value();
-
-        if (strcmp(name, ATTR_CODE_PATH) == 0) {
-            pkg->code_path = value;
-        } else if (strcmp(name, ATTR_CPU_ABI_OVERRIDE) == 0) {
-            pkg->cpu_abi_override = value;
-        } else if (strcmp(name, ATTR_FLAGS) == 0) {
-            uint64_t flags;
-            if (!str_to_num(value, 10, flags)) {
+    assert(m_parser.name() == TAG_PACKAGE);
+
+    uint32_t name = 0;
+    uint32_t real_name = 0;
+    uint32_t code_path = 0;
+    uint32_t resource_path = 0;
+    uint32_t native_library_path = 0;
+    uint32_t primary_cpu_abi = 0;
+    uint32_t secondary_cpu_abi = 0;
+    uint32_t cpu_abi_override = 0;
+    uint32_t uid_error = 0;
+    uint32_t install_status = 0;
+    uint32_t installer = 0;
+    uint64_t pkg_flags = 0;
+    uint64_t pkg_public_flags = 0;
+    uint64_t pkg_private_flags = 0;
+    uint64_t timestamp = 0;
+    uint64_t first_install_time = 0;
+    uint64_t last_update_time = 0;
+    int version = 0;
+    int user_id = 0;
+    int shared_user_id = 0;
+    bool is_shared_user = false;
+
+    bool want_name = m_fields & Packages::Field::Name;
+    bool want_paths = m_fields & Packages::Field::Paths;
+    bool want_cpu_abis = m_fields & Packages::Field::CpuAbis;
+    bool want_flags = m_fields & Packages::Field::Flags;
+    bool want_timestamps = m_fields & Packages::Field::Timestamps;
+    bool want_version = m_fields & Packages::Field::Version;
+    bool want_uid = m_fields & Packages::Field::Uid;
+    bool want_status = m_fields & Packages::Field::Status;
+
+    // Unrequested fields are neither stored nor validated
+    for (size_t i = 0; i < m_parser.attribute_count(); ++i) {
+        const std::string &attr = m_parser.attribute_name(i);
+        const std::string &value_str = m_parser.attribute_value(i);
+        const char *value = value_str.c_str();
+
+        if (attr == ATTR_CODE_PATH) {
+            if (want_paths) {
+                code_path = intern(value_str);
+            }
+        } else if (attr == ATTR_CPU_ABI_OVERRIDE) {
+            if (want_cpu_abis) {
+                cpu_abi_override = intern(value_str);
+            }
+        } else if (attr == ATTR_FLAGS) {
+            if (want_flags && !str_to_num(value, 10, pkg_flags)) {
                 LOGE("Invalid flags: '%s'", value);
                 return false;
             }
-            pkg->pkg_flags = static_cast<Package::Flag>(flags);
-        } else if (strcmp(name, ATTR_PUBLIC_FLAGS) == 0) {
-            uint64_t flags;
-            if (!str_to_num(value, 10, flags)) {
+        } else if (attr == ATTR_PUBLIC_FLAGS) {
+            if (want_flags && !str_to_num(value, 10, pkg_public_flags)) {
                 LOGE("Invalid public flags: '%s'", value);
                 return false;
             }
-            pkg->pkg_public_flags = static_cast<Package::PublicFlag>(flags);
-        } else if (strcmp(name, ATTR_PRIVATE_FLAGS) == 0) {
-            uint64_t flags;
-            if (!str_to_num(value, 10, flags)) {
+        } else if (attr == ATTR_PRIVATE_FLAGS) {
+            if (want_flags && !str_to_num(value, 10, pkg_private_flags)) {
                 LOGE("Invalid private flags: '%s'", value);
                 return false;
             }
-            pkg->pkg_private_flags = static_cast<Package::PrivateFlag>(flags);
-        } else if (strcmp(name, ATTR_FT) == 0) {
-            if (!str_to_num(value, 16, pkg->timestamp)) {
+        } else if (attr == ATTR_FT) {
+            if (want_timestamps && !str_to_num(value, 16, timestamp)) {
                 LOGE("Invalid ft timestamp: '%s'", value);
                 return false;
             }
-        } else if (strcmp(name, ATTR_INSTALL_STATUS) == 0) {
-            pkg->install_status = value;
-        } else if (strcmp(name, ATTR_INSTALLER) == 0) {
-            pkg->installer = value;
-        } else if (strcmp(name, ATTR_IT) == 0) {
-            if (!str_to_num(value, 16, pkg->first_install_time)) {
+        } else if (attr == ATTR_INSTALL_STATUS) {
+            if (want_status) {
+                install_status = intern(value_str);
+            }
+        } else if (attr == ATTR_INSTALLER) {
+            if (want_status) {
+                installer = intern(value_str);
+            }
+        } else if (attr == ATTR_IT) {
+            if (want_timestamps && !str_to_num(value, 16, first_install_time)) {
                 LOGE("Invalid first install timestamp: '%s'", value);
                 return false;
             }
-        } else if (strcmp(name, ATTR_NAME) == 0) {
-            pkg->name = value;
-        } else if (strcmp(name, ATTR_NATIVE_LIBRARY_PATH) == 0) {
-            pkg->native_library_path = value;
-        } else if (strcmp(name, ATTR_PRIMARY_CPU_ABI) == 0) {
-            pkg->primary_cpu_abi = value;
-        } else if (strcmp(name, ATTR_REAL_NAME) == 0) {
-            pkg->real_name = value;
-        } else if (strcmp(name, ATTR_RESOURCE_PATH) == 0) {
-            pkg->resource_path = value;
-        } else if (strcmp(name, ATTR_SECONDARY_CPU_ABI) == 0) {
-            pkg->secondary_cpu_abi = value;
-        } else if (strcmp(name, ATTR_SHARED_USER_ID) == 0) {
-            if (!str_to_num(value, 10, pkg->shared_user_id)) {
+        } else if (attr == ATTR_NAME) {
+            if (want_name) {
+                name = intern(value_str);
+            }
+        } else if (attr == ATTR_NATIVE_LIBRARY_PATH) {
+            if (want_paths) {
+                native_library_path = intern(value_str);
+            }
+        } else if (attr == ATTR_PRIMARY_CPU_ABI) {
+            if (want_cpu_abis) {
+                primary_cpu_abi = intern(value_str);
+            }
+        } else if (attr == ATTR_REAL_NAME) {
+            if (want_paths) {
+                real_name = intern(value_str);
+            }
+        } else if (attr == ATTR_RESOURCE_PATH) {
+            if (want_paths) {
+                resource_path = intern(value_str);
+            }
+        } else if (attr == ATTR_SECONDARY_CPU_ABI) {
+            if (want_cpu_abis) {
+                secondary_cpu_abi = intern(value_str);
+            }
+        } else if (attr == ATTR_SHARED_USER_ID) {
+            if (want_uid && !str_to_num(value, 10, shared_user_id)) {
                 LOGE("Invalid shared user ID: '%s'", value);
                 return false;
             }
-            pkg->is_shared_user = 1;
-        } else if (strcmp(name, ATTR_UID_ERROR) == 0) {
-            pkg->uid_error = value;
-        } else if (strcmp(name, ATTR_USER_ID) == 0) {
-            if (!str_to_num(value, 10, pkg->user_id)) {
+            is_shared_user = true;
+        } else if (attr == ATTR_UID_ERROR) {
+            if (want_status) {
+                uid_error = intern(value_str);
+            }
+        } else if (attr == ATTR_USER_ID) {
+            if (want_uid && !str_to_num(value, 10, user_id)) {
                 LOGE("Invalid user ID: '%s'", value);
                 return false;
             }
-            pkg->is_shared_user = 0;
-        } else if (strcmp(name, ATTR_UT) == 0) {
-            if (!str_to_num(value, 16, pkg->last_update_time)) {
+            is_shared_user = false;
+        } else if (attr == ATTR_UT) {
+            if (want_timestamps && !str_to_num(value, 16, last_update_time)) {
                 LOGE("Invalid last update timestamp: '%s'", value);
                 return false;
             }
-        } else if (strcmp(name, ATTR_VERSION) == 0) {
-            if (!str_to_num(value, 10, pkg->version)) {
+        } else if (attr == ATTR_VERSION) {
+            if (want_version && !str_to_num(value, 10, version)) {
                 LOGE("Invalid version: '%s'", value);
                 return false;
             }
-        } else if (strcmp(name, ATTR_SAMSUNG_DM) == 0
-                || strcmp(name, ATTR_SAMSUNG_DT) == 0
-                || strcmp(name, ATTR_SAMSUNG_NATIVE_LIBRARY_DIR) == 0
-                || strcmp(name, ATTR_SAMSUNG_NATIVE_LIBRARY_ROOT_DIR) == 0
-                || strcmp(name, ATTR_SAMSUNG_NATIVE_LIBRARY_ROOT_REQUIRES_ISA) == 0
-                || strcmp(name, ATTR_SAMSUNG_SECONDARY_NATIVE_LIBRARY_DIR) == 0) {
+        } else if (attr == ATTR_SAMSUNG_DM
+                || attr == ATTR_SAMSUNG_DT
+                || attr == ATTR_SAMSUNG_NATIVE_LIBRARY_DIR
+                || attr == ATTR_SAMSUNG_NATIVE_LIBRARY_ROOT_DIR
+                || attr == ATTR_SAMSUNG_NATIVE_LIBRARY_ROOT_REQUIRES_ISA
+                || attr == ATTR_SAMSUNG_SECONDARY_NATIVE_LIBRARY_DIR) {
             // Ignore Samsung-specific attributes
         } else {
-            LOGW("Unrecognized attribute '%s' in <%s>", name, TAG_PACKAGE);
+            LOGW("Unrecognized attribute '%s' in <%s>",
+                 attr.c_str(), TAG_PACKAGE);
         }
     }
 
-    for (pugi::xml_node cur_node : node.children()) {
-        if (cur_node.type() != pugi::xml_node_type::node_element) {
+    // The signatures of this package start here. load_xml() adds the end
+    // offset of the last package.
+    if (m_fields & Packages::Field::Signatures) {
+        m_pkgs.m_sig_offsets.push_back(
+                static_cast<uint32_t>(m_pkgs.m_sig_indexes.size()));
+    }
+
+    XmlPullParser::Event event;
+
+    while ((event = m_parser.next()) != XmlPullParser::Event::EndTag) {
+        if (event == XmlPullParser::Event::Text) {
             continue;
+        } else if (event != XmlPullParser::Event::StartTag) {
+            return false;
         }
 
-        if (strcmp(cur_node.name(), TAG_PACKAGE) == 0) {
-            LOGW("Nested <%s> is not allowed", TAG_PACKAGE);
-        } else if (strcmp(cur_node.name(), TAG_DEFINED_KEYSET) == 0
-                || strcmp(cur_node.name(), TAG_DOMAIN_VERIFICATION) == 0
-                || strcmp(cur_node.name(), TAG_PERMS) == 0
-                || strcmp(cur_node.name(), TAG_PROPER_SIGNING_KEYSET) == 0
-                || strcmp(cur_node.name(), TAG_SIGNING_KEYSET) == 0
-                || strcmp(cur_node.name(), TAG_UPGRADE_KEYSET) == 0) {
-            // Ignore
-        } else if (strcmp(cur_node.name(), TAG_SIGS) == 0) {
-            if (!parse_tag_sigs(cur_node, pkgs, pkg)) {
+        const std::string &tag = m_parser.name();
+
+        if (tag == TAG_SIGS && (m_fields & Packages::Field::Signatures)) {
+            if (!parse_tag_sigs()) {
                 return false;
             }
+            continue;
+        }
+
+        if (tag == TAG_PACKAGE) {
+            LOGW("Nested <%s> is not allowed", TAG_PACKAGE);
+        } else if (tag == TAG_DEFINED_KEYSET
+                || tag == TAG_DOMAIN_VERIFICATION
+                || tag == TAG_PERMS
+                || tag == TAG_PROPER_SIGNING_KEYSET
+                || tag == TAG_SIGNING_KEYSET
+                || tag == TAG_UPGRADE_KEYSET
+                || tag == TAG_SIGS) {
+            // Ignore
         } else {
-            LOGW("Unrecognized <%s> within <%s>", cur_node.name(), TAG_PACKAGE);
+            LOGW("Unrecognized <%s> within <%s>", tag.c_str(), TAG_PACKAGE);
+        }
+        if (!m_parser.skip_tag()) {
+            return false;
         }
     }
 
-    pkgs->pkgs.push_back(std::move(pkg));
+    auto index = static_cast<uint32_t>(m_pkgs.m_size++);
+
+    if (want_name) {
+        m_pkgs.m_name.push_back(name);
+        m_pkgs.m_name_index.emplace(m_pkgs.string_at(name), index);
+    }
+    if (want_paths) {
+        m_pkgs.m_real_name.push_back(real_name);
+        m_pkgs.m_code_path.push_back(code_path);
+        m_pkgs.m_resource_path.push_back(resource_path);
+        m_pkgs.m_native_library_path.push_back(native_library_path);
+    }
+    if (want_cpu_abis) {
+        m_pkgs.m_primary_cpu_abi.push_back(primary_cpu_abi);
+        m_pkgs.m_secondary_cpu_abi.push_back(secondary_cpu_abi);
+        m_pkgs.m_cpu_abi_override.push_back(cpu_abi_override);
+    }
+    if (want_flags) {
+        m_pkgs.m_pkg_flags.push_back(static_cast<Package::Flag>(pkg_flags));
+        m_pkgs.m_pkg_public_flags.push_back(
+                static_cast<Package::PublicFlag>(pkg_public_flags));
+        m_pkgs.m_pkg_private_flags.push_back(
+                static_cast<Package::PrivateFlag>(pkg_private_flags));
+    }
+    if (want_timestamps) {
+        m_pkgs.m_timestamp.push_back(timestamp);
+        m_pkgs.m_first_install_time.push_back(first_install_time);
+        m_pkgs.m_last_update_time.push_back(last_update_time);
+    }
+    if (want_version) {
+        m_pkgs.m_version.push_back(version);
+    }
+    if (want_uid) {
+        m_pkgs.m_user_id.push_back(user_id);
+        m_pkgs.m_shared_user_id.push_back(shared_user_id);
+        m_pkgs.m_is_shared_user.push_back(is_shared_user);
+        if (!is_shared_user) {
+            m_pkgs.m_uid_index.emplace(static_cast<uid_t>(user_id), index);
+        }
+    }
+    if (want_status) {
+        m_pkgs.m_uid_error.push_back(uid_error);
+        m_pkgs.m_install_status.push_back(install_status);
+        m_pkgs.m_installer.push_back(installer);
+    }
 
     return true;
 }
 
-static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs)
+bool PackagesParser::parse_tag_packages()
 {
-    assert(strcmp(node.name(), TAG_PACKAGES) == 0);
+    assert(m_parser.name() == TAG_PACKAGES);
+
+    XmlPullParser::Event event;
 
-    for (pugi::xml_node cur_node : node.children()) {
-        if (cur_node.type() != pugi::xml_node_type::node_element) {
+    while ((event = m_parser.next()) != XmlPullParser::Event::EndTag) {
+        if (event == XmlPullParser::Event::Text) {
             continue;
+        } else if (event != XmlPullParser::Event::StartTag) {
+            return false;
         }
 
-        if (strcmp(cur_node.name(), TAG_PACKAGES) == 0) {
-            LOGW("Nested <%s> is not allowed", TAG_PACKAGES);
-        } else if (strcmp(cur_node.name(), TAG_PACKAGE) == 0) {
-            if (!parse_tag_package(cur_node, pkgs)) {
+        const std::string &tag = m_parser.name();
+
+        if (tag == TAG_PACKAGE) {
+            if (!parse_tag_package()) {
                 return false;
             }
-        } else if (strcmp(cur_node.name(), TAG_DATABASE_VERSION) == 0
-                || strcmp(cur_node.name(), TAG_KEYSET_SETTINGS) == 0
-                || strcmp(cur_node.name(), TAG_LAST_PLATFORM_VERSION) == 0
-                || strcmp(cur_node.name(), TAG_PERMISSION_TREES) == 0
-                || strcmp(cur_node.name(), TAG_PERMISSIONS) == 0
-                || strcmp(cur_node.name(), TAG_RENAMED_PACKAGE) == 0
-                || strcmp(cur_node.name(), TAG_SHARED_USER) == 0
-                || strcmp(cur_node.name(), TAG_UPDATED_PACKAGE) == 0
-                || strcmp(cur_node.name(), TAG_VERSION) == 0) {
+            continue;
+        }
+
+        if (tag == TAG_PACKAGES) {
+            LOGW("Nested <%s> is not allowed", TAG_PACKAGES);
+        } else if (tag == TAG_DATABASE_VERSION
+                || tag == TAG_KEYSET_SETTINGS
+                || tag == TAG_LAST_PLATFORM_VERSION
+                || tag == TAG_PERMISSION_TREES
+                || tag == TAG_PERMISSIONS
+                || tag == TAG_RENAMED_PACKAGE
+                || tag == TAG_SHARED_USER
+                || tag == TAG_UPDATED_PACKAGE
+                || tag == TAG_VERSION) {
             // Ignore
         } else {
-            LOGW("Unrecognized <%s> within <%s>", cur_node.name(), TAG_PACKAGES);
+            LOGW("Unrecognized <%s> within <%s>", tag.c_str(), TAG_PACKAGES);
+        }
+        if (!m_parser.skip_tag()) {
+            return false;
         }
     }
 
     return true;
 }
 
+uint32_t PackagesParser::intern(const std::string &str)
+{
+    if (str.empty()) {
+        return 0;
+    }
+
+    auto it = m_string_ids.find(str);
+    if (it != m_string_ids.end()) {
+        return it->second;
+    }
+
+    auto offset = static_cast<uint32_t>(m_pkgs.m_strings.size());
+    m_pkgs.m_strings.append(str.c_str(), str.size() + 1);
+    m_string_ids.emplace(str, offset);
+
+    return offset;
+}
+
+Packages::Packages()
+{
+    clear();
+}
+
+/*!
+ * \brief Load packages from packages.xml
+ *
+ * \param path Path to packages.xml
+ * \param fields Fields to load. Fields that are not loaded are left at their
+ *               default values in the Package instances returned by get(),
+ *               find_by_uid(), and find_by_pkg(). find_by_uid() requires
+ *               Field::Uid and find_by_pkg() requires Field::Name.
+ */
+bool Packages::load_xml(const std::string &path, Fields fields)
+{
+    clear();
+    m_fields = fields;
+
+    PackagesParser parser(*this, fields);
+    if (!parser.parse(path)) {
+        return false;
+    }
+
+    // Add the end offset for the last package
+    if (fields & Field::Signatures) {
+        m_sig_offsets.push_back(static_cast<uint32_t>(m_sig_indexes.size()));
+    }
+
+    return true;
+}
+
+void Packages::clear()
+{
+    sigs.clear();
+
+    m_fields = {};
+    m_size = 0;
+    m_strings.assign(1, '\0');
+
+    m_name.clear();
+    m_real_name.clear();
+    m_code_path.clear();
+    m_resource_path.clear();
+    m_native_library_path.clear();
+    m_primary_cpu_abi.clear();
+    m_secondary_cpu_abi.clear();
+    m_cpu_abi_override.clear();
+    m_uid_error.clear();
+    m_install_status.clear();
+    m_installer.clear();
+    m_pkg_flags.clear();
+    m_pkg_public_flags.clear();
+    m_pkg_private_flags.clear();
+    m_timestamp.clear();
+    m_first_install_time.clear();
+    m_last_update_time.clear();
+    m_version.clear();
+    m_user_id.clear();
+    m_shared_user_id.clear();
+    m_is_shared_user.clear();
+    m_sig_offsets.clear();
+    m_sig_indexes.clear();
+    m_uid_index.clear();
+    m_name_index.clear();
+}
+
+size_t Packages::size() const
+{
+    return m_size;
+}
+
+Packages::Fields Packages::fields() const
+{
+    return m_fields;
+}
+
+/*!
+ * \brief Create a Package instance containing the loaded fields of a package
+ */
+std::shared_ptr<Package> Packages::get(size_t index) const
+{
+    std::shared_ptr<Package> pkg(new Package());
+
+    if (m_fields & Field::Name) {
+        pkg->name = string_at(m_name[index]);
+    }
+    if (m_fields & Field::Paths) {
+        pkg->real_name = string_at(m_real_name[index]);
+        pkg->code_path = string_at(m_code_path[index]);
+        pkg->resource_path = string_at(m_resource_path[index]);
+        pkg->native_library_path = string_at(m_native_library_path[index]);
+    }
+    if (m_fields & Field::CpuAbis) {
+        pkg->primary_cpu_abi = string_at(m_primary_cpu_abi[index]);
+        pkg->secondary_cpu_abi = string_at(m_secondary_cpu_abi[index]);
+        pkg->cpu_abi_override = string_at(m_cpu_abi_override[index]);
+    }
+    if (m_fields & Field::Flags) {
+        pkg->pkg_flags = m_pkg_flags[index];
+        pkg->pkg_public_flags = m_pkg_public_flags[index];
+        pkg->pkg_private_flags = m_pkg_private_flags[index];
+    }
+    if (m_fields & Field::Timestamps) {
+        pkg->timestamp = m_timestamp[index];
+        pkg->first_install_time = m_first_install_time[index];
+        pkg->last_update_time = m_last_update_time[index];
+    }
+    if (m_fields & Field::Version) {
+        pkg->version = m_version[index];
+    }
+    if (m_fields & Field::Uid) {
+        pkg->is_shared_user = m_is_shared_user[index];
+        pkg->user_id = m_user_id[index];
+        pkg->shared_user_id = m_shared_user_id[index];
+    }
+    if (m_fields & Field::Status) {
+        pkg->uid_error = string_at(m_uid_error[index]);
+        pkg->install_status = string_at(m_install_status[index]);
+        pkg->installer = string_at(m_installer[index]);
+    }
+    if (m_fields & Field::Signatures) {
+        for (uint32_t i = m_sig_offsets[index]; i < m_sig_offsets[index + 1];
+                ++i) {
+            pkg->sig_indexes.push_back(string_at(m_sig_indexes[i]));
+        }
+    }
+
+    return pkg;
+}
+
+const char * Packages::name(size_t index) const
+{
+    return string_at(m_name[index]);
+}
+
+Package::Flags Packages::pkg_flags(size_t index) const
+{
+    return m_pkg_flags[index];
+}
+
+Package::PublicFlags Packages::pkg_public_flags(size_t index) const
+{
+    return m_pkg_public_flags[index];
+}
+
+Package::PrivateFlags Packages::pkg_private_flags(size_t index) const
+{
+    return m_pkg_private_flags[index];
+}
+
+uid_t Packages::uid(size_t index) const
+{
+    return static_cast<uid_t>(m_is_shared_user[index]
+            ? m_shared_user_id[index] : m_user_id[index]);
+}
+
 std::shared_ptr<Package> Packages::find_by_uid(uid_t uid) const
 {
-    auto it = std::find_if(pkgs.begin(), pkgs.end(),
-                           [&](const std::shared_ptr<Package> &pkg) {
-        return !pkg->is_shared_user && pkg->user_id == static_cast<int>(uid);
-    });
-    return it == pkgs.end() ? std::shared_ptr<Package>() : *it;
+    auto it = m_uid_index.find(uid);
+    return it == m_uid_index.end() ? std::shared_ptr<Package>()
+            : get(it->second);
 }
 
 std::shared_ptr<Package> Packages::find_by_pkg(const std::string &pkg_id) const
 {
-    auto it = std::find_if(pkgs.begin(), pkgs.end(),
-                           [&](const std::shared_ptr<Package> &pkg) {
-        return pkg->name == pkg_id;
-    });
-    return it == pkgs.end() ? std::shared_ptr<Package>() : *it;
+    auto it = m_name_index.find(pkg_id);
+    return it == m_name_index.end() ? std::shared_ptr<Package>()
+            : get(it->second);
+}
+
+const char * Packages::string_at(uint32_t offset) const
+{
+    return m_strings.data() + offset;
 }
 
 }
@@ -169,16 +169,106 @@ MB_DECLARE_OPERATORS_FOR_FLAGS(Package::Flags)
 MB_DECLARE_OPERATORS_FOR_FLAGS(Package::PublicFlags)
 MB_DECLARE_OPERATORS_FOR_FLAGS(Package::PrivateFlags)
 
+/*!
+ * \brief Compact table of packages from packages.xml
+ *
+ * The packages are stored column-wise with strings interned into a single
+ * buffer. Only the fields requested when loading are stored.
+ */
 class Packages
 {
 public:
-    std::vector<std::shared_ptr<Package>> pkgs;
+    enum class Field : uint32_t
+    {
+        Name        = 1u << 0,
+        // realName, codePath, resourcePath, and nativeLibraryPath
+        Paths       = 1u << 1,
+        // primaryCpuAbi, secondaryCpuAbi, and cpuAbiOverride
+        CpuAbis     = 1u << 2,
+        // flags, publicFlags, and privateFlags
+        Flags       = 1u << 3,
+        // ft, it, and ut
+        Timestamps  = 1u << 4,
+        Version     = 1u << 5,
+        // userId and sharedUserId
+        Uid         = 1u << 6,
+        // uidError, installStatus, and installer
+        Status      = 1u << 7,
+        Signatures  = 1u << 8,
+
+        All         = (1u << 9) - 1,
+    };
+    MB_DECLARE_FLAGS(Fields, Field)
+
+    Packages();
+
+    // Only contains keys for the loaded packages' signatures
     std::unordered_map<std::string, std::string> sigs;
 
-    bool load_xml(const std::string &path);
+    bool load_xml(const std::string &path, Fields fields = Field::All);
+    void clear();
+
+    size_t size() const;
+    Fields fields() const;
+
+    std::shared_ptr<Package> get(size_t index) const;
+
+    const char * name(size_t index) const;
+    Package::Flags pkg_flags(size_t index) const;
+    Package::PublicFlags pkg_public_flags(size_t index) const;
+    Package::PrivateFlags pkg_private_flags(size_t index) const;
+    uid_t uid(size_t index) const;
 
     std::shared_ptr<Package> find_by_uid(uid_t uid) const;
     std::shared_ptr<Package> find_by_pkg(const std::string &pkg_id) const;
+
+private:
+    friend class PackagesParser;
+
+    const char * string_at(uint32_t offset) const;
+
+    Fields m_fields;
+    size_t m_size;
+
+    // NULL-terminated strings. Columns store offsets into this buffer and
+    // offset 0 is the empty string.
+    std::string m_strings;
+
+    // String columns
+    std::vector<uint32_t> m_name;
+    std::vector<uint32_t> m_real_name;
+    std::vector<uint32_t> m_code_path;
+    std::vector<uint32_t> m_resource_path;
+    std::vector<uint32_t> m_native_library_path;
+    std::vector<uint32_t> m_primary_cpu_abi;
+    std::vector<uint32_t> m_secondary_cpu_abi;
+    std::vector<uint32_t> m_cpu_abi_override;
+    std::vector<uint32_t> m_uid_error;
+    std::vector<uint32_t> m_install_status;
+    std::vector<uint32_t> m_installer;
+
+    // Numeric columns
+    std::vector<Package::Flags> m_pkg_flags;
+    std::vector<Package::PublicFlags> m_pkg_public_flags;
+    std::vector<Package::PrivateFlags> m_pkg_private_flags;
+    std::vector<uint64_t> m_timestamp;
+    std::vector<uint64_t> m_first_install_time;
+    std::vector<uint64_t> m_last_update_time;
+    std::vector<int> m_version;
+    std::vector<int> m_user_id;
+    std::vector<int> m_shared_user_id;
+    std::vector<bool> m_is_shared_user;
+
+    // Signature indexes of package i are stored in
+    // m_sig_indexes[m_sig_offsets[i]] to m_sig_indexes[m_sig_offsets[i + 1]]
+    std::vector<uint32_t> m_sig_offsets;
+    std::vector<uint32_t> m_sig_indexes;
+
+    // Lookup indexes. The first package wins if there are duplicates.
+    std::unordered_map<uid_t, uint32_t> m_uid_index;
+    std::unordered_map<std::string, uint32_t> m_name_index;
 };
 
+MB_DECLARE_OPERATORS_FOR_FLAGS(Packages::Fields)
+
 }
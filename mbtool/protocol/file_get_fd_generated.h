@@ -0,0 +1,89 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_FILEGETFD_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_FILEGETFD_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct FileGetFdRequest;
+
+struct FileGetFdResponse;
+
+struct FileGetFdRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ID = 4
+  };
+  int32_t id() const {
+    return GetField<int32_t>(VT_ID, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_ID) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileGetFdRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_id(int32_t id) {
+    fbb_.AddElement<int32_t>(FileGetFdRequest::VT_ID, id, 0);
+  }
+  FileGetFdRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileGetFdRequestBuilder &operator=(const FileGetFdRequestBuilder &);
+  flatbuffers::Offset<FileGetFdRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<FileGetFdRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileGetFdRequest> CreateFileGetFdRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t id = 0) {
+  FileGetFdRequestBuilder builder_(_fbb);
+  builder_.add_id(id);
+  return builder_.Finish();
+}
+
+struct FileGetFdResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileGetFdResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  FileGetFdResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileGetFdResponseBuilder &operator=(const FileGetFdResponseBuilder &);
+  flatbuffers::Offset<FileGetFdResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 0);
+    auto o = flatbuffers::Offset<FileGetFdResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileGetFdResponse> CreateFileGetFdResponse(
+    flatbuffers::FlatBufferBuilder &_fbb) {
+  FileGetFdResponseBuilder builder_(_fbb);
+  return builder_.Finish();
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_FILEGETFD_MBTOOL_DAEMON_V3_H_
@@ -14,6 +14,8 @@ struct PathGetDirectorySizeError;
 
 struct PathGetDirectorySizeRequest;
 
+struct PathGetDirectorySizeProgressResponse;
+
 struct PathGetDirectorySizeResponse;
 
 struct PathGetDirectorySizeError FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
@@ -80,7 +82,8 @@ inline flatbuffers::Offset<PathGetDirectorySizeError> CreatePathGetDirectorySize
 struct PathGetDirectorySizeRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_PATH = 4,
-    VT_EXCLUSIONS = 6
+    VT_EXCLUSIONS = 6,
+    VT_REPORT_PROGRESS = 8
   };
   const flatbuffers::String *path() const {
     return GetPointer<const flatbuffers::String *>(VT_PATH);
@@ -88,6 +91,9 @@ struct PathGetDirectorySizeRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers
   const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *exclusions() const {
     return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *>(VT_EXCLUSIONS);
   }
+  bool report_progress() const {
+    return GetField<uint8_t>(VT_REPORT_PROGRESS, 0) != 0;
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_PATH) &&
@@ -95,6 +101,7 @@ struct PathGetDirectorySizeRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_EXCLUSIONS) &&
            verifier.Verify(exclusions()) &&
            verifier.VerifyVectorOfStrings(exclusions()) &&
+           VerifyField<uint8_t>(verifier, VT_REPORT_PROGRESS) &&
            verifier.EndTable();
   }
 };
@@ -108,13 +115,16 @@ struct PathGetDirectorySizeRequestBuilder {
   void add_exclusions(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>>> exclusions) {
     fbb_.AddOffset(PathGetDirectorySizeRequest::VT_EXCLUSIONS, exclusions);
   }
+  void add_report_progress(bool report_progress) {
+    fbb_.AddElement<uint8_t>(PathGetDirectorySizeRequest::VT_REPORT_PROGRESS, static_cast<uint8_t>(report_progress), 0);
+  }
   PathGetDirectorySizeRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   PathGetDirectorySizeRequestBuilder &operator=(const PathGetDirectorySizeRequestBuilder &);
   flatbuffers::Offset<PathGetDirectorySizeRequest> Finish() {
-    const auto end = fbb_.EndTable(start_, 2);
+    const auto end = fbb_.EndTable(start_, 3);
     auto o = flatbuffers::Offset<PathGetDirectorySizeRequest>(end);
     return o;
   }
@@ -123,21 +133,85 @@ struct PathGetDirectorySizeRequestBuilder {
 inline flatbuffers::Offset<PathGetDirectorySizeRequest> CreatePathGetDirectorySizeRequest(
     flatbuffers::FlatBufferBuilder &_fbb,
     flatbuffers::Offset<flatbuffers::String> path = 0,
-    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>>> exclusions = 0) {
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>>> exclusions = 0,
+    bool report_progress = false) {
   PathGetDirectorySizeRequestBuilder builder_(_fbb);
   builder_.add_exclusions(exclusions);
   builder_.add_path(path);
+  builder_.add_report_progress(report_progress);
   return builder_.Finish();
 }
 
 inline flatbuffers::Offset<PathGetDirectorySizeRequest> CreatePathGetDirectorySizeRequestDirect(
     flatbuffers::FlatBufferBuilder &_fbb,
     const char *path = nullptr,
-    const std::vector<flatbuffers::Offset<flatbuffers::String>> *exclusions = nullptr) {
+    const std::vector<flatbuffers::Offset<flatbuffers::String>> *exclusions = nullptr,
+    bool report_progress = false) {
   return mbtool::daemon::v3::CreatePathGetDirectorySizeRequest(
       _fbb,
       path ? _fbb.CreateString(path) : 0,
-      exclusions ? _fbb.CreateVector<flatbuffers::Offset<flatbuffers::String>>(*exclusions) : 0);
+      exclusions ? _fbb.CreateVector<flatbuffers::Offset<flatbuffers::String>>(*exclusions) : 0,
+      report_progress);
+}
+
+struct PathGetDirectorySizeProgressResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_SIZE = 4,
+    VT_ALLOCATED_SIZE = 6,
+    VT_FILES = 8
+  };
+  uint64_t size() const {
+    return GetField<uint64_t>(VT_SIZE, 0);
+  }
+  uint64_t allocated_size() const {
+    return GetField<uint64_t>(VT_ALLOCATED_SIZE, 0);
+  }
+  uint64_t files() const {
+    return GetField<uint64_t>(VT_FILES, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint64_t>(verifier, VT_SIZE) &&
+           VerifyField<uint64_t>(verifier, VT_ALLOCATED_SIZE) &&
+           VerifyField<uint64_t>(verifier, VT_FILES) &&
+           verifier.EndTable();
+  }
+};
+
+struct PathGetDirectorySizeProgressResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_size(uint64_t size) {
+    fbb_.AddElement<uint64_t>(PathGetDirectorySizeProgressResponse::VT_SIZE, size, 0);
+  }
+  void add_allocated_size(uint64_t allocated_size) {
+    fbb_.AddElement<uint64_t>(PathGetDirectorySizeProgressResponse::VT_ALLOCATED_SIZE, allocated_size, 0);
+  }
+  void add_files(uint64_t files) {
+    fbb_.AddElement<uint64_t>(PathGetDirectorySizeProgressResponse::VT_FILES, files, 0);
+  }
+  PathGetDirectorySizeProgressResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  PathGetDirectorySizeProgressResponseBuilder &operator=(const PathGetDirectorySizeProgressResponseBuilder &);
+  flatbuffers::Offset<PathGetDirectorySizeProgressResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 3);
+    auto o = flatbuffers::Offset<PathGetDirectorySizeProgressResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<PathGetDirectorySizeProgressResponse> CreatePathGetDirectorySizeProgressResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint64_t size = 0,
+    uint64_t allocated_size = 0,
+    uint64_t files = 0) {
+  PathGetDirectorySizeProgressResponseBuilder builder_(_fbb);
+  builder_.add_files(files);
+  builder_.add_allocated_size(allocated_size);
+  builder_.add_size(size);
+  return builder_.Finish();
 }
 
 struct PathGetDirectorySizeResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
@@ -145,7 +219,8 @@ struct PathGetDirectorySizeResponse FLATBUFFERS_FINAL_CLASS : private flatbuffer
     VT_SUCCESS = 4,
     VT_ERROR_MSG = 6,
     VT_SIZE = 8,
-    VT_ERROR = 10
+    VT_ERROR = 10,
+    VT_ALLOCATED_SIZE = 12
   };
   bool success() const {
     return GetField<uint8_t>(VT_SUCCESS, 0) != 0;
@@ -159,6 +234,9 @@ struct PathGetDirectorySizeResponse FLATBUFFERS_FINAL_CLASS : private flatbuffer
   const PathGetDirectorySizeError *error() const {
     return GetPointer<const PathGetDirectorySizeError *>(VT_ERROR);
   }
+  uint64_t allocated_size() const {
+    return GetField<uint64_t>(VT_ALLOCATED_SIZE, 0);
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint8_t>(verifier, VT_SUCCESS) &&
@@ -167,6 +245,7 @@ struct PathGetDirectorySizeResponse FLATBUFFERS_FINAL_CLASS : private flatbuffer
            VerifyField<uint64_t>(verifier, VT_SIZE) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
            verifier.VerifyTable(error()) &&
+           VerifyField<uint64_t>(verifier, VT_ALLOCATED_SIZE) &&
            verifier.EndTable();
   }
 };
@@ -186,13 +265,16 @@ struct PathGetDirectorySizeResponseBuilder {
   void add_error(flatbuffers::Offset<PathGetDirectorySizeError> error) {
     fbb_.AddOffset(PathGetDirectorySizeResponse::VT_ERROR, error);
   }
+  void add_allocated_size(uint64_t allocated_size) {
+    fbb_.AddElement<uint64_t>(PathGetDirectorySizeResponse::VT_ALLOCATED_SIZE, allocated_size, 0);
+  }
   PathGetDirectorySizeResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   PathGetDirectorySizeResponseBuilder &operator=(const PathGetDirectorySizeResponseBuilder &);
   flatbuffers::Offset<PathGetDirectorySizeResponse> Finish() {
-    const auto end = fbb_.EndTable(start_, 4);
+    const auto end = fbb_.EndTable(start_, 5);
     auto o = flatbuffers::Offset<PathGetDirectorySizeResponse>(end);
     return o;
   }
@@ -203,8 +285,10 @@ inline flatbuffers::Offset<PathGetDirectorySizeResponse> CreatePathGetDirectoryS
     bool success = false,
     flatbuffers::Offset<flatbuffers::String> error_msg = 0,
     uint64_t size = 0,
-    flatbuffers::Offset<PathGetDirectorySizeError> error = 0) {
+    flatbuffers::Offset<PathGetDirectorySizeError> error = 0,
+    uint64_t allocated_size = 0) {
   PathGetDirectorySizeResponseBuilder builder_(_fbb);
+  builder_.add_allocated_size(allocated_size);
   builder_.add_size(size);
   builder_.add_error(error);
   builder_.add_error_msg(error_msg);
@@ -217,13 +301,15 @@ inline flatbuffers::Offset<PathGetDirectorySizeResponse> CreatePathGetDirectoryS
     bool success = false,
     const char *error_msg = nullptr,
     uint64_t size = 0,
-    flatbuffers::Offset<PathGetDirectorySizeError> error = 0) {
+    flatbuffers::Offset<PathGetDirectorySizeError> error = 0,
+    uint64_t allocated_size = 0) {
   return mbtool::daemon::v3::CreatePathGetDirectorySizeResponse(
       _fbb,
       success,
       error_msg ? _fbb.CreateString(error_msg) : 0,
       size,
-      error);
+      error,
+      allocated_size);
 }
 
 }  // namespace v3
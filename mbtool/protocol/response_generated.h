@@ -10,6 +10,7 @@
 #include "crypto_get_pw_type_generated.h"
 #include "file_chmod_generated.h"
 #include "file_close_generated.h"
+#include "file_get_fd_generated.h"
 #include "file_open_generated.h"
 #include "file_read_generated.h"
 #include "file_seek_generated.h"
@@ -44,6 +45,10 @@ struct Invalid;
 
 struct Unsupported;
 
+struct BatchResponseEntry;
+
+struct BatchResponse;
+
 struct Response;
 
 enum ResponseType {
@@ -80,8 +85,11 @@ enum ResponseType {
   ResponseType_CryptoDecryptResponse = 30,
   ResponseType_CryptoGetPwTypeResponse = 31,
   ResponseType_PathReadlinkResponse = 32,
+  ResponseType_BatchResponse = 33,
+  ResponseType_FileGetFdResponse = 34,
+  ResponseType_PathGetDirectorySizeProgressResponse = 35,
   ResponseType_MIN = ResponseType_NONE,
-  ResponseType_MAX = ResponseType_PathReadlinkResponse
+  ResponseType_MAX = ResponseType_PathGetDirectorySizeProgressResponse
 };
 
 inline const char **EnumNamesResponseType() {
@@ -119,6 +127,9 @@ inline const char **EnumNamesResponseType() {
     "CryptoDecryptResponse",
     "CryptoGetPwTypeResponse",
     "PathReadlinkResponse",
+    "BatchResponse",
+    "FileGetFdResponse",
+    "PathGetDirectorySizeProgressResponse",
     nullptr
   };
   return names;
@@ -261,6 +272,18 @@ template<> struct ResponseTypeTraits<mbtool::daemon::v3::PathReadlinkResponse> {
   static const ResponseType enum_value = ResponseType_PathReadlinkResponse;
 };
 
+template<> struct ResponseTypeTraits<BatchResponse> {
+  static const ResponseType enum_value = ResponseType_BatchResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::FileGetFdResponse> {
+  static const ResponseType enum_value = ResponseType_FileGetFdResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::PathGetDirectorySizeProgressResponse> {
+  static const ResponseType enum_value = ResponseType_PathGetDirectorySizeProgressResponse;
+};
+
 bool VerifyResponseType(flatbuffers::Verifier &verifier, const void *obj, ResponseType type);
 bool VerifyResponseTypeVector(flatbuffers::Verifier &verifier, const flatbuffers::Vector<flatbuffers::Offset<void>> *values, const flatbuffers::Vector<uint8_t> *types);
 
@@ -320,10 +343,114 @@ inline flatbuffers::Offset<Unsupported> CreateUnsupported(
   return builder_.Finish();
 }
 
+struct BatchResponseEntry FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_RESPONSE = 4
+  };
+  const flatbuffers::Vector<uint8_t> *response() const {
+    return GetPointer<const flatbuffers::Vector<uint8_t> *>(VT_RESPONSE);
+  }
+  const mbtool::daemon::v3::Response *response_nested_root() const {
+    const uint8_t* data = response()->Data();
+    return flatbuffers::GetRoot<mbtool::daemon::v3::Response>(data);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_RESPONSE) &&
+           verifier.Verify(response()) &&
+           verifier.EndTable();
+  }
+};
+
+struct BatchResponseEntryBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_response(flatbuffers::Offset<flatbuffers::Vector<uint8_t>> response) {
+    fbb_.AddOffset(BatchResponseEntry::VT_RESPONSE, response);
+  }
+  BatchResponseEntryBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  BatchResponseEntryBuilder &operator=(const BatchResponseEntryBuilder &);
+  flatbuffers::Offset<BatchResponseEntry> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<BatchResponseEntry>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<BatchResponseEntry> CreateBatchResponseEntry(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<uint8_t>> response = 0) {
+  BatchResponseEntryBuilder builder_(_fbb);
+  builder_.add_response(response);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<BatchResponseEntry> CreateBatchResponseEntryDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<uint8_t> *response = nullptr) {
+  return mbtool::daemon::v3::CreateBatchResponseEntry(
+      _fbb,
+      response ? _fbb.CreateVector<uint8_t>(*response) : 0);
+}
+
+struct BatchResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_RESPONSES = 4
+  };
+  const flatbuffers::Vector<flatbuffers::Offset<BatchResponseEntry>> *responses() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<BatchResponseEntry>> *>(VT_RESPONSES);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_RESPONSES) &&
+           verifier.Verify(responses()) &&
+           verifier.VerifyVectorOfTables(responses()) &&
+           verifier.EndTable();
+  }
+};
+
+struct BatchResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_responses(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<BatchResponseEntry>>> responses) {
+    fbb_.AddOffset(BatchResponse::VT_RESPONSES, responses);
+  }
+  BatchResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  BatchResponseBuilder &operator=(const BatchResponseBuilder &);
+  flatbuffers::Offset<BatchResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<BatchResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<BatchResponse> CreateBatchResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<BatchResponseEntry>>> responses = 0) {
+  BatchResponseBuilder builder_(_fbb);
+  builder_.add_responses(responses);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<BatchResponse> CreateBatchResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<flatbuffers::Offset<BatchResponseEntry>> *responses = nullptr) {
+  return mbtool::daemon::v3::CreateBatchResponse(
+      _fbb,
+      responses ? _fbb.CreateVector<flatbuffers::Offset<BatchResponseEntry>>(*responses) : 0);
+}
+
 struct Response FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_RESPONSE_TYPE = 4,
-    VT_RESPONSE = 6
+    VT_RESPONSE = 6,
+    VT_ID = 8
   };
   ResponseType response_type() const {
     return static_cast<ResponseType>(GetField<uint8_t>(VT_RESPONSE_TYPE, 0));
@@ -331,11 +458,15 @@ struct Response FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const void *response() const {
     return GetPointer<const void *>(VT_RESPONSE);
   }
+  uint64_t id() const {
+    return GetField<uint64_t>(VT_ID, 0);
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint8_t>(verifier, VT_RESPONSE_TYPE) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_RESPONSE) &&
            VerifyResponseType(verifier, response(), response_type()) &&
+           VerifyField<uint64_t>(verifier, VT_ID) &&
            verifier.EndTable();
   }
 };
@@ -349,13 +480,16 @@ struct ResponseBuilder {
   void add_response(flatbuffers::Offset<void> response) {
     fbb_.AddOffset(Response::VT_RESPONSE, response);
   }
+  void add_id(uint64_t id) {
+    fbb_.AddElement<uint64_t>(Response::VT_ID, id, 0);
+  }
   ResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   ResponseBuilder &operator=(const ResponseBuilder &);
   flatbuffers::Offset<Response> Finish() {
-    const auto end = fbb_.EndTable(start_, 2);
+    const auto end = fbb_.EndTable(start_, 3);
     auto o = flatbuffers::Offset<Response>(end);
     return o;
   }
@@ -364,8 +498,10 @@ struct ResponseBuilder {
 inline flatbuffers::Offset<Response> CreateResponse(
     flatbuffers::FlatBufferBuilder &_fbb,
     ResponseType response_type = ResponseType_NONE,
-    flatbuffers::Offset<void> response = 0) {
+    flatbuffers::Offset<void> response = 0,
+    uint64_t id = 0) {
   ResponseBuilder builder_(_fbb);
+  builder_.add_id(id);
   builder_.add_response(response);
   builder_.add_response_type(response_type);
   return builder_.Finish();
@@ -504,6 +640,18 @@ inline bool VerifyResponseType(flatbuffers::Verifier &verifier, const void *obj,
       auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathReadlinkResponse *>(obj);
       return verifier.VerifyTable(ptr);
     }
+    case ResponseType_BatchResponse: {
+      auto ptr = reinterpret_cast<const BatchResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_FileGetFdResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileGetFdResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_PathGetDirectorySizeProgressResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathGetDirectorySizeProgressResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
     default: return false;
   }
 }
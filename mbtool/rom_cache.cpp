@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rom_cache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/path.h"
+
+#define LOG_TAG "mbtool/rom_cache"
+
+// Only the existence of directory entries affects the list of installed ROMs
+#define WATCH_MASK \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+            | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+namespace mb
+{
+
+static bool timespec_equal(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static bool timespec_before(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec < b.tv_sec
+            || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+/*!
+ * \brief Get the current time with the same granularity as inode timestamps
+ */
+static struct timespec coarse_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts;
+}
+
+/*!
+ * \class RomCache
+ *
+ * \brief Cached list of ROMs
+ *
+ * The result of the scan function is reused until a directory that the scan
+ * reported as a dependency or the mount table changes.
+ */
+
+/*!
+ * \brief Construct cache
+ *
+ * \param scan Function that adds the ROMs to a Roms instance and appends the
+ *             directories whose contents determine the result
+ */
+RomCache::RomCache(ScanFn scan)
+    : m_scan(scan)
+    , m_valid(false)
+    , m_watch_pid(-1)
+    , m_inotify_fd(-1)
+    , m_mounts_fd(-1)
+    , m_watches_complete(false)
+{
+}
+
+RomCache::~RomCache()
+{
+    close_watches();
+}
+
+void RomCache::get_path_state(const std::string &path, PathState &state)
+{
+    struct stat sb;
+
+    state.path = path;
+    state.exists = stat(path.c_str(), &sb) == 0;
+    state.dev = state.exists ? sb.st_dev : 0;
+    state.ino = state.exists ? sb.st_ino : 0;
+    state.mtime = state.exists ? sb.st_mtim : timespec{};
+}
+
+bool RomCache::path_state_changed(const PathState &state)
+{
+    PathState current;
+    get_path_state(state.path, current);
+
+    return current.exists != state.exists
+            || current.dev != state.dev
+            || current.ino != state.ino
+            || !timespec_equal(current.mtime, state.mtime);
+}
+
+void RomCache::close_watches()
+{
+    if (m_inotify_fd >= 0) {
+        close(m_inotify_fd);
+        m_inotify_fd = -1;
+    }
+    if (m_mounts_fd >= 0) {
+        close(m_mounts_fd);
+        m_mounts_fd = -1;
+    }
+    m_watches_complete = false;
+}
+
+/*!
+ * \brief Watch a directory or, if it does not exist, its closest parent
+ */
+bool RomCache::add_watch(const std::string &path)
+{
+    std::string dir(path);
+
+    while (inotify_add_watch(m_inotify_fd, dir.c_str(), WATCH_MASK) < 0) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            LOGW("%s: Failed to add inotify watch: %s",
+                 dir.c_str(), strerror(errno));
+            return false;
+        }
+
+        std::string parent = util::dir_name(dir);
+        if (parent == dir) {
+            return false;
+        }
+        dir = std::move(parent);
+    }
+
+    return true;
+}
+
+void RomCache::setup_watches()
+{
+    close_watches();
+    m_watch_pid = getpid();
+
+    m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotify_fd < 0) {
+        LOGW("Failed to initialize inotify: %s", strerror(errno));
+        return;
+    }
+
+    // The mount table fd is readable with POLLPRI after mounts change
+    m_mounts_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+    if (m_mounts_fd < 0) {
+        LOGW("/proc/self/mounts: Failed to open: %s", strerror(errno));
+        return;
+    }
+
+    m_watches_complete = true;
+
+    for (auto const &state : m_deps) {
+        if (!add_watch(state.path)) {
+            m_watches_complete = false;
+        }
+    }
+}
+
+bool RomCache::watches_triggered()
+{
+    struct pollfd pfds[2] = {
+        { m_inotify_fd, POLLIN, 0 },
+        { m_mounts_fd, POLLPRI, 0 },
+    };
+
+    return poll(pfds, 2, 0) != 0;
+}
+
+bool RomCache::is_valid()
+{
+    if (!m_valid) {
+        return false;
+    }
+
+    if (m_watch_pid != getpid()) {
+        // The cache was inherited from the parent process, which may have
+        // missed changes. Start watching for new changes and then check
+        // whether anything changed in between.
+        setup_watches();
+    } else if (watches_triggered()) {
+        return false;
+    } else if (m_watches_complete) {
+        return true;
+    }
+
+    for (auto const &state : m_deps) {
+        if (path_state_changed(state)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void RomCache::rescan()
+{
+    struct timespec start = coarse_now();
+
+    Roms roms;
+    std::vector<std::string> deps;
+    m_scan(roms, deps);
+
+    m_roms = std::move(roms.roms);
+    m_deps.clear();
+
+    for (auto &path : deps) {
+        if (!path.empty()) {
+            m_deps.emplace_back();
+            m_deps.back().path = std::move(path);
+        }
+    }
+
+    // Watch first so that changes made after the states are recorded are not
+    // missed
+    setup_watches();
+
+    m_valid = true;
+
+    for (auto &state : m_deps) {
+        get_path_state(state.path, state);
+
+        // Changes made while scanning may not be reflected in the result
+        if (state.exists && !timespec_before(state.mtime, start)) {
+            m_valid = false;
+        }
+    }
+}
+
+/*!
+ * \brief Rescan if anything changed
+ */
+void RomCache::update()
+{
+    if (!is_valid()) {
+        rescan();
+    }
+}
+
+/*!
+ * \brief Add cached ROMs
+ *
+ * \param roms Roms instance to add copies of the cached ROMs to
+ */
+void RomCache::get_installed(Roms &roms)
+{
+    update();
+
+    for (auto const &rom : m_roms) {
+        roms.roms.push_back(std::make_shared<Rom>(*rom));
+    }
+}
+
+static void scan_installed(Roms &roms, std::vector<std::string> &deps)
+{
+    roms.add_installed(&deps);
+}
+
+static RomCache installed_cache(&scan_installed);
+
+/*!
+ * \brief Refresh the list of installed ROMs if anything changed
+ *
+ * The daemon calls this before forking so that connection processes inherit
+ * an up-to-date cache.
+ */
+void rom_cache_update()
+{
+    installed_cache.update();
+}
+
+/*!
+ * \brief Add installed ROMs
+ *
+ * This is equivalent to Roms::add_installed(), but the result is reused until
+ * a directory that the result depends on or the mount table changes.
+ */
+void rom_cache_get_installed(Roms &roms)
+{
+    installed_cache.get_installed(roms);
+}
+
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ctime>
+
+#include <sys/types.h>
+
+#include "mbcommon/common.h"
+
+#include "roms.h"
+
+namespace mb
+{
+
+class RomCache
+{
+public:
+    typedef void (*ScanFn)(Roms &roms, std::vector<std::string> &deps);
+
+    explicit RomCache(ScanFn scan);
+    ~RomCache();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(RomCache)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(RomCache)
+
+    void update();
+    void get_installed(Roms &roms);
+
+private:
+    struct PathState
+    {
+        std::string path;
+        bool exists;
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+    };
+
+    ScanFn m_scan;
+
+    // ROMs from the last scan and the directories the scan depended on
+    bool m_valid;
+    std::vector<std::shared_ptr<Rom>> m_roms;
+    std::vector<PathState> m_deps;
+
+    // Change notifications for the dependencies and the mount table. These
+    // are only used by the process that created them because a forked child
+    // would otherwise consume events from the same queues as its parent.
+    pid_t m_watch_pid;
+    int m_inotify_fd;
+    int m_mounts_fd;
+    bool m_watches_complete;
+
+    static void get_path_state(const std::string &path, PathState &state);
+    static bool path_state_changed(const PathState &state);
+
+    void close_watches();
+    bool add_watch(const std::string &path);
+    void setup_watches();
+    bool watches_triggered();
+    bool is_valid();
+    void rescan();
+};
+
+void rom_cache_get_installed(Roms &roms);
+void rom_cache_update();
+
+}
@@ -31,10 +31,12 @@
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/mount.h"
+#include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
 
 #include "multiboot.h"
+#include "rom_cache.h"
 
 #define LOG_TAG "mbtool/roms"
 
@@ -197,10 +199,14 @@ static bool cmp_rom_id(const std::shared_ptr<Rom> &a,
     return a->id < b->id;
 }
 
-void Roms::add_data_roms()
+void Roms::add_data_roms(std::vector<std::string> *deps)
 {
     std::string system = get_raw_path("/data/multiboot");
 
+    if (deps) {
+        deps->push_back(system);
+    }
+
     DIR *dp = opendir(system.c_str());
     if (!dp ) {
         return;
@@ -235,7 +241,7 @@ void Roms::add_data_roms()
     std::move(temp_roms.begin(), temp_roms.end(), std::back_inserter(roms));
 }
 
-void Roms::add_extsd_roms()
+void Roms::add_extsd_roms(std::vector<std::string> *deps)
 {
     std::string mount_point = get_extsd_partition();
     std::string search_dir;
@@ -250,6 +256,10 @@ void Roms::add_extsd_roms()
         is_boot = false;
     }
 
+    if (deps) {
+        deps->push_back(search_dir);
+    }
+
     DIR *dp = opendir(search_dir.c_str());
     if (!dp) {
         return;
@@ -273,6 +283,9 @@ void Roms::add_extsd_roms()
         std::string image(search_dir);
         image += "/";
         image += ent->d_name;
+        if (deps) {
+            deps->push_back(image);
+        }
         if (is_boot) {
             image += "/boot.img";
         } else {
@@ -288,12 +301,20 @@ void Roms::add_extsd_roms()
     std::move(temp_roms.begin(), temp_roms.end(), std::back_inserter(roms));
 }
 
-void Roms::add_installed()
+/*!
+ * \brief Add installed ROMs
+ *
+ * \param[out] deps If not null, the directories whose contents determine the
+ *                  result are appended to this list. Creating, removing, or
+ *                  renaming entries in any other directory does not change the
+ *                  set of installed ROMs.
+ */
+void Roms::add_installed(std::vector<std::string> *deps)
 {
     Roms all_roms;
     all_roms.add_builtin();
-    all_roms.add_data_roms();
-    all_roms.add_extsd_roms();
+    all_roms.add_data_roms(deps);
+    all_roms.add_extsd_roms(deps);
 
     struct stat sb;
 
@@ -301,6 +322,12 @@ void Roms::add_installed()
         std::string boot_path = get_raw_path(rom->boot_image_path());
         std::string system_path = rom->full_system_path();
 
+        if (deps) {
+            deps->push_back(util::dir_name(boot_path));
+            deps->push_back(rom->system_is_image
+                    ? util::dir_name(system_path) : system_path);
+        }
+
         if (stat(boot_path.c_str(), &sb) == 0) {
             // If boot image exists, assume that the ROM is installed
             roms.push_back(rom);
@@ -335,7 +362,7 @@ std::shared_ptr<Rom> Roms::find_by_id(const std::string &id) const
 std::shared_ptr<Rom> Roms::get_current_rom()
 {
     Roms roms;
-    roms.add_installed();
+    rom_cache_get_installed(roms);
 
     // This is set if mbtool is handling the boot process
     std::string prop_id = util::property_get_string(PROP_MULTIBOOT_ROM_ID, {});
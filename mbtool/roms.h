@@ -74,10 +74,10 @@ private:
     static std::shared_ptr<Rom> create_rom_extsd_slot(const std::string &id);
 
     void add_builtin();
-    void add_data_roms();
-    void add_extsd_roms();
+    void add_data_roms(std::vector<std::string> *deps);
+    void add_extsd_roms(std::vector<std::string> *deps);
 public:
-    void add_installed();
+    void add_installed(std::vector<std::string> *deps = nullptr);
 
     std::shared_ptr<Rom> find_by_id(const std::string &id) const;
 
@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2015-2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sepolicy_cache.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/finally.h"
+#include "mbcommon/string.h"
+#include "mbcommon/version.h"
+#include "mblog/logging.h"
+#include "mbutil/directory.h"
+#include "mbutil/file.h"
+#include "mbutil/string.h"
+
+#define LOG_TAG "mbtool/sepolicy_cache"
+
+// Maximum number of cached policies. There is one entry per boot image and
+// patch type, so this only needs to cover a handful of ROMs.
+#define MAX_ENTRIES         8
+
+// Cache entries are stored as:
+//
+//   magic (8 bytes)
+//   key (SHA-512, 64 bytes)
+//   SHA-512 of the policy (64 bytes)
+//   policy size (uint64_t, native endianness)
+//   policy
+//
+// The policy checksum guards against truncated or corrupted files. A bad
+// policy written to /sepolicy would prevent the ROM from booting.
+static const char CACHE_MAGIC[8] = { 'M', 'B', 'S', 'E', 'P', 'O', 'L', '1' };
+
+#define HEADER_SIZE \
+    (sizeof(CACHE_MAGIC) + 2 * SHA512_DIGEST_LENGTH + sizeof(uint64_t))
+
+namespace mb
+{
+
+static std::string entry_path(const std::string &cache_dir,
+                              const unsigned char key[SEPOLICY_CACHE_KEY_SIZE])
+{
+    // The full key is verified when the entry is loaded
+    std::string path(cache_dir);
+    path += '/';
+    path += util::hex_string(key, 8);
+    path += ".bin";
+    return path;
+}
+
+static bool write_fully(int fd, const void *data, size_t size)
+{
+    auto ptr = static_cast<const unsigned char *>(data);
+
+    while (size > 0) {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += n;
+        size -= static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Remove the least recently used entries beyond MAX_ENTRIES
+ */
+static void prune_entries(const std::string &cache_dir)
+{
+    DIR *dp = opendir(cache_dir.c_str());
+    if (!dp) {
+        return;
+    }
+
+    auto close_dp = finally([&]{
+        closedir(dp);
+    });
+
+    std::vector<std::pair<time_t, std::string>> entries;
+    struct dirent *ent;
+    struct stat sb;
+
+    while ((ent = readdir(dp))) {
+        if (!ends_with(ent->d_name, ".bin")) {
+            continue;
+        }
+
+        std::string path(cache_dir);
+        path += '/';
+        path += ent->d_name;
+
+        if (stat(path.c_str(), &sb) == 0) {
+            entries.emplace_back(sb.st_mtime, std::move(path));
+        }
+    }
+
+    if (entries.size() <= MAX_ENTRIES) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end());
+
+    for (size_t i = 0; i < entries.size() - MAX_ENTRIES; ++i) {
+        LOGD("%s: Removing old cached policy", entries[i].second.c_str());
+        unlink(entries[i].second.c_str());
+    }
+}
+
+/*!
+ * \brief Compute cache key for a patched policy
+ *
+ * The key covers the source policy, the patch that is applied to it, any
+ * runtime state that the patch depends on, and the mbtool version (which
+ * determines what the patch does).
+ *
+ * \param source Source policy data
+ * \param size Size of \p source
+ * \param variant Name of the patch
+ * \param runtime_input State of the system that affects the patch output
+ * \param key Output cache key
+ */
+void sepolicy_cache_key(const void *source, size_t size,
+                        const char *variant, const char *runtime_input,
+                        unsigned char key[SEPOLICY_CACHE_KEY_SIZE])
+{
+    SHA512_CTX ctx;
+    uint64_t size64 = size;
+
+    SHA512_Init(&ctx);
+    SHA512_Update(&ctx, &size64, sizeof(size64));
+    SHA512_Update(&ctx, source, size);
+    SHA512_Update(&ctx, variant, strlen(variant) + 1);
+    SHA512_Update(&ctx, runtime_input, strlen(runtime_input) + 1);
+    SHA512_Update(&ctx, version(), strlen(version()) + 1);
+    SHA512_Update(&ctx, git_version(), strlen(git_version()) + 1);
+    SHA512_Final(key, &ctx);
+}
+
+/*!
+ * \brief Load cached patched policy
+ *
+ * \param cache_dir Cache directory
+ * \param key Cache key from sepolicy_cache_key()
+ * \param data Output policy data
+ *
+ * \return Whether a valid entry for \p key was found
+ */
+bool sepolicy_cache_load(const std::string &cache_dir,
+                         const unsigned char key[SEPOLICY_CACHE_KEY_SIZE],
+                         std::vector<unsigned char> &data)
+{
+    std::string path = entry_path(cache_dir, key);
+    std::vector<unsigned char> buf;
+
+    if (!util::file_read_all(path, buf)) {
+        if (errno != ENOENT) {
+            LOGW("%s: Failed to read cached policy: %s",
+                 path.c_str(), strerror(errno));
+        }
+        return false;
+    }
+
+    if (buf.size() < HEADER_SIZE) {
+        LOGW("%s: Cached policy is truncated", path.c_str());
+        return false;
+    }
+
+    const unsigned char *ptr = buf.data();
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    uint64_t size;
+
+    if (memcmp(ptr, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0) {
+        LOGW("%s: Invalid cached policy header", path.c_str());
+        return false;
+    }
+    ptr += sizeof(CACHE_MAGIC);
+
+    if (memcmp(ptr, key, SEPOLICY_CACHE_KEY_SIZE) != 0) {
+        LOGD("%s: Cached policy is for a different key", path.c_str());
+        return false;
+    }
+    ptr += SEPOLICY_CACHE_KEY_SIZE;
+
+    memcpy(digest, ptr, sizeof(digest));
+    ptr += sizeof(digest);
+
+    memcpy(&size, ptr, sizeof(size));
+
+    if (size != buf.size() - HEADER_SIZE) {
+        LOGW("%s: Cached policy size does not match header", path.c_str());
+        return false;
+    }
+
+    unsigned char actual[SHA512_DIGEST_LENGTH];
+    SHA512(buf.data() + HEADER_SIZE, buf.size() - HEADER_SIZE, actual);
+
+    if (memcmp(digest, actual, sizeof(digest)) != 0) {
+        LOGW("%s: Cached policy checksum does not match", path.c_str());
+        return false;
+    }
+
+    buf.erase(buf.begin(), buf.begin() + HEADER_SIZE);
+    data.swap(buf);
+
+    // Keep recently used entries from being pruned
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+
+    return true;
+}
+
+/*!
+ * \brief Store patched policy in the cache
+ *
+ * The entry is written to a temporary file and renamed into place, so an
+ * interrupted write never leaves a partial entry behind.
+ *
+ * \param cache_dir Cache directory
+ * \param key Cache key from sepolicy_cache_key()
+ * \param data Patched policy data
+ * \param size Size of \p data
+ *
+ * \return Whether the entry was stored
+ */
+bool sepolicy_cache_store(const std::string &cache_dir,
+                          const unsigned char key[SEPOLICY_CACHE_KEY_SIZE],
+                          const void *data, size_t size)
+{
+    if (!util::mkdir_recursive(cache_dir, 0700)) {
+        LOGW("%s: Failed to create directory: %s",
+             cache_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string path = entry_path(cache_dir, key);
+    std::string temp_path = path + ".tmp";
+
+    unsigned char header[HEADER_SIZE];
+    unsigned char *ptr = header;
+    uint64_t size64 = size;
+
+    memcpy(ptr, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    ptr += sizeof(CACHE_MAGIC);
+    memcpy(ptr, key, SEPOLICY_CACHE_KEY_SIZE);
+    ptr += SEPOLICY_CACHE_KEY_SIZE;
+    SHA512(static_cast<const unsigned char *>(data), size, ptr);
+    ptr += SHA512_DIGEST_LENGTH;
+    memcpy(ptr, &size64, sizeof(size64));
+
+    int fd = open(temp_path.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGW("%s: Failed to open for writing: %s",
+             temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ret = write_fully(fd, header, sizeof(header))
+            && write_fully(fd, data, size)
+            && fsync(fd) == 0;
+    int saved_errno = errno;
+
+    if (close(fd) < 0 && ret) {
+        ret = false;
+        saved_errno = errno;
+    }
+
+    if (!ret || rename(temp_path.c_str(), path.c_str()) < 0) {
+        if (ret) {
+            saved_errno = errno;
+        }
+        LOGW("%s: Failed to write cached policy: %s",
+             path.c_str(), strerror(saved_errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    prune_entries(cache_dir);
+
+    return true;
+}
+
+/*!
+ * \brief Remove cached patched policy
+ *
+ * \param cache_dir Cache directory
+ * \param key Cache key from sepolicy_cache_key()
+ */
+void sepolicy_cache_remove(const std::string &cache_dir,
+                           const unsigned char key[SEPOLICY_CACHE_KEY_SIZE])
+{
+    unlink(entry_path(cache_dir, key).c_str());
+}
+
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2015-2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <openssl/sha.h>
+
+namespace mb
+{
+
+constexpr size_t SEPOLICY_CACHE_KEY_SIZE = SHA512_DIGEST_LENGTH;
+
+void sepolicy_cache_key(const void *source, size_t size,
+                        const char *variant, const char *runtime_input,
+                        unsigned char key[SEPOLICY_CACHE_KEY_SIZE]);
+bool sepolicy_cache_load(const std::string &cache_dir,
+                         const unsigned char key[SEPOLICY_CACHE_KEY_SIZE],
+                         std::vector<unsigned char> &data);
+bool sepolicy_cache_store(const std::string &cache_dir,
+                          const unsigned char key[SEPOLICY_CACHE_KEY_SIZE],
+                          const void *data, size_t size);
+void sepolicy_cache_remove(const std::string &cache_dir,
+                           const unsigned char key[SEPOLICY_CACHE_KEY_SIZE]);
+
+}
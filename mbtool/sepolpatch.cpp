@@ -19,10 +19,15 @@
 
 #include "sepolpatch.h"
 
+#include <chrono>
 #include <memory>
+#include <vector>
 
+#include <cerrno>
 #include <climits>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 #include <fcntl.h>
 #include <getopt.h>
@@ -40,11 +45,14 @@
 
 #include "mbcommon/common.h"
 #include "mbcommon/finally.h"
+#include "mbcommon/string.h"
 #include "mblog/logging.h"
+#include "mbutil/file.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
 
 #include "multiboot.h"
+#include "sepolicy_cache.h"
 
 #define LOG_TAG "mbtool/sepolpatch"
 
@@ -332,6 +340,365 @@ bool selinux_raw_reindex(policydb_t *pdb)
             && policydb_index_others(nullptr, pdb, 0) == 0;
 }
 
+// Batched avtab editing
+
+static inline uint64_t pack_allow_key(uint16_t source_type_val,
+                                      uint16_t target_type_val,
+                                      uint16_t class_val)
+{
+    return (static_cast<uint64_t>(source_type_val) << 32)
+            | (static_cast<uint64_t>(target_type_val) << 16)
+            | class_val;
+}
+
+static inline avtab_key_t unpack_allow_key(uint64_t packed)
+{
+    avtab_key_t key;
+    key.source_type = static_cast<uint16_t>(packed >> 32);
+    key.target_type = static_cast<uint16_t>(packed >> 16);
+    key.target_class = static_cast<uint16_t>(packed);
+    key.specified = AVTAB_ALLOWED;
+    return key;
+}
+
+/*!
+ * \brief Grow avtab hash table to fit \p nrules rules
+ *
+ * libsepol sizes the table once when the policy is read and never rehashes,
+ * so inserting many rules lengthens every chain. This rebuilds the table with
+ * the bucket count libsepol would have chosen for \p nrules. If that is not
+ * larger than the current bucket count, nothing is done.
+ */
+static bool avtab_reserve(avtab_t *avtab, uint32_t nrules)
+{
+    avtab_t new_avtab;
+
+    if (avtab_init(&new_avtab) < 0) {
+        return false;
+    }
+
+    if (avtab_alloc(&new_avtab, nrules) < 0) {
+        avtab_destroy(&new_avtab);
+        return false;
+    }
+
+    if (new_avtab.nslot <= avtab->nslot) {
+        avtab_destroy(&new_avtab);
+        return true;
+    }
+
+    for (uint32_t i = 0; i < avtab->nslot; ++i) {
+        for (avtab_ptr_t cur = avtab->htable[i]; cur; cur = cur->next) {
+            // Extended permissions are copied by avtab_insert()
+            if (avtab_insert(&new_avtab, &cur->key, &cur->datum) != 0) {
+                avtab_destroy(&new_avtab);
+                return false;
+            }
+        }
+    }
+
+    avtab_destroy(avtab);
+    *avtab = new_avtab;
+
+    return true;
+}
+
+/*!
+ * \class AvtabBatch
+ *
+ * \brief Accumulates avtab changes and applies them in a single pass
+ *
+ * Patches that touch many rules (eg. granting all permissions for every
+ * attribute) would otherwise perform an avtab lookup, and possibly an insert,
+ * for every individual permission. AvtabBatch merges all permission changes
+ * for the same source, target, and class into one edit and applies them in
+ * commit(). If many rules are added, the avtab hash table is grown once
+ * before they are inserted.
+ *
+ * Queries, such as rules_by_target(), only reflect the committed state of the
+ * policy. copy_target_rules() also takes the pending edits into account, so
+ * rules added earlier in the same batch are copied too. Pending edits are
+ * discarded if the batch is destroyed without being committed.
+ */
+
+AvtabBatch::AvtabBatch(policydb_t *pdb)
+    : m_pdb(pdb)
+    , m_remove_specified(0)
+    , m_indexed(false)
+{
+}
+
+AvtabBatch::~AvtabBatch() = default;
+
+policydb_t * AvtabBatch::policy() const
+{
+    return m_pdb;
+}
+
+/*!
+ * \brief Add or remove permissions from an allow rule
+ *
+ * \param source_type_val Source type for rule
+ * \param target_type_val Target type for rule
+ * \param class_val Class for rule
+ * \param perms Mask of permission bits (`1 << (perm_val - 1)`)
+ * \param remove Whether to remove the permissions
+ */
+void AvtabBatch::set_perms(uint16_t source_type_val,
+                           uint16_t target_type_val,
+                           uint16_t class_val,
+                           uint32_t perms,
+                           bool remove)
+{
+    if (perms == 0) {
+        return;
+    }
+
+    auto &edit = m_edits[pack_allow_key(
+            source_type_val, target_type_val, class_val)];
+
+    // The last change to each bit wins, like with individual edits
+    if (remove) {
+        edit.set &= ~perms;
+        edit.clear |= perms;
+    } else {
+        edit.set |= perms;
+        edit.clear &= ~perms;
+    }
+}
+
+bool AvtabBatch::grant_all_perms(uint16_t source_type_val,
+                                 uint16_t target_type_val,
+                                 uint16_t class_val)
+{
+    if (class_val == 0 || class_val > m_pdb->p_classes.nprim) {
+        return false;
+    }
+
+    if (m_class_perms.empty()) {
+        m_class_perms.resize(m_pdb->p_classes.nprim);
+
+        for (uint32_t i = 0; i < m_pdb->p_classes.nprim; ++i) {
+            auto clazz = m_pdb->class_val_to_struct[i];
+            if (!clazz) {
+                continue;
+            }
+
+            hashtab_t tables[] = { clazz->permissions.table, nullptr, nullptr };
+            if (clazz->comdatum) {
+                tables[1] = clazz->comdatum->permissions.table;
+            }
+
+            for (auto table = tables; *table; ++table) {
+                for (uint32_t bucket = 0; bucket < (*table)->size; ++bucket) {
+                    for (hashtab_ptr_t cur = (*table)->htable[bucket]; cur;
+                            cur = cur->next) {
+                        auto perm_datum = static_cast<perm_datum_t *>(
+                                cur->datum);
+                        m_class_perms[i] |= 1U << (perm_datum->s.value - 1);
+                    }
+                }
+            }
+        }
+    }
+
+    if (!m_pdb->class_val_to_struct[class_val - 1]) {
+        return false;
+    }
+
+    set_perms(source_type_val, target_type_val, class_val,
+              m_class_perms[class_val - 1], false);
+
+    return true;
+}
+
+bool AvtabBatch::grant_all_perms(uint16_t source_type_val,
+                                 uint16_t target_type_val)
+{
+    for (uint32_t class_val = 1; class_val <= m_pdb->p_classes.nprim;
+            ++class_val) {
+        if (!grant_all_perms(source_type_val, target_type_val,
+                             static_cast<uint16_t>(class_val))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Copy allow rules targeting one type to another type
+ *
+ * For every rule `allow X from_type:C perms;`, the permissions are added to
+ * `allow X to_type:C perms;`. The rules are copied as they will be after
+ * commit(), including pending edits and removals.
+ */
+void AvtabBatch::copy_target_rules(uint16_t from_type_val,
+                                   uint16_t to_type_val)
+{
+    // Permissions of the rules targeting from_type_val, keyed like m_edits
+    std::unordered_map<uint64_t, uint32_t> rules;
+
+    for (avtab_ptr_t node : rules_by_target(from_type_val)) {
+        if (!(node->key.specified & AVTAB_ALLOWED)
+                || (node->key.specified & m_remove_specified)) {
+            continue;
+        }
+
+        rules[pack_allow_key(node->key.source_type, from_type_val,
+                             node->key.target_class)] |= node->datum.data;
+    }
+
+    // Same order as commit(): edits are applied after removals
+    for (auto const &item : m_edits) {
+        if (unpack_allow_key(item.first).target_type != from_type_val) {
+            continue;
+        }
+
+        auto &perms = rules[item.first];
+        perms = (perms | item.second.set) & ~item.second.clear;
+    }
+
+    // set_perms() may rehash m_edits, so it can't be called in the loop above
+    for (auto const &rule : rules) {
+        avtab_key_t key = unpack_allow_key(rule.first);
+
+        set_perms(key.source_type, to_type_val, key.target_class,
+                  rule.second, false);
+    }
+}
+
+/*!
+ * \brief Remove all rules whose key matches \p specified
+ *
+ * \param specified Mask of `AVTAB_*` rule types
+ */
+void AvtabBatch::remove_rules_matching(uint16_t specified)
+{
+    m_remove_specified |= specified;
+}
+
+const std::vector<avtab_ptr_t> & AvtabBatch::rules_by_target(uint16_t type_val)
+{
+    build_index();
+
+    static const std::vector<avtab_ptr_t> empty;
+    return type_val < m_by_target.size() ? m_by_target[type_val] : empty;
+}
+
+/*!
+ * \brief Apply all pending changes to the policy
+ *
+ * Removals are applied first, then permission changes to existing rules, and
+ * finally new rules are inserted.
+ *
+ * \return Whether all changes were applied. On failure, the avtab may have
+ *         been partially updated.
+ */
+bool AvtabBatch::commit()
+{
+    avtab_t *avtab = &m_pdb->te_avtab;
+
+    if (m_remove_specified) {
+        for (uint32_t i = 0; i < avtab->nslot; ++i) {
+            avtab_ptr_t prev = nullptr;
+            for (avtab_ptr_t cur = avtab->htable[i]; cur;) {
+                if (cur->key.specified & m_remove_specified) {
+                    avtab_ptr_t to_free = cur;
+
+                    if (prev) {
+                        prev->next = cur = cur->next;
+                    } else {
+                        avtab->htable[i] = cur = cur->next;
+                    }
+
+                    if (to_free->key.specified & AVTAB_XPERMS) {
+                        free(to_free->datum.xperms);
+                    }
+                    free(to_free);
+
+                    --avtab->nel;
+
+                    // Don't advance pointer
+                } else {
+                    prev = cur;
+                    cur = cur->next;
+                }
+            }
+        }
+    }
+
+    std::vector<std::pair<avtab_key_t, avtab_datum_t>> to_insert;
+
+    for (auto const &item : m_edits) {
+        avtab_key_t key = unpack_allow_key(item.first);
+        avtab_datum_t *datum = avtab_search(avtab, &key);
+
+        if (datum) {
+            datum->data = (datum->data | item.second.set) & ~item.second.clear;
+        } else if (item.second.set) {
+            avtab_datum_t new_datum = {};
+            new_datum.data = item.second.set;
+            to_insert.emplace_back(key, new_datum);
+        }
+    }
+
+    if (!to_insert.empty()) {
+        // Rebuilding the table costs about as much as inserting every existing
+        // rule again, so only do it if the number of rules at least doubles
+        if (to_insert.size() >= avtab->nel && !avtab_reserve(
+                avtab, static_cast<uint32_t>(avtab->nel + to_insert.size()))) {
+            LOGE("Failed to resize avtab for %zu new rules",
+                 to_insert.size());
+            return false;
+        }
+
+        for (auto &pair : to_insert) {
+            if (avtab_insert(avtab, &pair.first, &pair.second) != 0) {
+                LOGE("Failed to add rule to avtab");
+                return false;
+            }
+        }
+    }
+
+    LOGV("Committed %zu avtab edits (%zu new rules)",
+         m_edits.size(), to_insert.size());
+
+    reset();
+
+    return true;
+}
+
+void AvtabBatch::build_index()
+{
+    if (m_indexed) {
+        return;
+    }
+
+    m_by_target.assign(m_pdb->p_types.nprim + 1, {});
+
+    for (uint32_t i = 0; i < m_pdb->te_avtab.nslot; ++i) {
+        for (avtab_ptr_t cur = m_pdb->te_avtab.htable[i]; cur;
+                cur = cur->next) {
+            if (cur->key.target_type < m_by_target.size()) {
+                m_by_target[cur->key.target_type].push_back(cur);
+            }
+        }
+    }
+
+    m_indexed = true;
+}
+
+void AvtabBatch::reset()
+{
+    m_edits.clear();
+    m_remove_specified = 0;
+
+    // Nodes may have been freed or the table rebuilt
+    m_indexed = false;
+    m_by_target.clear();
+}
+
 // Static helper functions
 
 static inline class_datum_t * find_class(policydb_t *pdb, const char *name)
@@ -750,7 +1117,7 @@ bool selinux_add_to_role(policydb_t *pdb,
     return ret != SELinuxResult::Error;
 }
 
-static void selinux_strip_no_audit(policydb_t *pdb)
+static bool selinux_strip_no_audit(AvtabBatch &batch)
 {
 #if 0
     // This implementation works, but is confusing since it won't be printed
@@ -768,37 +1135,14 @@ static void selinux_strip_no_audit(policydb_t *pdb)
             }
         }
     }
+
+    return true;
 #else
     // This alternative implementation removes the key from avtab, which will
     // work correctly with every tool.
 
-    for (uint32_t i = 0; i < pdb->te_avtab.nslot; i++) {
-        avtab_ptr_t prev = nullptr;
-        for (avtab_ptr_t cur = pdb->te_avtab.htable[i]; cur;) {
-            if ((cur->key.specified & AVTAB_AUDITDENY)
-                    || (cur->key.specified & AVTAB_XPERMS_DONTAUDIT)) {
-                avtab_ptr_t to_free = cur;
-
-                if (prev) {
-                    prev->next = cur = cur->next;
-                } else {
-                    pdb->te_avtab.htable[i] = cur = cur->next;
-                }
-
-                if (to_free->key.specified & AVTAB_XPERMS) {
-                    free(to_free->datum.xperms);
-                }
-                free(to_free);
-
-                --pdb->te_avtab.nel;
-
-                // Don't advance pointer
-            } else {
-                prev = cur;
-                cur = cur->next;
-            }
-        }
-    }
+    batch.remove_rules_matching(AVTAB_AUDITDENY | AVTAB_XPERMS_DONTAUDIT);
+    return true;
 #endif
 }
 
@@ -810,30 +1154,96 @@ static void selinux_strip_no_audit(policydb_t *pdb)
         if (!(expr)) return false; \
     } while (0)
 
-static inline bool add_rules(policydb_t *pdb,
-                             const char *source,
-                             const char *target,
-                             const char *clazz,
-                             const std::vector<std::string> &perms)
+static bool set_rules(AvtabBatch &batch,
+                      const char *source_str,
+                      const char *target_str,
+                      const char *class_str,
+                      const std::vector<std::string> &perms,
+                      bool remove)
 {
-    for (auto const &perm : perms) {
-        if (!selinux_add_rule(pdb, source, target, clazz, perm.c_str())) {
+    policydb_t *pdb = batch.policy();
+    type_datum_t *source, *target;
+    class_datum_t *clazz;
+    uint32_t mask = 0;
+
+    source = find_type(pdb, source_str);
+    if (!source) {
+        LOGE("Source type %s does not exist", source_str);
+        return false;
+    }
+
+    target = find_type(pdb, target_str);
+    if (!target) {
+        LOGE("Target type %s does not exist", target_str);
+        return false;
+    }
+
+    clazz = find_class(pdb, class_str);
+    if (!clazz) {
+        LOGE("Class %s does not exist", class_str);
+        return false;
+    }
+
+    for (auto const &perm_str : perms) {
+        perm_datum_t *perm = find_perm(clazz, perm_str.c_str());
+        if (!perm) {
+            LOGE("Perm %s does not exist in class %s",
+                 perm_str.c_str(), class_str);
             return false;
         }
+
+        mask |= 1U << (perm->s.value - 1);
     }
 
+    batch.set_perms(static_cast<uint16_t>(source->s.value),
+                    static_cast<uint16_t>(target->s.value),
+                    static_cast<uint16_t>(clazz->s.value),
+                    mask, remove);
+
     return true;
 }
 
+static inline bool add_rules(AvtabBatch &batch,
+                             const char *source,
+                             const char *target,
+                             const char *clazz,
+                             const std::vector<std::string> &perms)
+{
+    return set_rules(batch, source, target, clazz, perms, false);
+}
+
 MB_UNUSED
-static inline bool remove_rules(policydb_t *pdb,
+static inline bool remove_rules(AvtabBatch &batch,
                                 const char *source,
                                 const char *target,
                                 const char *clazz,
                                 const std::vector<std::string> &perms)
 {
-    for (auto const &perm : perms) {
-        if (!selinux_remove_rule(pdb, source, target, clazz, perm.c_str())) {
+    return set_rules(batch, source, target, clazz, perms, true);
+}
+
+/*!
+ * \brief Grant \p source_str all permissions on every attribute
+ */
+static bool grant_all_attributes(AvtabBatch &batch, const char *source_str)
+{
+    policydb_t *pdb = batch.policy();
+
+    type_datum_t *source = find_type(pdb, source_str);
+    if (!source) {
+        return false;
+    }
+
+    for (uint32_t type_val = 1; type_val <= pdb->p_types.nprim; ++type_val) {
+        // Skip non-attributes
+        if (pdb->type_val_to_struct[type_val - 1]->flavor != TYPE_ATTRIB) {
+            continue;
+        }
+
+        if (!batch.grant_all_perms(static_cast<uint16_t>(source->s.value),
+                                   static_cast<uint16_t>(type_val))) {
+            LOGE("Failed to grant all perms for: %s -> %s",
+                 source_str, pdb->p_type_val_to_name[type_val - 1]);
             return false;
         }
     }
@@ -841,8 +1251,10 @@ static inline bool remove_rules(policydb_t *pdb,
     return true;
 }
 
-static bool apply_pre_boot_patches(policydb_t *pdb)
+static bool apply_pre_boot_patches(AvtabBatch &batch)
 {
+    policydb_t *pdb = batch.policy();
+
     // We are going to allow everything. The stage 1 policy is not a security
     // concern because the real (secure) policy will be loaded by the real /init
     // binary. This temporary policy exists solely for stage 2 to prepare the
@@ -854,45 +1266,19 @@ static bool apply_pre_boot_patches(policydb_t *pdb)
     // For TW 6.0 ROMs, the kernel #define's the permissive flag to be 0, so
     // per-type permissive flags are completely ignored. For these ROMs, we'll
     // allow every attribute to do everything.
-
-    type_datum_t *kernel = find_type(pdb, "kernel");
-    if (!kernel) {
-        return false;
-    }
-
-    // For all attributes
-    for (uint32_t type_val = 1; type_val <= pdb->p_types.nprim; ++type_val) {
-        // Skip non-attributes
-        if (pdb->type_val_to_struct[type_val - 1]->flavor != TYPE_ATTRIB) {
-            continue;
-        }
-
-        auto ret = selinux_raw_grant_all_perms(
-                pdb, static_cast<uint16_t>(kernel->s.value),
-                static_cast<uint16_t>(type_val));
-        switch (ret) {
-        case SELinuxResult::Changed:
-        case SELinuxResult::Unchanged:
-            break;
-        case SELinuxResult::Error:
-            LOGE("Failed to grant all perms for: %s -> %s",
-                 "kernel", pdb->p_type_val_to_name[type_val - 1]);
-            return false;
-        }
-    }
+    ff(grant_all_attributes(batch, "kernel"));
 
     // Allow the real init to load the "secure" SELinux policy
-    ff(selinux_add_rule(pdb, "kernel", "kernel", "security", "load_policy"));
+    ff(add_rules(batch, "kernel", "kernel", "security", { "load_policy" }));
 
     return true;
 }
 
-static bool copy_avtab_rules(policydb_t *pdb,
+static bool copy_avtab_rules(AvtabBatch &batch,
                              const char *source_type,
                              const char *target_type)
 {
-    std::vector<std::pair<avtab_key_t, avtab_datum_t>> to_add;
-
+    policydb_t *pdb = batch.policy();
     type_datum_t *source, *target;
 
     if (strcmp(source_type, target_type) == 0) {
@@ -912,49 +1298,44 @@ static bool copy_avtab_rules(policydb_t *pdb,
         return false;
     }
 
-    // Gather rules to copy
-    for (uint32_t i = 0; i < pdb->te_avtab.nslot; ++i) {
-        for (avtab_ptr_t cur = pdb->te_avtab.htable[i]; cur; cur = cur->next) {
-            if (!(cur->key.specified & AVTAB_ALLOWED)) {
-                continue;
-            }
-
-            if (cur->key.target_type == source->s.value) {
-                avtab_key_t copy = cur->key;
-                copy.target_type = static_cast<uint16_t>(target->s.value);
+    batch.copy_target_rules(static_cast<uint16_t>(source->s.value),
+                            static_cast<uint16_t>(target->s.value));
+    return true;
+}
 
-                to_add.push_back(std::make_pair(std::move(copy), cur->datum));
-            }
-        }
+/*!
+ * \brief Get the SELinux label of the internal storage directory
+ *
+ * INTERNAL_STORAGE is tried first, followed by /data/media.
+ *
+ * \param[out] path Path whose label was read (or the last path tried)
+ * \param[out] context Label of \p path
+ *
+ * \return Whether a label was read. If false, errno is set.
+ */
+static bool get_data_media_context(const char *&path, std::string &context)
+{
+    path = INTERNAL_STORAGE;
+    if (util::selinux_lget_context(path, context)) {
+        return true;
     }
 
-    avtab_datum_t *datum;
-    for (auto &pair : to_add) {
-        datum = avtab_search(&pdb->te_avtab, &pair.first);
-
-        if (!datum) {
-            // Create new avtab rule if the key doesn't exist
-            if (avtab_insert(&pdb->te_avtab, &pair.first, &pair.second) != 0) {
-                LOGE("Failed to add rule to avtab");
-                return false;
-            }
-        } else {
-            // Add additional perms if the key already exists
-            datum->data |= pair.second.data;
-        }
-    }
+    LOGW("%s: Failed to get context: %s; trying /data/media",
+         path, strerror(errno));
 
-    return true;
+    path = "/data/media";
+    return util::selinux_lget_context(path, context);
 }
 
 /*!
  * \brief Patch SEPolicy to allow media_data_file-labeled /data/media to work on
  *        Android >= 5.0
  */
-static bool fix_data_media_rules(policydb_t *pdb)
+static bool fix_data_media_rules(AvtabBatch &batch)
 {
+    policydb_t *pdb = batch.policy();
+
     static const char *expected_type = "media_rw_data_file";
-    const char *path = INTERNAL_STORAGE;
 
     if (!find_type(pdb, expected_type)) {
         LOGW("Type %s doesn't exist. Won't touch %s related rules",
@@ -962,15 +1343,13 @@ static bool fix_data_media_rules(policydb_t *pdb)
         return true;
     }
 
+    const char *path;
     std::string context;
-    if (!util::selinux_lget_context(path, context)) {
+    if (!get_data_media_context(path, context)) {
+        int saved_errno = errno;
         LOGE("%s: Failed to get context: %s", path, strerror(errno));
-        path = "/data/media";
-        if (!util::selinux_lget_context(path, context)) {
-            LOGE("%s: Failed to get context: %s", path, strerror(errno));
-            // Don't fail if /data/media does not exist
-            return errno == ENOENT;
-        }
+        // Don't fail if /data/media does not exist
+        return saved_errno == ENOENT;
     }
 
     std::vector<std::string> pieces = util::split(context, ":");
@@ -986,7 +1365,7 @@ static bool fix_data_media_rules(policydb_t *pdb)
 
     LOGV("Copying %s rules to %s because of improper %s SELinux label",
          expected_type, type.c_str(), path);
-    ff(copy_avtab_rules(pdb, expected_type, type.c_str()));
+    ff(copy_avtab_rules(batch, expected_type, type.c_str()));
 
     // Required for MLS on Android 7.1
     ff(selinux_set_attribute(pdb, type.c_str(), "mlstrustedobject"));
@@ -994,8 +1373,10 @@ static bool fix_data_media_rules(policydb_t *pdb)
     return true;
 }
 
-static bool create_mbtool_types(policydb_t *pdb)
+static bool create_mbtool_types(AvtabBatch &batch)
 {
+    policydb_t *pdb = batch.policy();
+
     // Used for running any mbtool commands
     ff(selinux_create_type(pdb, "mb_exec") != SELinuxResult::Error);
     ff(selinux_add_to_role(pdb, "r", "mb_exec"));
@@ -1004,146 +1385,151 @@ static bool create_mbtool_types(policydb_t *pdb)
     ff(selinux_set_attribute(pdb, "mb_exec", "mlstrustedsubject"));
 
     // Allow setting the current process context from init to mb_exec
-    ff(add_rules(pdb, "init", "mb_exec", "process", {
+    ff(add_rules(batch, "init", "mb_exec", "process", {
         "noatsecure", "rlimitinh", "setcurrent", "siginh", "transition",
         //"dyntransition",
     }));
 
     // Allow installd to connect to appsync's socket
-    ff(add_rules(pdb, "installd", "mb_exec", "unix_stream_socket", {
+    ff(add_rules(batch, "installd", "mb_exec", "unix_stream_socket", {
         "accept", "listen", "read", "write",
     }));
     if (find_type(pdb, "system_server")) {
-        ff(add_rules(pdb, "system_server", "mb_exec", "unix_stream_socket", {
+        ff(add_rules(batch, "system_server", "mb_exec", "unix_stream_socket", {
             "connectto",
         }));
     } else {
-        ff(add_rules(pdb, "system", "mb_exec", "unix_stream_socket", {
+        ff(add_rules(batch, "system", "mb_exec", "unix_stream_socket", {
             "connectto",
         }));
     }
 
     // Allow apps to connect to the daemon
-    ff(add_rules(pdb, "untrusted_app", "mb_exec", "unix_stream_socket", {
+    ff(add_rules(batch, "untrusted_app", "mb_exec", "unix_stream_socket", {
         "connectto",
     }));
 
     // Allow zygote to write to our stdout pipe when rebooting
-    ff(add_rules(pdb, "zygote", "init", "fifo_file", { "write" }));
+    ff(add_rules(batch, "zygote", "init", "fifo_file", { "write" }));
 
     // Allow rebooting via the android.intent.action.REBOOT intent
     if (find_type(pdb, "activity_service")) {
-        ff(add_rules(pdb, "zygote", "activity_service", "service_manager", { "find" }));
+        ff(add_rules(batch, "zygote", "activity_service", "service_manager", { "find" }));
     }
     if (find_type(pdb, "system_server")) {
-        ff(add_rules(pdb, "zygote", "system_server", "binder", { "call" }));
+        ff(add_rules(batch, "zygote", "system_server", "binder", { "call" }));
     }
 
-    ff(add_rules(pdb, "zygote", "init", "unix_stream_socket", { "read", "write" }));
-    ff(add_rules(pdb, "zygote", "servicemanager", "binder", { "call" }));
+    ff(add_rules(batch, "zygote", "init", "unix_stream_socket", { "read", "write" }));
+    ff(add_rules(batch, "zygote", "servicemanager", "binder", { "call" }));
 
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "binder", { "transfer" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "dir", { "search" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "file", { "open", "read" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "process", { "getattr" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "dir", { "search" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "file", { "open" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "file", { "read" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "process", { "getattr" }));
+    ff(add_rules(batch, "servicemanager", "mb_exec", "binder", { "transfer" }));
+    ff(add_rules(batch, "servicemanager", "mb_exec", "dir", { "search" }));
+    ff(add_rules(batch, "servicemanager", "mb_exec", "file", { "open", "read" }));
+    ff(add_rules(batch, "servicemanager", "mb_exec", "process", { "getattr" }));
+    ff(add_rules(batch, "servicemanager", "zygote", "dir", { "search" }));
+    ff(add_rules(batch, "servicemanager", "zygote", "file", { "open" }));
+    ff(add_rules(batch, "servicemanager", "zygote", "file", { "read" }));
+    ff(add_rules(batch, "servicemanager", "zygote", "process", { "getattr" }));
 
     // For in-app flashing
-    ff(add_rules(pdb, "rootfs", "tmpfs", "filesystem", { "associate" }));
-    ff(add_rules(pdb, "tmpfs",  "rootfs", "filesystem", { "associate" }));
-    ff(add_rules(pdb, "kernel", "mb_exec", "fd", { "use" }));
+    ff(add_rules(batch, "rootfs", "tmpfs", "filesystem", { "associate" }));
+    ff(add_rules(batch, "tmpfs",  "rootfs", "filesystem", { "associate" }));
+    ff(add_rules(batch, "kernel", "mb_exec", "fd", { "use" }));
 
     // Give mb_exec <insert diety here> permissions
-    type_datum_t *mb_exec = find_type(pdb, "mb_exec");
-    if (!mb_exec) {
-        return false;
-    }
-
-    // For all attributes
-    for (uint32_t type_val = 1; type_val <= pdb->p_types.nprim;
-            ++type_val) {
-        // Skip non-attributes
-        if (pdb->type_val_to_struct[type_val - 1]->flavor
-                != TYPE_ATTRIB) {
-            continue;
-        }
-
-        auto ret2 = selinux_raw_grant_all_perms(
-                pdb, static_cast<uint16_t>(mb_exec->s.value),
-                static_cast<uint16_t>(type_val));
-        switch (ret2) {
-        case SELinuxResult::Changed:
-        case SELinuxResult::Unchanged:
-            break;
-        case SELinuxResult::Error:
-            LOGE("Failed to grant all perms for: %s -> %s",
-                 "mb_exec", pdb->p_type_val_to_name[type_val - 1]);
-            return false;
-        }
-    }
+    ff(grant_all_attributes(batch, "mb_exec"));
 
     return true;
 }
 
-static bool apply_main_patches(policydb_t *pdb)
+static bool apply_main_patches(AvtabBatch &batch)
 {
-    ff(fix_data_media_rules(pdb));
-    ff(create_mbtool_types(pdb));
+    ff(fix_data_media_rules(batch));
+    ff(create_mbtool_types(batch));
 
     return true;
 }
 
-static bool apply_cwm_recovery_patches(policydb_t *pdb)
+static bool apply_cwm_recovery_patches(AvtabBatch &batch)
 {
     // Debugging rules (for CWM and Philz)
-    ff(add_rules(pdb, "adbd",  "block_device",    "blk_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "graphics_device", "chr_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "graphics_device", "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "input_device",    "chr_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "input_device",    "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "file",       { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "lnk_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "system_file",     "file",       { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "tmpfs",           "file",       { "relabelto" }));
-
-    ff(add_rules(pdb, "rootfs", "tmpfs",          "filesystem", { "associate" }));
-    ff(add_rules(pdb, "tmpfs",  "rootfs",         "filesystem", { "associate" }));
+    ff(add_rules(batch, "adbd",  "block_device",    "blk_file",   { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "graphics_device", "chr_file",   { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "graphics_device", "dir",        { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "input_device",    "chr_file",   { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "input_device",    "dir",        { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "rootfs",          "dir",        { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "rootfs",          "file",       { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "rootfs",          "lnk_file",   { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "system_file",     "file",       { "relabelto" }));
+    ff(add_rules(batch, "adbd",  "tmpfs",           "file",       { "relabelto" }));
+
+    ff(add_rules(batch, "rootfs", "tmpfs",          "filesystem", { "associate" }));
+    ff(add_rules(batch, "tmpfs",  "rootfs",         "filesystem", { "associate" }));
 
     return true;
 }
 
+/*!
+ * \brief Apply a patch to a policy
+ *
+ * All avtab changes made by the patch steps are collected in a single
+ * AvtabBatch, so the avtab is indexed and rewritten at most once per policy.
+ */
 bool selinux_apply_patch(policydb_t *pdb, SELinuxPatch patch)
 {
+    AvtabBatch batch(pdb);
     bool ret = false;
 
     switch (patch) {
     case SELinuxPatch::PreBoot:
-        ret = apply_pre_boot_patches(pdb);
+        ret = apply_pre_boot_patches(batch);
         break;
     case SELinuxPatch::Main:
-        ret = apply_main_patches(pdb);
+        ret = apply_main_patches(batch);
         break;
     case SELinuxPatch::CwmRecovery:
-        ret = apply_cwm_recovery_patches(pdb);
+        ret = apply_cwm_recovery_patches(batch);
         break;
     case SELinuxPatch::StripNoAudit:
-        selinux_strip_no_audit(pdb);
-        ret = true;
+        ret = selinux_strip_no_audit(batch);
         break;
     case SELinuxPatch::None:
         break;
     }
 
-    return ret;
+    return ret && batch.commit();
 }
 
-bool patch_sepolicy(const std::string &source,
-                    const std::string &target,
-                    SELinuxPatch patch)
+static const char * patch_name(SELinuxPatch patch)
+{
+    switch (patch) {
+    case SELinuxPatch::PreBoot:
+        return "pre-boot";
+    case SELinuxPatch::Main:
+        return "main";
+    case SELinuxPatch::CwmRecovery:
+        return "cwm-recovery";
+    case SELinuxPatch::StripNoAudit:
+        return "strip-no-audit";
+    case SELinuxPatch::None:
+        break;
+    }
+
+    return "none";
+}
+
+/*!
+ * \brief Load, patch, and serialize a policy
+ *
+ * \param source Path to source policy
+ * \param patch Patch to apply
+ * \param data Output binary policy
+ */
+static bool patch_sepolicy_image(const std::string &source,
+                                 SELinuxPatch patch,
+                                 std::vector<unsigned char> &data)
 {
     policydb_t pdb;
 
@@ -1168,7 +1554,43 @@ bool patch_sepolicy(const std::string &source,
         return false;
     }
 
-    if (!util::selinux_write_policy(target, &pdb)) {
+    // Don't print warnings to stderr
+    sepol_handle_t *handle = sepol_handle_create();
+    sepol_msg_set_callback(handle, nullptr, nullptr);
+
+    auto destroy_handle = finally([&]{
+        sepol_handle_destroy(handle);
+    });
+
+    void *image;
+    size_t image_size;
+
+    if (policydb_to_image(handle, &pdb, &image, &image_size) < 0) {
+        LOGE("Failed to write policydb to memory");
+        return false;
+    }
+
+    auto free_image = finally([&]{
+        free(image);
+    });
+
+    auto ptr = static_cast<unsigned char *>(image);
+    data.assign(ptr, ptr + image_size);
+
+    return true;
+}
+
+bool patch_sepolicy(const std::string &source,
+                    const std::string &target,
+                    SELinuxPatch patch)
+{
+    std::vector<unsigned char> data;
+
+    if (!patch_sepolicy_image(source, patch, data)) {
+        return false;
+    }
+
+    if (!util::selinux_write_policy_data(target, data.data(), data.size())) {
         LOGE("%s: Failed to write SELinux policy", target.c_str());
         return false;
     }
@@ -1176,6 +1598,99 @@ bool patch_sepolicy(const std::string &source,
     return true;
 }
 
+/*!
+ * \brief Get the runtime state that the output of a patch depends on
+ *
+ * The main patch copies rules depending on the label of the internal storage
+ * directory, so a cached policy is only valid for the same label.
+ */
+static std::string patch_runtime_input(SELinuxPatch patch)
+{
+    if (patch != SELinuxPatch::Main) {
+        return {};
+    }
+
+    const char *path;
+    std::string context;
+    if (!get_data_media_context(path, context)) {
+        // No label for the patch to depend on. Labels never contain '<'.
+        return format("<error:%d>", errno);
+    }
+
+    return context;
+}
+
+/*!
+ * \brief Patch policy, reusing the result from a previous boot if possible
+ *
+ * The patched policy is cached in \p cache_dir, keyed by the contents of
+ * \p source, the patch type, the mbtool version, and, for the main patch,
+ * the SELinux label of the internal storage directory. If a cached policy
+ * exists, it is written directly to \p target and no patching is done.
+ * Failure to read or update the cache is not fatal.
+ *
+ * \note \p source and \p target may refer to the same file.
+ */
+bool patch_sepolicy_cached(const std::string &source,
+                           const std::string &target,
+                           SELinuxPatch patch,
+                           const std::string &cache_dir)
+{
+    std::vector<unsigned char> source_data;
+
+    if (!util::file_read_all(source, source_data)) {
+        LOGE("%s: Failed to read SELinux policy: %s",
+             source.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string runtime_input = patch_runtime_input(patch);
+
+    unsigned char key[SEPOLICY_CACHE_KEY_SIZE];
+    sepolicy_cache_key(source_data.data(), source_data.size(),
+                       patch_name(patch), runtime_input.c_str(), key);
+
+    // Not needed anymore and can be several megabytes
+    std::vector<unsigned char>().swap(source_data);
+
+    std::vector<unsigned char> data;
+
+    if (sepolicy_cache_load(cache_dir, key, data)) {
+        LOGD("%s: Using cached %s policy", source.c_str(), patch_name(patch));
+
+        if (util::selinux_write_policy_data(target, data.data(), data.size())) {
+            return true;
+        }
+
+        // The kernel may have rejected the policy. Don't trust it again.
+        LOGW("%s: Failed to write cached policy; patching again",
+             target.c_str());
+        sepolicy_cache_remove(cache_dir, key);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (!patch_sepolicy_image(source, patch, data)) {
+        return false;
+    }
+
+    LOGD("%s: Applied %s patch in %lld ms", source.c_str(), patch_name(patch),
+         static_cast<long long>(
+                 std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - start).count()));
+
+    if (!util::selinux_write_policy_data(target, data.data(), data.size())) {
+        LOGE("%s: Failed to write SELinux policy", target.c_str());
+        return false;
+    }
+
+    // Only cache policies that were written successfully. If the target is
+    // the kernel's load file, this also means that the policy was accepted.
+    sepolicy_cache_store(cache_dir, key, data.data(), data.size());
+
+    return true;
+}
+
 bool patch_loaded_sepolicy(SELinuxPatch patch)
 {
     ScopedFILE fp(fopen(util::SELINUX_ENFORCE_FILE, "rbe"), fclose);
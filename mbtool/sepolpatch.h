@@ -20,9 +20,13 @@
 #pragma once
 
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <sepol/policydb/policydb.h>
 
+#include "mbcommon/common.h"
+
 namespace mb
 {
 
@@ -62,6 +66,62 @@ SELinuxResult selinux_raw_add_to_role(policydb_t *pdb,
                                       uint16_t type_val);
 bool selinux_raw_reindex(policydb_t *pdb);
 
+// Batched avtab editing
+
+class AvtabBatch
+{
+public:
+    explicit AvtabBatch(policydb_t *pdb);
+    ~AvtabBatch();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(AvtabBatch)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(AvtabBatch)
+
+    policydb_t * policy() const;
+
+    void set_perms(uint16_t source_type_val,
+                   uint16_t target_type_val,
+                   uint16_t class_val,
+                   uint32_t perms,
+                   bool remove);
+    bool grant_all_perms(uint16_t source_type_val,
+                         uint16_t target_type_val,
+                         uint16_t class_val);
+    bool grant_all_perms(uint16_t source_type_val,
+                         uint16_t target_type_val);
+    void copy_target_rules(uint16_t from_type_val,
+                           uint16_t to_type_val);
+    void remove_rules_matching(uint16_t specified);
+
+    const std::vector<avtab_ptr_t> & rules_by_target(uint16_t type_val);
+
+    bool commit();
+
+private:
+    struct PermEdit
+    {
+        uint32_t set;
+        uint32_t clear;
+    };
+
+    void build_index();
+    void reset();
+
+    policydb_t *m_pdb;
+
+    // Pending allow rule edits, keyed by source, target, and class
+    std::unordered_map<uint64_t, PermEdit> m_edits;
+    // avtab key types to remove
+    uint16_t m_remove_specified;
+
+    // Index of committed rules by target type value
+    bool m_indexed;
+    std::vector<std::vector<avtab_ptr_t>> m_by_target;
+
+    // Mask of all permissions by class value
+    std::vector<uint32_t> m_class_perms;
+};
+
 // Helper functions
 
 bool selinux_mount();
@@ -122,6 +182,10 @@ bool selinux_apply_patch(policydb_t *pdb, SELinuxPatch patch);
 bool patch_sepolicy(const std::string &source,
                     const std::string &target,
                     SELinuxPatch patch);
+bool patch_sepolicy_cached(const std::string &source,
+                           const std::string &target,
+                           SELinuxPatch patch,
+                           const std::string &cache_dir);
 bool patch_loaded_sepolicy(SELinuxPatch patch);
 
 int sepolpatch_main(int argc, char *argv[]);
@@ -42,6 +42,7 @@
 #include "mbutil/string.h"
 
 #include "multiboot.h"
+#include "rom_cache.h"
 #include "roms.h"
 
 #define LOG_TAG "mbtool/switcher"
@@ -319,7 +320,7 @@ SwitchRomResult switch_rom(const std::string &id,
 
     // Verify ROM ID
     Roms roms;
-    roms.add_installed();
+    rom_cache_get_installed(roms);
 
     auto r = roms.find_by_id(id);
     if (!r) {
@@ -442,7 +443,7 @@ bool set_kernel(const std::string &id, const std::string &boot_blockdev)
 
     // Verify ROM ID
     Roms roms;
-    roms.add_installed();
+    rom_cache_get_installed(roms);
 
     auto r = roms.find_by_id(id);
     if (!r) {
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include <cstdint>
+
+/*!
+ * \brief Minimal writer for the Android Binary XML format
+ */
+class AbxWriter
+{
+public:
+    AbxWriter() : m_data("ABX\0", 4)
+    {
+        token(0, 1 << 4);
+    }
+
+    void start_tag(const std::string &name)
+    {
+        token(2, 3 << 4);
+        interned(name);
+    }
+
+    void end_tag(const std::string &name)
+    {
+        token(3, 3 << 4);
+        interned(name);
+    }
+
+    void attr_string(const std::string &name, const std::string &value)
+    {
+        token(15, 2 << 4);
+        interned(name);
+        utf(value);
+    }
+
+    void attr_bytes_hex(const std::string &name, const std::string &bytes)
+    {
+        token(15, 4 << 4);
+        interned(name);
+        utf(bytes);
+    }
+
+    void attr_bytes_base64(const std::string &name, const std::string &bytes)
+    {
+        token(15, 5 << 4);
+        interned(name);
+        utf(bytes);
+    }
+
+    void attr_int(const std::string &name, int32_t value)
+    {
+        token(15, 6 << 4);
+        interned(name);
+        u32(static_cast<uint32_t>(value));
+    }
+
+    void attr_long_hex(const std::string &name, uint64_t value)
+    {
+        token(15, 9 << 4);
+        interned(name);
+        u32(static_cast<uint32_t>(value >> 32));
+        u32(static_cast<uint32_t>(value));
+    }
+
+    void text(const std::string &str)
+    {
+        token(4, 2 << 4);
+        utf(str);
+    }
+
+    std::string finish()
+    {
+        token(1, 1 << 4);
+        return m_data;
+    }
+
+private:
+    void token(uint8_t command, uint8_t type)
+    {
+        m_data += static_cast<char>(command | type);
+    }
+
+    void u16(uint16_t n)
+    {
+        m_data += static_cast<char>(n >> 8);
+        m_data += static_cast<char>(n);
+    }
+
+    void u32(uint32_t n)
+    {
+        u16(static_cast<uint16_t>(n >> 16));
+        u16(static_cast<uint16_t>(n));
+    }
+
+    void utf(const std::string &str)
+    {
+        u16(static_cast<uint16_t>(str.size()));
+        m_data += str;
+    }
+
+    void interned(const std::string &str)
+    {
+        auto it = m_pool.find(str);
+        if (it != m_pool.end()) {
+            u16(it->second);
+        } else {
+            u16(0xffff);
+            utf(str);
+            m_pool.emplace(str, static_cast<uint16_t>(m_pool.size()));
+        }
+    }
+
+    std::string m_data;
+    std::unordered_map<std::string, uint16_t> m_pool;
+};
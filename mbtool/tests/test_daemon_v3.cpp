@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mbcommon/version.h"
+#include "mbutil/socket.h"
+
+#include "daemon_v3.h"
+
+#include "protocol/request_generated.h"
+#include "protocol/response_generated.h"
+
+namespace fb = flatbuffers;
+namespace v3 = mbtool::daemon::v3;
+
+using namespace mb;
+
+class DaemonV3Test : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, _fds), 0);
+
+        _thread = std::thread([this]{
+            connection_version_3(_fds[1]);
+        });
+    }
+
+    void TearDown() override
+    {
+        // Closing the client end terminates the connection loop
+        close(_fds[0]);
+
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+
+        close(_fds[1]);
+    }
+
+    void send_request(fb::FlatBufferBuilder &builder)
+    {
+        ASSERT_TRUE(util::socket_write_bytes(
+                _fds[0], builder.GetBufferPointer(), builder.GetSize()));
+    }
+
+    const v3::Response * receive_response()
+    {
+        if (!util::socket_read_bytes(_fds[0], _data)) {
+            return nullptr;
+        }
+
+        fb::Verifier verifier(_data.data(), _data.size());
+        if (!v3::VerifyResponseBuffer(verifier)) {
+            return nullptr;
+        }
+
+        return v3::GetResponse(_data.data());
+    }
+
+    int _fds[2];
+    std::thread _thread;
+    std::vector<uint8_t> _data;
+};
+
+static fb::Offset<v3::Request> create_version_request(
+        fb::FlatBufferBuilder &builder, uint64_t id)
+{
+    return v3::CreateRequest(builder, v3::RequestType_MbGetVersionRequest,
+                             v3::CreateMbGetVersionRequest(builder).Union(),
+                             id);
+}
+
+TEST_F(DaemonV3Test, BatchCollectsResponsesInOrder)
+{
+    fb::FlatBufferBuilder builder;
+    std::vector<fb::Offset<v3::Request>> requests;
+
+    requests.push_back(create_version_request(builder, 1));
+    requests.push_back(v3::CreateRequest(
+            builder, v3::RequestType_FileOpenRequest,
+            v3::CreateFileOpenRequestDirect(
+                    builder, "/nonexistent/mbtool_tests").Union(), 2));
+    requests.push_back(v3::CreateRequest(
+            builder, v3::RequestType_FileCloseRequest,
+            v3::CreateFileCloseRequest(builder, 12345).Union(), 3));
+    requests.push_back(v3::CreateRequest(
+            builder, v3::RequestType_BatchRequest,
+            v3::CreateBatchRequest(builder).Union(), 4));
+    requests.push_back(v3::CreateRequest(
+            builder, v3::RequestType_NONE, 0, 5));
+
+    builder.Finish(v3::CreateRequest(
+            builder, v3::RequestType_BatchRequest,
+            v3::CreateBatchRequestDirect(builder, &requests).Union(), 100));
+    send_request(builder);
+
+    auto response = receive_response();
+    ASSERT_TRUE(response);
+    ASSERT_EQ(response->id(), 100u);
+    ASSERT_EQ(response->response_type(), v3::ResponseType_BatchResponse);
+
+    auto batch = static_cast<const v3::BatchResponse *>(response->response());
+    ASSERT_TRUE(batch->responses());
+    ASSERT_EQ(batch->responses()->size(), 5u);
+
+    std::vector<const v3::Response *> entries;
+    for (auto const *entry : *batch->responses()) {
+        fb::Verifier verifier(entry->response()->Data(),
+                              entry->response()->size());
+        ASSERT_TRUE(v3::VerifyResponseBuffer(verifier));
+        entries.push_back(entry->response_nested_root());
+    }
+
+    // Each entry echoes the ID of its request
+    for (size_t i = 0; i < entries.size(); ++i) {
+        ASSERT_EQ(entries[i]->id(), i + 1);
+    }
+
+    ASSERT_EQ(entries[0]->response_type(),
+              v3::ResponseType_MbGetVersionResponse);
+    auto version_response = static_cast<const v3::MbGetVersionResponse *>(
+            entries[0]->response());
+    ASSERT_TRUE(version_response->version());
+    ASSERT_STREQ(version_response->version()->c_str(), version());
+
+    // Failures are reported per entry without aborting the batch
+    ASSERT_EQ(entries[1]->response_type(), v3::ResponseType_FileOpenResponse);
+    auto open_response = static_cast<const v3::FileOpenResponse *>(
+            entries[1]->response());
+    ASSERT_FALSE(open_response->success());
+    ASSERT_TRUE(open_response->error());
+    ASSERT_EQ(open_response->error()->errno_value(), ENOENT);
+
+    ASSERT_EQ(entries[2]->response_type(), v3::ResponseType_Invalid);
+
+    // Nested batches are rejected
+    ASSERT_EQ(entries[3]->response_type(), v3::ResponseType_Invalid);
+
+    ASSERT_EQ(entries[4]->response_type(), v3::ResponseType_Unsupported);
+}
+
+TEST_F(DaemonV3Test, RequestAfterBatchUsesOwnId)
+{
+    fb::FlatBufferBuilder builder;
+    std::vector<fb::Offset<v3::Request>> requests;
+
+    requests.push_back(create_version_request(builder, 1));
+
+    builder.Finish(v3::CreateRequest(
+            builder, v3::RequestType_BatchRequest,
+            v3::CreateBatchRequestDirect(builder, &requests).Union(), 100));
+    send_request(builder);
+
+    auto response = receive_response();
+    ASSERT_TRUE(response);
+    ASSERT_EQ(response->id(), 100u);
+
+    builder.Clear();
+    builder.Finish(create_version_request(builder, 101));
+    send_request(builder);
+
+    // Responses are written directly to the socket again
+    response = receive_response();
+    ASSERT_TRUE(response);
+    ASSERT_EQ(response->id(), 101u);
+    ASSERT_EQ(response->response_type(),
+              v3::ResponseType_MbGetVersionResponse);
+}
+
+TEST_F(DaemonV3Test, EmptyBatch)
+{
+    fb::FlatBufferBuilder builder;
+
+    builder.Finish(v3::CreateRequest(
+            builder, v3::RequestType_BatchRequest,
+            v3::CreateBatchRequest(builder).Union(), 100));
+    send_request(builder);
+
+    auto response = receive_response();
+    ASSERT_TRUE(response);
+    ASSERT_EQ(response->id(), 100u);
+    ASSERT_EQ(response->response_type(), v3::ResponseType_BatchResponse);
+
+    auto batch = static_cast<const v3::BatchResponse *>(response->response());
+    ASSERT_TRUE(batch->responses());
+    ASSERT_EQ(batch->responses()->size(), 0u);
+}
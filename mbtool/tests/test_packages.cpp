@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "packages.h"
+
+#include "tests/abx_writer.h"
+
+using namespace mb;
+
+static const char PACKAGES_XML[] = R"(<?xml version='1.0' encoding='utf-8' standalone='yes' ?>
+<packages>
+    <version sdkVersion="27" databaseVersion="3" />
+    <package name="com.example.first" codePath="/data/app/com.example.first-1" ft="1" it="2" ut="3" version="10" userId="10050">
+        <sigs count="1">
+            <cert index="0" key="aaaa" />
+        </sigs>
+        <perms />
+    </package>
+    <package name="com.example.nosigs" codePath="/data/app/com.example.nosigs-1" ft="1" it="2" ut="3" version="20" userId="10051">
+    </package>
+    <package name="com.example.last" codePath="/data/app/com.example.last-1" ft="1" it="2" ut="3" version="30" userId="10052">
+        <sigs count="2">
+            <cert index="1" key="bbbb" />
+            <cert index="0" />
+        </sigs>
+    </package>
+</packages>
+)";
+
+static void write_abx_package(AbxWriter &w, const std::string &name,
+                              int version, int user_id)
+{
+    w.start_tag("package");
+    w.attr_string("name", name);
+    w.attr_string("codePath", "/data/app/" + name + "-1");
+    w.attr_long_hex("ft", 1);
+    w.attr_long_hex("it", 2);
+    w.attr_long_hex("ut", 3);
+    w.attr_int("version", version);
+    w.attr_int("userId", user_id);
+}
+
+static std::string create_abx_packages_xml()
+{
+    AbxWriter w;
+
+    w.start_tag("packages");
+
+    write_abx_package(w, "com.example.first", 10, 10050);
+    w.start_tag("sigs");
+    w.attr_int("count", 1);
+    w.start_tag("cert");
+    w.attr_int("index", 0);
+    w.attr_bytes_hex("key", std::string("\xaa\xaa", 2));
+    w.end_tag("cert");
+    w.end_tag("sigs");
+    w.start_tag("perms");
+    w.end_tag("perms");
+    w.end_tag("package");
+
+    write_abx_package(w, "com.example.nosigs", 20, 10051);
+    w.end_tag("package");
+
+    write_abx_package(w, "com.example.last", 30, 10052);
+    w.start_tag("sigs");
+    w.attr_int("count", 2);
+    w.start_tag("cert");
+    w.attr_int("index", 1);
+    w.attr_bytes_hex("key", std::string("\xbb\xbb", 2));
+    w.end_tag("cert");
+    w.start_tag("cert");
+    w.attr_int("index", 0);
+    w.end_tag("cert");
+    w.end_tag("sigs");
+    w.end_tag("package");
+
+    w.end_tag("packages");
+
+    return w.finish();
+}
+
+class PackagesTest : public testing::Test
+{
+protected:
+    void TearDown() override
+    {
+        if (!_path.empty()) {
+            unlink(_path.c_str());
+        }
+    }
+
+    void write_file(const std::string &data)
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        _path = tmpdir ? tmpdir : "/data/local/tmp";
+        _path += "/mbtool_packages_test.XXXXXX";
+
+        int fd = mkstemp(&_path[0]);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(write(fd, data.data(), data.size()),
+                  static_cast<ssize_t>(data.size()));
+        ASSERT_EQ(close(fd), 0);
+    }
+
+    void check_packages(const Packages &pkgs)
+    {
+        ASSERT_EQ(pkgs.size(), 3u);
+
+        auto first = pkgs.get(0);
+        ASSERT_EQ(first->name, "com.example.first");
+        ASSERT_EQ(first->code_path, "/data/app/com.example.first-1");
+        ASSERT_EQ(first->version, 10);
+        ASSERT_EQ(first->user_id, 10050);
+        ASSERT_EQ(first->first_install_time, 2u);
+        ASSERT_EQ(first->sig_indexes, std::vector<std::string>{"0"});
+
+        auto nosigs = pkgs.get(1);
+        ASSERT_EQ(nosigs->name, "com.example.nosigs");
+        ASSERT_TRUE(nosigs->sig_indexes.empty());
+
+        auto last = pkgs.get(2);
+        ASSERT_EQ(last->name, "com.example.last");
+        ASSERT_EQ(last->sig_indexes, (std::vector<std::string>{"1", "0"}));
+
+        ASSERT_EQ(pkgs.sigs.size(), 2u);
+        ASSERT_EQ(pkgs.sigs.at("0"), "aaaa");
+        ASSERT_EQ(pkgs.sigs.at("1"), "bbbb");
+
+        // Signatures must belong to the package that was looked up, since
+        // the daemon uses them to verify clients
+        auto by_uid = pkgs.find_by_uid(10052);
+        ASSERT_TRUE(!!by_uid);
+        ASSERT_EQ(by_uid->name, "com.example.last");
+        ASSERT_EQ(by_uid->sig_indexes, (std::vector<std::string>{"1", "0"}));
+
+        auto by_pkg = pkgs.find_by_pkg("com.example.first");
+        ASSERT_TRUE(!!by_pkg);
+        ASSERT_EQ(by_pkg->user_id, 10050);
+        ASSERT_EQ(by_pkg->sig_indexes, std::vector<std::string>{"0"});
+
+        ASSERT_FALSE(pkgs.find_by_uid(10053));
+        ASSERT_FALSE(pkgs.find_by_pkg("com.example.missing"));
+    }
+
+    std::string _path;
+};
+
+TEST_F(PackagesTest, LoadTextXml)
+{
+    ASSERT_NO_FATAL_FAILURE(write_file(PACKAGES_XML));
+
+    Packages pkgs;
+    ASSERT_TRUE(pkgs.load_xml(_path));
+    ASSERT_NO_FATAL_FAILURE(check_packages(pkgs));
+}
+
+TEST_F(PackagesTest, LoadBinaryXml)
+{
+    ASSERT_NO_FATAL_FAILURE(write_file(create_abx_packages_xml()));
+
+    Packages pkgs;
+    ASSERT_TRUE(pkgs.load_xml(_path));
+    ASSERT_NO_FATAL_FAILURE(check_packages(pkgs));
+}
+
+TEST_F(PackagesTest, LoadSelectedFields)
+{
+    ASSERT_NO_FATAL_FAILURE(write_file(PACKAGES_XML));
+
+    Packages pkgs;
+    ASSERT_TRUE(pkgs.load_xml(_path, Packages::Field::Uid
+            | Packages::Field::Signatures));
+    ASSERT_EQ(pkgs.size(), 3u);
+
+    auto pkg = pkgs.find_by_uid(10050);
+    ASSERT_TRUE(!!pkg);
+    ASSERT_TRUE(pkg->name.empty());
+    ASSERT_EQ(pkg->sig_indexes, std::vector<std::string>{"0"});
+
+    ASSERT_FALSE(pkgs.find_by_pkg("com.example.first"));
+}
+
+TEST_F(PackagesTest, LoadInvalidXml)
+{
+    ASSERT_NO_FATAL_FAILURE(write_file("<packages><package name=\"a\">"));
+
+    Packages pkgs;
+    ASSERT_FALSE(pkgs.load_xml(_path));
+}
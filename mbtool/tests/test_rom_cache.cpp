@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mbutil/delete.h"
+
+#include "rom_cache.h"
+
+using namespace mb;
+
+// Directory containing one subdirectory per ROM
+static std::string scan_root;
+static int scan_count;
+
+// Same rules as Roms::add_data_roms(): a ROM exists if its system directory
+// contains build.prop
+static void scan_test_roms(Roms &roms, std::vector<std::string> &deps)
+{
+    ++scan_count;
+    deps.push_back(scan_root);
+
+    DIR *dp = opendir(scan_root.c_str());
+    if (!dp) {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dp))) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        std::string system_path(scan_root);
+        system_path += "/";
+        system_path += ent->d_name;
+        system_path += "/system";
+        deps.push_back(system_path);
+
+        struct stat sb;
+        if (stat((system_path + "/build.prop").c_str(), &sb) == 0) {
+            auto rom = std::make_shared<Rom>();
+            rom->id = ent->d_name;
+            roms.roms.push_back(std::move(rom));
+        }
+    }
+
+    closedir(dp);
+}
+
+class RomCacheTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        _temp_dir = tmpdir ? tmpdir : "/data/local/tmp";
+        _temp_dir += "/mbtool_rom_cache_test.XXXXXX";
+
+        ASSERT_TRUE(mkdtemp(&_temp_dir[0]));
+
+        scan_root = _temp_dir + "/roms";
+        scan_count = 0;
+    }
+
+    void TearDown() override
+    {
+        util::delete_recursive(_temp_dir);
+    }
+
+    void create_rom(const std::string &id)
+    {
+        std::string path(scan_root);
+        ASSERT_TRUE(mkdir(path.c_str(), 0755) == 0 || errno == EEXIST);
+        path += "/";
+        path += id;
+        ASSERT_EQ(mkdir(path.c_str(), 0755), 0);
+        ASSERT_EQ(mkdir((path + "/data").c_str(), 0755), 0);
+        path += "/system";
+        ASSERT_EQ(mkdir(path.c_str(), 0755), 0);
+        create_file(path + "/build.prop");
+    }
+
+    void create_file(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ASSERT_GE(fd, 0);
+        close(fd);
+    }
+
+    // Changes made during the same timestamp tick as a scan make the cache
+    // rescan on the next call, so move existing directories to the past
+    void age_tree()
+    {
+        std::vector<std::string> paths{ scan_root };
+
+        DIR *dp = opendir(scan_root.c_str());
+        ASSERT_TRUE(dp);
+
+        struct dirent *ent;
+        while ((ent = readdir(dp))) {
+            if (ent->d_name[0] != '.') {
+                paths.push_back(scan_root + "/" + ent->d_name + "/system");
+            }
+        }
+
+        closedir(dp);
+
+        struct timespec times[2] = { { 1, 0 }, { 1, 0 } };
+        for (auto const &path : paths) {
+            ASSERT_EQ(utimensat(AT_FDCWD, path.c_str(), times, 0), 0);
+        }
+    }
+
+    static std::vector<std::string> get_ids(RomCache &cache)
+    {
+        Roms roms;
+        cache.get_installed(roms);
+
+        std::vector<std::string> ids;
+        for (auto const &rom : roms.roms) {
+            ids.push_back(rom->id);
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    std::string _temp_dir;
+};
+
+TEST_F(RomCacheTest, ReusedWhenUnchanged)
+{
+    create_rom("a");
+    create_rom("b");
+    age_tree();
+
+    RomCache cache(&scan_test_roms);
+
+    std::vector<std::string> expected{ "a", "b" };
+    ASSERT_EQ(get_ids(cache), expected);
+    ASSERT_EQ(get_ids(cache), expected);
+    ASSERT_EQ(scan_count, 1);
+}
+
+TEST_F(RomCacheTest, ReturnsCopies)
+{
+    create_rom("a");
+    age_tree();
+
+    RomCache cache(&scan_test_roms);
+
+    Roms roms;
+    cache.get_installed(roms);
+    ASSERT_EQ(roms.roms.size(), 1u);
+    roms.roms[0]->id = "modified";
+
+    std::vector<std::string> expected{ "a" };
+    ASSERT_EQ(get_ids(cache), expected);
+}
+
+TEST_F(RomCacheTest, UnrelatedChangeKeepsCache)
+{
+    create_rom("a");
+    age_tree();
+
+    RomCache cache(&scan_test_roms);
+    get_ids(cache);
+
+    create_file(scan_root + "/a/data/file");
+
+    get_ids(cache);
+    ASSERT_EQ(scan_count, 1);
+}
+
+TEST_F(RomCacheTest, InvalidatedByNewRom)
+{
+    create_rom("a");
+    age_tree();
+
+    RomCache cache(&scan_test_roms);
+    get_ids(cache);
+
+    create_rom("b");
+
+    std::vector<std::string> expected{ "a", "b" };
+    ASSERT_EQ(get_ids(cache), expected);
+}
+
+TEST_F(RomCacheTest, InvalidatedByRemovedFile)
+{
+    create_rom("a");
+    create_rom("b");
+    age_tree();
+
+    RomCache cache(&scan_test_roms);
+    get_ids(cache);
+
+    ASSERT_EQ(unlink((scan_root + "/b/system/build.prop").c_str()), 0);
+
+    std::vector<std::string> expected{ "a" };
+    ASSERT_EQ(get_ids(cache), expected);
+}
+
+TEST_F(RomCacheTest, InvalidatedByCreatedRoot)
+{
+    RomCache cache(&scan_test_roms);
+    ASSERT_TRUE(get_ids(cache).empty());
+
+    // The closest existing parent is watched instead
+    create_rom("a");
+
+    std::vector<std::string> expected{ "a" };
+    ASSERT_EQ(get_ids(cache), expected);
+}
+
+TEST_F(RomCacheTest, InvalidatedByRenamedRoot)
+{
+    create_rom("a");
+    age_tree();
+
+    RomCache cache(&scan_test_roms);
+    get_ids(cache);
+
+    ASSERT_EQ(rename(scan_root.c_str(), (_temp_dir + "/old").c_str()), 0);
+
+    ASSERT_TRUE(get_ids(cache).empty());
+}
+
+TEST_F(RomCacheTest, ForkedChildSeesEarlierChanges)
+{
+    create_rom("a");
+    age_tree();
+
+    RomCache cache(&scan_test_roms);
+    get_ids(cache);
+
+    // The child cannot use the parent's watches and must notice this change
+    // some other way
+    create_rom("b");
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+
+    if (pid == 0) {
+        std::vector<std::string> expected{ "a", "b" };
+        _exit(get_ids(cache) == expected ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), EXIT_SUCCESS);
+}
+
+TEST_F(RomCacheTest, ForkedChildWatchesForChanges)
+{
+    create_rom("a");
+    age_tree();
+
+    RomCache cache(&scan_test_roms);
+    get_ids(cache);
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+
+    if (pid == 0) {
+        bool ok = get_ids(cache).size() == 1 && scan_count == 1;
+
+        create_rom("b");
+
+        std::vector<std::string> expected{ "a", "b" };
+        ok = ok && get_ids(cache) == expected;
+        _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), EXIT_SUCCESS);
+}
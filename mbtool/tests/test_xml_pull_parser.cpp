@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <cstring>
+
+#include "xml_pull_parser.h"
+
+#include "tests/abx_writer.h"
+
+using namespace mb;
+
+using Event = XmlPullParser::Event;
+
+TEST(XmlPullParserTest, ParseText)
+{
+    static const char xml[] =
+            "<?xml version='1.0' encoding='utf-8' standalone='yes' ?>\n"
+            "<!-- comment -->\n"
+            "<root a=\"1 &amp; 2\" b='&lt;&#x41;&#66;&gt;'>\n"
+            "    <empty />\n"
+            "    <text>x &quot;y&quot;<![CDATA[<z>]]></text>\n"
+            "</root>\n";
+
+    XmlPullParser parser;
+    parser.open_memory(xml, sizeof(xml) - 1);
+
+    ASSERT_EQ(parser.next(), Event::StartTag);
+    ASSERT_EQ(parser.name(), "root");
+    ASSERT_EQ(parser.depth(), 1u);
+    ASSERT_EQ(parser.attribute_count(), 2u);
+    ASSERT_EQ(parser.attribute_name(0), "a");
+    ASSERT_EQ(parser.attribute_value(0), "1 & 2");
+    ASSERT_EQ(parser.attribute_name(1), "b");
+    ASSERT_EQ(parser.attribute_value(1), "<AB>");
+
+    ASSERT_EQ(parser.next(), Event::Text);
+
+    ASSERT_EQ(parser.next(), Event::StartTag);
+    ASSERT_EQ(parser.name(), "empty");
+    ASSERT_EQ(parser.depth(), 2u);
+    ASSERT_EQ(parser.attribute_count(), 0u);
+    ASSERT_EQ(parser.next(), Event::EndTag);
+    ASSERT_EQ(parser.name(), "empty");
+
+    ASSERT_EQ(parser.next(), Event::Text);
+
+    ASSERT_EQ(parser.next(), Event::StartTag);
+    ASSERT_EQ(parser.name(), "text");
+
+    std::string text;
+    std::string cdata;
+    ASSERT_EQ(parser.next(), Event::Text);
+    ASSERT_TRUE(parser.text(text));
+    ASSERT_EQ(text, "x \"y\"");
+    ASSERT_EQ(parser.next(), Event::Text);
+    ASSERT_TRUE(parser.text(cdata));
+    ASSERT_EQ(cdata, "<z>");
+    ASSERT_EQ(parser.next(), Event::EndTag);
+
+    ASSERT_EQ(parser.next(), Event::Text);
+    ASSERT_EQ(parser.next(), Event::EndTag);
+    ASSERT_EQ(parser.name(), "root");
+    ASSERT_EQ(parser.next(), Event::EndDocument);
+}
+
+TEST(XmlPullParserTest, SkipTag)
+{
+    static const char xml[] =
+            "<root><skip><a><b/></a>text</skip><next/></root>";
+
+    XmlPullParser parser;
+    parser.open_memory(xml, sizeof(xml) - 1);
+
+    ASSERT_EQ(parser.next(), Event::StartTag);
+    ASSERT_EQ(parser.next(), Event::StartTag);
+    ASSERT_EQ(parser.name(), "skip");
+    ASSERT_TRUE(parser.skip_tag());
+
+    ASSERT_EQ(parser.next(), Event::StartTag);
+    ASSERT_EQ(parser.name(), "next");
+    ASSERT_EQ(parser.depth(), 2u);
+}
+
+TEST(XmlPullParserTest, ParseTextErrors)
+{
+    static const char *const documents[] = {
+        "<root></other>",
+        "<root a=\"1>",
+        "<root>",
+    };
+
+    for (auto const *xml : documents) {
+        XmlPullParser parser;
+        parser.open_memory(xml, strlen(xml));
+
+        Event event;
+        while ((event = parser.next()) != Event::Error) {
+            ASSERT_NE(event, Event::EndDocument) << "Document: " << xml;
+        }
+        ASSERT_FALSE(parser.error().empty());
+    }
+}
+
+TEST(XmlPullParserTest, ParseInvalidEntity)
+{
+    static const char xml[] = "<root>&unknown;</root>";
+
+    XmlPullParser parser;
+    parser.open_memory(xml, sizeof(xml) - 1);
+
+    // Text is only decoded when it is requested
+    std::string text;
+    ASSERT_EQ(parser.next(), Event::StartTag);
+    ASSERT_EQ(parser.next(), Event::Text);
+    ASSERT_FALSE(parser.text(text));
+}
+
+TEST(XmlPullParserTest, ParseBinary)
+{
+    AbxWriter w;
+    w.start_tag("root");
+    w.attr_string("name", "value");
+    w.attr_int("int", -5);
+    w.attr_long_hex("long", 0x1234567890);
+    w.attr_bytes_hex("hex", "\x01\xab");
+    w.attr_bytes_base64("base64", "abcd");
+    w.start_tag("child");
+    w.text("a&b");
+    w.end_tag("child");
+    // Interned strings are reused
+    w.start_tag("child");
+    w.end_tag("child");
+    w.end_tag("root");
+    std::string data = w.finish();
+
+    XmlPullParser parser;
+    parser.open_memory(data.data(), data.size());
+
+    ASSERT_EQ(parser.next(), Event::StartTag);
+    ASSERT_EQ(parser.name(), "root");
+    ASSERT_EQ(parser.attribute_count(), 5u);
+    ASSERT_EQ(parser.attribute_value(0), "value");
+    ASSERT_EQ(parser.attribute_value(1), "-5");
+    ASSERT_EQ(parser.attribute_value(2), "1234567890");
+    ASSERT_EQ(parser.attribute_value(3), "01ab");
+    ASSERT_EQ(parser.attribute_value(4), "YWJjZA==");
+
+    std::string text;
+    ASSERT_EQ(parser.next(), Event::StartTag);
+    ASSERT_EQ(parser.name(), "child");
+    ASSERT_EQ(parser.next(), Event::Text);
+    ASSERT_TRUE(parser.text(text));
+    ASSERT_EQ(text, "a&b");
+    ASSERT_EQ(parser.next(), Event::EndTag);
+
+    ASSERT_EQ(parser.next(), Event::StartTag);
+    ASSERT_EQ(parser.name(), "child");
+    ASSERT_EQ(parser.attribute_count(), 0u);
+    ASSERT_EQ(parser.next(), Event::EndTag);
+
+    ASSERT_EQ(parser.next(), Event::EndTag);
+    ASSERT_EQ(parser.name(), "root");
+    ASSERT_EQ(parser.next(), Event::EndDocument);
+}
+
+TEST(XmlPullParserTest, ParseTruncatedBinary)
+{
+    AbxWriter w;
+    w.start_tag("root");
+    w.attr_string("name", "value");
+    w.end_tag("root");
+    std::string data = w.finish();
+
+    // Every prefix of the document must fail cleanly
+    for (size_t size = 5; size < data.size(); ++size) {
+        XmlPullParser parser;
+        parser.open_memory(data.data(), size);
+
+        Event event;
+        while ((event = parser.next()) != Event::Error) {
+            ASSERT_NE(event, Event::EndDocument) << "Size: " << size;
+        }
+    }
+}
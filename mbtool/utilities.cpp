@@ -33,6 +33,7 @@
 
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
+#include "mbdevice/database.h"
 #include "mbdevice/device.h"
 #include "mbdevice/json.h"
 #include "mblog/logging.h"
@@ -69,6 +70,22 @@ static bool get_device(const char *path, Device &device)
     LOGD("ro.product.device = %s", prop_product_device.c_str());
     LOGD("ro.build.product = %s", prop_build_product.c_str());
 
+    // Binary device databases are validated when generated and support
+    // looking up the device by codename without loading the whole list
+    DeviceDatabase db;
+    if (db.open(path)) {
+        for (auto const &codename : { prop_product_device,
+                                      prop_build_product }) {
+            if (!codename.empty() && db.find_by_codename(codename, device)
+                    && !device.validate()) {
+                return true;
+            }
+        }
+
+        LOGE("Unknown device: %s", prop_product_device.c_str());
+        return false;
+    }
+
     std::vector<unsigned char> contents;
     if (!util::file_read_all(path, contents)) {
         LOGE("%s: Failed to read file: %s", path, strerror(errno));
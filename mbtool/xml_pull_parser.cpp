@@ -0,0 +1,1046 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "xml_pull_parser.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/finally.h"
+#include "mbcommon/string.h"
+
+namespace mb
+{
+
+// ABX format from BinaryXmlSerializer.java in frameworks/base. The lower 4 bits
+// of each token byte are the XmlPullParser event and the upper 4 bits are the
+// type of the data that follows. Integers are big endian.
+static constexpr char ABX_MAGIC[] = { 'A', 'B', 'X', '\0' };
+
+static constexpr uint8_t ABX_START_DOCUMENT         = 0;
+static constexpr uint8_t ABX_END_DOCUMENT           = 1;
+static constexpr uint8_t ABX_START_TAG              = 2;
+static constexpr uint8_t ABX_END_TAG                = 3;
+static constexpr uint8_t ABX_TEXT                   = 4;
+static constexpr uint8_t ABX_CDSECT                 = 5;
+static constexpr uint8_t ABX_ENTITY_REF             = 6;
+static constexpr uint8_t ABX_IGNORABLE_WHITESPACE   = 7;
+static constexpr uint8_t ABX_PROCESSING_INSTRUCTION = 8;
+static constexpr uint8_t ABX_COMMENT                = 9;
+static constexpr uint8_t ABX_DOCDECL                = 10;
+static constexpr uint8_t ABX_ATTRIBUTE              = 15;
+
+static constexpr uint8_t ABX_TYPE_NULL              = 1 << 4;
+static constexpr uint8_t ABX_TYPE_STRING            = 2 << 4;
+static constexpr uint8_t ABX_TYPE_STRING_INTERNED   = 3 << 4;
+static constexpr uint8_t ABX_TYPE_BYTES_HEX         = 4 << 4;
+static constexpr uint8_t ABX_TYPE_BYTES_BASE64      = 5 << 4;
+static constexpr uint8_t ABX_TYPE_INT               = 6 << 4;
+static constexpr uint8_t ABX_TYPE_INT_HEX           = 7 << 4;
+static constexpr uint8_t ABX_TYPE_LONG              = 8 << 4;
+static constexpr uint8_t ABX_TYPE_LONG_HEX          = 9 << 4;
+static constexpr uint8_t ABX_TYPE_FLOAT             = 10 << 4;
+static constexpr uint8_t ABX_TYPE_DOUBLE            = 11 << 4;
+static constexpr uint8_t ABX_TYPE_BOOLEAN_TRUE      = 12 << 4;
+static constexpr uint8_t ABX_TYPE_BOOLEAN_FALSE     = 13 << 4;
+
+// Index that marks a newly interned string
+static constexpr uint16_t ABX_NEW_INTERNED_STRING   = 0xffff;
+
+static bool is_whitespace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_name_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+            || (c >= '0' && c <= '9') || c == '_' || c == ':' || c == '-'
+            || c == '.' || static_cast<unsigned char>(c) >= 0x80;
+}
+
+static void append_utf8(std::string &out, uint32_t c)
+{
+    if (c < 0x80) {
+        out += static_cast<char>(c);
+    } else if (c < 0x800) {
+        out += static_cast<char>(0xc0 | (c >> 6));
+        out += static_cast<char>(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        out += static_cast<char>(0xe0 | (c >> 12));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (c & 0x3f));
+    } else {
+        out += static_cast<char>(0xf0 | (c >> 18));
+        out += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (c & 0x3f));
+    }
+}
+
+/*!
+ * \brief Convert Java's modified UTF-8 to standard UTF-8
+ *
+ * Modified UTF-8 encodes NUL as two bytes and supplementary characters as
+ * surrogate pairs.
+ */
+static void convert_modified_utf8(const char *data, size_t size,
+                                  std::string &out)
+{
+    auto const *p = reinterpret_cast<const unsigned char *>(data);
+    auto const *end = p + size;
+
+    // Fast path when neither special case is present
+    if (!memchr(p, 0xc0, size) && !memchr(p, 0xed, size)) {
+        out.assign(data, size);
+        return;
+    }
+
+    out.clear();
+
+    while (p < end) {
+        if (end - p >= 2 && p[0] == 0xc0 && p[1] == 0x80) {
+            out += '\0';
+            p += 2;
+        } else if (end - p >= 6 && p[0] == 0xed && (p[1] & 0xf0) == 0xa0
+                && p[3] == 0xed && (p[4] & 0xf0) == 0xb0) {
+            uint32_t high = ((p[1] & 0x0fu) << 6) | (p[2] & 0x3fu);
+            uint32_t low = ((p[4] & 0x0fu) << 6) | (p[5] & 0x3fu);
+            append_utf8(out, 0x10000 + (high << 10) + low);
+            p += 6;
+        } else {
+            out += static_cast<char>(*p);
+            ++p;
+        }
+    }
+}
+
+static void append_hex(std::string &out, const unsigned char *data,
+                       size_t size)
+{
+    static constexpr char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < size; ++i) {
+        out += digits[data[i] >> 4];
+        out += digits[data[i] & 0xf];
+    }
+}
+
+static void format_number(std::string &out, uint64_t value, bool negative,
+                          unsigned int base)
+{
+    static constexpr char digits[] = "0123456789abcdef";
+    char buf[24];
+    char *p = buf + sizeof(buf);
+
+    do {
+        *--p = digits[value % base];
+        value /= base;
+    } while (value != 0);
+
+    if (negative) {
+        *--p = '-';
+    }
+
+    out.assign(p, static_cast<size_t>(buf + sizeof(buf) - p));
+}
+
+static void format_signed(std::string &out, int64_t value)
+{
+    // Negate in unsigned arithmetic so INT64_MIN doesn't overflow
+    if (value < 0) {
+        format_number(out, 0 - static_cast<uint64_t>(value), true, 10);
+    } else {
+        format_number(out, static_cast<uint64_t>(value), false, 10);
+    }
+}
+
+static void append_base64(std::string &out, const unsigned char *data,
+                          size_t size)
+{
+    static constexpr char alphabet[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t n = static_cast<uint32_t>(data[i]) << 16;
+        if (i + 1 < size) {
+            n |= static_cast<uint32_t>(data[i + 1]) << 8;
+        }
+        if (i + 2 < size) {
+            n |= data[i + 2];
+        }
+
+        out += alphabet[(n >> 18) & 0x3f];
+        out += alphabet[(n >> 12) & 0x3f];
+        out += i + 1 < size ? alphabet[(n >> 6) & 0x3f] : '=';
+        out += i + 2 < size ? alphabet[n & 0x3f] : '=';
+    }
+}
+
+/*!
+ * \brief Decode entity and character references
+ *
+ * \param normalize_ws Whether to replace whitespace characters with spaces as
+ *                     required for attribute values
+ */
+static bool decode(const char *begin, const char *end, bool normalize_ws,
+                   std::string &out)
+{
+    out.clear();
+
+    for (const char *p = begin; p < end;) {
+        // Fast path for runs of plain characters
+        const char *run = p;
+        while (p < end && *p != '&' && *p != '\r'
+                && !(normalize_ws && (*p == '\n' || *p == '\t'))) {
+            ++p;
+        }
+        out.append(run, p);
+
+        if (p == end) {
+            break;
+        } else if (*p == '\r') {
+            // Line endings are normalized to '\n'
+            out += normalize_ws ? ' ' : '\n';
+            ++p;
+            if (p < end && *p == '\n') {
+                ++p;
+            }
+            continue;
+        } else if (*p != '&') {
+            out += ' ';
+            ++p;
+            continue;
+        }
+
+        const char *semicolon = static_cast<const char *>(
+                memchr(p, ';', static_cast<size_t>(end - p)));
+        if (!semicolon) {
+            return false;
+        }
+
+        const char *ref = p + 1;
+        size_t ref_len = static_cast<size_t>(semicolon - ref);
+
+        if (ref_len > 1 && ref[0] == '#') {
+            uint32_t c = 0;
+            bool hex = ref[1] == 'x';
+
+            for (const char *d = ref + (hex ? 2 : 1); d < semicolon; ++d) {
+                uint32_t digit;
+                if (*d >= '0' && *d <= '9') {
+                    digit = static_cast<uint32_t>(*d - '0');
+                } else if (hex && *d >= 'a' && *d <= 'f') {
+                    digit = static_cast<uint32_t>(*d - 'a' + 10);
+                } else if (hex && *d >= 'A' && *d <= 'F') {
+                    digit = static_cast<uint32_t>(*d - 'A' + 10);
+                } else {
+                    return false;
+                }
+
+                c = c * (hex ? 16 : 10) + digit;
+                if (c > 0x10ffff) {
+                    return false;
+                }
+            }
+
+            append_utf8(out, c);
+        } else if (ref_len == 2 && memcmp(ref, "lt", 2) == 0) {
+            out += '<';
+        } else if (ref_len == 2 && memcmp(ref, "gt", 2) == 0) {
+            out += '>';
+        } else if (ref_len == 3 && memcmp(ref, "amp", 3) == 0) {
+            out += '&';
+        } else if (ref_len == 4 && memcmp(ref, "quot", 4) == 0) {
+            out += '"';
+        } else if (ref_len == 4 && memcmp(ref, "apos", 4) == 0) {
+            out += '\'';
+        } else {
+            return false;
+        }
+
+        p = semicolon + 1;
+    }
+
+    return true;
+}
+
+XmlPullParser::XmlPullParser()
+    : m_data(nullptr)
+    , m_size(0)
+    , m_pos(0)
+    , m_map(nullptr)
+    , m_map_size(0)
+    , m_attr_count(0)
+    , m_text_begin(0)
+    , m_text_end(0)
+    , m_text_is_cdata(false)
+    , m_binary(false)
+    , m_pending_end(false)
+{
+}
+
+XmlPullParser::~XmlPullParser()
+{
+    close();
+}
+
+/*!
+ * \brief Open an XML file
+ *
+ * The file is memory mapped and must not be modified while it is being parsed.
+ */
+bool XmlPullParser::open(const std::string &path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        m_error = format("Failed to open: %s", strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        ::close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        m_error = format("Failed to stat: %s", strerror(errno));
+        return false;
+    }
+
+    if (sb.st_size == 0) {
+        // mmap() does not allow empty mappings
+        open_memory("", 0);
+        return true;
+    }
+
+    void *map = mmap(nullptr, static_cast<size_t>(sb.st_size), PROT_READ,
+                     MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        m_error = format("Failed to mmap: %s", strerror(errno));
+        return false;
+    }
+
+    // Only read once, front to back
+    madvise(map, static_cast<size_t>(sb.st_size), MADV_SEQUENTIAL);
+
+    open_memory(map, static_cast<size_t>(sb.st_size));
+    m_map = map;
+    m_map_size = static_cast<size_t>(sb.st_size);
+
+    return true;
+}
+
+/*!
+ * \brief Parse an XML document in memory
+ *
+ * \p data must remain valid until the parser is closed.
+ */
+void XmlPullParser::open_memory(const void *data, size_t size)
+{
+    close();
+
+    m_data = static_cast<const char *>(data);
+    m_size = size;
+
+    if (size >= sizeof(ABX_MAGIC)
+            && memcmp(data, ABX_MAGIC, sizeof(ABX_MAGIC)) == 0) {
+        m_binary = true;
+        m_pos = sizeof(ABX_MAGIC);
+    }
+}
+
+void XmlPullParser::close()
+{
+    if (m_map) {
+        munmap(m_map, m_map_size);
+        m_map = nullptr;
+        m_map_size = 0;
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+    m_pos = 0;
+    m_name.clear();
+    m_attr_count = 0;
+    m_stack.clear();
+    m_pending_end = false;
+    m_binary = false;
+    m_string_pool.clear();
+    m_binary_text.clear();
+    m_error.clear();
+}
+
+XmlPullParser::Event XmlPullParser::next()
+{
+    m_attr_count = 0;
+
+    if (m_pending_end) {
+        m_pending_end = false;
+        m_name = std::move(m_stack.back());
+        m_stack.pop_back();
+        return Event::EndTag;
+    }
+
+    if (m_binary) {
+        return next_binary();
+    }
+
+    while (m_pos < m_size) {
+        if (m_data[m_pos] != '<') {
+            m_text_begin = m_pos;
+            m_text_is_cdata = false;
+
+            const void *lt = memchr(m_data + m_pos, '<', m_size - m_pos);
+            m_pos = lt ? static_cast<size_t>(static_cast<const char *>(lt) - m_data)
+                    : m_size;
+            m_text_end = m_pos;
+
+            if (m_stack.empty()) {
+                // Only whitespace is allowed outside of the root element
+                for (size_t i = m_text_begin; i < m_text_end; ++i) {
+                    if (!is_whitespace(m_data[i])) {
+                        return set_error("Text outside of root element");
+                    }
+                }
+                continue;
+            }
+
+            return Event::Text;
+        }
+
+        if (m_pos + 1 >= m_size) {
+            return set_error("Unexpected end of document");
+        }
+
+        char c = m_data[m_pos + 1];
+        if (c == '/') {
+            return parse_end_tag();
+        } else if (c == '?' || c == '!') {
+            if (!parse_markup()) {
+                return Event::Error;
+            } else if (m_text_is_cdata) {
+                return Event::Text;
+            }
+        } else {
+            return parse_start_tag();
+        }
+    }
+
+    if (!m_stack.empty()) {
+        return set_error("Unexpected end of document");
+    }
+
+    return Event::EndDocument;
+}
+
+/*!
+ * \brief Skip the children of the current start tag
+ *
+ * After this returns successfully, the current event is the corresponding end
+ * tag.
+ */
+bool XmlPullParser::skip_tag()
+{
+    size_t target = m_stack.size() - 1;
+
+    while (true) {
+        switch (next()) {
+        case Event::EndTag:
+            if (m_stack.size() == target) {
+                return true;
+            }
+            break;
+        case Event::EndDocument:
+        case Event::Error:
+            return false;
+        default:
+            break;
+        }
+    }
+}
+
+const std::string & XmlPullParser::name() const
+{
+    return m_name;
+}
+
+size_t XmlPullParser::attribute_count() const
+{
+    return m_attr_count;
+}
+
+const std::string & XmlPullParser::attribute_name(size_t index) const
+{
+    return m_attrs[index].first;
+}
+
+const std::string & XmlPullParser::attribute_value(size_t index) const
+{
+    return m_attrs[index].second;
+}
+
+/*!
+ * \brief Get the decoded text of the current text event
+ *
+ * \return False if the text contains an invalid entity or character reference
+ */
+bool XmlPullParser::text(std::string &out) const
+{
+    if (m_binary) {
+        out = m_binary_text;
+        return true;
+    } else if (m_text_is_cdata) {
+        out.assign(m_data + m_text_begin, m_data + m_text_end);
+        return true;
+    }
+
+    return decode(m_data + m_text_begin, m_data + m_text_end, false, out);
+}
+
+/*!
+ * \brief Number of currently open tags, including the current start tag
+ */
+size_t XmlPullParser::depth() const
+{
+    return m_stack.size();
+}
+
+const std::string & XmlPullParser::error() const
+{
+    return m_error;
+}
+
+XmlPullParser::Event XmlPullParser::parse_start_tag()
+{
+    // Skip '<'
+    ++m_pos;
+
+    if (!parse_name(m_name)) {
+        return set_error("Invalid tag name");
+    }
+
+    while (true) {
+        bool had_whitespace = m_pos < m_size && is_whitespace(m_data[m_pos]);
+        skip_whitespace();
+
+        if (m_pos >= m_size) {
+            return set_error("Unexpected end of document");
+        } else if (m_data[m_pos] == '>') {
+            ++m_pos;
+            break;
+        } else if (m_data[m_pos] == '/') {
+            if (m_pos + 1 >= m_size || m_data[m_pos + 1] != '>') {
+                return set_error("Expected '>' after '/'");
+            }
+            m_pos += 2;
+            m_pending_end = true;
+            break;
+        } else if (!had_whitespace) {
+            return set_error("Expected whitespace before attribute");
+        }
+
+        if (m_attr_count == m_attrs.size()) {
+            m_attrs.emplace_back();
+        }
+        auto &attr = m_attrs[m_attr_count];
+
+        if (!parse_name(attr.first)) {
+            return set_error("Invalid attribute name");
+        }
+
+        skip_whitespace();
+        if (m_pos >= m_size || m_data[m_pos] != '=') {
+            return set_error("Expected '=' after attribute name");
+        }
+        ++m_pos;
+        skip_whitespace();
+
+        if (!parse_attribute_value(attr.second)) {
+            return set_error("Invalid attribute value");
+        }
+
+        ++m_attr_count;
+    }
+
+    m_stack.push_back(m_name);
+
+    return Event::StartTag;
+}
+
+XmlPullParser::Event XmlPullParser::parse_end_tag()
+{
+    // Skip '</'
+    m_pos += 2;
+
+    if (!parse_name(m_name)) {
+        return set_error("Invalid tag name");
+    }
+
+    skip_whitespace();
+    if (m_pos >= m_size || m_data[m_pos] != '>') {
+        return set_error("Expected '>' at end of tag");
+    }
+    ++m_pos;
+
+    if (m_stack.empty() || m_stack.back() != m_name) {
+        return set_error("Mismatched end tag");
+    }
+    m_stack.pop_back();
+
+    return Event::EndTag;
+}
+
+/*!
+ * \brief Parse markup starting with "<?" or "<!"
+ *
+ * Everything except CDATA sections is skipped. If a CDATA section was parsed,
+ * m_text_is_cdata is set to true.
+ */
+bool XmlPullParser::parse_markup()
+{
+    const char *p = m_data + m_pos;
+    size_t remain = m_size - m_pos;
+
+    m_text_is_cdata = false;
+
+    if (p[1] == '?') {
+        if (!skip_past("?>")) {
+            set_error("Unterminated processing instruction");
+            return false;
+        }
+    } else if (remain >= 4 && memcmp(p, "<!--", 4) == 0) {
+        m_pos += 4;
+        if (!skip_past("-->")) {
+            set_error("Unterminated comment");
+            return false;
+        }
+    } else if (remain >= 9 && memcmp(p, "<![CDATA[", 9) == 0) {
+        if (m_stack.empty()) {
+            set_error("CDATA outside of root element");
+            return false;
+        }
+        m_pos += 9;
+        m_text_begin = m_pos;
+        if (!skip_past("]]>")) {
+            set_error("Unterminated CDATA section");
+            return false;
+        }
+        m_text_end = m_pos - 3;
+        m_text_is_cdata = true;
+    } else if (remain >= 9 && memcmp(p, "<!DOCTYPE", 9) == 0) {
+        if (!skip_past(">")) {
+            set_error("Unterminated DOCTYPE declaration");
+            return false;
+        }
+    } else {
+        set_error("Unsupported markup declaration");
+        return false;
+    }
+
+    return true;
+}
+
+bool XmlPullParser::parse_name(std::string &out)
+{
+    size_t begin = m_pos;
+
+    while (m_pos < m_size && is_name_char(m_data[m_pos])) {
+        ++m_pos;
+    }
+
+    if (m_pos == begin) {
+        return false;
+    }
+
+    out.assign(m_data + begin, m_data + m_pos);
+    return true;
+}
+
+bool XmlPullParser::parse_attribute_value(std::string &out)
+{
+    if (m_pos >= m_size || (m_data[m_pos] != '"' && m_data[m_pos] != '\'')) {
+        return false;
+    }
+
+    char quote = m_data[m_pos++];
+
+    const char *end = static_cast<const char *>(
+            memchr(m_data + m_pos, quote, m_size - m_pos));
+    if (!end) {
+        return false;
+    }
+
+    const char *begin = m_data + m_pos;
+    if (memchr(begin, '<', static_cast<size_t>(end - begin))) {
+        return false;
+    }
+
+    m_pos = static_cast<size_t>(end - m_data) + 1;
+
+    return decode(begin, end, true, out);
+}
+
+bool XmlPullParser::skip_past(const char *str)
+{
+    size_t len = strlen(str);
+
+    while (m_pos + len <= m_size) {
+        if (memcmp(m_data + m_pos, str, len) == 0) {
+            m_pos += len;
+            return true;
+        }
+        ++m_pos;
+    }
+
+    return false;
+}
+
+void XmlPullParser::skip_whitespace()
+{
+    while (m_pos < m_size && is_whitespace(m_data[m_pos])) {
+        ++m_pos;
+    }
+}
+
+XmlPullParser::Event XmlPullParser::next_binary()
+{
+    while (m_pos < m_size) {
+        uint8_t token;
+        if (!read_u8(token)) {
+            return set_error("Unexpected end of document");
+        }
+
+        uint8_t command = token & 0x0f;
+        uint8_t type = token & 0xf0;
+
+        switch (command) {
+        case ABX_START_DOCUMENT:
+            break;
+
+        case ABX_END_DOCUMENT:
+            if (!m_stack.empty()) {
+                return set_error("Unexpected end of document");
+            }
+            m_pos = m_size;
+            return Event::EndDocument;
+
+        case ABX_START_TAG:
+            if (type != ABX_TYPE_STRING_INTERNED) {
+                return set_error("Invalid tag name type");
+            }
+            return parse_binary_start_tag();
+
+        case ABX_END_TAG:
+            if (type != ABX_TYPE_STRING_INTERNED
+                    || !read_interned_utf(m_name)) {
+                return set_error("Invalid tag name");
+            }
+            if (m_stack.empty() || m_stack.back() != m_name) {
+                return set_error("Mismatched end tag");
+            }
+            m_stack.pop_back();
+            return Event::EndTag;
+
+        case ABX_TEXT:
+        case ABX_CDSECT:
+        case ABX_IGNORABLE_WHITESPACE:
+        case ABX_ENTITY_REF:
+            if (type == ABX_TYPE_NULL) {
+                m_binary_text.clear();
+            } else if (type != ABX_TYPE_STRING || !read_utf(m_binary_text)) {
+                return set_error("Invalid text");
+            }
+
+            if (command == ABX_ENTITY_REF) {
+                std::string ref("&");
+                ref += m_binary_text;
+                ref += ';';
+                if (!decode(ref.data(), ref.data() + ref.size(), false,
+                            m_binary_text)) {
+                    return set_error("Invalid entity reference");
+                }
+            }
+
+            // Only whitespace is allowed outside of the root element, but
+            // there's no need to be strict about it for binary documents
+            if (!m_stack.empty()) {
+                return Event::Text;
+            }
+            break;
+
+        case ABX_PROCESSING_INSTRUCTION:
+        case ABX_COMMENT:
+        case ABX_DOCDECL:
+            if (type != ABX_TYPE_NULL
+                    && (type != ABX_TYPE_STRING || !read_utf(m_binary_text))) {
+                return set_error("Invalid markup declaration");
+            }
+            break;
+
+        default:
+            return set_error("Invalid token");
+        }
+    }
+
+    // BinaryXmlSerializer always writes END_DOCUMENT
+    return set_error("Unexpected end of document");
+}
+
+XmlPullParser::Event XmlPullParser::parse_binary_start_tag()
+{
+    if (!read_interned_utf(m_name)) {
+        return set_error("Invalid tag name");
+    }
+
+    // Attributes immediately follow the start tag
+    while (m_pos < m_size
+            && (static_cast<uint8_t>(m_data[m_pos]) & 0x0f) == ABX_ATTRIBUTE) {
+        uint8_t type = static_cast<uint8_t>(m_data[m_pos++]) & 0xf0;
+
+        if (m_attr_count == m_attrs.size()) {
+            m_attrs.emplace_back();
+        }
+        auto &attr = m_attrs[m_attr_count];
+
+        if (!read_interned_utf(attr.first)) {
+            return set_error("Invalid attribute name");
+        }
+        if (!read_binary_value(type, attr.second)) {
+            return set_error("Invalid attribute value");
+        }
+
+        ++m_attr_count;
+    }
+
+    m_stack.push_back(m_name);
+
+    return Event::StartTag;
+}
+
+bool XmlPullParser::read_u8(uint8_t &out)
+{
+    if (m_size - m_pos < sizeof(out)) {
+        return false;
+    }
+    out = static_cast<uint8_t>(m_data[m_pos]);
+    m_pos += sizeof(out);
+    return true;
+}
+
+bool XmlPullParser::read_u16(uint16_t &out)
+{
+    if (m_size - m_pos < sizeof(out)) {
+        return false;
+    }
+    memcpy(&out, m_data + m_pos, sizeof(out));
+    out = mb_be16toh(out);
+    m_pos += sizeof(out);
+    return true;
+}
+
+bool XmlPullParser::read_u32(uint32_t &out)
+{
+    if (m_size - m_pos < sizeof(out)) {
+        return false;
+    }
+    memcpy(&out, m_data + m_pos, sizeof(out));
+    out = mb_be32toh(out);
+    m_pos += sizeof(out);
+    return true;
+}
+
+bool XmlPullParser::read_u64(uint64_t &out)
+{
+    if (m_size - m_pos < sizeof(out)) {
+        return false;
+    }
+    memcpy(&out, m_data + m_pos, sizeof(out));
+    out = mb_be64toh(out);
+    m_pos += sizeof(out);
+    return true;
+}
+
+bool XmlPullParser::read_utf(std::string &out)
+{
+    uint16_t size;
+    if (!read_u16(size) || m_size - m_pos < size) {
+        return false;
+    }
+
+    convert_modified_utf8(m_data + m_pos, size, out);
+    m_pos += size;
+    return true;
+}
+
+bool XmlPullParser::read_interned_utf(std::string &out)
+{
+    uint16_t index;
+    if (!read_u16(index)) {
+        return false;
+    }
+
+    if (index == ABX_NEW_INTERNED_STRING) {
+        if (!read_utf(out)) {
+            return false;
+        }
+        m_string_pool.push_back(out);
+    } else if (index < m_string_pool.size()) {
+        out = m_string_pool[index];
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read a typed ABX value and convert it to its text representation
+ */
+bool XmlPullParser::read_binary_value(uint8_t type, std::string &out)
+{
+    switch (type) {
+    case ABX_TYPE_NULL:
+        out.clear();
+        return true;
+
+    case ABX_TYPE_STRING:
+        return read_utf(out);
+
+    case ABX_TYPE_STRING_INTERNED:
+        return read_interned_utf(out);
+
+    case ABX_TYPE_BYTES_HEX:
+    case ABX_TYPE_BYTES_BASE64: {
+        uint16_t size;
+        if (!read_u16(size) || m_size - m_pos < size) {
+            return false;
+        }
+
+        auto const *data = reinterpret_cast<const unsigned char *>(
+                m_data + m_pos);
+        out.clear();
+
+        // Lowercase to match Signature.toCharsString(), which was used for
+        // certificates in the text format
+        if (type == ABX_TYPE_BYTES_HEX) {
+            append_hex(out, data, size);
+        } else {
+            append_base64(out, data, size);
+        }
+
+        m_pos += size;
+        return true;
+    }
+
+    case ABX_TYPE_INT:
+    case ABX_TYPE_INT_HEX: {
+        uint32_t value;
+        if (!read_u32(value)) {
+            return false;
+        }
+        if (type == ABX_TYPE_INT) {
+            format_signed(out, static_cast<int32_t>(value));
+        } else {
+            format_number(out, value, false, 16);
+        }
+        return true;
+    }
+
+    case ABX_TYPE_LONG:
+    case ABX_TYPE_LONG_HEX: {
+        uint64_t value;
+        if (!read_u64(value)) {
+            return false;
+        }
+        if (type == ABX_TYPE_LONG) {
+            format_signed(out, static_cast<int64_t>(value));
+        } else {
+            format_number(out, value, false, 16);
+        }
+        return true;
+    }
+
+    case ABX_TYPE_FLOAT: {
+        uint32_t bits;
+        float value;
+        if (!read_u32(bits)) {
+            return false;
+        }
+        memcpy(&value, &bits, sizeof(value));
+        out = format("%g", static_cast<double>(value));
+        return true;
+    }
+
+    case ABX_TYPE_DOUBLE: {
+        uint64_t bits;
+        double value;
+        if (!read_u64(bits)) {
+            return false;
+        }
+        memcpy(&value, &bits, sizeof(value));
+        out = format("%g", value);
+        return true;
+    }
+
+    case ABX_TYPE_BOOLEAN_TRUE:
+        out = "true";
+        return true;
+
+    case ABX_TYPE_BOOLEAN_FALSE:
+        out = "false";
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+XmlPullParser::Event XmlPullParser::set_error(const char *msg)
+{
+    if (m_binary) {
+        m_error = format("Offset %zu: %s", m_pos, msg);
+    } else {
+        size_t line = 1;
+        for (size_t i = 0; i < m_pos && i < m_size; ++i) {
+            if (m_data[i] == '\n') {
+                ++line;
+            }
+        }
+
+        m_error = format("Line %zu: %s", line, msg);
+    }
+
+    // Don't continue after an error
+    m_pos = m_size;
+    m_stack.clear();
+    m_pending_end = false;
+
+    return Event::Error;
+}
+
+}
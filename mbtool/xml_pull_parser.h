@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mbcommon/common.h"
+
+namespace mb
+{
+
+/*!
+ * \brief Streaming XML parser
+ *
+ * This parses a document one tag at a time without building a tree. Only the
+ * subset of XML written by Android's FastXmlSerializer is supported: elements,
+ * attributes, text, CDATA sections, comments, processing instructions, and a
+ * DOCTYPE declaration without an internal subset. The predefined entities and
+ * character references are decoded.
+ *
+ * Documents in the Android Binary XML (ABX) format written by
+ * BinaryXmlSerializer are detected automatically and produce the same events.
+ * Typed attribute values are converted to the strings that the text format
+ * would contain.
+ */
+class XmlPullParser
+{
+public:
+    enum class Event
+    {
+        StartTag,
+        EndTag,
+        Text,
+        EndDocument,
+        Error,
+    };
+
+    XmlPullParser();
+    ~XmlPullParser();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(XmlPullParser)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(XmlPullParser)
+
+    bool open(const std::string &path);
+    void open_memory(const void *data, size_t size);
+    void close();
+
+    Event next();
+    bool skip_tag();
+
+    const std::string & name() const;
+    size_t attribute_count() const;
+    const std::string & attribute_name(size_t index) const;
+    const std::string & attribute_value(size_t index) const;
+    bool text(std::string &out) const;
+    size_t depth() const;
+
+    const std::string & error() const;
+
+private:
+    Event parse_start_tag();
+    Event parse_end_tag();
+    bool parse_markup();
+
+    Event next_binary();
+    Event parse_binary_start_tag();
+    bool read_u8(uint8_t &out);
+    bool read_u16(uint16_t &out);
+    bool read_u32(uint32_t &out);
+    bool read_u64(uint64_t &out);
+    bool read_utf(std::string &out);
+    bool read_interned_utf(std::string &out);
+    bool read_binary_value(uint8_t type, std::string &out);
+    bool parse_name(std::string &out);
+    bool parse_attribute_value(std::string &out);
+    bool skip_past(const char *str);
+    void skip_whitespace();
+    Event set_error(const char *msg);
+
+    const char *m_data;
+    size_t m_size;
+    size_t m_pos;
+
+    // Backing storage if the file was memory mapped
+    void *m_map;
+    size_t m_map_size;
+
+    std::string m_name;
+    std::vector<std::pair<std::string, std::string>> m_attrs;
+    size_t m_attr_count;
+    // Text is only decoded if requested
+    size_t m_text_begin;
+    size_t m_text_end;
+    bool m_text_is_cdata;
+
+    // Whether the document is in the ABX format
+    bool m_binary;
+    // Interned strings in ABX documents
+    std::vector<std::string> m_string_pool;
+    // ABX text is decoded when it is read
+    std::string m_binary_text;
+    // Names of the currently open tags
+    std::vector<std::string> m_stack;
+    // Whether the last start tag was self-closing
+    bool m_pending_end;
+
+    std::string m_error;
+};
+
+}
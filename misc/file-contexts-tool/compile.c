@@ -8,6 +8,7 @@
 #include <unistd.h>
 
 #include "callbacks.h"
+#include "fcontexts.h"
 #include "label_file.h"
 
 static int process_file(struct pcre_shim *shim,
@@ -332,3 +333,167 @@ err:
     rc = -1;
     goto out;
 }
+
+// Compile the regex of a spec that has no regex data. Like compile_regex() in
+// label_file.h, the stem is skipped and the regex is anchored.
+static int compile_spec_regex(struct pcre_shim *shim, struct fcontexts *fc,
+                              struct fcontexts_spec *spec)
+{
+    struct regex_data *regex = NULL;
+    struct regex_error_data error_data;
+    const char *reg_buf = spec->regex_str;
+    char *anchored_regex = NULL;
+    char *buf = NULL;
+    size_t buf_size = 0;
+    FILE *fp = NULL;
+    int rc = -1;
+
+    if (spec->stem_id >= 0) {
+        reg_buf += fc->stems[spec->stem_id].len;
+    }
+
+    if (asprintf(&anchored_regex, "^%s$", reg_buf) < 0) {
+        anchored_regex = NULL;
+        goto out;
+    }
+
+    if (regex_prepare_data(shim, &regex, anchored_regex, &error_data) < 0) {
+        char errbuf[256];
+        regex_format_error(shim, &error_data, errbuf, sizeof(errbuf));
+        selinux_log("%s: Invalid regex: %s\n", spec->regex_str, errbuf);
+        goto out;
+    }
+
+    fp = open_memstream(&buf, &buf_size);
+    if (!fp) {
+        goto out;
+    }
+
+    if (regex_writef(shim, regex, fp) < 0) {
+        selinux_log("%s: Failed to serialize regex\n", spec->regex_str);
+        goto out;
+    }
+
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto out;
+    }
+    fp = NULL;
+
+    spec->regex_data = (unsigned char *) buf;
+    spec->regex_data_len = buf_size;
+    buf = NULL;
+
+    rc = 0;
+
+out:
+    if (fp) {
+        fclose(fp);
+    }
+    free(buf);
+    free(anchored_regex);
+    regex_data_free(shim, regex);
+    return rc;
+}
+
+// Compile only the regexes that are missing from a binary file_contexts file,
+// such as those added with fcontexts_add_spec(). Every other spec is copied
+// as-is.
+int compile_missing(struct pcre_shim *shim,
+                    const char *source_file, const char *target_file)
+{
+    struct fcontexts fc;
+    char *tmp = NULL;
+    int fd = -1;
+    FILE *fp = NULL;
+    struct stat sb;
+    int rc = -1;
+
+    if (stat(source_file, &sb) < 0) {
+        selinux_log("%s: Failed to stat file: %s\n",
+                    source_file, strerror(errno));
+        return -1;
+    }
+
+    if (fcontexts_read_file(&fc, source_file) < 0) {
+        return -1;
+    }
+
+    if (fc.version >= SELINUX_COMPILED_FCONTEXT_PCRE_VERS
+            && fc.pcre2 != shim->use_pcre2) {
+        selinux_log("%s: File was compiled with PCRE %s\n",
+                    source_file, fc.pcre_version);
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < fc.num_specs; ++i) {
+        if (!fc.specs[i].regex_data
+                && compile_spec_regex(shim, &fc, &fc.specs[i]) < 0) {
+            goto out;
+        }
+    }
+
+    if (asprintf(&tmp, "%s.XXXXXX", target_file) < 0) {
+        tmp = NULL;
+        goto out;
+    }
+
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        selinux_log("%s: Failed to open for writing: %s\n",
+                    tmp, strerror(errno));
+        goto out;
+    }
+
+    if (fchmod(fd, sb.st_mode) < 0) {
+        selinux_log("%s: Failed to chmod file: %s\n",
+                    tmp, strerror(errno));
+        goto out_unlink;
+    }
+
+    fp = fdopen(fd, "we");
+    if (!fp) {
+        selinux_log("%s: Failed to open for writing: %s\n",
+                    tmp, strerror(errno));
+        goto out_unlink;
+    }
+
+    // fclose() will close the file descriptor
+    fd = -1;
+
+    if (fcontexts_write(&fc, fp) < 0) {
+        goto out_unlink;
+    }
+
+    rc = fclose(fp);
+    fp = NULL;
+    if (rc != 0) {
+        selinux_log("%s: Failed to close file: %s\n", tmp, strerror(errno));
+        goto out_unlink;
+    }
+
+    rc = rename(tmp, target_file);
+    if (rc < 0) {
+        selinux_log("%s: Failed to rename to target: %s\n",
+                    tmp, strerror(errno));
+        goto out_unlink;
+    }
+
+    goto out;
+
+out_unlink:
+    rc = -1;
+    unlink(tmp);
+
+out:
+    if (fp) {
+        fclose(fp);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(tmp);
+    fcontexts_free(&fc);
+
+    return rc;
+}
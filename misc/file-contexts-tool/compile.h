@@ -8,6 +8,8 @@ extern "C" {
 
 int compile(struct pcre_shim *shim,
             const char *source_file, const char *target_file);
+int compile_missing(struct pcre_shim *shim,
+                    const char *source_file, const char *target_file);
 
 #ifdef __cplusplus
 }
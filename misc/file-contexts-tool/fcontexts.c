@@ -0,0 +1,642 @@
+#define _GNU_SOURCE
+
+#include "fcontexts.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "callbacks.h"
+#include "label_file.h"
+
+/*
+ * File Format
+ *
+ * See write_binary_file() in compile.c. The PCRE version string is only
+ * present for version >= SELINUX_COMPILED_FCONTEXT_PCRE_VERS and the prefix
+ * length is only present for version >= SELINUX_COMPILED_FCONTEXT_PREFIX_LEN.
+ *
+ * The regex data is:
+ *
+ * PCRE:
+ *   u32  - length of the pcre regex
+ *   char - pcre regex
+ *   u32  - length of the pcre study data
+ *   char - pcre study data
+ *
+ * PCRE2:
+ *   u32  - length of the serialized pcre2 regex
+ *   char - serialized pcre2 regex
+ *
+ * A regex that has not been compiled is written with zero lengths. Not every
+ * version of libselinux can load such a file, so it should only be used as an
+ * intermediate file for compile_missing().
+ */
+
+struct reader
+{
+    const unsigned char *ptr;
+    const unsigned char *end;
+};
+
+static int read_bytes(struct reader *r, void *buf, size_t size)
+{
+    if ((size_t) (r->end - r->ptr) < size) {
+        return -1;
+    }
+
+    if (buf) {
+        memcpy(buf, r->ptr, size);
+    }
+    r->ptr += size;
+
+    return 0;
+}
+
+static int read_u32(struct reader *r, uint32_t *value)
+{
+    return read_bytes(r, value, sizeof(*value));
+}
+
+// Read a NULL-terminated string whose length field includes the terminator
+static int read_string(struct reader *r, char **str)
+{
+    uint32_t len;
+
+    if (read_u32(r, &len) < 0 || len == 0
+            || (size_t) (r->end - r->ptr) < len
+            || r->ptr[len - 1] != '\0') {
+        return -1;
+    }
+
+    *str = strdup((const char *) r->ptr);
+    if (!*str) {
+        return -1;
+    }
+    r->ptr += len;
+
+    return 0;
+}
+
+static int read_regex_data(struct reader *r, bool pcre2,
+                           struct fcontexts_spec *spec)
+{
+    const unsigned char *begin = r->ptr;
+    uint32_t len;
+    // PCRE has the pattern and study data, PCRE2 only has the pattern
+    int sections = pcre2 ? 1 : 2;
+    bool compiled = true;
+
+    for (int i = 0; i < sections; ++i) {
+        if (read_u32(r, &len) < 0) {
+            return -1;
+        }
+
+        if (i == 0) {
+            compiled = len != 0;
+        } else if (compiled != (len != 0)) {
+            return -1;
+        }
+
+        if (read_bytes(r, NULL, len) < 0) {
+            return -1;
+        }
+    }
+
+    if (compiled) {
+        spec->regex_data_len = r->ptr - begin;
+        spec->regex_data = malloc(spec->regex_data_len);
+        if (!spec->regex_data) {
+            return -1;
+        }
+        memcpy(spec->regex_data, begin, spec->regex_data_len);
+    }
+
+    return 0;
+}
+
+// Whether the mode is stored as a u32 or a mode_t
+static bool mode_is_u32(uint32_t version)
+{
+    return sizeof(mode_t) > sizeof(uint32_t)
+            || version >= SELINUX_COMPILED_FCONTEXT_MODE;
+}
+
+void fcontexts_init(struct fcontexts *fc)
+{
+    memset(fc, 0, sizeof(*fc));
+}
+
+void fcontexts_free(struct fcontexts *fc)
+{
+    for (uint32_t i = 0; i < fc->num_stems; ++i) {
+        free(fc->stems[i].buf);
+    }
+    free(fc->stems);
+
+    for (uint32_t i = 0; i < fc->num_specs; ++i) {
+        free(fc->specs[i].context);
+        free(fc->specs[i].regex_str);
+        free(fc->specs[i].regex_data);
+    }
+    free(fc->specs);
+
+    free(fc->pcre_version);
+
+    fcontexts_init(fc);
+}
+
+int fcontexts_read(struct fcontexts *fc, const void *data, size_t size)
+{
+    struct reader r = {
+        .ptr = (const unsigned char *) data,
+        .end = (const unsigned char *) data + size,
+    };
+    uint32_t magic;
+    uint32_t len;
+
+    fcontexts_init(fc);
+
+    // Check magic
+    if (read_u32(&r, &magic) < 0 || magic != SELINUX_MAGIC_COMPILED_FCONTEXT) {
+        selinux_log("Invalid magic field\n");
+        goto err;
+    }
+
+    // Check version
+    if (read_u32(&r, &fc->version) < 0
+            || fc->version > SELINUX_COMPILED_FCONTEXT_MAX_VERS) {
+        selinux_log("Invalid version field\n");
+        goto err;
+    }
+
+    // PCRE version (not NULL-terminated)
+    if (fc->version >= SELINUX_COMPILED_FCONTEXT_PCRE_VERS) {
+        if (read_u32(&r, &len) < 0 || (size_t) (r.end - r.ptr) < len) {
+            selinux_log("Invalid PCRE version field\n");
+            goto err;
+        }
+
+        fc->pcre_version = strndup((const char *) r.ptr, len);
+        if (!fc->pcre_version) {
+            goto err;
+        }
+        r.ptr += len;
+
+        // PCRE2 versions start at 10.00
+        fc->pcre2 = strtol(fc->pcre_version, NULL, 10) >= 10;
+    }
+
+    // Stem map
+    if (read_u32(&r, &len) < 0 || len == 0
+            || len > (size_t) (r.end - r.ptr) / sizeof(uint32_t)) {
+        selinux_log("Invalid stem map length field\n");
+        goto err;
+    }
+
+    fc->stems = calloc(len, sizeof(*fc->stems));
+    if (!fc->stems) {
+        goto err;
+    }
+
+    // Counts are incremented first so that partially read entries are freed
+    // on failure
+    while (fc->num_stems < len) {
+        struct fcontexts_stem *stem = &fc->stems[fc->num_stems++];
+
+        // Length does not include NULL-terminator
+        if (read_u32(&r, &stem->len) < 0 || stem->len == 0
+                || stem->len == UINT32_MAX
+                || (size_t) (r.end - r.ptr) < stem->len + 1
+                || r.ptr[stem->len] != '\0') {
+            selinux_log("Invalid stem field\n");
+            goto err;
+        }
+
+        stem->buf = strndup((const char *) r.ptr, stem->len);
+        if (!stem->buf) {
+            goto err;
+        }
+        r.ptr += stem->len + 1;
+    }
+
+    // Regexes
+    if (read_u32(&r, &len) < 0 || len == 0
+            || len > (size_t) (r.end - r.ptr) / sizeof(uint32_t)) {
+        selinux_log("Invalid regex array length field\n");
+        goto err;
+    }
+
+    fc->specs = calloc(len, sizeof(*fc->specs));
+    if (!fc->specs) {
+        goto err;
+    }
+
+    while (fc->num_specs < len) {
+        struct fcontexts_spec *spec = &fc->specs[fc->num_specs++];
+
+        if (read_string(&r, &spec->context) < 0) {
+            selinux_log("Invalid context string field\n");
+            goto err;
+        }
+
+        if (read_string(&r, &spec->regex_str) < 0) {
+            selinux_log("Invalid regex string field\n");
+            goto err;
+        }
+
+        if (mode_is_u32(fc->version)) {
+            if (read_u32(&r, &spec->mode) < 0) {
+                selinux_log("Invalid mode value field\n");
+                goto err;
+            }
+        } else {
+            mode_t mode;
+
+            if (read_bytes(&r, &mode, sizeof(mode)) < 0) {
+                selinux_log("Invalid mode value field\n");
+                goto err;
+            }
+            spec->mode = mode;
+        }
+
+        if (read_bytes(&r, &spec->stem_id, sizeof(spec->stem_id)) < 0
+                || spec->stem_id < -1
+                || spec->stem_id >= (int32_t) fc->num_stems) {
+            selinux_log("Invalid stem ID field\n");
+            goto err;
+        }
+
+        if (read_u32(&r, &spec->has_meta_chars) < 0) {
+            selinux_log("Invalid meta chars field\n");
+            goto err;
+        }
+
+        if (fc->version >= SELINUX_COMPILED_FCONTEXT_PREFIX_LEN) {
+            if (read_u32(&r, &spec->prefix_len) < 0) {
+                selinux_log("Invalid prefix length field\n");
+                goto err;
+            }
+        }
+
+        if (read_regex_data(&r, fc->pcre2, spec) < 0) {
+            selinux_log("Invalid regex data field\n");
+            goto err;
+        }
+    }
+
+    return 0;
+
+err:
+    fcontexts_free(fc);
+    return -1;
+}
+
+int fcontexts_read_file(struct fcontexts *fc, const char *path)
+{
+    FILE *fp;
+    struct stat sb;
+    void *data = NULL;
+    int ret = -1;
+
+    fcontexts_init(fc);
+
+    fp = fopen(path, "rbe");
+    if (!fp) {
+        selinux_log("%s: Failed to open for reading: %s\n",
+                    path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fileno(fp), &sb) < 0) {
+        selinux_log("%s: Failed to stat file: %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    data = malloc(sb.st_size > 0 ? sb.st_size : 1);
+    if (!data) {
+        goto out;
+    }
+
+    if (fread(data, 1, sb.st_size, fp) != (size_t) sb.st_size) {
+        selinux_log("%s: Failed to read file: %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    ret = fcontexts_read(fc, data, sb.st_size);
+
+out:
+    free(data);
+    fclose(fp);
+    return ret;
+}
+
+static int write_u32(FILE *fp, uint32_t value)
+{
+    return fwrite(&value, sizeof(value), 1, fp) == 1 ? 0 : -1;
+}
+
+// Write a string with a length field that includes the NULL-terminator
+static int write_string(FILE *fp, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    if (write_u32(fp, len) < 0 || fwrite(str, 1, len, fp) != len) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int fcontexts_write(const struct fcontexts *fc, FILE *fp)
+{
+    if (write_u32(fp, SELINUX_MAGIC_COMPILED_FCONTEXT) < 0
+            || write_u32(fp, fc->version) < 0) {
+        goto err;
+    }
+
+    if (fc->version >= SELINUX_COMPILED_FCONTEXT_PCRE_VERS) {
+        const char *pcre_version = fc->pcre_version ? fc->pcre_version : "";
+        size_t len = strlen(pcre_version);
+
+        if (write_u32(fp, len) < 0
+                || fwrite(pcre_version, 1, len, fp) != len) {
+            goto err;
+        }
+    }
+
+    if (write_u32(fp, fc->num_stems) < 0) {
+        goto err;
+    }
+
+    for (uint32_t i = 0; i < fc->num_stems; ++i) {
+        const struct fcontexts_stem *stem = &fc->stems[i];
+
+        // Include the NULL-terminator, but not in the length
+        if (write_u32(fp, stem->len) < 0
+                || fwrite(stem->buf, 1, stem->len + 1, fp) != stem->len + 1) {
+            goto err;
+        }
+    }
+
+    if (write_u32(fp, fc->num_specs) < 0) {
+        goto err;
+    }
+
+    for (uint32_t i = 0; i < fc->num_specs; ++i) {
+        const struct fcontexts_spec *spec = &fc->specs[i];
+
+        if (write_string(fp, spec->context) < 0
+                || write_string(fp, spec->regex_str) < 0) {
+            goto err;
+        }
+
+        if (mode_is_u32(fc->version)) {
+            if (write_u32(fp, spec->mode) < 0) {
+                goto err;
+            }
+        } else {
+            mode_t mode = spec->mode;
+
+            if (fwrite(&mode, sizeof(mode), 1, fp) != 1) {
+                goto err;
+            }
+        }
+
+        if (fwrite(&spec->stem_id, sizeof(spec->stem_id), 1, fp) != 1
+                || write_u32(fp, spec->has_meta_chars) < 0) {
+            goto err;
+        }
+
+        if (fc->version >= SELINUX_COMPILED_FCONTEXT_PREFIX_LEN
+                && write_u32(fp, spec->prefix_len) < 0) {
+            goto err;
+        }
+
+        if (spec->regex_data) {
+            if (fwrite(spec->regex_data, 1, spec->regex_data_len, fp)
+                    != spec->regex_data_len) {
+                goto err;
+            }
+        } else {
+            if (write_u32(fp, 0) < 0
+                    || (!fc->pcre2 && write_u32(fp, 0) < 0)) {
+                goto err;
+            }
+        }
+    }
+
+    return 0;
+
+err:
+    selinux_log("Failed to write file: %s\n", strerror(errno));
+    return -1;
+}
+
+int fcontexts_write_file(const struct fcontexts *fc, const char *path)
+{
+    FILE *fp;
+    int ret;
+
+    fp = fopen(path, "wbe");
+    if (!fp) {
+        selinux_log("%s: Failed to open for writing: %s\n",
+                    path, strerror(errno));
+        return -1;
+    }
+
+    ret = fcontexts_write(fc, fp);
+
+    if (fclose(fp) != 0 && ret == 0) {
+        selinux_log("%s: Failed to close file: %s\n", path, strerror(errno));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static const char * mode_to_string(uint32_t mode)
+{
+    switch (mode) {
+    case S_IFBLK:
+        return "-b";
+    case S_IFCHR:
+        return "-c";
+    case S_IFDIR:
+        return "-d";
+    case S_IFIFO:
+        return "-p";
+    case S_IFLNK:
+        return "-l";
+    case S_IFSOCK:
+        return "-s";
+    case S_IFREG:
+        return "--";
+    default:
+        return NULL;
+    }
+}
+
+int fcontexts_write_text(const struct fcontexts *fc, FILE *fp)
+{
+    for (uint32_t i = 0; i < fc->num_specs; ++i) {
+        const struct fcontexts_spec *spec = &fc->specs[i];
+        const char *mode_string = mode_to_string(spec->mode);
+        int ret;
+
+        if (spec->mode != 0 && !mode_string) {
+            selinux_log("Invalid mode value\n");
+            return -1;
+        }
+
+        if (mode_string) {
+            ret = fprintf(fp, "%s %s %s\n",
+                          spec->regex_str, mode_string, spec->context);
+        } else {
+            ret = fprintf(fp, "%s %s\n", spec->regex_str, spec->context);
+        }
+
+        if (ret < 0) {
+            selinux_log("Failed to write spec: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Find or add the stem for a regex. Returns -1 if the regex has no stem.
+static int32_t add_stem(struct fcontexts *fc, const char *regex_str)
+{
+    int stem_len = get_stem_from_spec(regex_str);
+    struct fcontexts_stem *stems;
+    char *buf;
+
+    if (!stem_len) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < fc->num_stems; ++i) {
+        if (fc->stems[i].len == (uint32_t) stem_len
+                && strncmp(fc->stems[i].buf, regex_str, stem_len) == 0) {
+            return i;
+        }
+    }
+
+    buf = strndup(regex_str, stem_len);
+    if (!buf) {
+        return -2;
+    }
+
+    stems = realloc(fc->stems, (fc->num_stems + 1) * sizeof(*stems));
+    if (!stems) {
+        free(buf);
+        return -2;
+    }
+
+    fc->stems = stems;
+    fc->stems[fc->num_stems].buf = buf;
+    fc->stems[fc->num_stems].len = stem_len;
+
+    return fc->num_stems++;
+}
+
+// Append a spec. The regex is not compiled, so the spec will have no regex
+// data. The caller should call fcontexts_sort() after adding specs.
+int fcontexts_add_spec(struct fcontexts *fc, const char *regex_str,
+                       uint32_t mode, const char *context)
+{
+    struct fcontexts_spec *specs;
+    struct fcontexts_spec *spec;
+    struct spec meta;
+    int32_t stem_id;
+
+    stem_id = add_stem(fc, regex_str);
+    if (stem_id < -1) {
+        return -1;
+    }
+
+    specs = realloc(fc->specs, (fc->num_specs + 1) * sizeof(*specs));
+    if (!specs) {
+        return -1;
+    }
+    fc->specs = specs;
+
+    spec = &fc->specs[fc->num_specs];
+    memset(spec, 0, sizeof(*spec));
+
+    spec->context = strdup(context);
+    spec->regex_str = strdup(regex_str);
+    if (!spec->context || !spec->regex_str) {
+        free(spec->context);
+        free(spec->regex_str);
+        return -1;
+    }
+
+    memset(&meta, 0, sizeof(meta));
+    meta.regex_str = spec->regex_str;
+    spec_hasMetaChars(&meta);
+
+    spec->mode = mode;
+    spec->stem_id = stem_id;
+    spec->has_meta_chars = meta.hasMetaChars;
+    spec->prefix_len = meta.prefix_len;
+
+    ++fc->num_specs;
+
+    return 0;
+}
+
+// Unused stems are left in the stem map
+void fcontexts_remove_spec(struct fcontexts *fc, uint32_t index)
+{
+    struct fcontexts_spec *spec = &fc->specs[index];
+
+    free(spec->context);
+    free(spec->regex_str);
+    free(spec->regex_data);
+
+    memmove(spec, spec + 1,
+            (fc->num_specs - index - 1) * sizeof(*fc->specs));
+    --fc->num_specs;
+}
+
+// Move exact pathname specifications to the end, preserving the order within
+// each group (same as sort_specs() in label_file.h)
+int fcontexts_sort(struct fcontexts *fc)
+{
+    struct fcontexts_spec *sorted;
+    uint32_t n = 0;
+
+    sorted = malloc((fc->num_specs ? fc->num_specs : 1) * sizeof(*sorted));
+    if (!sorted) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < fc->num_specs; ++i) {
+        if (fc->specs[i].has_meta_chars) {
+            sorted[n++] = fc->specs[i];
+        }
+    }
+    for (uint32_t i = 0; i < fc->num_specs; ++i) {
+        if (!fc->specs[i].has_meta_chars) {
+            sorted[n++] = fc->specs[i];
+        }
+    }
+
+    free(fc->specs);
+    fc->specs = sorted;
+
+    return 0;
+}
+
+// Whether every spec has regex data that libselinux can load
+bool fcontexts_is_compiled(const struct fcontexts *fc)
+{
+    for (uint32_t i = 0; i < fc->num_specs; ++i) {
+        if (!fc->specs[i].regex_data) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// In-memory model of a binary file_contexts file. Unlike the structures in
+// label_file.h, the regex data is kept in its serialized form, so a file can be
+// read, modified, and written again without loading the PCRE library. Only
+// specs that are added (and thus have no regex data) need to be compiled.
+
+struct fcontexts_stem
+{
+    char *buf;
+    uint32_t len;
+};
+
+struct fcontexts_spec
+{
+    char *context;
+    char *regex_str;
+    uint32_t mode;
+    int32_t stem_id;
+    uint32_t has_meta_chars;
+    uint32_t prefix_len;
+
+    // Serialized regex data exactly as it appears in the file. For PCRE, this
+    // includes both the pattern and study data, including the length fields.
+    // NULL if the regex has not been compiled.
+    unsigned char *regex_data;
+    size_t regex_data_len;
+};
+
+struct fcontexts
+{
+    uint32_t version;
+    // NULL if version < SELINUX_COMPILED_FCONTEXT_PCRE_VERS
+    char *pcre_version;
+    bool pcre2;
+
+    struct fcontexts_stem *stems;
+    uint32_t num_stems;
+
+    struct fcontexts_spec *specs;
+    uint32_t num_specs;
+};
+
+void fcontexts_init(struct fcontexts *fc);
+void fcontexts_free(struct fcontexts *fc);
+
+int fcontexts_read(struct fcontexts *fc, const void *data, size_t size);
+int fcontexts_read_file(struct fcontexts *fc, const char *path);
+int fcontexts_write(const struct fcontexts *fc, FILE *fp);
+int fcontexts_write_file(const struct fcontexts *fc, const char *path);
+int fcontexts_write_text(const struct fcontexts *fc, FILE *fp);
+
+int fcontexts_add_spec(struct fcontexts *fc, const char *regex_str,
+                       uint32_t mode, const char *context);
+void fcontexts_remove_spec(struct fcontexts *fc, uint32_t index);
+int fcontexts_sort(struct fcontexts *fc);
+
+bool fcontexts_is_compiled(const struct fcontexts *fc);
+
+#ifdef __cplusplus
+}
+#endif
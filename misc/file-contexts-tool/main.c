@@ -14,12 +14,16 @@ static void usage(FILE *stream, const char *progname)
     fprintf(stream,
             "Usage: %s compile [option...] <source file> <target file>\n"
             "       %s decompile [option...] <source file> <target file>\n"
+            "       %s compile-missing [option...] <source file> <target file>\n"
+            "\n"
+            "compile-missing takes a binary file and compiles only the regexes\n"
+            "that have no compiled data. All other entries are copied as-is.\n"
             "\n"
             "Options:\n"
             "  -p, --pcre <PCRE lib path>\n"
             "                   Path to PCRE shared library\n"
             "  -h, --help       Display this help message\n",
-            progname, progname);
+            progname, progname, progname);
 }
 
 int main(int argc, char *argv[])
@@ -81,6 +85,8 @@ int main(int argc, char *argv[])
         ret = compile(&shim, source_path, target_path);
     } else if (strcmp(action, "decompile") == 0) {
         ret = decompile(&shim, source_path, target_path);
+    } else if (strcmp(action, "compile-missing") == 0) {
+        ret = compile_missing(&shim, source_path, target_path);
     } else {
         usage(stderr, argv[0]);
         ret = -1;
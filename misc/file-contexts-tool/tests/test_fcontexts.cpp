@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2018  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+
+#include "file-contexts-tool/fcontexts.h"
+
+// Values from label_file.h, which cannot be included here because it pulls in
+// the PCRE headers
+static constexpr uint32_t FCONTEXT_MAGIC = 0xf97cff8a;
+static constexpr uint32_t FCONTEXT_PCRE_VERS = 2;
+static constexpr uint32_t FCONTEXT_MODE = 3;
+static constexpr uint32_t FCONTEXT_PREFIX_LEN = 4;
+static constexpr uint32_t FCONTEXT_MAX_VERS = FCONTEXT_PREFIX_LEN;
+
+struct TestSpec
+{
+    const char *context;
+    const char *regex_str;
+    uint32_t mode;
+    int32_t stem_id;
+    uint32_t has_meta_chars;
+    uint32_t prefix_len;
+};
+
+static const char *test_stems[] = {
+    "/system",
+    "/data",
+};
+
+static const TestSpec test_specs[] = {
+    { "u:object_r:system_file:s0", "/system/bin(/.*)?", 0, 0, 1, 11 },
+    { "u:object_r:system_data_file:s0", "/data/local", S_IFDIR, 1, 0, 11 },
+    { "u:object_r:rootfs:s0", "/", S_IFREG, -1, 0, 1 },
+};
+
+class FileBuilder
+{
+public:
+    void u32(uint32_t value)
+    {
+        bytes(&value, sizeof(value));
+    }
+
+    void bytes(const void *data, size_t size)
+    {
+        _data.append(static_cast<const char *>(data), size);
+    }
+
+    // Length field includes the NULL-terminator
+    void string(const char *str)
+    {
+        u32(static_cast<uint32_t>(strlen(str) + 1));
+        bytes(str, strlen(str) + 1);
+    }
+
+    const std::string & data() const
+    {
+        return _data;
+    }
+
+private:
+    std::string _data;
+};
+
+struct FileParams
+{
+    uint32_t version;
+    bool pcre2;
+    bool compiled;
+};
+
+static bool mode_is_u32(uint32_t version)
+{
+    return sizeof(mode_t) > sizeof(uint32_t) || version >= FCONTEXT_MODE;
+}
+
+static std::string build_file(const FileParams &params)
+{
+    FileBuilder b;
+
+    b.u32(FCONTEXT_MAGIC);
+    b.u32(params.version);
+
+    if (params.version >= FCONTEXT_PCRE_VERS) {
+        const char *pcre_version = params.pcre2 ? "10.42" : "8.45";
+        b.u32(static_cast<uint32_t>(strlen(pcre_version)));
+        b.bytes(pcre_version, strlen(pcre_version));
+    }
+
+    b.u32(sizeof(test_stems) / sizeof(test_stems[0]));
+    for (auto const &stem : test_stems) {
+        b.u32(static_cast<uint32_t>(strlen(stem)));
+        b.bytes(stem, strlen(stem) + 1);
+    }
+
+    b.u32(sizeof(test_specs) / sizeof(test_specs[0]));
+    for (auto const &spec : test_specs) {
+        b.string(spec.context);
+        b.string(spec.regex_str);
+
+        if (mode_is_u32(params.version)) {
+            b.u32(spec.mode);
+        } else {
+            mode_t mode = static_cast<mode_t>(spec.mode);
+            b.bytes(&mode, sizeof(mode));
+        }
+
+        b.bytes(&spec.stem_id, sizeof(spec.stem_id));
+        b.u32(spec.has_meta_chars);
+
+        if (params.version >= FCONTEXT_PREFIX_LEN) {
+            b.u32(spec.prefix_len);
+        }
+
+        if (!params.compiled) {
+            b.u32(0);
+            if (!params.pcre2) {
+                b.u32(0);
+            }
+        } else if (params.pcre2) {
+            b.u32(4);
+            b.bytes("\x01\x02\x03\x04", 4);
+        } else {
+            b.u32(3);
+            b.bytes("\x05\x06\x07", 3);
+            b.u32(2);
+            b.bytes("\x08\x09", 2);
+        }
+    }
+
+    return b.data();
+}
+
+static bool write_to_string(const fcontexts &fc, std::string &out,
+                            bool text = false)
+{
+    char *buf = nullptr;
+    size_t size = 0;
+
+    FILE *fp = open_memstream(&buf, &size);
+    if (!fp) {
+        return false;
+    }
+
+    int ret = text ? fcontexts_write_text(&fc, fp) : fcontexts_write(&fc, fp);
+
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+
+    out.assign(buf, size);
+    free(buf);
+
+    return ret == 0;
+}
+
+class FcontextsTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        fcontexts_init(&_fc);
+    }
+
+    void TearDown() override
+    {
+        fcontexts_free(&_fc);
+    }
+
+    int read(const std::string &data)
+    {
+        return fcontexts_read(&_fc, data.data(), data.size());
+    }
+
+    std::vector<std::string> regexes() const
+    {
+        std::vector<std::string> result;
+        for (uint32_t i = 0; i < _fc.num_specs; ++i) {
+            result.emplace_back(_fc.specs[i].regex_str);
+        }
+        return result;
+    }
+
+    fcontexts _fc;
+};
+
+TEST_F(FcontextsTest, RoundTripAllVersions)
+{
+    static const FileParams params_list[] = {
+        { 1, false, true },
+        { 1, false, false },
+        { 2, false, true },
+        { 2, true, true },
+        { 3, false, true },
+        { 3, true, true },
+        { 4, false, true },
+        { 4, false, false },
+        { 4, true, true },
+        { 4, true, false },
+    };
+
+    for (auto const &params : params_list) {
+        SCOPED_TRACE(testing::Message() << "version=" << params.version
+                     << ", pcre2=" << params.pcre2
+                     << ", compiled=" << params.compiled);
+
+        std::string data = build_file(params);
+
+        ASSERT_EQ(read(data), 0);
+
+        ASSERT_EQ(_fc.version, params.version);
+        if (params.version >= FCONTEXT_PCRE_VERS) {
+            ASSERT_STREQ(_fc.pcre_version, params.pcre2 ? "10.42" : "8.45");
+            ASSERT_EQ(_fc.pcre2, params.pcre2);
+        } else {
+            ASSERT_EQ(_fc.pcre_version, nullptr);
+            ASSERT_FALSE(_fc.pcre2);
+        }
+
+        ASSERT_EQ(_fc.num_stems, 2u);
+        for (uint32_t i = 0; i < _fc.num_stems; ++i) {
+            ASSERT_STREQ(_fc.stems[i].buf, test_stems[i]);
+            ASSERT_EQ(_fc.stems[i].len, strlen(test_stems[i]));
+        }
+
+        ASSERT_EQ(_fc.num_specs, 3u);
+        for (uint32_t i = 0; i < _fc.num_specs; ++i) {
+            auto const &spec = _fc.specs[i];
+            auto const &expected = test_specs[i];
+
+            ASSERT_STREQ(spec.context, expected.context);
+            ASSERT_STREQ(spec.regex_str, expected.regex_str);
+            ASSERT_EQ(spec.mode, expected.mode);
+            ASSERT_EQ(spec.stem_id, expected.stem_id);
+            ASSERT_EQ(spec.has_meta_chars, expected.has_meta_chars);
+            ASSERT_EQ(spec.prefix_len, params.version >= FCONTEXT_PREFIX_LEN
+                    ? expected.prefix_len : 0u);
+
+            if (!params.compiled) {
+                ASSERT_EQ(spec.regex_data, nullptr);
+            } else {
+                ASSERT_NE(spec.regex_data, nullptr);
+                ASSERT_EQ(spec.regex_data_len, params.pcre2 ? 8u : 13u);
+            }
+        }
+
+        ASSERT_EQ(fcontexts_is_compiled(&_fc), params.compiled);
+
+        std::string written;
+        ASSERT_TRUE(write_to_string(_fc, written));
+        ASSERT_EQ(written, data);
+
+        fcontexts_free(&_fc);
+    }
+}
+
+TEST_F(FcontextsTest, RejectTruncatedInput)
+{
+    std::string data = build_file({FCONTEXT_MAX_VERS, false, true});
+
+    for (size_t size = 0; size < data.size(); ++size) {
+        ASSERT_LT(fcontexts_read(&_fc, data.data(), size), 0)
+                << "Truncated to " << size << " bytes";
+        ASSERT_EQ(_fc.specs, nullptr);
+        ASSERT_EQ(_fc.num_specs, 0u);
+        ASSERT_EQ(_fc.stems, nullptr);
+        ASSERT_EQ(_fc.num_stems, 0u);
+        ASSERT_EQ(_fc.pcre_version, nullptr);
+    }
+}
+
+TEST_F(FcontextsTest, RejectInvalidHeader)
+{
+    std::string data = build_file({FCONTEXT_MAX_VERS, false, true});
+
+    std::string bad_magic = data;
+    bad_magic[0] ^= 1;
+    ASSERT_LT(read(bad_magic), 0);
+
+    std::string new_version = data;
+    uint32_t version = FCONTEXT_MAX_VERS + 1;
+    memcpy(&new_version[4], &version, sizeof(version));
+    ASSERT_LT(read(new_version), 0);
+}
+
+TEST_F(FcontextsTest, RejectMismatchedPcreData)
+{
+    FileBuilder b;
+    b.u32(FCONTEXT_MAGIC);
+    b.u32(FCONTEXT_MAX_VERS);
+    b.u32(4);
+    b.bytes("8.45", 4);
+    b.u32(1);
+    b.u32(7);
+    b.bytes("/system", 8);
+    b.u32(1);
+    b.string("u:object_r:system_file:s0");
+    b.string("/system/bin(/.*)?");
+    b.u32(0);
+    int32_t stem_id = 0;
+    b.bytes(&stem_id, sizeof(stem_id));
+    b.u32(1);
+    b.u32(11);
+    // Pattern without study data
+    b.u32(3);
+    b.bytes("\x05\x06\x07", 3);
+    b.u32(0);
+
+    ASSERT_LT(read(b.data()), 0);
+}
+
+TEST_F(FcontextsTest, RejectInvalidStemId)
+{
+    std::string data = build_file({FCONTEXT_MAX_VERS, false, true});
+
+    // The first spec's stem ID follows its context, regex, and mode
+    auto pos = data.find("/system/bin(/.*)?");
+    ASSERT_NE(pos, std::string::npos);
+    pos += strlen("/system/bin(/.*)?") + 1 + sizeof(uint32_t);
+
+    int32_t stem_id = 2;
+    memcpy(&data[pos], &stem_id, sizeof(stem_id));
+    ASSERT_LT(read(data), 0);
+}
+
+TEST_F(FcontextsTest, AddSpecReusesStems)
+{
+    ASSERT_EQ(read(build_file({FCONTEXT_MAX_VERS, false, true})), 0);
+    ASSERT_TRUE(fcontexts_is_compiled(&_fc));
+
+    ASSERT_EQ(fcontexts_add_spec(&_fc, "/system/xbin/su", S_IFREG,
+                                 "u:object_r:su_exec:s0"), 0);
+    ASSERT_EQ(fcontexts_add_spec(&_fc, "/vendor/lib(/.*)?", 0,
+                                 "u:object_r:vendor_file:s0"), 0);
+    ASSERT_EQ(fcontexts_add_spec(&_fc, "/cache", S_IFDIR,
+                                 "u:object_r:cache_file:s0"), 0);
+
+    ASSERT_EQ(_fc.num_specs, 6u);
+    ASSERT_EQ(_fc.num_stems, 3u);
+    ASSERT_STREQ(_fc.stems[2].buf, "/vendor");
+    ASSERT_EQ(_fc.stems[2].len, 7u);
+
+    auto const &su = _fc.specs[3];
+    ASSERT_STREQ(su.context, "u:object_r:su_exec:s0");
+    ASSERT_EQ(su.mode, static_cast<uint32_t>(S_IFREG));
+    ASSERT_EQ(su.stem_id, 0);
+    ASSERT_EQ(su.has_meta_chars, 0u);
+    ASSERT_EQ(su.prefix_len, 15u);
+    ASSERT_EQ(su.regex_data, nullptr);
+
+    auto const &vendor = _fc.specs[4];
+    ASSERT_EQ(vendor.stem_id, 2);
+    ASSERT_EQ(vendor.has_meta_chars, 1u);
+    ASSERT_EQ(vendor.prefix_len, 11u);
+
+    auto const &cache = _fc.specs[5];
+    ASSERT_EQ(cache.stem_id, -1);
+
+    // Added specs have no regex data until they are compiled
+    ASSERT_FALSE(fcontexts_is_compiled(&_fc));
+
+    std::string written;
+    ASSERT_TRUE(write_to_string(_fc, written));
+
+    fcontexts reread;
+    ASSERT_EQ(fcontexts_read(&reread, written.data(), written.size()), 0);
+    ASSERT_EQ(reread.num_specs, 6u);
+    ASSERT_EQ(reread.num_stems, 3u);
+    ASSERT_NE(reread.specs[0].regex_data, nullptr);
+    ASSERT_EQ(reread.specs[3].regex_data, nullptr);
+    ASSERT_STREQ(reread.specs[4].regex_str, "/vendor/lib(/.*)?");
+    fcontexts_free(&reread);
+}
+
+TEST_F(FcontextsTest, RemoveSpecKeepsOrder)
+{
+    ASSERT_EQ(read(build_file({FCONTEXT_MAX_VERS, false, true})), 0);
+
+    fcontexts_remove_spec(&_fc, 1);
+
+    ASSERT_EQ(regexes(), (std::vector<std::string>{
+        "/system/bin(/.*)?", "/",
+    }));
+    // Stems are not removed, so the stem IDs stay valid
+    ASSERT_EQ(_fc.num_stems, 2u);
+    ASSERT_EQ(_fc.specs[1].stem_id, -1);
+
+    fcontexts_remove_spec(&_fc, 1);
+    fcontexts_remove_spec(&_fc, 0);
+    ASSERT_EQ(_fc.num_specs, 0u);
+}
+
+TEST_F(FcontextsTest, SortMovesExactPathsToEnd)
+{
+    ASSERT_EQ(fcontexts_add_spec(&_fc, "/a", 0, "u:object_r:a:s0"), 0);
+    ASSERT_EQ(fcontexts_add_spec(&_fc, "/b(/.*)?", 0, "u:object_r:b:s0"), 0);
+    ASSERT_EQ(fcontexts_add_spec(&_fc, "/c", 0, "u:object_r:c:s0"), 0);
+    ASSERT_EQ(fcontexts_add_spec(&_fc, "/d/.*", 0, "u:object_r:d:s0"), 0);
+    ASSERT_EQ(fcontexts_add_spec(&_fc, "/e\\.f", 0, "u:object_r:e:s0"), 0);
+
+    ASSERT_EQ(fcontexts_sort(&_fc), 0);
+
+    ASSERT_EQ(regexes(), (std::vector<std::string>{
+        "/b(/.*)?", "/d/.*", "/a", "/c", "/e\\.f",
+    }));
+}
+
+TEST_F(FcontextsTest, WriteText)
+{
+    ASSERT_EQ(read(build_file({FCONTEXT_MAX_VERS, false, true})), 0);
+
+    std::string text;
+    ASSERT_TRUE(write_to_string(_fc, text, true));
+    ASSERT_EQ(text,
+              "/system/bin(/.*)? u:object_r:system_file:s0\n"
+              "/data/local -d u:object_r:system_data_file:s0\n"
+              "/ -- u:object_r:rootfs:s0\n");
+
+    _fc.specs[0].mode = 1;
+    ASSERT_FALSE(write_to_string(_fc, text, true));
+}
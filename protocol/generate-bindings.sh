@@ -7,6 +7,7 @@ files=(
     v3/crypto_get_pw_type.fbs
     v3/file_chmod.fbs
     v3/file_close.fbs
+    v3/file_get_fd.fbs
     v3/file_open.fbs
     v3/file_read.fbs
     v3/file_seek.fbs